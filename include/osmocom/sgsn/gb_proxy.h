@@ -31,6 +31,7 @@ enum gbproxy_global_ctr {
 	GBPROX_GLOB_CTR_TX_ERR_SGSN,
 	GBPROX_GLOB_CTR_OTHER_ERR,
 	GBPROX_GLOB_CTR_PATCH_PEER_ERR,
+	GBPROX_GLOB_CTR_STORED_MSGS_DROPPED,
 };
 
 enum gbproxy_peer_ctr {
@@ -70,6 +71,14 @@ enum gbproxy_peer_ctr {
 	GBPROX_PEER_CTR_LAST,
 };
 
+enum gbproxy_area_ctr {
+	GBPROX_AREA_CTR_PAGING_PS,
+	GBPROX_AREA_CTR_PAGING_CS,
+	GBPROX_AREA_CTR_PAGING_BVC,
+	GBPROX_AREA_CTR_PAGING_BLOCKED,
+	GBPROX_AREA_CTR_LAST,
+};
+
 enum gbproxy_keep_mode {
 	GBPROX_KEEP_NEVER,	/* don't ever keep TLLI/IMSI state of de-registered subscribers */
 	GBPROX_KEEP_REATTACH,	/* keep if re-attach has been requested by SGSN */
@@ -83,10 +92,62 @@ enum gbproxy_match_id {
 	GBPROX_MATCH_LAST
 };
 
+/* node of a digit trie for IMSI prefix matching, child index 0 means none */
+struct gbproxy_imsi_prefix_node {
+	uint16_t next[10];
+	bool match;
+};
+
 struct gbproxy_match {
 	bool  enable;		/* is this match enabled? */
 	char *re_str;		/* regular expression (for IMSI) in string format */
 	regex_t re_comp;	/* compiled regular expression (for IMSI) */
+	/* trie for "^001", "^(001|002)" style patterns (NULL: use re_comp) */
+	struct gbproxy_imsi_prefix_node *prefix_trie;
+};
+
+#define GBPROXY_PEER_HASH_BITS 8
+#define GBPROXY_PEER_HASH_SIZE (1 << GBPROXY_PEER_HASH_BITS)
+
+#define GBPROXY_AREA_HASH_BITS 6
+#define GBPROXY_AREA_HASH_SIZE (1 << GBPROXY_AREA_HASH_BITS)
+
+/* a routeing area announced by the BSS peers, used to fan out PAGING */
+struct gbproxy_area {
+	/* linked to a gbproxy_config.ra_hash bucket */
+	struct llist_head ra_list;
+	/* linked to a gbproxy_config.la_hash bucket */
+	struct llist_head la_list;
+
+	/* Routeing Area Identification (raw 04.08 encoding) */
+	uint8_t ra[6];
+
+	/* peers within this routeing area (gbproxy_peer.area_list) */
+	struct llist_head peers;
+
+	/* Counter */
+	struct rate_ctr_group *ctrg;
+};
+
+#define GBPROXY_MAX_NRI_BITLEN 10
+#define GBPROXY_SGSN_MAX_NRI 16
+
+/* one SGSN of the pool (Gb-flex) that subscribers are distributed to */
+struct gbproxy_sgsn {
+	/* linked to gbproxy_config.sgsn_pool */
+	struct llist_head list;
+
+	/* NSEI of the SGSN */
+	uint16_t nsei;
+
+	/* share of new subscribers (0: only NRI and already pinned ones) */
+	unsigned int weight;
+	/* credit of the smooth weighted round robin selection */
+	int wrr_credit;
+
+	/* NRI values the SGSN encodes into the P-TMSIs it allocates */
+	uint16_t nri[GBPROXY_SGSN_MAX_NRI];
+	unsigned int num_nri;
 };
 
 /* global gb-proxy configuration */
@@ -99,6 +160,9 @@ struct gbproxy_config {
 
 	/* Linked list of all Gb peers (except SGSN) */
 	struct llist_head bts_peers;
+	/* bts_peers hashed by BVCI and by NSEI */
+	struct llist_head bvci_hash[GBPROXY_PEER_HASH_SIZE];
+	struct llist_head nsei_hash[GBPROXY_PEER_HASH_SIZE];
 
 	/* Counter */
 	struct rate_ctr_group *ctrg;
@@ -116,8 +180,21 @@ struct gbproxy_config {
 	int tlli_max_age;
 	/* If !0, Max len of gbproxy_peer->list (list of struct gbproxy_link_info) */
 	int tlli_max_len;
-	/* If !0, Max len of gbproxy_link_info->stored_msgs (list of msgb) */
+	/* If !0, Max number of link_infos of all peers together */
+	int tlli_max_total_len;
+	/* Fired periodically to clean up stale links of all peers */
+	struct osmo_timer_list clean_stale_timer;
+	/* All attached link_infos (struct gbproxy_link_info.lru_list), most
+	 * recently used first, so that the stale ones are at the end */
+	struct llist_head link_lru;
+	unsigned int link_count;
+	/* If !0, Max len of gbproxy_link_info->stored_msgs */
 	uint32_t stored_msgs_max_len;
+	/* If !0, Max bytes stored by all links together, oldest dropped first */
+	uint32_t stored_msgs_max_bytes;
+	/* All stored messages (struct gbproxy_stored_msg), oldest first */
+	struct llist_head stored_msgs;
+	size_t stored_msgs_bytes;
 
 	/* Should the P-TMSI be patched on the fly (required for 2-SGSN config) */
 	bool patch_ptmsi;
@@ -132,14 +209,44 @@ struct gbproxy_config {
 
 	/* IMSI checking/matching for 2-SGSN routing and patching */
 	struct gbproxy_match matches[GBPROX_MATCH_LAST];
+
+	/* SGSN pool (list of struct gbproxy_sgsn), empty if not pooling */
+	struct llist_head sgsn_pool;
+	/* Number of NRI bits in the P-TMSI (from bit 23 downwards), 0: none */
+	unsigned int nri_bitlen;
+
+	/* struct gbproxy_area hashed by RAI and by LAI */
+	struct llist_head ra_hash[GBPROXY_AREA_HASH_SIZE];
+	struct llist_head la_hash[GBPROXY_AREA_HASH_SIZE];
 };
 
+/* Keys by which link_infos are indexed within a peer */
+enum gbproxy_link_key {
+	GBPROX_KEY_TLLI,		/* tlli.current */
+	GBPROX_KEY_TLLI_ASSIGNED,	/* tlli.assigned */
+	GBPROX_KEY_SGSN_TLLI,		/* sgsn_tlli.current */
+	GBPROX_KEY_SGSN_TLLI_ASSIGNED,	/* sgsn_tlli.assigned */
+	GBPROX_KEY_PTMSI,		/* tlli.ptmsi */
+	GBPROX_KEY_IMSI,		/* imsi */
+	GBPROX_KEY_LAST,
+};
+
+#define GBPROXY_LINK_HASH_BITS 9
+#define GBPROXY_LINK_HASH_SIZE (1 << GBPROXY_LINK_HASH_BITS)
+
 struct gbproxy_patch_state {
 	struct osmo_plmn_id local_plmn;
 
-	/* List of TLLIs for which patching is enabled */
+	/* List of TLLIs for which patching is enabled, most recently used
+	 * first */
 	struct llist_head logical_links;
 	int logical_link_count;
+
+	/* Hash buckets per gbproxy_link_key, GBPROXY_LINK_HASH_SIZE each,
+	 * allocated on first use */
+	struct llist_head *link_hash;
+	/* Incremented on each attach, to order hash matches like the list */
+	unsigned long long link_seq;
 };
 
 /* one peer at NS level that we interact with (BSS/PCU) */
@@ -150,24 +257,32 @@ struct gbproxy_peer {
 	/* point back to the config */
 	struct gbproxy_config *cfg;
 
-	/* NSEI of the peer entity */
+	/* linked to a gbproxy_config.bvci_hash and nsei_hash bucket */
+	struct llist_head bvci_list;
+	struct llist_head nsei_list;
+
+	/* NSEI of the peer entity, use gbproxy_peer_set_nsei() to change it */
 	uint16_t nsei;
 
 	/* BVCI used for Point-to-Point to this peer */
 	uint16_t bvci;
 	bool blocked;
 
-	/* Routeing Area that this peer is part of (raw 04.08 encoding) */
+	/* Routeing Area that this peer is part of (raw 04.08 encoding),
+	 * use gbproxy_peer_set_ra() to change it */
 	uint8_t ra[6];
+	/* the area of ra (NULL if unknown), linked by area_list */
+	struct gbproxy_area *area;
+	struct llist_head area_list;
 
 	/* Counter */
 	struct rate_ctr_group *ctrg;
 
+	/* Bytes held by the messages stored for the links of this peer */
+	size_t stored_msgs_bytes;
+
 	/* State related to on-the-fly patching of certain messages */
 	struct gbproxy_patch_state patch_state;
-
-	/* Fired periodically to clean up stale links from list */
-	struct osmo_timer_list clean_stale_timer;
 };
 
 struct gbproxy_tlli_state {
@@ -185,10 +300,25 @@ struct gbproxy_tlli_state {
 	uint32_t ptmsi;
 };
 
+/* Entry of a link_info in one of the gbproxy_patch_state.link_hash buckets */
+struct gbproxy_link_hash_entry {
+	struct llist_head list;
+	struct gbproxy_link_info *link_info;
+};
+
 /* One TLLI (= UE, = Subscriber) served via this proxy */
 struct gbproxy_link_info {
 	/* link to gbproxy_peer.patch_state.logical_links */
 	struct llist_head list;
+	/* link to gbproxy_config.link_lru */
+	struct llist_head lru_list;
+	/* the peer this link_info is attached to */
+	struct gbproxy_peer *peer;
+
+	/* links to gbproxy_peer.patch_state.link_hash, one per key */
+	struct gbproxy_link_hash_entry hash[GBPROX_KEY_LAST];
+	/* patch_state.link_seq when this entry was last attached */
+	unsigned long long seq;
 
 	/* TLLI on the BSS/PCU side */
 	struct gbproxy_tlli_state tlli;
@@ -196,6 +326,8 @@ struct gbproxy_link_info {
 	struct gbproxy_tlli_state sgsn_tlli;
 	/* NSEI of the SGSN serving this link */
 	uint32_t sgsn_nsei;
+	/* has sgsn_nsei been selected from the SGSN pool? */
+	bool sgsn_pinned;
 
 	/* timestamp when we last had any contact with this UE */
 	time_t timestamp;
@@ -208,7 +340,8 @@ struct gbproxy_link_info {
 	bool imsi_acq_pending;
 
 	/* queue of stored UL messages (until IMSI acquisition completes and we can
-	 * determine which of the SGSNs we should route this to */
+	 * determine which of the SGSNs we should route this to, see
+	 * gbproxy_link_info_store_msg() */
 	struct llist_head stored_msgs;
 	uint32_t stored_msgs_len;
 
@@ -246,6 +379,10 @@ int gbprox_reset_persistent_nsvcs(struct gprs_ns_inst *nsi);
 
 void gbprox_reset(struct gbproxy_config *cfg);
 
+/* Relay a PAGING from the SGSN to the unblocked BVCs of its RA/LA */
+int gbprox_rx_paging(struct gbproxy_config *cfg, struct msgb *msg,
+		     struct tlv_parsed *tp, uint32_t nsei, uint16_t ns_bvci);
+
 /* TLLI info handling */
 void gbproxy_delete_link_infos(struct gbproxy_peer *peer);
 struct gbproxy_link_info *gbproxy_update_link_state_ul(
@@ -258,13 +395,22 @@ int gbproxy_update_link_state_after(
 	struct gbproxy_peer *peer, struct gbproxy_link_info *link_info,
 	time_t now, struct gprs_gb_parse_context *parse_ctx);
 int gbproxy_remove_stale_link_infos(struct gbproxy_peer *peer, time_t now);
+int gbproxy_remove_stale_links(struct gbproxy_config *cfg, time_t now);
 void gbproxy_delete_link_info(struct gbproxy_peer *peer,
 			 struct gbproxy_link_info *link_info);
 void gbproxy_link_info_discard_messages(struct gbproxy_link_info *link_info);
+int gbproxy_link_info_store_msg(struct gbproxy_peer *peer,
+				struct gbproxy_link_info *link_info,
+				struct msgb *msg,
+				const struct gprs_gb_parse_context *parse_ctx);
+struct msgb *gbproxy_link_info_dequeue_msg(struct gbproxy_link_info *link_info,
+					   struct gprs_gb_parse_context *parse_ctx);
+int gbproxy_link_info_drop_msg(struct gbproxy_link_info *link_info);
 
 void gbproxy_attach_link_info(struct gbproxy_peer *peer, time_t now,
 			      struct gbproxy_link_info *link_info);
-void gbproxy_update_link_info(struct gbproxy_link_info *link_info,
+void gbproxy_update_link_info(struct gbproxy_peer *peer,
+			      struct gbproxy_link_info *link_info,
 			      const uint8_t *imsi, size_t imsi_len);
 void gbproxy_detach_link_info(struct gbproxy_peer *peer,
 			      struct gbproxy_link_info *link_info);
@@ -327,8 +473,30 @@ struct gbproxy_peer *gbproxy_peer_by_lac(
 	struct gbproxy_config *cfg, const uint8_t *la);
 struct gbproxy_peer *gbproxy_peer_by_bssgp_tlv(
 	struct gbproxy_config *cfg, struct tlv_parsed *tp);
+struct gbproxy_area *gbproxy_area_by_rai(struct gbproxy_config *cfg,
+					 const uint8_t *ra);
+struct gbproxy_area *gbproxy_area_by_lai(struct gbproxy_config *cfg,
+					 const uint8_t *la,
+					 struct gbproxy_area *prev);
+void gbproxy_peer_set_ra(struct gbproxy_peer *peer, const uint8_t *ra);
+void gbproxy_peer_set_nsei(struct gbproxy_peer *peer, uint16_t nsei);
 struct gbproxy_peer *gbproxy_peer_alloc(struct gbproxy_config *cfg, uint16_t bvci);
 void gbproxy_peer_free(struct gbproxy_peer *peer);
 int gbproxy_cleanup_peers(struct gbproxy_config *cfg, uint16_t nsei, uint16_t bvci);
 
+/* SGSN pool handling */
+struct gbproxy_sgsn *gbproxy_sgsn_by_nsei(
+	struct gbproxy_config *cfg, uint16_t nsei);
+struct gbproxy_sgsn *gbproxy_sgsn_by_nri(
+	struct gbproxy_config *cfg, uint16_t nri);
+struct gbproxy_sgsn *gbproxy_sgsn_alloc(struct gbproxy_config *cfg, uint16_t nsei);
+void gbproxy_sgsn_free(struct gbproxy_sgsn *sgsn);
+void gbproxy_sgsn_pool_free(struct gbproxy_config *cfg);
+int gbproxy_sgsn_add_nri(struct gbproxy_sgsn *sgsn, uint16_t nri);
+int gbproxy_sgsn_del_nri(struct gbproxy_sgsn *sgsn, uint16_t nri);
+int gbproxy_tlli_nri(struct gbproxy_config *cfg, uint32_t tlli, uint16_t *nri);
+uint32_t gbproxy_select_sgsn(struct gbproxy_config *cfg,
+	struct gbproxy_link_info *link_info,
+	struct gprs_gb_parse_context *parse_ctx);
+
 #endif
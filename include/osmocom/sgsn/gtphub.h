@@ -222,6 +222,69 @@ int expiry_tick(struct expiry *exq, time_t now);
 void expiry_clear(struct expiry *exq);
 
 
+/* hash index */
+
+/* A hash index allows looking up items by a precomputed 32 bit hash value
+ * instead of iterating a complete list. Items embed a struct
+ * hash_index_entry. The index only tells which items share a hash value; the
+ * caller must still compare the actual keys of each item found.
+ *
+ * The bucket array is allocated on demand, grows along with the number of
+ * entries and is freed again when the last entry is removed, so that an
+ * unused index occupies no dynamic memory. */
+
+struct hash_index_entry {
+	struct llist_head entry;
+	uint32_t hash;
+	struct hash_index *idx; /* NULL when not indexed */
+};
+
+struct hash_index {
+	struct llist_head *buckets;
+	unsigned int n_buckets; /* zero or a power of two */
+	unsigned int count;
+};
+
+/* Initialize an index to empty; no memory is allocated yet. */
+void hash_index_init(struct hash_index *idx);
+
+/* Initialize to all-empty; must be called before using the entry. */
+void hash_index_entry_init(struct hash_index_entry *e);
+
+/* Add e to idx under the given hash. e must not be indexed yet. Entries with
+ * identical hash are iterated in the order they were added. */
+void hash_index_add(struct hash_index *idx, struct hash_index_entry *e,
+		    uint32_t hash);
+
+/* Remove e from whichever index it is listed in. Harmless if e is not
+ * indexed. */
+void hash_index_del(struct hash_index_entry *e);
+
+/* Mix an integer to a hash value suitable for a hash_index. */
+uint32_t hash_u32(uint32_t val);
+
+/* Return a hash value for len bytes at buf, continuing from the hash value
+ * passed as seed (pass 0 to start a new hash). */
+uint32_t hash_buf(uint32_t seed, const void *buf, size_t len);
+
+/* An always empty bucket, used while an index has no buckets allocated. */
+extern struct llist_head hash_index_no_bucket;
+
+static inline struct llist_head *hash_index_bucket(const struct hash_index *idx,
+						   uint32_t hash)
+{
+	if (!idx->n_buckets)
+		return &hash_index_no_bucket;
+	return &idx->buckets[hash & (idx->n_buckets - 1)];
+}
+
+/* Iterate all items in idx indexed under HASH. POS is a pointer to the
+ * containing struct, MEMBER the name of its struct hash_index_entry. */
+#define hash_index_for_each_possible(IDX, POS, MEMBER, HASH) \
+	llist_for_each_entry(POS, hash_index_bucket(IDX, HASH), MEMBER.entry) \
+		if ((POS)->MEMBER.hash != (HASH)) {} else
+
+
 /* number map */
 
 /* A number map assigns a "random" mapped number to each user provided number.
@@ -284,6 +347,8 @@ struct nr_pool {
 struct nr_mapping {
 	struct llist_head entry;
 	struct expiring_item expiry_entry;
+	struct hash_index_entry orig_hash; /* in nr_map->by_orig */
+	struct hash_index_entry repl_hash; /* in nr_map->by_repl */
 
 	void *origin;
 	nr_t orig;
@@ -294,6 +359,10 @@ struct nr_map {
 	struct nr_pool *pool; /* multiple nr_maps can share a nr_pool. */
 	struct expiry *add_items_to_expiry;
 	struct llist_head mappings;
+
+	/* The same mappings, indexed for nr_map_get() and nr_map_get_inv(). */
+	struct hash_index by_orig;
+	struct hash_index by_repl;
 };
 
 
@@ -349,6 +418,32 @@ int nr_map_empty(const struct nr_map *map);
 static const int GTPH_EXPIRE_QUICKLY_SECS = 30; /* TODO is there a spec for this? */
 static const int GTPH_EXPIRE_SLOWLY_MINUTES = 6 * 60; /* TODO is there a spec for this? */
 
+/* A resolved GGSN is kept for the TTL of its DNS record, but at least this
+ * long, so that a zero TTL doesn't trigger a DNS query per request. Without a
+ * TTL (e.g. from /etc/hosts), it is kept for GTPH_EXPIRE_SLOWLY_MINUTES. */
+static const int GTPH_GGSN_TTL_MIN_SECS = 10;
+/* A resolved GGSN used at least this often is queried again in the last tenth
+ * of its TTL, so that it is refreshed before it expires. */
+static const unsigned int GTPH_GGSN_PREFETCH_HITS = 2;
+
+/* The tunnel journal is rewritten to hold only live tunnels at least this
+ * often, and also as soon as it has more than twice as many records as there
+ * are tunnels (but at least GTPH_JOURNAL_COMPACT_MIN records). */
+static const int GTPH_JOURNAL_COMPACT_SECS = 10 * 60;
+static const unsigned int GTPH_JOURNAL_COMPACT_MIN = 1024;
+/* A compaction triggered by the number of records is not attempted again
+ * sooner than this, e.g. after it failed. */
+static const int GTPH_JOURNAL_COMPACT_RETRY_SECS = 60;
+
+/* GGSN pool members are sent an Echo Request this often. After this many
+ * unanswered ones in a row, a member gets no new PDP contexts until it answers
+ * again. */
+static const int GTPH_GGSN_ECHO_SECS = 10;
+static const unsigned int GTPH_GGSN_ECHO_MISSED_MAX = 3;
+/* A pool member whose Echo round trip time is above this gets a
+ * proportionally smaller share of new PDP contexts. */
+static const unsigned int GTPH_GGSN_RTT_SLOW_MS = 200;
+
 struct gtphub_cfg_addr {
 	const char *addr_str;
 	uint16_t port;
@@ -358,17 +453,41 @@ struct gtphub_cfg_bind {
 	struct gtphub_cfg_addr bind;
 };
 
+/* Datagrams read with one recvmmsg() and flushed with sendmmsg() per bind. */
+#define GTPH_BATCH_SIZE_DEFAULT 32
+#define GTPH_BATCH_SIZE_MAX 1024
+
+/* A GGSN of the pool that Create PDP Context Requests are spread across,
+ * reached at the default GTP-C port. */
+struct gtphub_cfg_ggsn {
+	const char *addr_str;
+	unsigned int weight;
+};
+
+#define GTPH_GGSN_POOL_MAX 16
+
 struct gtphub_cfg {
 	struct gtphub_cfg_bind to_gsns[GTPH_SIDE_N][GTPH_PLANE_N];
 	struct gtphub_cfg_addr proxy[GTPH_SIDE_N][GTPH_PLANE_N];
 	int sgsn_use_sender; /* Use sender, not GSN addr IE with std ports */
+	unsigned int batch_size; /* zero means GTPH_BATCH_SIZE_DEFAULT */
+	unsigned int workers; /* zero or one: no extra worker processes */
+	const char *journal_path; /* NULL: tunnels don't survive a restart */
+	/* If not empty, used instead of resolving GGSNs via DNS. */
+	struct gtphub_cfg_ggsn ggsn_pool[GTPH_GGSN_POOL_MAX];
+	unsigned int ggsn_pool_len;
 };
 
+#define GTPH_WORKERS_MAX 16
+
 
 /* state */
 
 struct gtphub_peer {
 	struct llist_head entry;
+	struct gtphub_bind *bind;
+	/* in bind->gc_peers once all addresses are gone */
+	struct llist_head gc_entry;
 
 	struct llist_head addresses; /* Alternatives, not load balancing. */
 	struct nr_pool seq_pool;
@@ -377,6 +496,7 @@ struct gtphub_peer {
 
 struct gtphub_peer_addr {
 	struct llist_head entry;
+	struct hash_index_entry addr_hash; /* in gtphub_bind->addrs_by_addr */
 
 	struct gtphub_peer *peer;
 	struct gsn_addr addr;
@@ -385,6 +505,9 @@ struct gtphub_peer_addr {
 
 struct gtphub_peer_port {
 	struct llist_head entry;
+	struct hash_index_entry port_hash; /* in gtphub_bind->ports_by_addr */
+	/* in bind->gc_ports while ref_count is zero */
+	struct llist_head gc_entry;
 
 	struct gtphub_peer_addr *peer_addr;
 	uint16_t port;
@@ -395,19 +518,54 @@ struct gtphub_peer_port {
 	struct rate_ctr_group *counters_io;
 };
 
+/* I/O counters of a tunnel endpoint. Binds and peers have rate_ctr groups,
+ * but one per tunnel endpoint would cost too much memory and slow down tunnel
+ * creation; these are only summed up when shown. */
+struct gtphub_tunnel_counters {
+	uint64_t pkts_in;
+	uint64_t pkts_out;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+};
+
 struct gtphub_tunnel_endpoint {
+	struct gtphub_tunnel *tun; /* the tunnel containing this endpoint */
 	struct gtphub_peer_port *peer;
 	uint32_t tei_orig; /* from/to peer */
+	/* in gtphub->endpoints_by_tei_orig[side][plane] */
+	struct hash_index_entry tei_orig_hash;
 
-	struct rate_ctr_group *counters_io;
+	struct gtphub_tunnel_counters counters;
 };
 
 struct gtphub_tunnel {
 	struct llist_head entry;
 	struct expiring_item expiry_entry;
+	struct hash_index_entry tei_repl_hash; /* in gtphub->tunnels_by_tei */
 
 	uint32_t tei_repl; /* unique TEI to replace peers' TEIs */
 	struct gtphub_tunnel_endpoint endpoint[GTPH_SIDE_N][GTPH_PLANE_N];
+
+	struct gtphub *hub;
+	int journaled; /* 1 if the last journal record for it is not a delete */
+};
+
+/* A member of the GGSN pool, see gtphub_ggsn_pool_select(). */
+struct gtphub_pool_ggsn {
+	struct gtphub_peer_port *pp; /* ref counted */
+	unsigned int weight; /* as configured */
+	/* weight reduced by the health below, 0 if unreachable */
+	unsigned int eff_weight;
+	/* for smooth weighted round robin */
+	int64_t current;
+	unsigned long selected;
+
+	int echo_pending;
+	uint16_t echo_seq;
+	int64_t echo_sent_ms;
+	unsigned int echo_missed; /* in a row */
+	int rtt_ms; /* smoothed Echo round trip time, -1 if unknown */
+	unsigned int reject_permille; /* smoothed Create PDP Ctx reject rate */
 };
 
 struct gtphub_bind {
@@ -418,8 +576,20 @@ struct gtphub_bind {
 	/* list of struct gtphub_peer */
 	struct llist_head peers;
 
+	/* All addresses and ports of above peers, to identify a sender
+	 * without iterating all peers. */
+	struct hash_index addrs_by_addr; /* struct gtphub_peer_addr */
+	struct hash_index ports_by_addr; /* struct gtphub_peer_port, by addr
+					    and port */
+
+	/* Candidates for the next gtphub_gc(): unreferenced ports and peers
+	 * without addresses. */
+	struct llist_head gc_ports; /* struct gtphub_peer_port */
+	struct llist_head gc_peers; /* struct gtphub_peer */
+
 	const char *label; /* For logging */
 	struct rate_ctr_group *counters_io;
+	struct rate_ctr_group *counters_batch;
 };
 
 struct gtphub_resolved_ggsn {
@@ -432,6 +602,24 @@ struct gtphub_resolved_ggsn {
 
 	/* Which address and port we resolved that to. */
 	struct gtphub_peer_port *peer;
+
+	/* in gtphub->resolved_ggsns_by_apn_oi */
+	struct hash_index_entry apn_oi_hash;
+	int ttl; /* seconds */
+	time_t valid_until;
+	unsigned int hits; /* since last resolved */
+};
+
+/* gtphub->counters */
+enum gtphub_counters_hub {
+	GTPH_CTR_PARKED = 0,
+	GTPH_CTR_PARKED_FORWARDED,
+	GTPH_CTR_PARKED_DROPPED,
+	GTPH_CTR_GGSN_CACHE_HIT,
+	GTPH_CTR_GGSN_CACHE_MISS,
+	GTPH_CTR_GGSN_PREFETCH,
+	GTPH_CTR_RETRANS_REPLAYED,
+	GTPH_CTR_RETRANS_FORWARDED,
 };
 
 struct gtphub {
@@ -445,14 +633,25 @@ struct gtphub {
 	 * same TEI for a time long enough for the TEI nr map to wrap an entire
 	 * uint32_t; if a new TEI were mapped every second, this would take
 	 * more than 100 years (in which a single given TEI must not time out)
-	 * to cause a problem. */
+	 * to cause a problem. TEIs still in use by a tunnel are skipped when
+	 * the pool wraps. */
 	struct nr_pool tei_pool;
 
 	struct llist_head tunnels; /* struct gtphub_tunnel */
+	/* The same tunnels, indexed by tei_repl, for per-packet lookup. */
+	struct hash_index tunnels_by_tei;
+	/* Ctrl plane seq mappings by origin port and orig seq nr, to recognize
+	 * retransmitted requests (opaque). */
+	struct hash_index seq_reqs;
+	/* Tunnel endpoints indexed by peer address and tei_orig, to detect
+	 * peers reusing a TEI of a stale tunnel. */
+	struct hash_index endpoints_by_tei_orig[GTPH_SIDE_N][GTPH_PLANE_N];
 	struct llist_head pending_deletes; /* opaque (gtphub.c) */
 
 	struct llist_head ggsn_lookups; /* opaque (gtphub_ares.c) */
+	struct hash_index ggsn_lookups_by_apn_oi; /* opaque (gtphub_ares.c) */
 	struct llist_head resolved_ggsns; /* struct gtphub_resolved_ggsn */
+	struct hash_index resolved_ggsns_by_apn_oi;
 
 	struct osmo_timer_list gc_timer;
 	struct expiry expire_quickly;
@@ -461,6 +660,27 @@ struct gtphub {
 	uint8_t restart_counter;
 
 	int sgsn_use_sender;
+
+	unsigned int batch_size;
+	struct gtphub_batch *batch; /* opaque (gtphub.c) */
+
+	/* With several workers, each one is a separate process with its own
+	 * struct gtphub, owning a slice of the TEI and sequence nr space. */
+	unsigned int workers;
+	unsigned int worker_id;
+
+	struct rate_ctr_group *counters; /* enum gtphub_counters_hub */
+
+	/* Append-only journal of complete tunnels, see gtphub_journal_open().
+	 * journal_fd is -1 when there is none. */
+	int journal_fd;
+	char *journal_path;
+	unsigned int journal_records;
+	time_t journal_compacted;
+
+	struct gtphub_pool_ggsn ggsn_pool[GTPH_GGSN_POOL_MAX];
+	unsigned int ggsn_pool_len;
+	time_t ggsn_pool_echo_last;
 };
 
 struct gtp_packet_desc;
@@ -471,7 +691,9 @@ struct gtp_packet_desc;
 int gtphub_vty_init(struct gtphub *global_hub, struct gtphub_cfg *global_cfg);
 int gtphub_cfg_read(struct gtphub_cfg *cfg, const char *config_file);
 
-/* Initialize and start gtphub: bind to ports, run expiry timers. */
+/* Initialize and start gtphub: bind to ports, run expiry timers. If
+ * cfg->workers > 1, fork that many worker processes in total, which all
+ * return from this function; hub->worker_id tells them apart. */
 int gtphub_start(struct gtphub *hub, struct gtphub_cfg *cfg,
 		 uint8_t restart_counter);
 
@@ -484,6 +706,18 @@ time_t gtphub_now(void);
 /* Remove expired items, empty peers, ... */
 void gtphub_gc(struct gtphub *hub, time_t now);
 
+/* Restore the tunnels recorded in the journal file at path, if any, rewrite
+ * it to hold only those and keep it open to record tunnel changes from now on.
+ * If there was a journal, hub->restart_counter is set to the one saved in it,
+ * so that peers don't see a restart. Return the number of restored tunnels, or
+ * -1 on error. */
+int gtphub_journal_open(struct gtphub *hub, const char *path, time_t now);
+
+/* Rewrite the journal to hold only the current tunnels. */
+int gtphub_journal_compact(struct gtphub *hub, time_t now);
+
+void gtphub_journal_close(struct gtphub *hub);
+
 /* Return the string of the first address for this peer. */
 const char *gtphub_peer_str(struct gtphub_peer *peer);
 
@@ -512,12 +746,68 @@ struct gtphub_peer_port *gtphub_port_have(struct gtphub *hub,
 struct gtphub_peer_port *gtphub_port_find_sa(const struct gtphub_bind *bind,
 					     const struct osmo_sockaddr *addr);
 
-void gtphub_resolved_ggsn(struct gtphub *hub, const char *apn_oi_str,
-			  struct gsn_addr *resolved_addr,
-			  time_t now);
+/* Cache the GGSN resolved for apn_oi_str for ttl seconds (or -1 if unknown)
+ * and return its peer port, or NULL on error. */
+struct gtphub_peer_port *gtphub_resolved_ggsn(struct gtphub *hub,
+					      const char *apn_oi_str,
+					      struct gsn_addr *resolved_addr,
+					      int ttl,
+					      time_t now);
+
+/* Return the cached GGSN for apn_oi_str, or NULL if there is none or its TTL
+ * has run out. If it is about to expire and popular enough to be worth it,
+ * set *prefetch to 1, otherwise to 0. */
+struct gtphub_peer_port *gtphub_resolved_ggsn_find(struct gtphub *hub,
+						   const char *apn_oi_str,
+						   time_t now,
+						   int *prefetch);
+
+/* Hash value of an APN-OI string, for hub->*_by_apn_oi. */
+uint32_t gtphub_apn_oi_hash(const char *apn_oi_str);
+
+/* Add the GGSN at addr, on the default GTP-C port, to hub's GGSN pool. Return
+ * the new member, or NULL if the pool is full. */
+struct gtphub_pool_ggsn *gtphub_ggsn_pool_add(struct gtphub *hub,
+					      const struct gsn_addr *addr,
+					      unsigned int weight);
+
+/* Pick the pool member for a new PDP context, by smooth weighted round robin
+ * over the members' effective weights. Established tunnels stay with their
+ * GGSN, since they are found by TEI. Return NULL if the pool is empty. */
+struct gtphub_pool_ggsn *gtphub_ggsn_pool_select(struct gtphub *hub);
+
+/* Feed health input for a pool member: an Echo round trip time, or whether a
+ * Create PDP Context Request was accepted. */
+void gtphub_ggsn_pool_rtt(struct gtphub_pool_ggsn *g, unsigned int rtt_ms);
+void gtphub_ggsn_pool_create_result(struct gtphub_pool_ggsn *g, int accepted);
+
+/* Create PDP Context Requests are parked in a list of the pending GGSN
+ * lookup while DNS resolution is in progress, at most GTPH_PARKED_MAX per
+ * lookup. Parked requests also expire along with hub->expire_quickly. */
+#define GTPH_PARKED_MAX 16
+
+/* Forward all requests parked in the list to the resolved ggsn, and empty the
+ * list. */
+void gtphub_parked_forward(struct gtphub *hub, struct llist_head *parked,
+			   struct gtphub_peer_port *ggsn, time_t now);
+
+/* Discard all requests parked in the list. */
+void gtphub_parked_drop(struct llist_head *parked);
 
 const char *gtphub_port_str(struct gtphub_peer_port *port);
 
 int gtphub_write(const struct osmo_fd *to,
 		 const struct osmo_sockaddr *to_addr,
 		 const uint8_t *buf, size_t buf_len);
+
+/* One outgoing datagram, for gtphub_write_batch(). */
+struct gtphub_out {
+	const uint8_t *buf;
+	size_t len;
+	struct osmo_sockaddr to_addr;
+};
+
+/* Send n datagrams via the same socket, using as few syscalls as possible.
+ * Return the number of datagrams that were sent. */
+int gtphub_write_batch(const struct osmo_fd *to,
+		       const struct gtphub_out *out, unsigned int n);
@@ -196,4 +196,11 @@ int sgsn_cdr_init(struct sgsn_instance *sgsn);
 int sgsn_ares_init(struct sgsn_instance *sgsn);
 int sgsn_ares_query(struct sgsn_instance *sgsm, const char *name, ares_host_callback cb, void *data);
 
+/* Like sgsn_ares_query(), but also pass the smallest TTL of the A records
+ * found to cb, or -1 if unknown. */
+typedef void (*sgsn_ares_ttl_callback)(void *arg, int status, int timeouts,
+				       struct hostent *hostent, int ttl);
+int sgsn_ares_query_ttl(struct sgsn_instance *sgsn, const char *name,
+			sgsn_ares_ttl_callback cb, void *data);
+
 #endif
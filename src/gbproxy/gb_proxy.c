@@ -65,6 +65,7 @@ static const struct rate_ctr_desc global_ctr_description[] = {
 	{ "tx-err:sgsn",    "NS Transmission error     (SGSN)" },
 	{ "error",          "Other error                     " },
 	{ "mod-peer-err",   "Patch error: no peer            " },
+	{ "stored-drop",    "Stored msg dropped, max bytes   " },
 };
 
 static const struct rate_ctr_group_desc global_ctrg_desc = {
@@ -75,10 +76,12 @@ static const struct rate_ctr_group_desc global_ctrg_desc = {
 	.class_id = OSMO_STATS_CLASS_GLOBAL,
 };
 
-static int gbprox_relay2peer(struct msgb *old_msg, struct gbproxy_peer *peer,
-			  uint16_t ns_bvci);
+static int gbprox_send2peer(struct msgb *msg, struct gbproxy_peer *peer,
+			    uint16_t ns_bvci);
 static int gbprox_relay2sgsn(struct gbproxy_config *cfg, struct msgb *old_msg,
 			     uint16_t ns_bvci, uint16_t sgsn_nsei);
+static int gbprox_send2sgsn(struct gbproxy_config *cfg, struct msgb *msg,
+			    uint16_t ns_bvci, uint16_t sgsn_nsei);
 static void gbproxy_reset_imsi_acquisition(struct gbproxy_link_info* link_info);
 
 static int check_peer_nsei(struct gbproxy_peer *peer, uint16_t nsei)
@@ -245,6 +248,16 @@ uint32_t gbproxy_make_bss_ptmsi(struct gbproxy_peer *peer,
 
 			bss_ptmsi = bss_ptmsi | GSM23003_TMSI_SGSN_MASK;
 
+			/* Keep the NRI, so that the SGSN can still be
+			 * found by the TLLI alone */
+			if (peer->cfg->nri_bitlen) {
+				uint32_t nri_mask =
+					((1 << peer->cfg->nri_bitlen) - 1) <<
+					(24 - peer->cfg->nri_bitlen);
+				bss_ptmsi = (bss_ptmsi & ~nri_mask) |
+					(sgsn_ptmsi & nri_mask);
+			}
+
 			if (gbproxy_link_info_by_ptmsi(peer, bss_ptmsi))
 				bss_ptmsi = GSM_RESERVED_TMSI;
 		} while (bss_ptmsi == GSM_RESERVED_TMSI && max_retries--);
@@ -329,18 +342,14 @@ static int gbproxy_flush_stored_messages(struct gbproxy_peer *peer,
 {
 	int rc;
 	struct msgb *stored_msg;
+	struct gprs_gb_parse_context tmp_parse_ctx;
 
-	/* Patch and flush stored messages towards the SGSN */
-	while ((stored_msg = msgb_dequeue_count(&link_info->stored_msgs,
-						&link_info->stored_msgs_len))) {
-		struct gprs_gb_parse_context tmp_parse_ctx = {0};
-		tmp_parse_ctx.to_bss = 0;
-		tmp_parse_ctx.peer_nsei = msgb_nsei(stored_msg);
+	/* Patch and flush stored messages towards the SGSN, they have been
+	 * parsed when they were stored */
+	while ((stored_msg = gbproxy_link_info_dequeue_msg(link_info,
+							   &tmp_parse_ctx))) {
 		int len_change = 0;
 
-		gprs_gb_parse_bssgp(msgb_bssgph(stored_msg),
-				    msgb_bssgp_len(stored_msg),
-				    &tmp_parse_ctx);
 		gbproxy_patch_bssgp(stored_msg, msgb_bssgph(stored_msg),
 				    msgb_bssgp_len(stored_msg),
 				    peer, link_info, &len_change,
@@ -354,8 +363,9 @@ static int gbproxy_flush_stored_messages(struct gbproxy_peer *peer,
 			return -1;
 		}
 
-		rc = gbprox_relay2sgsn(peer->cfg, stored_msg,
-				       msgb_bvci(stored_msg), link_info->sgsn_nsei);
+		/* The stored message is our own copy, hand it over */
+		rc = gbprox_send2sgsn(peer->cfg, stored_msg,
+				      msgb_bvci(stored_msg), link_info->sgsn_nsei);
 
 		if (rc < 0)
 			LOGP(DLLC, LOGL_ERROR,
@@ -364,7 +374,6 @@ static int gbproxy_flush_stored_messages(struct gbproxy_peer *peer,
 			     tmp_parse_ctx.peer_nsei,
 			     tmp_parse_ctx.llc_msg_name ?
 			     tmp_parse_ctx.llc_msg_name : "BSSGP");
-		msgb_free(stored_msg);
 	}
 
 	return 0;
@@ -375,8 +384,6 @@ static int gbproxy_gsm48_to_peer(struct gbproxy_peer *peer,
 				 uint16_t bvci,
 				 struct msgb *msg /* Takes msg ownership */)
 {
-	int rc;
-
 	/* Workaround to avoid N(U) collisions and to enable a restart
 	 * of the IMSI acquisition procedure. This will work unless the
 	 * SGSN has an initial V(UT) within [256-32, 256+n_retries]
@@ -385,9 +392,7 @@ static int gbproxy_gsm48_to_peer(struct gbproxy_peer *peer,
 	link_info->vu_gen_tx_bss = (link_info->vu_gen_tx_bss + 1) % 512;
 
 	gprs_push_bssgp_dl_unitdata(msg, link_info->tlli.current);
-	rc = gbprox_relay2peer(msg, peer, bvci);
-	msgb_free(msg);
-	return rc;
+	return gbprox_send2peer(msg, peer, bvci);
 }
 
 static void gbproxy_acquire_imsi(struct gbproxy_peer *peer,
@@ -421,7 +426,7 @@ static int gbproxy_imsi_acquisition(struct gbproxy_peer *peer,
 				    struct gbproxy_link_info* link_info,
 				    struct gprs_gb_parse_context *parse_ctx)
 {
-	struct msgb *stored_msg;
+	int rc;
 
 	if (!link_info)
 		return 1;
@@ -495,15 +500,11 @@ static int gbproxy_imsi_acquisition(struct gbproxy_peer *peer,
 				   + 1 - peer->cfg->stored_msgs_max_len;
 
 		for (; exceeded_max_len > 0; exceeded_max_len--) {
-			struct msgb *msgb_drop;
-			msgb_drop = msgb_dequeue_count(&link_info->stored_msgs,
-						       &link_info->stored_msgs_len);
+			int nsei_drop = gbproxy_link_info_drop_msg(link_info);
 			LOGP(DLLC, LOGL_INFO,
 			     "NSEI=%d(BSS) Dropping stored msgb from list "
 			     "(!acq imsi, length %d, max_len exceeded)\n",
-			     msgb_nsei(msgb_drop), link_info->stored_msgs_len);
-
-			msgb_free(msgb_drop);
+			     nsei_drop, link_info->stored_msgs_len);
 		}
 	}
 
@@ -514,9 +515,14 @@ static int gbproxy_imsi_acquisition(struct gbproxy_peer *peer,
 	     msgb_nsei(msg),
 	     parse_ctx->llc_msg_name ? parse_ctx->llc_msg_name : "BSSGP");
 
-	stored_msg = bssgp_msgb_copy(msg, "process_bssgp_ul");
-	msgb_enqueue_count(&link_info->stored_msgs, stored_msg,
-			   &link_info->stored_msgs_len);
+	rc = gbproxy_link_info_store_msg(peer, link_info, msg, parse_ctx);
+	if (rc < 0) {
+		LOGP(DLLC, LOGL_NOTICE,
+		     "NSEI=%d(BSS) Dropping message instead of storing it "
+		     "(!acq imsi, %s)\n",
+		     msgb_nsei(msg), strerror(-rc));
+		rate_ctr_inc(&peer->cfg->ctrg->ctr[GBPROX_GLOB_CTR_STORED_MSGS_DROPPED]);
+	}
 
 	if (!link_info->imsi_acq_pending) {
 		LOGP(DLLC, LOGL_INFO,
@@ -578,7 +584,8 @@ static int gbprox_process_bssgp_ul(struct gbproxy_config *cfg,
 	uint32_t sgsn_nsei = cfg->nsip_sgsn_nsei;
 
 	if (!cfg->core_plmn.mcc && !cfg->core_plmn.mnc && !cfg->core_apn &&
-	    !cfg->acquire_imsi && !cfg->patch_ptmsi && !cfg->route_to_sgsn2)
+	    !cfg->acquire_imsi && !cfg->patch_ptmsi && !cfg->route_to_sgsn2 &&
+	    llist_empty(&cfg->sgsn_pool))
 		return 1;
 
 	parse_ctx.to_bss = 0;
@@ -649,13 +656,8 @@ static int gbprox_process_bssgp_ul(struct gbproxy_config *cfg,
 		}
 	}
 
-	if (link_info && cfg->route_to_sgsn2) {
-		if (cfg->acquire_imsi && link_info->imsi_len == 0)
-			sgsn_nsei = 0xffff;
-		else if (gbproxy_imsi_matches(cfg, GBPROX_MATCH_ROUTING,
-					      link_info))
-			sgsn_nsei = cfg->nsip_sgsn2_nsei;
-	}
+	if (cfg->route_to_sgsn2 || !llist_empty(&cfg->sgsn_pool))
+		sgsn_nsei = gbproxy_select_sgsn(cfg, link_info, &parse_ctx);
 
 	if (link_info)
 		link_info->sgsn_nsei = sgsn_nsei;
@@ -696,7 +698,8 @@ static void gbprox_process_bssgp_dl(struct gbproxy_config *cfg,
 	struct gbproxy_link_info *link_info = NULL;
 
 	if (!cfg->core_plmn.mcc && !cfg->core_plmn.mnc && !cfg->core_apn &&
-	    !cfg->acquire_imsi && !cfg->patch_ptmsi && !cfg->route_to_sgsn2)
+	    !cfg->acquire_imsi && !cfg->patch_ptmsi && !cfg->route_to_sgsn2 &&
+	    llist_empty(&cfg->sgsn_pool))
 		return;
 
 	parse_ctx.to_bss = 1;
@@ -773,13 +776,36 @@ static void gbprox_process_bssgp_dl(struct gbproxy_config *cfg,
 	return;
 }
 
+/* Copy the BSSGP PDU of a message into a new msgb that is just large enough
+ * for it and the NS header that will be put in front of it again. The
+ * received msgb is owned (and freed) by the NS layer and usually has a much
+ * larger buffer, most of which bssgp_msgb_copy() would copy as well. */
+static struct msgb *gbprox_msgb_copy_pdu(const struct msgb *old_msg,
+					 const char *name)
+{
+	size_t headroom = msgb_bssgph(old_msg) - old_msg->head;
+	size_t len = msgb_bssgp_len(old_msg);
+	struct msgb *msg;
+
+	msg = msgb_alloc_headroom(headroom + len, headroom, name);
+	if (!msg)
+		return NULL;
+
+	msgb_bssgph(msg) = msgb_put(msg, len);
+	memcpy(msgb_bssgph(msg), msgb_bssgph(old_msg), len);
+
+	msgb_nsei(msg) = msgb_nsei(old_msg);
+	msgb_bvci(msg) = msgb_bvci(old_msg);
+	msgb_tlli(msg) = msgb_tlli(old_msg);
+
+	return msg;
+}
+
 /* feed a message down the NS-VC associated with the specified peer */
-static int gbprox_relay2sgsn(struct gbproxy_config *cfg, struct msgb *old_msg,
-			     uint16_t ns_bvci, uint16_t sgsn_nsei)
+static int gbprox_send2sgsn(struct gbproxy_config *cfg,
+			    struct msgb *msg /* Takes msg ownership */,
+			    uint16_t ns_bvci, uint16_t sgsn_nsei)
 {
-	/* create a copy of the message so the old one can
-	 * be free()d safely when we return from gbprox_rcvmsg() */
-	struct msgb *msg = bssgp_msgb_copy(old_msg, "msgb_relay2sgsn");
 	int rc;
 
 	DEBUGP(DGPRS, "NSEI=%u proxying BTS->SGSN (NS_BVCI=%u, NSEI=%u)\n",
@@ -797,13 +823,45 @@ static int gbprox_relay2sgsn(struct gbproxy_config *cfg, struct msgb *old_msg,
 	return rc;
 }
 
-/* feed a message down the NS-VC associated with the specified peer */
-static int gbprox_relay2peer(struct msgb *old_msg, struct gbproxy_peer *peer,
-			  uint16_t ns_bvci)
+static int gbprox_relay2sgsn(struct gbproxy_config *cfg, struct msgb *old_msg,
+			     uint16_t ns_bvci, uint16_t sgsn_nsei)
 {
 	/* create a copy of the message so the old one can
 	 * be free()d safely when we return from gbprox_rcvmsg() */
-	struct msgb *msg = bssgp_msgb_copy(old_msg, "msgb_relay2peer");
+	struct msgb *msg = gbprox_msgb_copy_pdu(old_msg, "msgb_relay2sgsn");
+
+	if (!msg) {
+		rate_ctr_inc(&cfg->ctrg->ctr[GBPROX_GLOB_CTR_TX_ERR_SGSN]);
+		return -ENOMEM;
+	}
+
+	return gbprox_send2sgsn(cfg, msg, ns_bvci, sgsn_nsei);
+}
+
+/* relay a copy of a BVC related message to all SGSNs except the primary one,
+ * every SGSN that serves subscribers behind the BVC needs to know it */
+static void gbprox_relay2other_sgsns(struct gbproxy_config *cfg,
+				     struct msgb *old_msg, uint16_t ns_bvci)
+{
+	struct gbproxy_sgsn *sgsn;
+
+	if (cfg->route_to_sgsn2)
+		gbprox_relay2sgsn(cfg, old_msg, ns_bvci, cfg->nsip_sgsn2_nsei);
+
+	llist_for_each_entry(sgsn, &cfg->sgsn_pool, list) {
+		if (sgsn->nsei == cfg->nsip_sgsn_nsei)
+			continue;
+		if (cfg->route_to_sgsn2 && sgsn->nsei == cfg->nsip_sgsn2_nsei)
+			continue;
+
+		gbprox_relay2sgsn(cfg, old_msg, ns_bvci, sgsn->nsei);
+	}
+}
+
+/* feed a message down the NS-VC associated with the specified peer */
+static int gbprox_send2peer(struct msgb *msg /* Takes msg ownership */,
+			    struct gbproxy_peer *peer, uint16_t ns_bvci)
+{
 	int rc;
 
 	DEBUGP(DGPRS, "NSEI=%u proxying SGSN->BSS (NS_BVCI=%u, NSEI=%u)\n",
@@ -822,6 +880,21 @@ static int gbprox_relay2peer(struct msgb *old_msg, struct gbproxy_peer *peer,
 	return rc;
 }
 
+static int gbprox_relay2peer(struct msgb *old_msg, struct gbproxy_peer *peer,
+			  uint16_t ns_bvci)
+{
+	/* create a copy of the message so the old one can
+	 * be free()d safely when we return from gbprox_rcvmsg() */
+	struct msgb *msg = gbprox_msgb_copy_pdu(old_msg, "msgb_relay2peer");
+
+	if (!msg) {
+		rate_ctr_inc(&peer->ctrg->ctr[GBPROX_PEER_CTR_TX_ERR]);
+		return -ENOMEM;
+	}
+
+	return gbprox_send2peer(msg, peer, ns_bvci);
+}
+
 static int block_unblock_peer(struct gbproxy_config *cfg, uint16_t ptp_bvci, uint8_t pdu_type)
 {
 	struct gbproxy_peer *peer;
@@ -900,11 +973,8 @@ static int gbprox_rx_ptp_from_bss(struct gbproxy_config *cfg,
 
 	switch (pdu_type) {
 	case BSSGP_PDUT_FLOW_CONTROL_BVC:
-		if (!cfg->route_to_sgsn2)
-			break;
-
-		/* Send a copy to the secondary SGSN */
-		gbprox_relay2sgsn(cfg, msg, ns_bvci, cfg->nsip_sgsn2_nsei);
+		/* Send a copy to the secondary and pooled SGSNs */
+		gbprox_relay2other_sgsns(cfg, msg, ns_bvci);
 		break;
 	default:
 		break;
@@ -949,9 +1019,9 @@ static int gbprox_rx_ptp_from_sgsn(struct gbproxy_config *cfg,
 	case BSSGP_PDUT_FLOW_CONTROL_BVC_ACK:
 	case BSSGP_PDUT_BVC_BLOCK_ACK:
 	case BSSGP_PDUT_BVC_UNBLOCK_ACK:
-		if (cfg->route_to_sgsn2 && nsei == cfg->nsip_sgsn2_nsei)
-			/* Hide ACKs from the secondary SGSN, the primary SGSN
-			 * is responsible to send them. */
+		if (nsei != cfg->nsip_sgsn_nsei)
+			/* Hide ACKs from the secondary and pooled SGSNs, the
+			 * primary SGSN is responsible to send them. */
 			return 0;
 		break;
 	default:
@@ -975,7 +1045,7 @@ static int gbprox_rx_sig_from_bss(struct gbproxy_config *cfg,
 	int data_len = msgb_bssgp_len(msg) - sizeof(*bgph);
 	struct gbproxy_peer *from_peer = NULL;
 	struct gprs_ra_id raid;
-	int copy_to_sgsn2 = 0;
+	int copy_to_other_sgsns = 0;
 	int rc;
 
 	if (ns_bvci != 0 && ns_bvci != 1) {
@@ -1008,13 +1078,13 @@ static int gbprox_rx_sig_from_bss(struct gbproxy_config *cfg,
 		from_peer = gbproxy_peer_by_nsei(cfg, nsei);
 		if (!from_peer)
 			goto err_no_peer;
-		memcpy(from_peer->ra, TLVP_VAL(&tp, BSSGP_IE_ROUTEING_AREA),
-			sizeof(from_peer->ra));
+		gbproxy_peer_set_ra(from_peer,
+				    TLVP_VAL(&tp, BSSGP_IE_ROUTEING_AREA));
 		gsm48_parse_ra(&raid, from_peer->ra);
 		LOGP(DGPRS, LOGL_INFO, "NSEI=%u BSSGP SUSPEND/RESUME "
 			"RAI snooping: RAI %s behind BVCI=%u\n",
 			nsei, osmo_rai_name(&raid), from_peer->bvci);
-		/* FIXME: This only supports one BSS per RA */
+		/* FIXME: The ACK only goes to one BSS per RA */
 		break;
 	case BSSGP_PDUT_BVC_RESET:
 		/* If we receive a BVC reset on the signalling endpoint, we
@@ -1038,11 +1108,11 @@ static int gbprox_rx_sig_from_bss(struct gbproxy_config *cfg,
 				LOGP(DGPRS, LOGL_INFO, "Allocationg new peer for BVCI=%u via NSEI=%u\n", bvci, nsei);
 				from_peer = gbproxy_peer_alloc(cfg, bvci);
 				OSMO_ASSERT(from_peer);
-				from_peer->nsei = nsei;
+				gbproxy_peer_set_nsei(from_peer, nsei);
 			}
 
 			if (!check_peer_nsei(from_peer, nsei))
-				from_peer->nsei = nsei;
+				gbproxy_peer_set_nsei(from_peer, nsei);
 
 			if (TLVP_PRESENT(&tp, BSSGP_IE_CELL_ID)) {
 				struct gprs_ra_id raid;
@@ -1050,15 +1120,13 @@ static int gbprox_rx_sig_from_bss(struct gbproxy_config *cfg,
 				 * PDU, this means we can extend our local
 				 * state information about this particular cell
 				 * */
-				memcpy(from_peer->ra,
-					TLVP_VAL(&tp, BSSGP_IE_CELL_ID),
-					sizeof(from_peer->ra));
+				gbproxy_peer_set_ra(from_peer,
+					TLVP_VAL(&tp, BSSGP_IE_CELL_ID));
 				gsm48_parse_ra(&raid, from_peer->ra);
 				LOGP(DGPRS, LOGL_INFO, "NSEI=%u/BVCI=%u Cell ID %s\n",
 				     nsei, bvci, osmo_rai_name(&raid));
 			}
-			if (cfg->route_to_sgsn2)
-				copy_to_sgsn2 = 1;
+			copy_to_other_sgsns = 1;
 		}
 		break;
 	}
@@ -1069,8 +1137,8 @@ static int gbprox_rx_sig_from_bss(struct gbproxy_config *cfg,
 	if (!rc)
 		return 0;
 
-	if (copy_to_sgsn2)
-		gbprox_relay2sgsn(cfg, msg, ns_bvci, cfg->nsip_sgsn2_nsei);
+	if (copy_to_other_sgsns)
+		gbprox_relay2other_sgsns(cfg, msg, ns_bvci);
 
 	return gbprox_relay2sgsn(cfg, msg, ns_bvci, cfg->nsip_sgsn_nsei);
 err_no_peer:
@@ -1085,12 +1153,44 @@ err_mand_ie:
 	return bssgp_tx_status(BSSGP_CAUSE_MISSING_MAND_IE, NULL, msg);
 }
 
+/* Relay a PAGING to all unblocked BVCs of a routeing area, returns the
+ * number of copies sent */
+static int gbprox_page_area(struct gbproxy_area *area, struct msgb *msg,
+			    uint16_t ns_bvci)
+{
+	struct bssgp_normal_hdr *bgph = (struct bssgp_normal_hdr *) msgb_bssgph(msg);
+	struct gbproxy_peer *peer;
+	int sent = 0;
+
+	if (bgph->pdu_type == BSSGP_PDUT_PAGING_CS)
+		rate_ctr_inc(&area->ctrg->ctr[GBPROX_AREA_CTR_PAGING_CS]);
+	else
+		rate_ctr_inc(&area->ctrg->ctr[GBPROX_AREA_CTR_PAGING_PS]);
+
+	llist_for_each_entry(peer, &area->peers, area_list) {
+		if (peer->blocked) {
+			rate_ctr_inc(&area->ctrg->
+				     ctr[GBPROX_AREA_CTR_PAGING_BLOCKED]);
+			continue;
+		}
+		LOGP(DGPRS, LOGL_DEBUG, "BSSGP PAGING relayed to BVCI=%u\n",
+		     peer->bvci);
+		gbprox_relay2peer(msg, peer, ns_bvci);
+		rate_ctr_inc(&area->ctrg->ctr[GBPROX_AREA_CTR_PAGING_BVC]);
+		sent += 1;
+	}
+
+	return sent;
+}
+
 /* Receive paging request from SGSN, we need to relay to proper BSS */
-static int gbprox_rx_paging(struct gbproxy_config *cfg, struct msgb *msg, struct tlv_parsed *tp,
+int gbprox_rx_paging(struct gbproxy_config *cfg, struct msgb *msg, struct tlv_parsed *tp,
 			    uint32_t nsei, uint16_t ns_bvci)
 {
-	struct gbproxy_peer *peer = NULL;
+	struct gbproxy_area *area = NULL;
 	int errctr = GBPROX_GLOB_CTR_PROTO_ERR_SGSN;
+	int found = 0;
+	int sent = 0;
 
 	LOGP(DGPRS, LOGL_INFO, "NSEI=%u(SGSN) BSSGP PAGING ",
 		nsei);
@@ -1100,25 +1200,39 @@ static int gbprox_rx_paging(struct gbproxy_config *cfg, struct msgb *msg, struct
 			bvci);
 		errctr = GBPROX_GLOB_CTR_OTHER_ERR;
 	} else if (TLVP_PRESENT(tp, BSSGP_IE_ROUTEING_AREA)) {
-		peer = gbproxy_peer_by_rai(cfg, TLVP_VAL(tp, BSSGP_IE_ROUTEING_AREA));
-		LOGPC(DGPRS, LOGL_INFO, "routing by RAI to peer BVCI=%u\n",
-			peer ? peer->bvci : -1);
+		area = gbproxy_area_by_rai(cfg, TLVP_VAL(tp, BSSGP_IE_ROUTEING_AREA));
+		LOGPC(DGPRS, LOGL_INFO, "routing by RAI to %s peers\n",
+			area ? "all" : "no");
+		if (area) {
+			sent += gbprox_page_area(area, msg, ns_bvci);
+			found = 1;
+		}
 		errctr = GBPROX_GLOB_CTR_INV_RAI;
 	} else if (TLVP_PRESENT(tp, BSSGP_IE_LOCATION_AREA)) {
-		peer = gbproxy_peer_by_lai(cfg, TLVP_VAL(tp, BSSGP_IE_LOCATION_AREA));
-		LOGPC(DGPRS, LOGL_INFO, "routing by LAI to peer BVCI=%u\n",
-			peer ? peer->bvci : -1);
+		const uint8_t *la = TLVP_VAL(tp, BSSGP_IE_LOCATION_AREA);
+		LOGPC(DGPRS, LOGL_INFO, "routing by LAI to all peers\n");
+		/* every routeing area of the location area is paged */
+		while ((area = gbproxy_area_by_lai(cfg, la, area))) {
+			sent += gbprox_page_area(area, msg, ns_bvci);
+			found = 1;
+		}
 		errctr = GBPROX_GLOB_CTR_INV_LAI;
 	} else
 		LOGPC(DGPRS, LOGL_INFO, "\n");
 
-	if (!peer) {
+	if (!found) {
 		LOGP(DGPRS, LOGL_ERROR, "NSEI=%u(SGSN) BSSGP PAGING: "
 			"unable to route, missing IE\n", nsei);
 		rate_ctr_inc(&cfg->ctrg->ctr[errctr]);
 		return -EINVAL;
 	}
-	return gbprox_relay2peer(msg, peer, ns_bvci);
+	if (!sent) {
+		LOGP(DGPRS, LOGL_ERROR, "NSEI=%u(SGSN) BSSGP PAGING: "
+			"no unblocked BVC in the area\n", nsei);
+		rate_ctr_inc(&cfg->ctrg->ctr[errctr]);
+		return -EINVAL;
+	}
+	return 0;
 }
 
 /* Receive an incoming BVC-RESET message from the SGSN */
@@ -1207,7 +1321,7 @@ static int gbprox_rx_sig_from_sgsn(struct gbproxy_config *cfg,
 		rc = rx_reset_from_sgsn(cfg, msg, orig_msg, &tp, nsei, ns_bvci);
 		break;
 	case BSSGP_PDUT_BVC_RESET_ACK:
-		if (cfg->route_to_sgsn2 && nsei == cfg->nsip_sgsn2_nsei)
+		if (nsei != cfg->nsip_sgsn_nsei)
 			break;
 		/* fall through */
 	case BSSGP_PDUT_FLUSH_LL:
@@ -1310,7 +1424,8 @@ err_no_peer:
 static int gbproxy_is_sgsn_nsei(struct gbproxy_config *cfg, uint16_t nsei)
 {
 	return nsei == cfg->nsip_sgsn_nsei ||
-		(cfg->route_to_sgsn2 && nsei == cfg->nsip_sgsn2_nsei);
+		(cfg->route_to_sgsn2 && nsei == cfg->nsip_sgsn2_nsei) ||
+		gbproxy_sgsn_by_nsei(cfg, nsei) != NULL;
 }
 
 /* Main input function for Gb proxy */
@@ -1427,13 +1542,31 @@ int gbprox_signal(unsigned int subsys, unsigned int signal,
 	return 0;
 }
 
+static void clean_stale_timer_cb(void *data)
+{
+	time_t now;
+	struct timespec ts = {0,};
+	struct gbproxy_config *cfg = (struct gbproxy_config *) data;
+
+	osmo_clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = ts.tv_sec;
+	gbproxy_remove_stale_links(cfg, now);
+	if (cfg->clean_stale_timer_freq != 0)
+		osmo_timer_schedule(&cfg->clean_stale_timer,
+					cfg->clean_stale_timer_freq, 0);
+}
+
 void gbprox_reset(struct gbproxy_config *cfg)
 {
 	struct gbproxy_peer *peer, *tmp;
 
+	osmo_timer_del(&cfg->clean_stale_timer);
+
 	llist_for_each_entry_safe(peer, tmp, &cfg->bts_peers, list)
 		gbproxy_peer_free(peer);
 
+	gbproxy_sgsn_pool_free(cfg);
+
 	rate_ctr_group_free(cfg->ctrg);
 	gbproxy_init_config(cfg);
 }
@@ -1441,13 +1574,27 @@ void gbprox_reset(struct gbproxy_config *cfg)
 int gbproxy_init_config(struct gbproxy_config *cfg)
 {
 	struct timespec tp;
+	int i;
 
 	INIT_LLIST_HEAD(&cfg->bts_peers);
+	INIT_LLIST_HEAD(&cfg->sgsn_pool);
+	INIT_LLIST_HEAD(&cfg->stored_msgs);
+	INIT_LLIST_HEAD(&cfg->link_lru);
+	cfg->link_count = 0;
+	for (i = 0; i < GBPROXY_PEER_HASH_SIZE; i++) {
+		INIT_LLIST_HEAD(&cfg->bvci_hash[i]);
+		INIT_LLIST_HEAD(&cfg->nsei_hash[i]);
+	}
+	for (i = 0; i < GBPROXY_AREA_HASH_SIZE; i++) {
+		INIT_LLIST_HEAD(&cfg->ra_hash[i]);
+		INIT_LLIST_HEAD(&cfg->la_hash[i]);
+	}
 	cfg->ctrg = rate_ctr_group_alloc(tall_sgsn_ctx, &global_ctrg_desc, 0);
 	if (!cfg->ctrg) {
 		LOGP(DGPRS, LOGL_ERROR, "Cannot allocate global counter group!\n");
 		return -1;
 	}
+	osmo_timer_setup(&cfg->clean_stale_timer, clean_stale_timer_cb, cfg);
 	osmo_clock_gettime(CLOCK_REALTIME, &tp);
 
 	return 0;
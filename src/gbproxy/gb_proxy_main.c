@@ -273,6 +273,7 @@ int main(int argc, char **argv)
 {
 	int rc;
 	struct ctrl_handle *ctrl;
+	struct gbproxy_sgsn *sgsn;
 
 	tall_sgsn_ctx = talloc_named_const(NULL, 0, "nsip_proxy");
 	msgb_talloc_ctx_init(tall_sgsn_ctx, 0);
@@ -364,6 +365,15 @@ int main(int argc, char **argv)
 		exit(2);
 	}
 
+	llist_for_each_entry(sgsn, &gbcfg->sgsn_pool, list) {
+		if (!gprs_nsvc_by_nsei(gbcfg->nsi, sgsn->nsei)) {
+			LOGP(DGPRS, LOGL_FATAL, "You cannot pool NSEI %u "
+				"without creating that NSEI before\n",
+				sgsn->nsei);
+			exit(2);
+		}
+	}
+
 	rc = gprs_ns_nsip_listen(bssgp_nsi);
 	if (rc < 0) {
 		LOGP(DGPRS, LOGL_FATAL, "Cannot bind/listen on NSIP socket\n");
@@ -19,6 +19,7 @@
  */
 
 #include <osmocom/sgsn/gb_proxy.h>
+#include <osmocom/sgsn/crc24.h>
 
 #include <osmocom/sgsn/gprs_utils.h>
 #include <osmocom/sgsn/gprs_gb_parse.h>
@@ -29,12 +30,35 @@
 #include <osmocom/core/rate_ctr.h>
 #include <osmocom/gsm/apn.h>
 
+#include <string.h>
+
 extern void *tall_sgsn_ctx;
 
+/* FCS of an LLC frame that is kept up to date while fields of the same
+ * size are patched in place */
+struct gbproxy_llc_fcs {
+	/* end of the data covered by the FCS */
+	const uint8_t *end;
+	uint32_t fcs;
+};
+
+static void gbproxy_llc_fcs_update(struct gbproxy_llc_fcs *llc_fcs,
+				   const uint8_t *old_data,
+				   const uint8_t *new_data, size_t len)
+{
+	if (!llc_fcs)
+		return;
+
+	llc_fcs->fcs = crc24_update(llc_fcs->fcs, old_data, new_data, len,
+				    llc_fcs->end - (new_data + len));
+}
+
 /* patch RA identifier in place */
 static void gbproxy_patch_raid(struct gsm48_ra_id *raid_enc, struct gbproxy_peer *peer,
-			       int to_bss, const char *log_text)
+			       int to_bss, const char *log_text,
+			       struct gbproxy_llc_fcs *llc_fcs)
 {
+	struct gsm48_ra_id old_raid_enc = *raid_enc;
 	struct gbproxy_patch_state *state = &peer->patch_state;
 	struct osmo_plmn_id old_plmn;
 	struct gprs_ra_id raid;
@@ -83,6 +107,8 @@ static void gbproxy_patch_raid(struct gsm48_ra_id *raid_enc, struct gbproxy_peer
 	     osmo_rai_name(&raid));
 
 	gsm48_encode_ra(raid_enc, &raid);
+	gbproxy_llc_fcs_update(llc_fcs, (uint8_t *)&old_raid_enc,
+			       (uint8_t *)raid_enc, sizeof(*raid_enc));
 	rate_ctr_inc(&peer->ctrg->ctr[counter]);
 }
 
@@ -171,8 +197,10 @@ static int gbproxy_patch_tlli(uint8_t *tlli_enc,
 static int gbproxy_patch_ptmsi(uint8_t *ptmsi_enc,
 			       struct gbproxy_peer *peer,
 			       uint32_t new_ptmsi,
-			       int to_bss, const char *log_text)
+			       int to_bss, const char *log_text,
+			       struct gbproxy_llc_fcs *llc_fcs)
 {
+	uint32_t old_ptmsi_be;
 	uint32_t ptmsi_be;
 	uint32_t ptmsi;
 	enum gbproxy_peer_ctr counter =
@@ -190,8 +218,11 @@ static int gbproxy_patch_ptmsi(uint8_t *ptmsi_enc,
 	     "Replacing %08x -> %08x\n",
 	     log_text, ptmsi, new_ptmsi);
 
+	old_ptmsi_be = ptmsi_be;
 	ptmsi_be = htonl(new_ptmsi);
 	memcpy(ptmsi_enc, &ptmsi_be, sizeof(ptmsi_be));
+	gbproxy_llc_fcs_update(llc_fcs, (uint8_t *)&old_ptmsi_be, ptmsi_enc,
+			       sizeof(ptmsi_be));
 
 	rate_ctr_inc(&peer->ctrg->ctr[counter]);
 
@@ -207,6 +238,13 @@ int gbproxy_patch_llc(struct msgb *msg, uint8_t *llc, size_t llc_len,
 	int have_patched = 0;
 	int fcs;
 	struct gbproxy_config *cfg = peer->cfg;
+	struct gbproxy_llc_fcs llc_fcs = {
+		.end = llc + ghp->crc_length,
+		.fcs = ghp->fcs,
+	};
+	/* Only carry a correct FCS forward, otherwise recompute it below */
+	struct gbproxy_llc_fcs *fcs_ptr =
+		ghp->fcs == ghp->fcs_calc ? &llc_fcs : NULL;
 
 	if (parse_ctx->ptmsi_enc && link_info &&
 	    !parse_ctx->old_raid_is_foreign && peer->cfg->patch_ptmsi) {
@@ -218,7 +256,8 @@ int gbproxy_patch_llc(struct msgb *msg, uint8_t *llc, size_t llc_len,
 
 		if (ptmsi != GSM_RESERVED_TMSI) {
 			if (gbproxy_patch_ptmsi(parse_ctx->ptmsi_enc, peer,
-						ptmsi, parse_ctx->to_bss, "P-TMSI"))
+						ptmsi, parse_ctx->to_bss, "P-TMSI",
+						fcs_ptr))
 				have_patched = 1;
 		} else {
 			/* TODO: invalidate old RAI if present (see below) */
@@ -234,20 +273,21 @@ int gbproxy_patch_llc(struct msgb *msg, uint8_t *llc, size_t llc_len,
 
 		OSMO_ASSERT(ptmsi);
 		if (gbproxy_patch_ptmsi(parse_ctx->new_ptmsi_enc, peer,
-					ptmsi, parse_ctx->to_bss, "new P-TMSI"))
+					ptmsi, parse_ctx->to_bss, "new P-TMSI",
+					fcs_ptr))
 			have_patched = 1;
 	}
 
 	if (parse_ctx->raid_enc) {
 		gbproxy_patch_raid((struct gsm48_ra_id *)parse_ctx->raid_enc, peer, parse_ctx->to_bss,
-				   parse_ctx->llc_msg_name);
+				   parse_ctx->llc_msg_name, fcs_ptr);
 		have_patched = 1;
 	}
 
 	if (parse_ctx->old_raid_enc && !parse_ctx->old_raid_is_foreign) {
 		/* TODO: Patch to invalid if P-TMSI unknown. */
 		gbproxy_patch_raid((struct gsm48_ra_id *)parse_ctx->old_raid_enc, peer, parse_ctx->to_bss,
-				   parse_ctx->llc_msg_name);
+				   parse_ctx->llc_msg_name, fcs_ptr);
 		have_patched = 1;
 	}
 
@@ -257,6 +297,8 @@ int gbproxy_patch_llc(struct msgb *msg, uint8_t *llc, size_t llc_len,
 	    gbproxy_imsi_matches(cfg, GBPROX_MATCH_PATCHING, link_info) &&
 	    cfg->core_apn) {
 		size_t new_len;
+		/* The incremental FCS does not cover the new APN */
+		fcs_ptr = NULL;
 		gbproxy_patch_apn_ie(msg,
 				     parse_ctx->apn_ie, parse_ctx->apn_ie_len,
 				     peer, &new_len, parse_ctx->llc_msg_name);
@@ -269,8 +311,12 @@ int gbproxy_patch_llc(struct msgb *msg, uint8_t *llc, size_t llc_len,
 		llc_len += *len_change;
 		ghp->crc_length += *len_change;
 
-		/* Fix FCS */
-		fcs = gprs_llc_fcs(llc, ghp->crc_length);
+		/* Fix FCS, the incrementally updated one is only valid as long
+		 * as the APN has not been patched */
+		if (fcs_ptr)
+			fcs = llc_fcs.fcs;
+		else
+			fcs = gprs_llc_fcs(llc, ghp->crc_length);
 		LOGP(DLLC, LOGL_DEBUG, "Updated LLC message, CRC: %06x -> %06x\n",
 		     ghp->fcs, fcs);
 
@@ -293,7 +339,7 @@ void gbproxy_patch_bssgp(struct msgb *msg, uint8_t *bssgp, size_t bssgp_len,
 
 	if (parse_ctx->bssgp_raid_enc)
 		gbproxy_patch_raid((struct gsm48_ra_id *)parse_ctx->bssgp_raid_enc, peer,
-				   parse_ctx->to_bss, "BSSGP");
+				   parse_ctx->to_bss, "BSSGP", NULL);
 
 	if (parse_ctx->need_decryption &&
 	    (peer->cfg->patch_ptmsi || peer->cfg->core_apn)) {
@@ -344,7 +390,7 @@ void gbproxy_patch_bssgp(struct msgb *msg, uint8_t *bssgp, size_t bssgp_len,
 		if (ptmsi != GSM_RESERVED_TMSI)
 			gbproxy_patch_ptmsi(
 				parse_ctx->bssgp_ptmsi_enc, peer,
-				ptmsi, parse_ctx->to_bss, "BSSGP P-TMSI");
+				ptmsi, parse_ctx->to_bss, "BSSGP P-TMSI", NULL);
 	}
 
 	if (parse_ctx->llc) {
@@ -402,6 +448,88 @@ void gbproxy_clear_patch_filter(struct gbproxy_match *match)
 	}
 	talloc_free(match->re_str);
 	match->re_str = NULL;
+	talloc_free(match->prefix_trie);
+	match->prefix_trie = NULL;
+}
+
+/* Build a digit trie if the filter only selects IMSI prefixes, i.e. it is
+ * "^" followed by digits or by "(digits|digits|...)", optionally ending in
+ * ".*", or it is ".*". Other filters are left to regexec(). */
+static struct gbproxy_imsi_prefix_node *gbproxy_compile_prefix_trie(
+	const char *filter)
+{
+	struct gbproxy_imsi_prefix_node *trie;
+	const char *p = filter;
+	unsigned int num_nodes = 1;
+	unsigned int node = 0;
+	bool group = false;
+
+	trie = talloc_zero_array(tall_sgsn_ctx, struct gbproxy_imsi_prefix_node,
+				 strlen(filter) + 1);
+	if (!trie)
+		return NULL;
+
+	if (strcmp(p, ".*") == 0) {
+		trie[0].match = true;
+		return trie;
+	}
+
+	if (*p++ != '^')
+		goto unsupported;
+
+	if (*p == '(') {
+		group = true;
+		p++;
+	}
+
+	for (;; p++) {
+		if (*p >= '0' && *p <= '9') {
+			int digit = *p - '0';
+			if (!trie[node].next[digit])
+				trie[node].next[digit] = num_nodes++;
+			node = trie[node].next[digit];
+		} else if (group && *p == '|') {
+			trie[node].match = true;
+			node = 0;
+		} else if (group && *p == ')') {
+			trie[node].match = true;
+			p++;
+			break;
+		} else if (!group) {
+			trie[node].match = true;
+			break;
+		} else {
+			goto unsupported;
+		}
+	}
+
+	if (*p == '\0' || strcmp(p, ".*") == 0)
+		return trie;
+
+unsupported:
+	talloc_free(trie);
+	return NULL;
+}
+
+/* Walk the BCD digits of an IMSI mobile identity through the trie */
+static int gbproxy_check_imsi_prefix(const struct gbproxy_imsi_prefix_node *trie,
+				     const uint8_t *imsi, size_t imsi_len)
+{
+	const struct gbproxy_imsi_prefix_node *node = &trie[0];
+	size_t i;
+
+	for (i = 1; i < 2 * imsi_len; i++) {
+		uint8_t digit = i & 1 ? imsi[i / 2] >> 4 : imsi[i / 2] & 0x0f;
+
+		if (node->match)
+			return 1;
+		if (digit > 9 || !node->next[digit])
+			return 0;
+
+		node = &trie[node->next[digit]];
+	}
+
+	return node->match;
 }
 
 int gbproxy_set_patch_filter(struct gbproxy_match *match, const char *filter,
@@ -421,6 +549,7 @@ int gbproxy_set_patch_filter(struct gbproxy_match *match, const char *filter,
 	if (rc == 0) {
 		match->enable = true;
 		match->re_str = talloc_strdup(tall_sgsn_ctx, filter);
+		match->prefix_trie = gbproxy_compile_prefix_trie(filter);
 		return 0;
 	}
 
@@ -443,6 +572,9 @@ int gbproxy_check_imsi(struct gbproxy_match *match,
 		return 1;
 
 	rc = gprs_is_mi_imsi(imsi, imsi_len);
+	if (rc > 0 && match->prefix_trie)
+		return gbproxy_check_imsi_prefix(match->prefix_trie,
+						 imsi, imsi_len);
 	if (rc > 0)
 		rc = gsm48_mi_to_string(mi_buf, sizeof(mi_buf), imsi, imsi_len);
 	if (rc <= 0) {
@@ -28,6 +28,7 @@
 #include <osmocom/core/rate_ctr.h>
 #include <osmocom/core/stats.h>
 #include <osmocom/core/talloc.h>
+#include <osmocom/gsm/gsm48.h>
 #include <osmocom/gsm/tlv.h>
 
 #include <string.h>
@@ -80,12 +81,36 @@ static const struct rate_ctr_group_desc peer_ctrg_desc = {
 	.class_id = OSMO_STATS_CLASS_PEER,
 };
 
+static const struct rate_ctr_desc area_ctr_description[] = {
+	{ "paging:ps",	   "PS Paging received for the RA   " },
+	{ "paging:cs",	   "CS Paging received for the RA   " },
+	{ "paging:bvc",	   "Paging relayed to a BVC         " },
+	{ "paging:blocked","Paging not relayed, BVC blocked " },
+};
+
+osmo_static_assert(ARRAY_SIZE(area_ctr_description) == GBPROX_AREA_CTR_LAST, area_everything_described);
+
+static const struct rate_ctr_group_desc area_ctrg_desc = {
+	.group_name_prefix = "gbproxy:area",
+	.group_description = "GBProxy Routeing Area Statistics",
+	.num_ctr = ARRAY_SIZE(area_ctr_description),
+	.ctr_desc = area_ctr_description,
+	.class_id = OSMO_STATS_CLASS_GLOBAL,
+};
+
+
+static struct llist_head *gbproxy_peer_bucket(struct llist_head *hash,
+					       uint16_t id)
+{
+	return &hash[((uint32_t)id * 2654435761u) >> (32 - GBPROXY_PEER_HASH_BITS)];
+}
 
 /* Find the gbprox_peer by its BVCI */
 struct gbproxy_peer *gbproxy_peer_by_bvci(struct gbproxy_config *cfg, uint16_t bvci)
 {
 	struct gbproxy_peer *peer;
-	llist_for_each_entry(peer, &cfg->bts_peers, list) {
+	llist_for_each_entry(peer, gbproxy_peer_bucket(cfg->bvci_hash, bvci),
+			     bvci_list) {
 		if (peer->bvci == bvci)
 			return peer;
 	}
@@ -97,33 +122,90 @@ struct gbproxy_peer *gbproxy_peer_by_nsei(struct gbproxy_config *cfg,
 					  uint16_t nsei)
 {
 	struct gbproxy_peer *peer;
-	llist_for_each_entry(peer, &cfg->bts_peers, list) {
+	llist_for_each_entry(peer, gbproxy_peer_bucket(cfg->nsei_hash, nsei),
+			     nsei_list) {
 		if (peer->nsei == nsei)
 			return peer;
 	}
 	return NULL;
 }
 
-/* look-up a peer by its Routeing Area Identification (RAI) */
-struct gbproxy_peer *gbproxy_peer_by_rai(struct gbproxy_config *cfg,
+/* Set the NSEI of a peer and rehash it */
+void gbproxy_peer_set_nsei(struct gbproxy_peer *peer, uint16_t nsei)
+{
+	if (peer->nsei == nsei)
+		return;
+
+	llist_del(&peer->nsei_list);
+	peer->nsei = nsei;
+	llist_add(&peer->nsei_list,
+		  gbproxy_peer_bucket(peer->cfg->nsei_hash, nsei));
+}
+
+static struct llist_head *gbproxy_area_bucket(struct llist_head *hash,
+					       const uint8_t *id, size_t len)
+{
+	uint32_t h = 2166136261u;
+
+	while (len--)
+		h = (h ^ *id++) * 16777619u;
+
+	return &hash[(h * 2654435761u) >> (32 - GBPROXY_AREA_HASH_BITS)];
+}
+
+/* look-up a routeing area by its Routeing Area Identification (RAI) */
+struct gbproxy_area *gbproxy_area_by_rai(struct gbproxy_config *cfg,
 					 const uint8_t *ra)
 {
-	struct gbproxy_peer *peer;
-	llist_for_each_entry(peer, &cfg->bts_peers, list) {
-		if (!memcmp(peer->ra, ra, 6))
-			return peer;
+	struct gbproxy_area *area;
+	struct llist_head *bucket = gbproxy_area_bucket(cfg->ra_hash, ra, 6);
+
+	llist_for_each_entry(area, bucket, ra_list) {
+		if (!memcmp(area->ra, ra, 6))
+			return area;
+	}
+	return NULL;
+}
+
+/* look-up the routeing areas within a Location Area (LAI), pass the
+ * previous result to get the next one */
+struct gbproxy_area *gbproxy_area_by_lai(struct gbproxy_config *cfg,
+					 const uint8_t *la,
+					 struct gbproxy_area *prev)
+{
+	struct llist_head *bucket = gbproxy_area_bucket(cfg->la_hash, la, 5);
+	struct llist_head *pos = prev ? prev->la_list.next : bucket->next;
+	struct gbproxy_area *area;
+
+	for (; pos != bucket; pos = pos->next) {
+		area = llist_entry(pos, struct gbproxy_area, la_list);
+		if (!memcmp(area->ra, la, 5))
+			return area;
 	}
 	return NULL;
 }
 
+/* look-up a peer by its Routeing Area Identification (RAI) */
+struct gbproxy_peer *gbproxy_peer_by_rai(struct gbproxy_config *cfg,
+					 const uint8_t *ra)
+{
+	struct gbproxy_area *area = gbproxy_area_by_rai(cfg, ra);
+
+	if (!area || llist_empty(&area->peers))
+		return NULL;
+	return llist_first_entry(&area->peers, struct gbproxy_peer, area_list);
+}
+
 /* look-up a peer by its Location Area Identification (LAI) */
 struct gbproxy_peer *gbproxy_peer_by_lai(struct gbproxy_config *cfg,
 					 const uint8_t *la)
 {
-	struct gbproxy_peer *peer;
-	llist_for_each_entry(peer, &cfg->bts_peers, list) {
-		if (!memcmp(peer->ra, la, 5))
-			return peer;
+	struct gbproxy_area *area = NULL;
+
+	while ((area = gbproxy_area_by_lai(cfg, la, area))) {
+		if (!llist_empty(&area->peers))
+			return llist_first_entry(&area->peers,
+						 struct gbproxy_peer, area_list);
 	}
 	return NULL;
 }
@@ -167,18 +249,74 @@ struct gbproxy_peer *gbproxy_peer_by_bssgp_tlv(struct gbproxy_config *cfg,
 	return NULL;
 }
 
-static void clean_stale_timer_cb(void *data)
+static struct gbproxy_area *gbproxy_area_alloc(struct gbproxy_config *cfg,
+					       const uint8_t *ra)
+{
+	struct gbproxy_area *area;
+	struct gprs_ra_id raid;
+
+	area = talloc_zero(tall_sgsn_ctx, struct gbproxy_area);
+	if (!area)
+		return NULL;
+
+	memcpy(area->ra, ra, sizeof(area->ra));
+	gsm48_parse_ra(&raid, area->ra);
+	area->ctrg = rate_ctr_group_alloc(area, &area_ctrg_desc,
+					  (raid.lac << 8) | raid.rac);
+	if (!area->ctrg) {
+		talloc_free(area);
+		return NULL;
+	}
+
+	INIT_LLIST_HEAD(&area->peers);
+	llist_add(&area->ra_list, gbproxy_area_bucket(cfg->ra_hash, ra, 6));
+	llist_add_tail(&area->la_list, gbproxy_area_bucket(cfg->la_hash, ra, 5));
+
+	return area;
+}
+
+static void gbproxy_peer_leave_area(struct gbproxy_peer *peer)
+{
+	struct gbproxy_area *area = peer->area;
+
+	if (!area)
+		return;
+
+	llist_del(&peer->area_list);
+	peer->area = NULL;
+
+	if (!llist_empty(&area->peers))
+		return;
+
+	llist_del(&area->ra_list);
+	llist_del(&area->la_list);
+	rate_ctr_group_free(area->ctrg);
+	talloc_free(area);
+}
+
+/* Set the Routeing Area of a peer and move it to the matching area */
+void gbproxy_peer_set_ra(struct gbproxy_peer *peer, const uint8_t *ra)
 {
-	time_t now;
-	struct timespec ts = {0,};
-	struct gbproxy_peer *peer = (struct gbproxy_peer *) data;
+	struct gbproxy_area *area;
+
+	if (peer->area && !memcmp(peer->ra, ra, sizeof(peer->ra)))
+		return;
 
-	osmo_clock_gettime(CLOCK_MONOTONIC, &ts);
-	now = ts.tv_sec;
-	gbproxy_remove_stale_link_infos(peer, now);
-	if (peer->cfg->clean_stale_timer_freq != 0)
-		osmo_timer_schedule(&peer->clean_stale_timer,
-					peer->cfg->clean_stale_timer_freq, 0);
+	gbproxy_peer_leave_area(peer);
+	memcpy(peer->ra, ra, sizeof(peer->ra));
+
+	area = gbproxy_area_by_rai(peer->cfg, ra);
+	if (!area)
+		area = gbproxy_area_alloc(peer->cfg, ra);
+	if (!area) {
+		LOGP(DGPRS, LOGL_ERROR, "BVCI=%u: Cannot allocate the area\n",
+		     peer->bvci);
+		return;
+	}
+
+	/* like bts_peers, the latest peer is found first */
+	llist_add(&peer->area_list, &area->peers);
+	peer->area = area;
 }
 
 struct gbproxy_peer *gbproxy_peer_alloc(struct gbproxy_config *cfg, uint16_t bvci)
@@ -198,21 +336,20 @@ struct gbproxy_peer *gbproxy_peer_alloc(struct gbproxy_config *cfg, uint16_t bvc
 	peer->cfg = cfg;
 
 	llist_add(&peer->list, &cfg->bts_peers);
+	llist_add(&peer->bvci_list, gbproxy_peer_bucket(cfg->bvci_hash, bvci));
+	llist_add(&peer->nsei_list, gbproxy_peer_bucket(cfg->nsei_hash, 0));
 
 	INIT_LLIST_HEAD(&peer->patch_state.logical_links);
 
-	osmo_timer_setup(&peer->clean_stale_timer, clean_stale_timer_cb, peer);
-	if (peer->cfg->clean_stale_timer_freq != 0)
-		osmo_timer_schedule(&peer->clean_stale_timer,
-					peer->cfg->clean_stale_timer_freq, 0);
-
 	return peer;
 }
 
 void gbproxy_peer_free(struct gbproxy_peer *peer)
 {
 	llist_del(&peer->list);
-	osmo_timer_del(&peer->clean_stale_timer);
+	llist_del(&peer->bvci_list);
+	llist_del(&peer->nsei_list);
+	gbproxy_peer_leave_area(peer);
 	gbproxy_delete_link_infos(peer);
 
 	rate_ctr_group_free(peer->ctrg);
@@ -226,7 +363,9 @@ int gbproxy_cleanup_peers(struct gbproxy_config *cfg, uint16_t nsei, uint16_t bv
 	int counter = 0;
 	struct gbproxy_peer *peer, *tmp;
 
-	llist_for_each_entry_safe(peer, tmp, &cfg->bts_peers, list) {
+	llist_for_each_entry_safe(peer, tmp,
+				  gbproxy_peer_bucket(cfg->nsei_hash, nsei),
+				  nsei_list) {
 		if (peer->nsei != nsei)
 			continue;
 		if (bvci && peer->bvci != bvci)
@@ -0,0 +1,211 @@
+/* Gb proxy SGSN pool handling */
+
+/*
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <osmocom/sgsn/gb_proxy.h>
+
+#include <osmocom/sgsn/debug.h>
+#include <osmocom/sgsn/gprs_gb_parse.h>
+
+#include <osmocom/core/talloc.h>
+#include <osmocom/gsm/gsm48.h>
+
+#include <errno.h>
+
+extern void *tall_sgsn_ctx;
+
+struct gbproxy_sgsn *gbproxy_sgsn_by_nsei(struct gbproxy_config *cfg,
+					  uint16_t nsei)
+{
+	struct gbproxy_sgsn *sgsn;
+
+	llist_for_each_entry(sgsn, &cfg->sgsn_pool, list) {
+		if (sgsn->nsei == nsei)
+			return sgsn;
+	}
+
+	return NULL;
+}
+
+struct gbproxy_sgsn *gbproxy_sgsn_by_nri(struct gbproxy_config *cfg,
+					 uint16_t nri)
+{
+	struct gbproxy_sgsn *sgsn;
+	unsigned int i;
+
+	llist_for_each_entry(sgsn, &cfg->sgsn_pool, list) {
+		for (i = 0; i < sgsn->num_nri; i++) {
+			if (sgsn->nri[i] == nri)
+				return sgsn;
+		}
+	}
+
+	return NULL;
+}
+
+struct gbproxy_sgsn *gbproxy_sgsn_alloc(struct gbproxy_config *cfg,
+					uint16_t nsei)
+{
+	struct gbproxy_sgsn *sgsn;
+
+	sgsn = talloc_zero(tall_sgsn_ctx, struct gbproxy_sgsn);
+	if (!sgsn)
+		return NULL;
+
+	sgsn->nsei = nsei;
+	sgsn->weight = 1;
+
+	llist_add_tail(&sgsn->list, &cfg->sgsn_pool);
+
+	return sgsn;
+}
+
+void gbproxy_sgsn_free(struct gbproxy_sgsn *sgsn)
+{
+	llist_del(&sgsn->list);
+	talloc_free(sgsn);
+}
+
+void gbproxy_sgsn_pool_free(struct gbproxy_config *cfg)
+{
+	struct gbproxy_sgsn *sgsn, *tmp;
+
+	llist_for_each_entry_safe(sgsn, tmp, &cfg->sgsn_pool, list)
+		gbproxy_sgsn_free(sgsn);
+}
+
+int gbproxy_sgsn_add_nri(struct gbproxy_sgsn *sgsn, uint16_t nri)
+{
+	unsigned int i;
+
+	for (i = 0; i < sgsn->num_nri; i++) {
+		if (sgsn->nri[i] == nri)
+			return 0;
+	}
+
+	if (sgsn->num_nri >= ARRAY_SIZE(sgsn->nri))
+		return -ENOSPC;
+
+	sgsn->nri[sgsn->num_nri++] = nri;
+	return 0;
+}
+
+int gbproxy_sgsn_del_nri(struct gbproxy_sgsn *sgsn, uint16_t nri)
+{
+	unsigned int i;
+
+	for (i = 0; i < sgsn->num_nri; i++) {
+		if (sgsn->nri[i] != nri)
+			continue;
+
+		sgsn->nri[i] = sgsn->nri[--sgsn->num_nri];
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
+/* Get the NRI from a local or foreign TLLI, the NRI bits of the P-TMSI are
+ * retained there (3GPP TS 23.236, 4.3). Returns 0 if there is none. */
+int gbproxy_tlli_nri(struct gbproxy_config *cfg, uint32_t tlli, uint16_t *nri)
+{
+	if (!cfg->nri_bitlen)
+		return 0;
+
+	switch (gprs_tlli_type(tlli)) {
+	case TLLI_LOCAL:
+	case TLLI_FOREIGN:
+		break;
+	default:
+		return 0;
+	}
+
+	*nri = (tlli >> (24 - cfg->nri_bitlen)) &
+		((1 << cfg->nri_bitlen) - 1);
+	return 1;
+}
+
+/* Smooth weighted round robin, spreads the picks of heavier SGSNs instead of
+ * sending bursts to them */
+static struct gbproxy_sgsn *gbproxy_sgsn_by_weight(struct gbproxy_config *cfg)
+{
+	struct gbproxy_sgsn *sgsn, *best = NULL;
+	int total = 0;
+
+	llist_for_each_entry(sgsn, &cfg->sgsn_pool, list) {
+		if (!sgsn->weight)
+			continue;
+
+		sgsn->wrr_credit += sgsn->weight;
+		total += sgsn->weight;
+
+		if (!best || sgsn->wrr_credit > best->wrr_credit)
+			best = sgsn;
+	}
+
+	if (best)
+		best->wrr_credit -= total;
+
+	return best;
+}
+
+/* Select the SGSN for an uplink message, link_info may be NULL. A link that
+ * is assigned to a pool member stays pinned to it. Returns the NSEI, or 0xffff
+ * if the IMSI has to be acquired first. */
+uint32_t gbproxy_select_sgsn(struct gbproxy_config *cfg,
+			     struct gbproxy_link_info *link_info,
+			     struct gprs_gb_parse_context *parse_ctx)
+{
+	struct gbproxy_sgsn *sgsn = NULL;
+	uint16_t nri;
+
+	/* The NRI of the P-TMSI identifies the SGSN that allocated it */
+	if (parse_ctx->tlli_enc &&
+	    gbproxy_tlli_nri(cfg, parse_ctx->tlli, &nri))
+		sgsn = gbproxy_sgsn_by_nri(cfg, nri);
+
+	if (!sgsn && link_info && link_info->sgsn_pinned)
+		sgsn = gbproxy_sgsn_by_nsei(cfg, link_info->sgsn_nsei);
+
+	if (sgsn)
+		goto pin;
+
+	if (!link_info)
+		return cfg->nsip_sgsn_nsei;
+
+	if (cfg->route_to_sgsn2) {
+		if (cfg->acquire_imsi && link_info->imsi_len == 0)
+			return 0xffff;
+		if (gbproxy_imsi_matches(cfg, GBPROX_MATCH_ROUTING, link_info))
+			return cfg->nsip_sgsn2_nsei;
+	}
+
+	sgsn = gbproxy_sgsn_by_weight(cfg);
+	if (!sgsn)
+		return cfg->nsip_sgsn_nsei;
+
+	LOGP(DGPRS, LOGL_INFO, "TLLI %08x assigned to SGSN NSEI=%u\n",
+	     link_info->tlli.current, sgsn->nsei);
+
+pin:
+	if (link_info)
+		link_info->sgsn_pinned = true;
+
+	return sgsn->nsei;
+}
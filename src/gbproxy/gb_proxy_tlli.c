@@ -29,9 +29,145 @@
 
 #include <osmocom/gsm/gsm_utils.h>
 
+#include <osmocom/gprs/gprs_msgb.h>
+
 #include <osmocom/core/rate_ctr.h>
 #include <osmocom/core/talloc.h>
 
+#include <errno.h>
+#include <string.h>
+
+static uint32_t gbproxy_link_hash_u32(uint32_t v)
+{
+	/* TLLIs and P-TMSIs mostly differ in their lower bits */
+	return (v * 2654435761u) >> (32 - GBPROXY_LINK_HASH_BITS);
+}
+
+static uint32_t gbproxy_link_hash_imsi(const uint8_t *imsi, size_t imsi_len)
+{
+	uint32_t h = 2166136261u;
+
+	while (imsi_len--)
+		h = (h ^ *imsi++) * 16777619u;
+
+	return gbproxy_link_hash_u32(h);
+}
+
+/* Return the value a link_info is indexed by for the given key (not for the
+ * IMSI). Unset TLLIs are 0, an unset P-TMSI is GSM_RESERVED_TMSI. */
+static uint32_t gbproxy_link_key_value(const struct gbproxy_link_info *link_info,
+				       enum gbproxy_link_key key)
+{
+	switch (key) {
+	case GBPROX_KEY_TLLI:
+		return link_info->tlli.current;
+	case GBPROX_KEY_TLLI_ASSIGNED:
+		return link_info->tlli.assigned;
+	case GBPROX_KEY_SGSN_TLLI:
+		return link_info->sgsn_tlli.current;
+	case GBPROX_KEY_SGSN_TLLI_ASSIGNED:
+		return link_info->sgsn_tlli.assigned;
+	case GBPROX_KEY_PTMSI:
+		return link_info->tlli.ptmsi;
+	default:
+		OSMO_ASSERT(0);
+	}
+	return 0;
+}
+
+static struct llist_head *gbproxy_link_bucket(struct gbproxy_patch_state *state,
+					      enum gbproxy_link_key key,
+					      uint32_t hash)
+{
+	return &state->link_hash[key * GBPROXY_LINK_HASH_SIZE + hash];
+}
+
+static void gbproxy_hash_link_info(struct gbproxy_peer *peer,
+				   struct gbproxy_link_info *link_info)
+{
+	struct gbproxy_patch_state *state = &peer->patch_state;
+	enum gbproxy_link_key key;
+	uint32_t value;
+
+	if (!state->link_hash) {
+		int i;
+		state->link_hash = talloc_array(peer, struct llist_head,
+						GBPROX_KEY_LAST * GBPROXY_LINK_HASH_SIZE);
+		OSMO_ASSERT(state->link_hash != NULL);
+		for (i = 0; i < GBPROX_KEY_LAST * GBPROXY_LINK_HASH_SIZE; i++)
+			INIT_LLIST_HEAD(&state->link_hash[i]);
+	}
+
+	for (key = 0; key < GBPROX_KEY_IMSI; key++) {
+		value = gbproxy_link_key_value(link_info, key);
+		if (key == GBPROX_KEY_PTMSI ? value == GSM_RESERVED_TMSI : !value)
+			continue;
+
+		link_info->hash[key].link_info = link_info;
+		llist_add(&link_info->hash[key].list,
+			  gbproxy_link_bucket(state, key,
+					      gbproxy_link_hash_u32(value)));
+	}
+
+	if (link_info->imsi_len > 0) {
+		link_info->hash[GBPROX_KEY_IMSI].link_info = link_info;
+		llist_add(&link_info->hash[GBPROX_KEY_IMSI].list,
+			  gbproxy_link_bucket(state, GBPROX_KEY_IMSI,
+					      gbproxy_link_hash_imsi(link_info->imsi,
+								     link_info->imsi_len)));
+	}
+}
+
+static void gbproxy_unhash_link_info(struct gbproxy_link_info *link_info)
+{
+	enum gbproxy_link_key key;
+
+	for (key = 0; key < GBPROX_KEY_LAST; key++) {
+		if (!link_info->hash[key].link_info)
+			continue;
+		llist_del(&link_info->hash[key].list);
+		link_info->hash[key].link_info = NULL;
+	}
+}
+
+/* To be called whenever one of the indexed fields of an attached link_info
+ * has been changed */
+static void gbproxy_rehash_link_info(struct gbproxy_peer *peer,
+				     struct gbproxy_link_info *link_info)
+{
+	gbproxy_unhash_link_info(link_info);
+	gbproxy_hash_link_info(peer, link_info);
+}
+
+/* Find the most recently attached link_info indexed by key with the given
+ * value and (if sgsn_nsei is set) SGSN NSEI, unless best is more recent */
+static struct gbproxy_link_info *gbproxy_link_info_by_key(
+	struct gbproxy_patch_state *state,
+	enum gbproxy_link_key key, uint32_t value,
+	const uint32_t *sgsn_nsei,
+	struct gbproxy_link_info *best)
+{
+	struct gbproxy_link_hash_entry *entry;
+	struct llist_head *bucket;
+
+	if (!state->link_hash)
+		return best;
+
+	bucket = gbproxy_link_bucket(state, key, gbproxy_link_hash_u32(value));
+	llist_for_each_entry(entry, bucket, list) {
+		struct gbproxy_link_info *link_info = entry->link_info;
+
+		if (gbproxy_link_key_value(link_info, key) != value)
+			continue;
+		if (sgsn_nsei && link_info->sgsn_nsei != *sgsn_nsei)
+			continue;
+		if (!best || link_info->seq > best->seq)
+			best = link_info;
+	}
+
+	return best;
+}
+
 struct gbproxy_link_info *gbproxy_link_info_by_tlli(struct gbproxy_peer *peer,
 					    uint32_t tlli)
 {
@@ -41,29 +177,23 @@ struct gbproxy_link_info *gbproxy_link_info_by_tlli(struct gbproxy_peer *peer,
 	if (!tlli)
 		return NULL;
 
-	llist_for_each_entry(link_info, &state->logical_links, list)
-		if (link_info->tlli.current == tlli ||
-		    link_info->tlli.assigned == tlli)
-			return link_info;
-
-	return NULL;
+	link_info = gbproxy_link_info_by_key(state, GBPROX_KEY_TLLI,
+					     tlli, NULL, NULL);
+	return gbproxy_link_info_by_key(state, GBPROX_KEY_TLLI_ASSIGNED,
+					tlli, NULL, link_info);
 }
 
 struct gbproxy_link_info *gbproxy_link_info_by_ptmsi(
 	struct gbproxy_peer *peer,
 	uint32_t ptmsi)
 {
-	struct gbproxy_link_info *link_info;
 	struct gbproxy_patch_state *state = &peer->patch_state;
 
 	if (ptmsi == GSM_RESERVED_TMSI)
 		return NULL;
 
-	llist_for_each_entry(link_info, &state->logical_links, list)
-		if (link_info->tlli.ptmsi == ptmsi)
-			return link_info;
-
-	return NULL;
+	return gbproxy_link_info_by_key(state, GBPROX_KEY_PTMSI,
+					ptmsi, NULL, NULL);
 }
 
 struct gbproxy_link_info *gbproxy_link_info_by_any_sgsn_tlli(
@@ -77,12 +207,10 @@ struct gbproxy_link_info *gbproxy_link_info_by_any_sgsn_tlli(
 		return NULL;
 
 	/* Don't care about the NSEI */
-	llist_for_each_entry(link_info, &state->logical_links, list)
-		if (link_info->sgsn_tlli.current == tlli ||
-		     link_info->sgsn_tlli.assigned == tlli)
-			return link_info;
-
-	return NULL;
+	link_info = gbproxy_link_info_by_key(state, GBPROX_KEY_SGSN_TLLI,
+					     tlli, NULL, NULL);
+	return gbproxy_link_info_by_key(state, GBPROX_KEY_SGSN_TLLI_ASSIGNED,
+					tlli, NULL, link_info);
 }
 
 struct gbproxy_link_info *gbproxy_link_info_by_sgsn_tlli(
@@ -95,13 +223,10 @@ struct gbproxy_link_info *gbproxy_link_info_by_sgsn_tlli(
 	if (!tlli)
 		return NULL;
 
-	llist_for_each_entry(link_info, &state->logical_links, list)
-		if ((link_info->sgsn_tlli.current == tlli ||
-		     link_info->sgsn_tlli.assigned == tlli) &&
-		    link_info->sgsn_nsei == sgsn_nsei)
-			return link_info;
-
-	return NULL;
+	link_info = gbproxy_link_info_by_key(state, GBPROX_KEY_SGSN_TLLI,
+					     tlli, &sgsn_nsei, NULL);
+	return gbproxy_link_info_by_key(state, GBPROX_KEY_SGSN_TLLI_ASSIGNED,
+					tlli, &sgsn_nsei, link_info);
 }
 
 struct gbproxy_link_info *gbproxy_link_info_by_imsi(
@@ -109,32 +234,312 @@ struct gbproxy_link_info *gbproxy_link_info_by_imsi(
 	const uint8_t *imsi,
 	size_t imsi_len)
 {
-	struct gbproxy_link_info *link_info;
+	struct gbproxy_link_hash_entry *entry;
+	struct gbproxy_link_info *best = NULL;
 	struct gbproxy_patch_state *state = &peer->patch_state;
+	struct llist_head *bucket;
 
 	if (!gprs_is_mi_imsi(imsi, imsi_len))
 		return NULL;
 
-	llist_for_each_entry(link_info, &state->logical_links, list) {
+	if (!state->link_hash)
+		return NULL;
+
+	bucket = gbproxy_link_bucket(state, GBPROX_KEY_IMSI,
+				     gbproxy_link_hash_imsi(imsi, imsi_len));
+	llist_for_each_entry(entry, bucket, list) {
+		struct gbproxy_link_info *link_info = entry->link_info;
+
 		if (link_info->imsi_len != imsi_len)
 			continue;
 		if (memcmp(link_info->imsi, imsi, imsi_len) != 0)
 			continue;
+		if (!best || link_info->seq > best->seq)
+			best = link_info;
+	}
+
+	return best;
+}
+
+/* Pointers of a parse context into the BSSGP PDU, stored as offset + 1 (0 for
+ * NULL), and the other fields that the patching code depends on. The TLVs are
+ * not kept, the peer of a stored message is already known. */
+struct gbproxy_stored_parse {
+	uint16_t g48_hdr;
+	uint16_t bgp_hdr;
+	uint16_t bud_hdr;
+	uint16_t bssgp_data;
+	uint16_t llc;
+	uint16_t llc_data;
+	uint16_t tlli_enc;
+	uint16_t old_tlli_enc;
+	uint16_t imsi;
+	uint16_t apn_ie;
+	uint16_t ptmsi_enc;
+	uint16_t new_ptmsi_enc;
+	uint16_t raid_enc;
+	uint16_t old_raid_enc;
+	uint16_t bssgp_raid_enc;
+	uint16_t bssgp_ptmsi_enc;
+
+	uint16_t bssgp_data_len;
+	uint16_t llc_len;
+	uint8_t imsi_len;
+	uint8_t apn_ie_len;
+	struct gprs_llc_hdr_parsed llc_hdr_parsed;
+	const char *llc_msg_name;
+	uint32_t tlli;
+	uint8_t pdu_type;
+	bool invalidate_tlli;
+	bool await_reattach;
+	bool need_decryption;
+	bool old_raid_is_foreign;
+};
+
+/* An UL message held back until the IMSI is acquired, only the BSSGP PDU is
+ * kept */
+struct gbproxy_stored_msg {
+	/* linked to gbproxy_link_info.stored_msgs */
+	struct llist_head list;
+	/* linked to gbproxy_config.stored_msgs, oldest first */
+	struct llist_head cfg_list;
+
+	struct gbproxy_peer *peer;
+	struct gbproxy_link_info *link_info;
+
+	uint16_t nsei;
+	uint16_t bvci;
+	uint32_t tlli;
+	/* buffer layout of the original msgb, patching may grow the PDU */
+	uint16_t headroom;
+	uint16_t data_len;
+
+	struct gbproxy_stored_parse parse;
 
-		return link_info;
+	uint16_t len;
+	uint8_t data[0];
+};
+
+#define STORED_OFFSET(field) \
+	(parse_ctx->field ? \
+	 (uint16_t)((const uint8_t *)parse_ctx->field - bssgp + 1) : 0)
+#define STORED_POINTER(field) \
+	(sp->field ? (void *)(bssgp + sp->field - 1) : NULL)
+
+static void gbproxy_store_parse_ctx(struct gbproxy_stored_parse *sp,
+				    const uint8_t *bssgp,
+				    const struct gprs_gb_parse_context *parse_ctx)
+{
+	sp->g48_hdr = STORED_OFFSET(g48_hdr);
+	sp->bgp_hdr = STORED_OFFSET(bgp_hdr);
+	sp->bud_hdr = STORED_OFFSET(bud_hdr);
+	sp->bssgp_data = STORED_OFFSET(bssgp_data);
+	sp->llc = STORED_OFFSET(llc);
+	sp->llc_data = STORED_OFFSET(llc_hdr_parsed.data);
+	sp->tlli_enc = STORED_OFFSET(tlli_enc);
+	sp->old_tlli_enc = STORED_OFFSET(old_tlli_enc);
+	sp->imsi = STORED_OFFSET(imsi);
+	sp->apn_ie = STORED_OFFSET(apn_ie);
+	sp->ptmsi_enc = STORED_OFFSET(ptmsi_enc);
+	sp->new_ptmsi_enc = STORED_OFFSET(new_ptmsi_enc);
+	sp->raid_enc = STORED_OFFSET(raid_enc);
+	sp->old_raid_enc = STORED_OFFSET(old_raid_enc);
+	sp->bssgp_raid_enc = STORED_OFFSET(bssgp_raid_enc);
+	sp->bssgp_ptmsi_enc = STORED_OFFSET(bssgp_ptmsi_enc);
+
+	sp->bssgp_data_len = parse_ctx->bssgp_data_len;
+	sp->llc_len = parse_ctx->llc_len;
+	sp->imsi_len = parse_ctx->imsi_len;
+	sp->apn_ie_len = parse_ctx->apn_ie_len;
+	sp->llc_hdr_parsed = parse_ctx->llc_hdr_parsed;
+	sp->llc_msg_name = parse_ctx->llc_msg_name;
+	sp->tlli = parse_ctx->tlli;
+	sp->pdu_type = parse_ctx->pdu_type;
+	sp->invalidate_tlli = parse_ctx->invalidate_tlli;
+	sp->await_reattach = parse_ctx->await_reattach;
+	sp->need_decryption = parse_ctx->need_decryption;
+	sp->old_raid_is_foreign = parse_ctx->old_raid_is_foreign;
+}
+
+static void gbproxy_load_parse_ctx(const struct gbproxy_stored_parse *sp,
+				   uint8_t *bssgp,
+				   struct gprs_gb_parse_context *parse_ctx)
+{
+	memset(parse_ctx, 0, sizeof(*parse_ctx));
+
+	parse_ctx->g48_hdr = STORED_POINTER(g48_hdr);
+	parse_ctx->bgp_hdr = STORED_POINTER(bgp_hdr);
+	parse_ctx->bud_hdr = STORED_POINTER(bud_hdr);
+	parse_ctx->bssgp_data = STORED_POINTER(bssgp_data);
+	parse_ctx->llc = STORED_POINTER(llc);
+	parse_ctx->tlli_enc = STORED_POINTER(tlli_enc);
+	parse_ctx->old_tlli_enc = STORED_POINTER(old_tlli_enc);
+	parse_ctx->imsi = STORED_POINTER(imsi);
+	parse_ctx->apn_ie = STORED_POINTER(apn_ie);
+	parse_ctx->ptmsi_enc = STORED_POINTER(ptmsi_enc);
+	parse_ctx->new_ptmsi_enc = STORED_POINTER(new_ptmsi_enc);
+	parse_ctx->raid_enc = STORED_POINTER(raid_enc);
+	parse_ctx->old_raid_enc = STORED_POINTER(old_raid_enc);
+	parse_ctx->bssgp_raid_enc = STORED_POINTER(bssgp_raid_enc);
+	parse_ctx->bssgp_ptmsi_enc = STORED_POINTER(bssgp_ptmsi_enc);
+
+	parse_ctx->bssgp_data_len = sp->bssgp_data_len;
+	parse_ctx->llc_len = sp->llc_len;
+	parse_ctx->imsi_len = sp->imsi_len;
+	parse_ctx->apn_ie_len = sp->apn_ie_len;
+	parse_ctx->llc_hdr_parsed = sp->llc_hdr_parsed;
+	parse_ctx->llc_hdr_parsed.data = STORED_POINTER(llc_data);
+	parse_ctx->llc_msg_name = sp->llc_msg_name;
+	parse_ctx->tlli = sp->tlli;
+	parse_ctx->pdu_type = sp->pdu_type;
+	parse_ctx->invalidate_tlli = sp->invalidate_tlli;
+	parse_ctx->await_reattach = sp->await_reattach;
+	parse_ctx->need_decryption = sp->need_decryption;
+	parse_ctx->old_raid_is_foreign = sp->old_raid_is_foreign;
+}
+
+static void gbproxy_stored_msg_free(struct gbproxy_stored_msg *stored_msg)
+{
+	struct gbproxy_peer *peer = stored_msg->peer;
+	size_t size = sizeof(*stored_msg) + stored_msg->len;
+
+	llist_del(&stored_msg->list);
+	llist_del(&stored_msg->cfg_list);
+	stored_msg->link_info->stored_msgs_len -= 1;
+	peer->stored_msgs_bytes -= size;
+	peer->cfg->stored_msgs_bytes -= size;
+
+	talloc_free(stored_msg);
+}
+
+/* Drop the oldest stored messages of all links until the byte budget is met */
+static void gbproxy_enforce_stored_msgs_budget(struct gbproxy_config *cfg)
+{
+	struct gbproxy_stored_msg *oldest;
+
+	while (cfg->stored_msgs_max_bytes > 0 &&
+	       cfg->stored_msgs_bytes > cfg->stored_msgs_max_bytes) {
+		oldest = llist_first_entry(&cfg->stored_msgs,
+					   struct gbproxy_stored_msg, cfg_list);
+		LOGP(DLLC, LOGL_INFO,
+		     "NSEI=%d(BSS) Dropping stored msgb of TLLI %08x "
+		     "(!acq imsi, %zu bytes stored, max_bytes exceeded)\n",
+		     oldest->nsei, oldest->link_info->tlli.current,
+		     cfg->stored_msgs_bytes);
+		rate_ctr_inc(&cfg->ctrg->ctr[GBPROX_GLOB_CTR_STORED_MSGS_DROPPED]);
+		gbproxy_stored_msg_free(oldest);
+	}
+}
+
+/* Store a copy of an unpatched UL message along with its parse result. Older
+ * messages of all links are dropped to stay within the byte budget, returns
+ * a negative errno if the message itself cannot be stored. */
+int gbproxy_link_info_store_msg(struct gbproxy_peer *peer,
+				struct gbproxy_link_info *link_info,
+				struct msgb *msg,
+				const struct gprs_gb_parse_context *parse_ctx)
+{
+	struct gbproxy_config *cfg = peer->cfg;
+	struct gbproxy_stored_msg *stored_msg;
+	const uint8_t *bssgp = msgb_bssgph(msg);
+	size_t len = msgb_bssgp_len(msg);
+	size_t size = sizeof(*stored_msg) + len;
+
+	if (len > UINT16_MAX - 1)
+		return -EINVAL;
+
+	/* Don't drop everything else for a message that cannot fit anyway */
+	if (cfg->stored_msgs_max_bytes > 0 && size > cfg->stored_msgs_max_bytes)
+		return -EMSGSIZE;
+
+	stored_msg = talloc_named_const(link_info, size,
+					"struct gbproxy_stored_msg");
+	if (!stored_msg)
+		return -ENOMEM;
+
+	stored_msg->peer = peer;
+	stored_msg->link_info = link_info;
+	stored_msg->nsei = msgb_nsei(msg);
+	stored_msg->bvci = msgb_bvci(msg);
+	stored_msg->tlli = msgb_tlli(msg);
+	stored_msg->headroom = bssgp - msg->head;
+	stored_msg->data_len = msg->data_len;
+	stored_msg->len = len;
+	memcpy(stored_msg->data, bssgp, len);
+	gbproxy_store_parse_ctx(&stored_msg->parse, bssgp, parse_ctx);
+
+	llist_add_tail(&stored_msg->list, &link_info->stored_msgs);
+	llist_add_tail(&stored_msg->cfg_list, &cfg->stored_msgs);
+	link_info->stored_msgs_len += 1;
+	peer->stored_msgs_bytes += size;
+	cfg->stored_msgs_bytes += size;
+
+	gbproxy_enforce_stored_msgs_budget(cfg);
+
+	return 0;
+}
+
+/* Take the oldest stored message of a link, returns a new msgb and restores
+ * parse_ctx to point into it, NULL if there is none. */
+struct msgb *gbproxy_link_info_dequeue_msg(struct gbproxy_link_info *link_info,
+					   struct gprs_gb_parse_context *parse_ctx)
+{
+	struct gbproxy_stored_msg *stored_msg;
+	struct msgb *msg;
+
+	while (!llist_empty(&link_info->stored_msgs)) {
+		stored_msg = llist_first_entry(&link_info->stored_msgs,
+					       struct gbproxy_stored_msg, list);
+
+		msg = msgb_alloc_headroom(stored_msg->data_len,
+					  stored_msg->headroom, "stored_msg");
+		if (!msg) {
+			gbproxy_stored_msg_free(stored_msg);
+			continue;
+		}
+
+		msgb_bssgph(msg) = msgb_put(msg, stored_msg->len);
+		memcpy(msgb_bssgph(msg), stored_msg->data, stored_msg->len);
+		msgb_nsei(msg) = stored_msg->nsei;
+		msgb_bvci(msg) = stored_msg->bvci;
+		msgb_tlli(msg) = stored_msg->tlli;
+
+		gbproxy_load_parse_ctx(&stored_msg->parse, msgb_bssgph(msg),
+				       parse_ctx);
+		parse_ctx->to_bss = 0;
+		parse_ctx->peer_nsei = stored_msg->nsei;
+
+		gbproxy_stored_msg_free(stored_msg);
+		return msg;
 	}
 
 	return NULL;
 }
 
+/* Drop the oldest stored message of a link, returns the NSEI it was received
+ * from or -1 if there is none */
+int gbproxy_link_info_drop_msg(struct gbproxy_link_info *link_info)
+{
+	struct gbproxy_stored_msg *stored_msg;
+	int nsei;
+
+	if (llist_empty(&link_info->stored_msgs))
+		return -1;
+
+	stored_msg = llist_first_entry(&link_info->stored_msgs,
+				       struct gbproxy_stored_msg, list);
+	nsei = stored_msg->nsei;
+	gbproxy_stored_msg_free(stored_msg);
+
+	return nsei;
+}
+
 void gbproxy_link_info_discard_messages(struct gbproxy_link_info *link_info)
 {
-	struct msgb *msg, *nxt;
+	struct gbproxy_stored_msg *stored_msg, *nxt;
 
-	llist_for_each_entry_safe(msg, nxt, &link_info->stored_msgs, list) {
-		llist_del(&msg->list);
-		msgb_free(msg);
-	}
+	llist_for_each_entry_safe(stored_msg, nxt, &link_info->stored_msgs, list)
+		gbproxy_stored_msg_free(stored_msg);
 }
 
 void gbproxy_delete_link_info(struct gbproxy_peer *peer,
@@ -144,9 +549,12 @@ void gbproxy_delete_link_info(struct gbproxy_peer *peer,
 
 	gbproxy_link_info_discard_messages(link_info);
 
+	gbproxy_unhash_link_info(link_info);
 	llist_del(&link_info->list);
+	llist_del(&link_info->lru_list);
 	talloc_free(link_info);
 	state->logical_link_count -= 1;
+	peer->cfg->link_count -= 1;
 
 	peer->ctrg->ctr[GBPROX_PEER_CTR_TLLI_CACHE_SIZE].current =
 		state->logical_link_count;
@@ -170,8 +578,13 @@ void gbproxy_attach_link_info(struct gbproxy_peer *peer, time_t now,
 	struct gbproxy_patch_state *state = &peer->patch_state;
 
 	link_info->timestamp = now;
+	link_info->seq = ++state->link_seq;
+	link_info->peer = peer;
 	llist_add(&link_info->list, &state->logical_links);
+	llist_add(&link_info->lru_list, &peer->cfg->link_lru);
+	gbproxy_hash_link_info(peer, link_info);
 	state->logical_link_count += 1;
+	peer->cfg->link_count += 1;
 
 	peer->ctrg->ctr[GBPROX_PEER_CTR_TLLI_CACHE_SIZE].current =
 		state->logical_link_count;
@@ -230,6 +643,49 @@ int gbproxy_remove_stale_link_infos(struct gbproxy_peer *peer, time_t now)
 	return deleted_count;
 }
 
+/* Remove the least recently used links of all peers that exceed the total
+ * length or max age. Every link is moved to the front when it is used, so
+ * only the expired ones need to be looked at. */
+int gbproxy_remove_stale_links(struct gbproxy_config *cfg, time_t now)
+{
+	struct gbproxy_link_info *link_info;
+	int deleted_count = 0;
+	time_t age;
+
+	while (cfg->tlli_max_total_len > 0 &&
+	       cfg->link_count > cfg->tlli_max_total_len) {
+		OSMO_ASSERT(!llist_empty(&cfg->link_lru));
+		link_info = llist_entry(cfg->link_lru.prev,
+					struct gbproxy_link_info, lru_list);
+		LOGP(DGPRS, LOGL_INFO,
+		     "Removing TLLI %08x from list "
+		     "(stale, total length %u, max_total_len exceeded)\n",
+		     link_info->tlli.current, cfg->link_count);
+
+		gbproxy_delete_link_info(link_info->peer, link_info);
+		deleted_count += 1;
+	}
+
+	while (cfg->tlli_max_age > 0 && !llist_empty(&cfg->link_lru)) {
+		link_info = llist_entry(cfg->link_lru.prev,
+					struct gbproxy_link_info, lru_list);
+		age = now - link_info->timestamp;
+		/* age < 0 only happens after system time jumps, discard entry */
+		if (age <= cfg->tlli_max_age && age >= 0)
+			break;
+
+		LOGP(DGPRS, LOGL_INFO,
+		     "Removing TLLI %08x from list "
+		     "(stale, age %d, max_age exceeded)\n",
+		     link_info->tlli.current, (int)age);
+
+		gbproxy_delete_link_info(link_info->peer, link_info);
+		deleted_count += 1;
+	}
+
+	return deleted_count;
+}
+
 struct gbproxy_link_info *gbproxy_link_info_alloc( struct gbproxy_peer *peer)
 {
 	struct gbproxy_link_info *link_info;
@@ -240,6 +696,8 @@ struct gbproxy_link_info *gbproxy_link_info_alloc( struct gbproxy_peer *peer)
 
 	link_info->vu_gen_tx_bss = GBPROXY_INIT_VU_GEN_TX;
 
+	INIT_LLIST_HEAD(&link_info->list);
+	INIT_LLIST_HEAD(&link_info->lru_list);
 	INIT_LLIST_HEAD(&link_info->stored_msgs);
 
 	return link_info;
@@ -251,15 +709,19 @@ void gbproxy_detach_link_info(
 {
 	struct gbproxy_patch_state *state = &peer->patch_state;
 
-	llist_del(&link_info->list);
+	gbproxy_unhash_link_info(link_info);
+	llist_del_init(&link_info->list);
+	llist_del_init(&link_info->lru_list);
 	OSMO_ASSERT(state->logical_link_count > 0);
 	state->logical_link_count -= 1;
+	peer->cfg->link_count -= 1;
 
 	peer->ctrg->ctr[GBPROX_PEER_CTR_TLLI_CACHE_SIZE].current =
 		state->logical_link_count;
 }
 
-void gbproxy_update_link_info(struct gbproxy_link_info *link_info,
+void gbproxy_update_link_info(struct gbproxy_peer *peer,
+			      struct gbproxy_link_info *link_info,
 			      const uint8_t *imsi, size_t imsi_len)
 {
 	if (!gprs_is_mi_imsi(imsi, imsi_len))
@@ -270,6 +732,12 @@ void gbproxy_update_link_info(struct gbproxy_link_info *link_info,
 		talloc_realloc_size(link_info, link_info->imsi, imsi_len);
 	OSMO_ASSERT(link_info->imsi != NULL);
 	memcpy(link_info->imsi, imsi, imsi_len);
+
+	/* Not attached yet, gbproxy_attach_link_info() will index it */
+	if (llist_empty(&link_info->list))
+		return;
+
+	gbproxy_rehash_link_info(peer, link_info);
 }
 
 void gbproxy_reassign_tlli(struct gbproxy_tlli_state *tlli_state,
@@ -308,8 +776,9 @@ uint32_t gbproxy_map_tlli(uint32_t other_tlli,
 	return tlli;
 }
 
-static void gbproxy_validate_tlli(struct gbproxy_tlli_state *tlli_state,
-				  uint32_t tlli, int to_bss)
+/* Returns 1 if the current TLLI has been replaced by the assigned one */
+static int gbproxy_validate_tlli(struct gbproxy_tlli_state *tlli_state,
+				 uint32_t tlli, int to_bss)
 {
 	LOGP(DGPRS, LOGL_DEBUG,
 	     "%s({current = %08x, assigned = %08x, net_vld = %d, bss_vld = %d}, %08x)\n",
@@ -317,11 +786,11 @@ static void gbproxy_validate_tlli(struct gbproxy_tlli_state *tlli_state,
 	     tlli_state->net_validated, tlli_state->bss_validated, tlli);
 
 	if (!tlli_state->assigned || tlli_state->assigned != tlli)
-		return;
+		return 0;
 
 	/* TODO: Is this ok? Check spec */
 	if (gprs_tlli_type(tlli) != TLLI_LOCAL)
-		return;
+		return 0;
 
 	/* See GSM 04.08, 4.7.1.5 */
 	if (to_bss)
@@ -330,7 +799,7 @@ static void gbproxy_validate_tlli(struct gbproxy_tlli_state *tlli_state,
 		tlli_state->bss_validated = true;
 
 	if (!tlli_state->bss_validated || !tlli_state->net_validated)
-		return;
+		return 0;
 
 	LOGP(DGPRS, LOGL_INFO,
 	     "The TLLI %08x has been validated (was %08x)\n",
@@ -338,14 +807,19 @@ static void gbproxy_validate_tlli(struct gbproxy_tlli_state *tlli_state,
 
 	tlli_state->current = tlli;
 	tlli_state->assigned = 0;
+	return 1;
 }
 
 static void gbproxy_touch_link_info(struct gbproxy_peer *peer,
 				    struct gbproxy_link_info *link_info,
 				    time_t now)
 {
-	gbproxy_detach_link_info(peer, link_info);
-	gbproxy_attach_link_info(peer, now, link_info);
+	/* Like detaching and attaching again, but the hash entries stay
+	 * as they are, the callers rehash after changing an indexed field */
+	link_info->timestamp = now;
+	link_info->seq = ++peer->patch_state.link_seq;
+	llist_move(&link_info->list, &peer->patch_state.logical_links);
+	llist_move(&link_info->lru_list, &peer->cfg->link_lru);
 }
 
 static int gbproxy_unregister_link_info(struct gbproxy_peer *peer,
@@ -366,6 +840,7 @@ static int gbproxy_unregister_link_info(struct gbproxy_peer *peer,
 	link_info->tlli.assigned = 0;
 	link_info->sgsn_tlli.current = 0;
 	link_info->sgsn_tlli.assigned = 0;
+	gbproxy_rehash_link_info(peer, link_info);
 
 	link_info->is_deregistered = true;
 
@@ -412,7 +887,7 @@ static void gbproxy_assign_imsi(struct gbproxy_peer *peer,
 	}
 
 	/* Update the IMSI field */
-	gbproxy_update_link_info(link_info,
+	gbproxy_update_link_info(peer, link_info,
 				 parse_ctx->imsi, parse_ctx->imsi_len);
 
 	/* Check, whether the IMSI matches */
@@ -527,6 +1002,7 @@ struct gbproxy_link_info *gbproxy_update_link_state_ul(
 							   parse_ctx->tlli);
 			link_info->sgsn_tlli.current = sgsn_tlli;
 			link_info->tlli.current = parse_ctx->tlli;
+			gbproxy_rehash_link_info(peer, link_info);
 		} else if (!tlli_is_valid) {
 			/* New TLLI (info found by IMSI or P-TMSI) */
 			link_info->tlli.current = parse_ctx->tlli;
@@ -535,17 +1011,22 @@ struct gbproxy_link_info *gbproxy_update_link_state_ul(
 				gbproxy_make_sgsn_tlli(peer, link_info,
 						       parse_ctx->tlli);
 			link_info->sgsn_tlli.assigned = 0;
+			gbproxy_rehash_link_info(peer, link_info);
 			gbproxy_touch_link_info(peer, link_info, now);
 		} else {
+			int changed;
+
 			sgsn_tlli = gbproxy_map_tlli(parse_ctx->tlli, link_info, 0);
 			if (!sgsn_tlli)
 				sgsn_tlli = gbproxy_make_sgsn_tlli(peer, link_info,
 								   parse_ctx->tlli);
 
-			gbproxy_validate_tlli(&link_info->tlli,
-					      parse_ctx->tlli, 0);
-			gbproxy_validate_tlli(&link_info->sgsn_tlli,
-					      sgsn_tlli, 0);
+			changed = gbproxy_validate_tlli(&link_info->tlli,
+							parse_ctx->tlli, 0);
+			changed |= gbproxy_validate_tlli(&link_info->sgsn_tlli,
+							 sgsn_tlli, 0);
+			if (changed)
+				gbproxy_rehash_link_info(peer, link_info);
 			gbproxy_touch_link_info(peer, link_info, now);
 		}
 	} else if (link_info) {
@@ -610,6 +1091,7 @@ struct gbproxy_link_info *gbproxy_update_link_state_dl(
 		/* Setup PTMSIs */
 		link_info->sgsn_tlli.ptmsi = new_sgsn_ptmsi;
 		link_info->tlli.ptmsi = new_bss_ptmsi;
+		gbproxy_rehash_link_info(peer, link_info);
 	} else if (parse_ctx->tlli_enc && parse_ctx->new_ptmsi_enc && !link_info &&
 		   !peer->cfg->patch_ptmsi) {
 		/* A new P-TMSI has been signalled in the message with an unknown
@@ -641,6 +1123,7 @@ struct gbproxy_link_info *gbproxy_update_link_state_dl(
 		/* Setup TLLIs */
 		link_info->sgsn_tlli.current = parse_ctx->tlli;
 		link_info->tlli.current = parse_ctx->tlli;
+		gbproxy_rehash_link_info(peer, link_info);
 
 		if (!parse_ctx->new_ptmsi_enc)
 			return link_info;
@@ -652,11 +1135,17 @@ struct gbproxy_link_info *gbproxy_update_link_state_dl(
 		/* Setup P-TMSIs */
 		link_info->sgsn_tlli.ptmsi = new_ptmsi;
 		link_info->tlli.ptmsi = new_ptmsi;
+		gbproxy_rehash_link_info(peer, link_info);
 	} else if (parse_ctx->tlli_enc && parse_ctx->llc && link_info) {
 		uint32_t bss_tlli = gbproxy_map_tlli(parse_ctx->tlli,
 						     link_info, 1);
-		gbproxy_validate_tlli(&link_info->sgsn_tlli, parse_ctx->tlli, 1);
-		gbproxy_validate_tlli(&link_info->tlli, bss_tlli, 1);
+		int changed;
+
+		changed = gbproxy_validate_tlli(&link_info->sgsn_tlli,
+						parse_ctx->tlli, 1);
+		changed |= gbproxy_validate_tlli(&link_info->tlli, bss_tlli, 1);
+		if (changed)
+			gbproxy_rehash_link_info(peer, link_info);
 		gbproxy_touch_link_info(peer, link_info, now);
 	} else if (link_info) {
 		gbproxy_touch_link_info(peer, link_info, now);
@@ -712,10 +1201,12 @@ int gbproxy_update_link_state_after(
 				      peer, new_sgsn_tlli);
 		gbproxy_reassign_tlli(&link_info->tlli,
 				      peer, new_bss_tlli);
+		gbproxy_rehash_link_info(peer, link_info);
 		gbproxy_remove_matching_link_infos(peer, link_info);
 	}
 
 	gbproxy_remove_stale_link_infos(peer, now);
+	gbproxy_remove_stale_links(peer->cfg, now);
 
 	return rc;
 }
@@ -75,6 +75,8 @@ static void gbprox_vty_print_peer(struct vty *vty, struct gbproxy_peer *peer)
 		"RAI %s", peer->nsei, peer->bvci, osmo_rai_name(&raid));
 	if (peer->blocked)
 		vty_out(vty, " [BVC-BLOCKED]");
+	if (peer->stored_msgs_bytes)
+		vty_out(vty, ", stored %zu bytes", peer->stored_msgs_bytes);
 
 	vty_out(vty, "%s", VTY_NEWLINE);
 }
@@ -82,6 +84,8 @@ static void gbprox_vty_print_peer(struct vty *vty, struct gbproxy_peer *peer)
 static int config_write_gbproxy(struct vty *vty)
 {
 	enum gbproxy_match_id match_id;
+	struct gbproxy_sgsn *sgsn;
+	unsigned int i;
 
 	vty_out(vty, "gbproxy%s", VTY_NEWLINE);
 
@@ -120,6 +124,17 @@ static int config_write_gbproxy(struct vty *vty)
 		vty_out(vty, " secondary-sgsn nsei %u%s", g_cfg->nsip_sgsn2_nsei,
 			VTY_NEWLINE);
 
+	if (g_cfg->nri_bitlen > 0)
+		vty_out(vty, " nri bitlen %u%s", g_cfg->nri_bitlen,
+			VTY_NEWLINE);
+	llist_for_each_entry(sgsn, &g_cfg->sgsn_pool, list) {
+		vty_out(vty, " sgsn-pool nsei %u weight %u%s", sgsn->nsei,
+			sgsn->weight, VTY_NEWLINE);
+		for (i = 0; i < sgsn->num_nri; i++)
+			vty_out(vty, " sgsn-pool nsei %u nri %u%s", sgsn->nsei,
+				sgsn->nri[i], VTY_NEWLINE);
+	}
+
 	if (g_cfg->clean_stale_timer_freq > 0)
 		vty_out(vty, " link-list clean-stale-timer %u%s",
 			g_cfg->clean_stale_timer_freq, VTY_NEWLINE);
@@ -129,12 +144,18 @@ static int config_write_gbproxy(struct vty *vty)
 	if (g_cfg->tlli_max_len > 0)
 		vty_out(vty, " link-list max-length %d%s",
 			g_cfg->tlli_max_len, VTY_NEWLINE);
+	if (g_cfg->tlli_max_total_len > 0)
+		vty_out(vty, " link-list max-total-length %d%s",
+			g_cfg->tlli_max_total_len, VTY_NEWLINE);
 	vty_out(vty, " link-list keep-mode %s%s",
 		get_value_string(keep_modes, g_cfg->keep_link_infos),
 		VTY_NEWLINE);
 	if (g_cfg->stored_msgs_max_len > 0)
 		vty_out(vty, " link stored-msgs-max-length %"PRIu32"%s",
 			g_cfg->stored_msgs_max_len, VTY_NEWLINE);
+	if (g_cfg->stored_msgs_max_bytes > 0)
+		vty_out(vty, " link stored-msgs-max-bytes %"PRIu32"%s",
+			g_cfg->stored_msgs_max_bytes, VTY_NEWLINE);
 
 
 	return CMD_SUCCESS;
@@ -408,6 +429,138 @@ DEFUN(cfg_gbproxy_no_secondary_sgsn,
 	return CMD_SUCCESS;
 }
 
+#define GBPROXY_SGSN_POOL_STR "Distribute subscribers to a pool of SGSNs (Gb-flex)\n"
+#define GBPROXY_SGSN_POOL_NSEI_STR "NSEI of the pooled SGSN (also add the primary SGSN to share its load)\n" \
+	"The NSEI\n"
+
+static struct gbproxy_sgsn *get_pool_sgsn(struct vty *vty, const char *nsei_str,
+					  bool create)
+{
+	unsigned int nsei = atoi(nsei_str);
+	struct gbproxy_sgsn *sgsn = gbproxy_sgsn_by_nsei(g_cfg, nsei);
+
+	if (!sgsn && create)
+		sgsn = gbproxy_sgsn_alloc(g_cfg, nsei);
+	if (!sgsn)
+		vty_out(vty, "%% SGSN NSEI %u is not in the pool%s", nsei,
+			VTY_NEWLINE);
+	return sgsn;
+}
+
+DEFUN(cfg_gbproxy_sgsn_pool_weight,
+      cfg_gbproxy_sgsn_pool_weight_cmd,
+      "sgsn-pool nsei <0-65534> weight <0-255>",
+      GBPROXY_SGSN_POOL_STR GBPROXY_SGSN_POOL_NSEI_STR
+      "Share of new subscribers assigned to this SGSN\n"
+      "Relative weight (0: only subscribers with a matching NRI)\n")
+{
+	struct gbproxy_sgsn *sgsn = get_pool_sgsn(vty, argv[0], true);
+
+	if (!sgsn)
+		return CMD_WARNING;
+
+	sgsn->weight = atoi(argv[1]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_gbproxy_sgsn_pool_nri,
+      cfg_gbproxy_sgsn_pool_nri_cmd,
+      "sgsn-pool nsei <0-65534> nri <0-1023>",
+      GBPROXY_SGSN_POOL_STR GBPROXY_SGSN_POOL_NSEI_STR
+      "Route TLLIs/P-TMSIs carrying this Network Resource Identifier to the SGSN\n"
+      "The NRI value\n")
+{
+	struct gbproxy_sgsn *sgsn;
+	uint16_t nri = atoi(argv[1]);
+	struct gbproxy_sgsn *other = gbproxy_sgsn_by_nri(g_cfg, nri);
+
+	/* An NRI that doesn't fit into the P-TMSI can never be selected */
+	if (nri >= (1 << g_cfg->nri_bitlen)) {
+		vty_out(vty, "%% NRI %u does not fit into nri bitlen %u%s",
+			nri, g_cfg->nri_bitlen, VTY_NEWLINE);
+		return CMD_WARNING;
+	}
+
+	sgsn = get_pool_sgsn(vty, argv[0], true);
+	if (!sgsn)
+		return CMD_WARNING;
+
+	if (other && other != sgsn) {
+		vty_out(vty, "%% NRI %u is already used by SGSN NSEI %u%s",
+			nri, other->nsei, VTY_NEWLINE);
+		return CMD_WARNING;
+	}
+
+	if (gbproxy_sgsn_add_nri(sgsn, nri) < 0) {
+		vty_out(vty, "%% Too many NRIs for SGSN NSEI %u%s",
+			sgsn->nsei, VTY_NEWLINE);
+		return CMD_WARNING;
+	}
+
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_gbproxy_no_sgsn_pool_nri,
+      cfg_gbproxy_no_sgsn_pool_nri_cmd,
+      "no sgsn-pool nsei <0-65534> nri <0-1023>",
+      NO_STR GBPROXY_SGSN_POOL_STR GBPROXY_SGSN_POOL_NSEI_STR
+      "Remove a Network Resource Identifier from the SGSN\n"
+      "The NRI value\n")
+{
+	struct gbproxy_sgsn *sgsn = get_pool_sgsn(vty, argv[0], false);
+
+	if (!sgsn)
+		return CMD_WARNING;
+
+	if (gbproxy_sgsn_del_nri(sgsn, atoi(argv[1])) < 0) {
+		vty_out(vty, "%% NRI %s is not used by SGSN NSEI %u%s",
+			argv[1], sgsn->nsei, VTY_NEWLINE);
+		return CMD_WARNING;
+	}
+
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_gbproxy_no_sgsn_pool,
+      cfg_gbproxy_no_sgsn_pool_cmd,
+      "no sgsn-pool nsei <0-65534>",
+      NO_STR GBPROXY_SGSN_POOL_STR GBPROXY_SGSN_POOL_NSEI_STR)
+{
+	struct gbproxy_sgsn *sgsn = get_pool_sgsn(vty, argv[0], false);
+
+	if (!sgsn)
+		return CMD_WARNING;
+
+	gbproxy_sgsn_free(sgsn);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_gbproxy_nri_bitlen,
+      cfg_gbproxy_nri_bitlen_cmd,
+      "nri bitlen <0-" OSMO_STRINGIFY_VAL(GBPROXY_MAX_NRI_BITLEN) ">",
+      "Network Resource Identifier (NRI) parameters\n"
+      "Number of NRI bits in the P-TMSI, starting at bit 23 (0: don't use NRIs)\n"
+      "The number of bits\n")
+{
+	struct gbproxy_sgsn *sgsn;
+	unsigned int i;
+
+	g_cfg->nri_bitlen = atoi(argv[0]);
+
+	llist_for_each_entry(sgsn, &g_cfg->sgsn_pool, list) {
+		for (i = 0; i < sgsn->num_nri; i++) {
+			if (sgsn->nri[i] < (1 << g_cfg->nri_bitlen))
+				continue;
+			vty_out(vty, "%% NRI %u of SGSN NSEI %u does not fit "
+				"into nri bitlen %u and is not used%s",
+				sgsn->nri[i], sgsn->nsei, g_cfg->nri_bitlen,
+				VTY_NEWLINE);
+		}
+	}
+
+	return CMD_SUCCESS;
+}
+
 #define GBPROXY_LINK_LIST_STR "Set TLLI list parameters\n"
 #define GBPROXY_LINK_STR "Set TLLI parameters\n"
 
@@ -419,16 +572,13 @@ DEFUN(cfg_gbproxy_link_list_clean_stale_timer,
       GBPROXY_LINK_LIST_STR GBPROXY_CLEAN_STALE_TIMER_STR
       "Frequency at which the periodic timer is fired (in seconds)\n")
 {
-	struct gbproxy_peer *peer;
 	g_cfg->clean_stale_timer_freq = (unsigned int) atoi(argv[0]);
 
-	/* Re-schedule running timers soon in case prev frequency was really big
-	   and new frequency is desired to be lower. After initial run, periodic
-	   time is used. Use random() to avoid firing timers for all peers at
-	   the same time */
-	llist_for_each_entry(peer, &g_cfg->bts_peers, list)
-		osmo_timer_schedule(&peer->clean_stale_timer,
-					random() % 5, random() % 1000000);
+	/* Re-schedule the running timer soon in case prev frequency was really
+	   big and new frequency is desired to be lower. After initial run,
+	   periodic time is used. */
+	osmo_timer_schedule(&g_cfg->clean_stale_timer,
+			    random() % 5, random() % 1000000);
 
 	return CMD_SUCCESS;
 }
@@ -439,11 +589,9 @@ DEFUN(cfg_gbproxy_link_list_no_clean_stale_timer,
       NO_STR GBPROXY_LINK_LIST_STR GBPROXY_CLEAN_STALE_TIMER_STR)
 
 {
-	struct gbproxy_peer *peer;
 	g_cfg->clean_stale_timer_freq = 0;
 
-	llist_for_each_entry(peer, &g_cfg->bts_peers, list)
-		osmo_timer_del(&peer->clean_stale_timer);
+	osmo_timer_del(&g_cfg->clean_stale_timer);
 
 	return CMD_SUCCESS;
 }
@@ -494,6 +642,29 @@ DEFUN(cfg_gbproxy_link_list_no_max_len,
 	return CMD_SUCCESS;
 }
 
+#define GBPROXY_MAX_TOTAL_LEN_STR "Limit the number of logical links of all peers\n"
+
+DEFUN(cfg_gbproxy_link_list_max_total_len,
+      cfg_gbproxy_link_list_max_total_len_cmd,
+      "link-list max-total-length <1-9999999>",
+      GBPROXY_LINK_LIST_STR GBPROXY_MAX_TOTAL_LEN_STR
+      "Maximum number of logical links, the least recently used ones are removed first\n")
+{
+	g_cfg->tlli_max_total_len = atoi(argv[0]);
+
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_gbproxy_link_list_no_max_total_len,
+      cfg_gbproxy_link_list_no_max_total_len_cmd,
+      "no link-list max-total-length",
+      NO_STR GBPROXY_LINK_LIST_STR GBPROXY_MAX_TOTAL_LEN_STR)
+{
+	g_cfg->tlli_max_total_len = 0;
+
+	return CMD_SUCCESS;
+}
+
 DEFUN(cfg_gbproxy_link_list_keep_mode,
       cfg_gbproxy_link_list_keep_mode_cmd,
       "link-list keep-mode (never|re-attach|identified|always)",
@@ -531,6 +702,29 @@ DEFUN(cfg_gbproxy_link_no_stored_msgs_max_len,
 	return CMD_SUCCESS;
 }
 
+#define GBPROXY_MAX_BYTES_STR "Limit the total size\n"
+
+DEFUN(cfg_gbproxy_link_stored_msgs_max_bytes,
+      cfg_gbproxy_link_stored_msgs_max_bytes_cmd,
+      "link stored-msgs-max-bytes <1-1000000000>",
+      GBPROXY_LINK_STR GBPROXY_MAX_BYTES_STR
+      "Maximum number of bytes stored by all logical links waiting to acquire their IMSI, the oldest messages are dropped first\n")
+{
+	g_cfg->stored_msgs_max_bytes = (uint32_t) atoi(argv[0]);
+
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_gbproxy_link_no_stored_msgs_max_bytes,
+      cfg_gbproxy_link_no_stored_msgs_max_bytes_cmd,
+      "no link stored-msgs-max-bytes",
+      NO_STR GBPROXY_LINK_STR GBPROXY_MAX_BYTES_STR)
+{
+	g_cfg->stored_msgs_max_bytes = 0;
+
+	return CMD_SUCCESS;
+}
+
 
 DEFUN(show_gbproxy, show_gbproxy_cmd, "show gbproxy [stats]",
        SHOW_STR "Display information about the Gb proxy\n" "Show statistics\n")
@@ -586,7 +780,8 @@ DEFUN(show_gbproxy_links, show_gbproxy_links_cmd, "show gbproxy links",
 					link_info->stored_msgs_len,
 					g_cfg->stored_msgs_max_len);
 
-			if (g_cfg->route_to_sgsn2)
+			if (g_cfg->route_to_sgsn2 ||
+			    !llist_empty(&g_cfg->sgsn_pool))
 				vty_out(vty, ", SGSN NSEI %d",
 					link_info->sgsn_nsei);
 
@@ -885,24 +1080,33 @@ int gbproxy_vty_init(void)
 	install_element(GBPROXY_NODE, &cfg_gbproxy_match_imsi_cmd);
 	install_element(GBPROXY_NODE, &cfg_gbproxy_core_apn_cmd);
 	install_element(GBPROXY_NODE, &cfg_gbproxy_secondary_sgsn_cmd);
+	install_element(GBPROXY_NODE, &cfg_gbproxy_sgsn_pool_weight_cmd);
+	install_element(GBPROXY_NODE, &cfg_gbproxy_sgsn_pool_nri_cmd);
+	install_element(GBPROXY_NODE, &cfg_gbproxy_nri_bitlen_cmd);
 	install_element(GBPROXY_NODE, &cfg_gbproxy_patch_ptmsi_cmd);
 	install_element(GBPROXY_NODE, &cfg_gbproxy_acquire_imsi_cmd);
 	install_element(GBPROXY_NODE, &cfg_gbproxy_link_list_clean_stale_timer_cmd);
 	install_element(GBPROXY_NODE, &cfg_gbproxy_link_list_max_age_cmd);
 	install_element(GBPROXY_NODE, &cfg_gbproxy_link_list_max_len_cmd);
+	install_element(GBPROXY_NODE, &cfg_gbproxy_link_list_max_total_len_cmd);
 	install_element(GBPROXY_NODE, &cfg_gbproxy_link_list_keep_mode_cmd);
 	install_element(GBPROXY_NODE, &cfg_gbproxy_link_stored_msgs_max_len_cmd);
+	install_element(GBPROXY_NODE, &cfg_gbproxy_link_stored_msgs_max_bytes_cmd);
 	install_element(GBPROXY_NODE, &cfg_gbproxy_no_core_mcc_cmd);
 	install_element(GBPROXY_NODE, &cfg_gbproxy_no_core_mnc_cmd);
 	install_element(GBPROXY_NODE, &cfg_gbproxy_no_match_imsi_cmd);
 	install_element(GBPROXY_NODE, &cfg_gbproxy_no_core_apn_cmd);
 	install_element(GBPROXY_NODE, &cfg_gbproxy_no_secondary_sgsn_cmd);
+	install_element(GBPROXY_NODE, &cfg_gbproxy_no_sgsn_pool_nri_cmd);
+	install_element(GBPROXY_NODE, &cfg_gbproxy_no_sgsn_pool_cmd);
 	install_element(GBPROXY_NODE, &cfg_gbproxy_no_patch_ptmsi_cmd);
 	install_element(GBPROXY_NODE, &cfg_gbproxy_no_acquire_imsi_cmd);
 	install_element(GBPROXY_NODE, &cfg_gbproxy_link_list_no_clean_stale_timer_cmd);
 	install_element(GBPROXY_NODE, &cfg_gbproxy_link_list_no_max_age_cmd);
 	install_element(GBPROXY_NODE, &cfg_gbproxy_link_list_no_max_len_cmd);
+	install_element(GBPROXY_NODE, &cfg_gbproxy_link_list_no_max_total_len_cmd);
 	install_element(GBPROXY_NODE, &cfg_gbproxy_link_no_stored_msgs_max_len_cmd);
+	install_element(GBPROXY_NODE, &cfg_gbproxy_link_no_stored_msgs_max_bytes_cmd);
 
 	/* broken or deprecated to allow an upgrade path */
 	install_element(GBPROXY_NODE, &cfg_gbproxy_broken_apn_match_cmd);
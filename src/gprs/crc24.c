@@ -65,3 +65,87 @@ uint32_t crc24_calc(uint32_t fcs, uint8_t *cp, unsigned int len)
 		fcs = (fcs >> 8) ^ tbl_crc24[(fcs ^ *cp++) & 0xff];
 	return fcs;
 }
+
+/* reflected CRC-24 polynomial, equal to tbl_crc24[0x80] */
+#define POLY_CRC24	0xad85dd
+
+/* x^(8n) modulo the polynomial for n = 0..254, bit-reflected (x^0 is bit 23).
+ * x^255 = 1 modulo this polynomial, so this covers any number of bytes. */
+static const uint32_t tbl_crc24_x8n[255] = {
+	0x00800000, 0x00008000, 0x00000080, 0x00ad85dd, 0x006b53bb, 0x00013058, 0x00a75cb0, 0x001517e7,
+	0x00119289, 0x004f3aa8, 0x0049e532, 0x004e39d4, 0x00891ee0, 0x00866db4, 0x00a2b7c3, 0x00768278,
+	0x00770d46, 0x00baf47c, 0x00c04025, 0x00b1c067, 0x00bcb383, 0x008ddb4f, 0x0058a04d, 0x00ae3061,
+	0x00fd6831, 0x006e6f78, 0x007715ab, 0x00693f3c, 0x003bd4dd, 0x006bc5ea, 0x0044c3a9, 0x009f49bd,
+	0x00400000, 0x00004000, 0x00000040, 0x00fb4733, 0x00982c00, 0x0000982c, 0x0053ae58, 0x00a70e2e,
+	0x00a54c99, 0x00279d54, 0x0024f299, 0x00271cea, 0x00448f70, 0x004336da, 0x00fcde3c, 0x003b413c,
+	0x003b86a3, 0x005d7a3e, 0x00cda5cf, 0x00f565ee, 0x00f3dc1c, 0x00eb687a, 0x0081d5fb, 0x00fa9ded,
+	0x00d331c5, 0x003737bc, 0x00960f08, 0x00349f9e, 0x00b06fb3, 0x0035e2f5, 0x008fe409, 0x00e22103,
+	0x00200000, 0x00002000, 0x00000020, 0x00d02644, 0x004c1600, 0x00004c16, 0x0029d72c, 0x00538717,
+	0x00ff2391, 0x0013ceaa, 0x00bffc91, 0x00138e75, 0x002247b8, 0x00219b6d, 0x007e6f1e, 0x001da09e,
+	0x00b0468c, 0x002ebd1f, 0x00cb573a, 0x007ab2f7, 0x0079ee0e, 0x0075b43d, 0x00ed6f20, 0x00d0cb2b,
+	0x00c41d3f, 0x001b9bde, 0x004b0784, 0x001a4fcf, 0x00f5b204, 0x00b774a7, 0x00ea77d9, 0x00dc955c,
+	0x00100000, 0x00001000, 0x00000010, 0x00681322, 0x00260b00, 0x0000260b, 0x0014eb96, 0x00844656,
+	0x00d21415, 0x0009e755, 0x00f27b95, 0x00a442e7, 0x001123dc, 0x00bd486b, 0x003f378f, 0x000ed04f,
+	0x00582346, 0x00badb52, 0x0065ab9d, 0x0090dca6, 0x003cf707, 0x00975fc3, 0x0076b790, 0x00c5e048,
+	0x00cf8b42, 0x000dcdef, 0x002583c2, 0x00a0a23a, 0x007ad902, 0x00f63f8e, 0x00d8be31, 0x006e4aae,
+	0x00080000, 0x00000800, 0x00000008, 0x00340991, 0x00130580, 0x00ad96d8, 0x000a75cb, 0x0042232b,
+	0x00c48fd7, 0x00a97677, 0x00d4b817, 0x00ffa4ae, 0x000891ee, 0x00f321e8, 0x00b21e1a, 0x00aaedfa,
+	0x002c11a3, 0x005d6da9, 0x009f5013, 0x00486e53, 0x00b3fe5e, 0x00e62a3c, 0x003b5bc8, 0x0062f024,
+	0x0067c5a1, 0x00ab632a, 0x0012c1e1, 0x0050511d, 0x003d6c81, 0x007b1fc7, 0x00c1dac5, 0x00372557,
+	0x00040000, 0x00000400, 0x00000004, 0x00b78115, 0x000982c0, 0x0056cb6c, 0x00a8bf38, 0x008c9448,
+	0x00cfc236, 0x00f93ee6, 0x00c7d9d6, 0x007fd257, 0x000448f7, 0x007990f4, 0x00590f0d, 0x005576fd,
+	0x00bb8d0c, 0x00833309, 0x00e22dd4, 0x0089b2f4, 0x0059ff2f, 0x0073151e, 0x001dade4, 0x00317812,
+	0x009e670d, 0x0055b195, 0x00a4e52d, 0x0085ad53, 0x00b3339d, 0x00900a3e, 0x00cd68bf, 0x00b61776,
+	0x00020000, 0x00000200, 0x00000002, 0x00f64557, 0x0004c160, 0x002b65b6, 0x00545f9c, 0x00464a24,
+	0x0067e11b, 0x007c9f73, 0x0063eceb, 0x00926cf6, 0x00afa1a6, 0x003cc87a, 0x0081025b, 0x00873ea3,
+	0x005dc686, 0x00ec1c59, 0x007116ea, 0x0044d97a, 0x00817a4a, 0x00398a8f, 0x000ed6f2, 0x0018bc09,
+	0x00e2b65b, 0x00875d17, 0x00fff74b, 0x00ef5374, 0x00f41c13, 0x0048051f, 0x00cb3182, 0x005b0bbb,
+	0x00010000, 0x00000100, 0x00000001, 0x00d6a776, 0x000260b0, 0x0015b2db, 0x002a2fce, 0x00232512,
+	0x009e7550, 0x0093ca64, 0x009c73a8, 0x0049367b, 0x0057d0d3, 0x001e643d, 0x00ed04f0, 0x00ee1a8c,
+	0x002ee343, 0x00db8bf1, 0x00388b75, 0x00226cbd, 0x0040bd25, 0x00b1409a, 0x00076b79, 0x00a1dbd9,
+	0x00dcdef0, 0x00ee2b56, 0x00d27e78, 0x0077a9ba, 0x00d78bd4, 0x00898752, 0x006598c1
+};
+
+/* Multiply a and b modulo the polynomial (bit-reflected, x^0 is bit 23) */
+static uint32_t crc24_multmodp(uint32_t a, uint32_t b)
+{
+	uint32_t m = 1 << 23;
+	uint32_t p = 0;
+
+	while (a) {
+		if (a & m) {
+			p ^= b;
+			a ^= m;
+		}
+		m >>= 1;
+		b = b & 1 ? (b >> 1) ^ POLY_CRC24 : b >> 1;
+	}
+	return p;
+}
+
+/* Advance a CRC register over len zero bytes */
+static uint32_t crc24_zeros(uint32_t fcs, unsigned int len)
+{
+	return crc24_multmodp(tbl_crc24_x8n[len % 255], fcs);
+}
+
+/* Update the CRC-24 of a frame after len bytes in it have been changed in
+ * place from old_data to new_data, with tail_len bytes between the end of the
+ * changed area and the end of the data covered by the CRC. The CRC is linear,
+ * so the difference only depends on the changed bits and their position. This
+ * works both on crc24_calc() results and on the inverted FCS. */
+uint32_t crc24_update(uint32_t fcs, const uint8_t *old_data,
+		      const uint8_t *new_data, unsigned int len,
+		      unsigned int tail_len)
+{
+	uint32_t delta = 0;
+
+	while (len--)
+		delta = (delta >> 8) ^
+			tbl_crc24[(delta ^ *old_data++ ^ *new_data++) & 0xff];
+
+	if (!delta)
+		return fcs;
+
+	return fcs ^ crc24_zeros(delta, tail_len);
+}
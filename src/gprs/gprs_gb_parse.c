@@ -410,24 +410,31 @@ int gprs_gb_parse_llc(uint8_t *llc, size_t llc_len,
 
 	/* parse LLC */
 	rc = gprs_llc_hdr_parse(ghp, llc, llc_len);
-	gprs_llc_hdr_dump(ghp, NULL);
+	if (log_check_level(DLLC, LOGL_DEBUG))
+		gprs_llc_hdr_dump(ghp, NULL);
 	if (rc != 0) {
 		LOGP(DLLC, LOGL_NOTICE, "Error during LLC header parsing\n");
 		return 0;
 	}
 
-	fcs = gprs_llc_fcs(llc, ghp->crc_length);
-	LOGP(DLLC, LOGL_DEBUG, "Got LLC message, CRC: %06x (computed %06x)\n",
-	     ghp->fcs, fcs);
-
 	if (!ghp->data)
 		return 0;
 
-	if (ghp->sapi != GPRS_SAPI_GMM)
+	/* Only GMM/SM messages are decoded (and possibly patched) further.
+	 * Everything else is mostly user data, where the header is all we
+	 * need, so don't run the CRC over it unless it is logged. */
+	if (ghp->sapi != GPRS_SAPI_GMM || ghp->cmd != GPRS_LLC_UI) {
+		if (log_check_level(DLLC, LOGL_DEBUG))
+			LOGP(DLLC, LOGL_DEBUG, "Got LLC message, CRC: %06x "
+			     "(computed %06x)\n", ghp->fcs,
+			     gprs_llc_fcs(llc, ghp->crc_length));
 		return 1;
+	}
 
-	if (ghp->cmd != GPRS_LLC_UI)
-		return 1;
+	fcs = gprs_llc_fcs(llc, ghp->crc_length);
+	ghp->fcs_calc = fcs;
+	LOGP(DLLC, LOGL_DEBUG, "Got LLC message, CRC: %06x (computed %06x)\n",
+	     ghp->fcs, fcs);
 
 	if (ghp->is_encrypted) {
 		parse_ctx->need_decryption = 1;
@@ -23,6 +23,7 @@
 #include <osmocom/sgsn/debug.h>
 
 #include <netdb.h>
+#include <arpa/nameser.h>
 
 extern void *tall_sgsn_ctx;
 
@@ -36,6 +37,11 @@ struct cares_cb_data {
 	void *data;
 };
 
+struct cares_ttl_cb_data {
+	sgsn_ares_ttl_callback cb;
+	void *data;
+};
+
 static void osmo_ares_reschedule(struct sgsn_instance *sgsn);
 static void ares_cb(void *_arg, int status, int timeouts, struct hostent *hostent)
 {
@@ -46,6 +52,34 @@ static void ares_cb(void *_arg, int status, int timeouts, struct hostent *hosten
 	talloc_free(arg);
 }
 
+static void ares_ttl_cb(void *_arg, int status, int timeouts,
+			unsigned char *abuf, int alen)
+{
+	struct cares_ttl_cb_data *arg = _arg;
+	struct hostent *hostent = NULL;
+	struct ares_addrttl addrttls[8];
+	int naddrttls = ARRAY_SIZE(addrttls);
+	int ttl = -1;
+	int i;
+
+	if (status == ARES_SUCCESS)
+		status = ares_parse_a_reply(abuf, alen, &hostent,
+					    addrttls, &naddrttls);
+	if (status == ARES_SUCCESS) {
+		/* The answer is valid as long as all of its records are. */
+		for (i = 0; i < naddrttls; i++) {
+			if (ttl < 0 || addrttls[i].ttl < ttl)
+				ttl = addrttls[i].ttl;
+		}
+	}
+
+	arg->cb(arg->data, status, timeouts, hostent, ttl);
+	if (hostent)
+		ares_free_hostent(hostent);
+	osmo_ares_reschedule(sgsn);
+	talloc_free(arg);
+}
+
 static int ares_osmo_fd_cb(struct osmo_fd *fd, unsigned int what)
 {
 	LOGP(DGPRS, LOGL_DEBUG, "C-ares fd(%d) ready(%d)\n", fd->fd, what);
@@ -145,6 +179,29 @@ int sgsn_ares_query(struct sgsn_instance *sgsn, const char *name,
 	return 0;
 }
 
+int sgsn_ares_query_ttl(struct sgsn_instance *sgsn, const char *name,
+			sgsn_ares_ttl_callback cb, void *data)
+{
+	struct cares_ttl_cb_data *cb_data;
+	struct hostent *hostent;
+
+	/* Like ares_gethostbyname(), look at the hosts file first. Its entries
+	 * have no TTL. */
+	if (ares_gethostbyname_file(sgsn->ares_channel, name, AF_INET,
+				    &hostent) == ARES_SUCCESS) {
+		cb(data, ARES_SUCCESS, 0, hostent, -1);
+		ares_free_hostent(hostent);
+		return 0;
+	}
+
+	cb_data = talloc_zero(tall_sgsn_ctx, struct cares_ttl_cb_data);
+	cb_data->cb = cb;
+	cb_data->data = data;
+	ares_search(sgsn->ares_channel, name, C_IN, T_A, ares_ttl_cb, cb_data);
+	osmo_ares_reschedule(sgsn);
+	return 0;
+}
+
 int sgsn_ares_init(struct sgsn_instance *sgsn)
 {
 	struct ares_options options;
@@ -19,15 +19,22 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
 #include <string.h>
 #include <errno.h>
 #include <inttypes.h>
 #include <time.h>
 #include <limits.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <sys/socket.h>
+#include <sys/prctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <linux/filter.h>
 
 #include <gtp.h>
 #include <gtpie.h>
@@ -81,6 +88,21 @@ enum gtp_rc {
 	GTP_RC_INVALID_IE = -3,
 };
 
+/* The IEs gtphub looks at or rewrites, see gtp_scan_ies(). */
+enum gtp_ie_idx {
+	GTP_IE_CAUSE,
+	GTP_IE_IMSI,
+	GTP_IE_RECOVERY,
+	GTP_IE_TEI_DI,
+	GTP_IE_TEI_C,
+	GTP_IE_TEARDOWN,
+	GTP_IE_NSAPI,
+	GTP_IE_APN,
+	GTP_IE_GSN_ADDR_C, /* the first GSN Address IE */
+	GTP_IE_GSN_ADDR_U, /* the second GSN Address IE */
+	GTP_IE_N
+};
+
 struct gtp_packet_desc {
 	union gtp_packet *data;
 	int data_len;
@@ -94,8 +116,30 @@ struct gtp_packet_desc {
 	unsigned int plane_idx;
 	unsigned int side_idx;
 	struct gtphub_tunnel *tun;
+	/* If this is a response, the sequence nr mapping of its request. */
+	struct gtphub_seq_mapping *seq_map;
+	/* Hash of the Ctrl packet as received, before any rewriting. */
+	uint32_t digest;
 	time_t timestamp;
-	union gtpie_member *ie[GTPIE_SIZE];
+	/* The first instance of each IE gtphub uses, pointing into data, or
+	 * NULL if absent. */
+	union gtpie_member *ie[GTP_IE_N];
+};
+
+/* A sequence nr mapping, i.e. a request forwarded to the peer owning the
+ * nr_map. On the Ctrl plane, it keeps the response forwarded back to the
+ * origin, to answer retransmissions of the request without bothering the peer
+ * again. */
+struct gtphub_seq_mapping {
+	struct nr_mapping nrm; /* first, to talloc_free() via nrm */
+
+	/* in gtphub->seq_reqs, by origin and orig */
+	struct hash_index_entry req_hash;
+	uint8_t req_type;
+	uint32_t req_digest;
+
+	uint8_t *rsp;
+	size_t rsp_len;
 };
 
 struct pending_delete {
@@ -132,6 +176,64 @@ static const struct rate_ctr_group_desc gtphub_ctrg_io_desc = {
 	.class_id = OSMO_STATS_CLASS_GLOBAL,
 };
 
+static inline void gtphub_tunnel_count_in(struct gtphub_tunnel_endpoint *te,
+					  size_t len)
+{
+	te->counters.pkts_in ++;
+	te->counters.bytes_in += len;
+}
+
+static inline void gtphub_tunnel_count_out(struct gtphub_tunnel_endpoint *te,
+					   size_t len)
+{
+	te->counters.pkts_out ++;
+	te->counters.bytes_out += len;
+}
+
+static const struct rate_ctr_desc gtphub_counters_hub_desc[] = {
+	{ "parked",           "Requests parked during GGSN resolution" },
+	{ "parked.forwarded", "Parked requests forwarded after resolution" },
+	{ "parked.dropped",   "Parked requests dropped (queue full, expired,"
+			      " resolution failed)" },
+	{ "ggsn.cache.hit",   "GGSN found in the resolved GGSN cache" },
+	{ "ggsn.cache.miss",  "GGSN not cached or its DNS TTL ran out" },
+	{ "ggsn.prefetch",    "DNS queries refreshing a cached GGSN" },
+	{ "retrans.replayed", "Retransmitted requests answered with the"
+			      " cached response" },
+	{ "retrans.forwarded", "Retransmitted requests forwarded again, no"
+			       " response seen yet" },
+};
+
+static const struct rate_ctr_group_desc gtphub_ctrg_hub_desc = {
+	.group_name_prefix = "gtphub",
+	.group_description = "GTP Hub Statistics",
+	.num_ctr = ARRAY_SIZE(gtphub_counters_hub_desc),
+	.ctr_desc = gtphub_counters_hub_desc,
+	.class_id = OSMO_STATS_CLASS_GLOBAL,
+};
+
+enum gtphub_counters_batch {
+	GTPH_CTR_RX_BATCHES = 0,
+	GTPH_CTR_RX_TRUNCATED,
+	GTPH_CTR_TX_BATCHES,
+	GTPH_CTR_TX_ERRORS,
+};
+
+static const struct rate_ctr_desc gtphub_counters_batch_desc[] = {
+	{ "rx.batches",   "recvmmsg() calls returning datagrams" },
+	{ "rx.truncated", "Datagrams dropped for exceeding the buffer" },
+	{ "tx.batches",   "sendmmsg() batches flushed" },
+	{ "tx.errors",    "Datagrams that could not be sent" },
+};
+
+static const struct rate_ctr_group_desc gtphub_ctrg_batch_desc = {
+	.group_name_prefix = "gtphub:batch",
+	.group_description = "Batched I/O Statistics",
+	.num_ctr = ARRAY_SIZE(gtphub_counters_batch_desc),
+	.ctr_desc = gtphub_counters_batch_desc,
+	.class_id = OSMO_STATS_CLASS_GLOBAL,
+};
+
 
 /* support */
 
@@ -260,12 +362,15 @@ static int gsn_addr_get(struct gsn_addr *gsna, const struct gtp_packet_desc *p,
 	if (p->rc != GTP_RC_PDU_C)
 		return -1;
 
-	unsigned int len;
-	/* gtpie.h fails to declare gtpie_gettlv()'s first arg as const. */
-	if (gtpie_gettlv((union gtpie_member**)p->ie, GTPIE_GSN_ADDR, idx,
-			 &len, gsna->buf, sizeof(gsna->buf))
-	    != 0)
+	OSMO_ASSERT(idx >= 0 && idx < 2);
+	const union gtpie_member *ie = p->ie[GTP_IE_GSN_ADDR_C + idx];
+	if (!ie)
+		return -1;
+
+	unsigned int len = ntoh16(ie->tlv.l);
+	if (len > sizeof(gsna->buf))
 		return -1;
+	memcpy(gsna->buf, ie->tlv.v, len);
 	gsna->len = len;
 	return 0;
 }
@@ -276,13 +381,11 @@ static int gsn_addr_put(const struct gsn_addr *gsna, struct gtp_packet_desc *p,
 	if (p->rc != GTP_RC_PDU_C)
 		return -1;
 
-	int ie_idx;
-	ie_idx = gtpie_getie(p->ie, GTPIE_GSN_ADDR, idx);
-
-	if (ie_idx < 0)
+	OSMO_ASSERT(idx >= 0 && idx < 2);
+	if (!p->ie[GTP_IE_GSN_ADDR_C + idx])
 		return -1;
 
-	struct gtpie_tlv *ie = &p->ie[ie_idx]->tlv;
+	struct gtpie_tlv *ie = &p->ie[GTP_IE_GSN_ADDR_C + idx]->tlv;
 	int ie_l = ntoh16(ie->l);
 	if (ie_l != gsna->len) {
 		LOG(LOGL_ERROR, "Not implemented:"
@@ -480,15 +583,42 @@ static int get_ie_imsi_str(union gtpie_member *ie[], int i,
 	return imsi_to_str(imsi_buf, imsi_str);
 }
 
+/* Like get_ie_imsi_str(), for the IMSI IE found by gtp_scan_ies(). */
+static int gtp_get_imsi_str(const struct gtp_packet_desc *p,
+			    const char **imsi_str)
+{
+	uint8_t imsi_buf[8];
+	if (!p->ie[GTP_IE_IMSI])
+		return 0;
+	memcpy(imsi_buf, p->ie[GTP_IE_IMSI]->tv0.v, sizeof(imsi_buf));
+	return imsi_to_str(imsi_buf, imsi_str);
+}
+
+/* Return the value of a one octet IE found by gtp_scan_ies() in *val. Return
+ * 0 on success, -1 if the IE is not present, like gtpie_gettv1(). */
+static int gtp_get_tv1(const struct gtp_packet_desc *p, enum gtp_ie_idx idx,
+		       uint8_t *val)
+{
+	if (!p->ie[idx])
+		return -1;
+	*val = p->ie[idx]->tv1.v;
+	return 0;
+}
+
 /* Return 0 if not present, 1 if present and decoded successfully, -1 if
  * present but cannot be decoded. */
-static int get_ie_apn_str(union gtpie_member *ie[], const char **apn_str)
+static int gtp_get_apn_str(const struct gtp_packet_desc *p,
+			   const char **apn_str)
 {
 	static char apn_buf[GSM_APN_LENGTH];
+	const union gtpie_member *ie = p->ie[GTP_IE_APN];
 	unsigned int len;
-	if (gtpie_gettlv(ie, GTPIE_APN, 0,
-			 &len, apn_buf, sizeof(apn_buf)) != 0)
+	if (!ie)
 		return 0;
+	len = ntoh16(ie->tlv.l);
+	if (len > sizeof(apn_buf))
+		len = sizeof(apn_buf);
+	memcpy(apn_buf, ie->tlv.v, len);
 
 	if (len < 2) {
 		LOG(LOGL_ERROR, "APN IE: invalid length: %d\n",
@@ -509,6 +639,166 @@ static int get_ie_apn_str(union gtpie_member *ie[], const char **apn_str)
 	return 1;
 }
 
+/* Value lengths of the TV format IEs, indexed by IE type; TLV IEs (type >=
+ * 128) carry their own length. 0 means unknown, which makes the IE chain
+ * undecodable, as with gtpie_decaps(). */
+static const uint8_t gtp_ie_tv_len[128] = {
+	[GTPIE_CAUSE] = 1,
+	[GTPIE_IMSI] = 8,
+	[GTPIE_RAI] = 6,
+	[GTPIE_TLLI] = 4,
+	[GTPIE_P_TMSI] = 4,
+	[GTPIE_QOS_PROFILE0] = 3,
+	[GTPIE_REORDER] = 1,
+	[GTPIE_AUTH_TRIPLET] = 28,
+	[GTPIE_MAP_CAUSE] = 1,
+	[GTPIE_P_TMSI_S] = 3,
+	[GTPIE_MS_VALIDATED] = 1,
+	[GTPIE_RECOVERY] = 1,
+	[GTPIE_SELECTION_MODE] = 1,
+	[GTPIE_TEI_DI] = 4,
+	[GTPIE_TEI_C] = 4,
+	[GTPIE_TEI_DII] = 5,
+	[GTPIE_TEARDOWN] = 1,
+	[GTPIE_NSAPI] = 1,
+	[GTPIE_RANAP_CAUSE] = 1,
+	[GTPIE_RAB_CONTEXT] = 9,
+	[GTPIE_RP_SMS] = 1,
+	[GTPIE_RP] = 1,
+	[GTPIE_PFI] = 2,
+	[GTPIE_CHARGING_C] = 2,
+	[GTPIE_TRACE_REF] = 2,
+	[GTPIE_TRACE_TYPE] = 2,
+	[GTPIE_MS_NOT_REACH] = 1,
+	[GTPIE_CHARGING_ID] = 4,
+};
+
+/* Walk the IE chain once, validating the IE lengths, and point p->ie[] at the
+ * first instance of each IE gtphub uses (the first two for GSN Address). This
+ * replaces a full gtpie_decaps() on each GTP-C packet: the IEs are accessed
+ * and rewritten in place in p->data. Return 0 on success, -1 if the IE chain
+ * cannot be decoded. */
+static int gtp_scan_ies(struct gtp_packet_desc *p)
+{
+	uint8_t *pos = (uint8_t*)p->data + p->header_len;
+	uint8_t *end = (uint8_t*)p->data + p->data_len;
+	int gsn_addrs = 0;
+
+	while (pos < end) {
+		union gtpie_member *ie = (union gtpie_member*)pos;
+		uint8_t t = *pos;
+		unsigned int len;
+		int idx = -1;
+
+		if (t & 0x80) {
+			if ((end - pos) < 3)
+				return -1;
+			len = 3 + ((pos[1] << 8) | pos[2]);
+		} else if ((p->version == 0)
+			   && ((t == GTPIE_TEI_DI) || (t == GTPIE_TEI_C))) {
+			/* GTPv0 has two octet Flow Labels in place of the
+			 * TEIs, which gtphub doesn't map. */
+			len = 1 + 2;
+			t = 0;
+		} else {
+			if (!gtp_ie_tv_len[t])
+				return -1;
+			len = 1 + gtp_ie_tv_len[t];
+		}
+
+		if ((end - pos) < len)
+			return -1;
+
+		switch (t) {
+		case GTPIE_CAUSE:
+			idx = GTP_IE_CAUSE;
+			break;
+		case GTPIE_IMSI:
+			idx = GTP_IE_IMSI;
+			break;
+		case GTPIE_RECOVERY:
+			idx = GTP_IE_RECOVERY;
+			break;
+		case GTPIE_TEI_DI:
+			idx = GTP_IE_TEI_DI;
+			break;
+		case GTPIE_TEI_C:
+			idx = GTP_IE_TEI_C;
+			break;
+		case GTPIE_TEARDOWN:
+			idx = GTP_IE_TEARDOWN;
+			break;
+		case GTPIE_NSAPI:
+			idx = GTP_IE_NSAPI;
+			break;
+		case GTPIE_APN:
+			idx = GTP_IE_APN;
+			break;
+		case GTPIE_GSN_ADDR:
+			if (gsn_addrs < 2)
+				idx = GTP_IE_GSN_ADDR_C + gsn_addrs;
+			gsn_addrs ++;
+			break;
+		default:
+			break;
+		}
+
+		if (idx >= 0 && !p->ie[idx])
+			p->ie[idx] = ie;
+
+		pos += len;
+	}
+	return 0;
+}
+
+/* Log all IEs of interest, for which gtp_scan_ies() only keeps the first
+ * instance. Decoding the full IE table is only worth it at debug level. */
+static void gtp_log_ies(const struct gtp_packet_desc *p)
+{
+	union gtpie_member *ie[GTPIE_SIZE];
+	int i;
+
+	if (gtpie_decaps(ie, p->version,
+			 (void*)((uint8_t*)p->data + p->header_len),
+			 p->data_len - p->header_len) != 0)
+		return;
+
+	for (i = 0; i < 10; i++) {
+		const char *imsi;
+		if (get_ie_imsi_str(ie, i, &imsi) < 1)
+			break;
+		LOG(LOGL_DEBUG, "| IMSI %s\n", imsi);
+	}
+
+	for (i = 0; i < 10; i++) {
+		uint8_t nsapi;
+		if (!get_ie_nsapi(ie, i, &nsapi))
+			break;
+		LOG(LOGL_DEBUG, "| NSAPI %d\n", (int)nsapi);
+	}
+
+	for (i = 0; i < 2; i++) {
+		struct gsn_addr addr;
+		if (gsn_addr_get(&addr, p, i) == 0)
+			LOG(LOGL_DEBUG, "| addr %s\n", gsn_addr_to_str(&addr));
+	}
+
+	for (i = 0; i < 10; i++) {
+		uint32_t tei;
+		if (gtpie_gettv4(ie, GTPIE_TEI_DI, i, &tei) != 0)
+			break;
+		LOG(LOGL_DEBUG, "| TEI DI (USER) %" PRIu32 " 0x%08" PRIx32 "\n",
+		    tei, tei);
+	}
+
+	for (i = 0; i < 10; i++) {
+		uint32_t tei;
+		if (gtpie_gettv4(ie, GTPIE_TEI_C, i, &tei) != 0)
+			break;
+		LOG(LOGL_DEBUG, "| TEI (CTRL) %" PRIu32 " 0x%08" PRIx32 "\n",
+		    tei, tei);
+	}
+}
 
 /* Validate header, and index information elements. Write decoded packet
  * information to *res. res->data will point at the given data buffer. On
@@ -543,9 +833,7 @@ static void gtp_decode(const uint8_t *data, int data_len,
 		return;
 	}
 
-	if (gtpie_decaps(res->ie, res->version,
-			 (void*)(data + res->header_len),
-			 res->data_len - res->header_len) != 0) {
+	if (gtp_scan_ies(res) != 0) {
 		res->rc = GTP_RC_INVALID_IE;
 		LOG(LOGL_ERROR, "INVALID: cannot decode IEs."
 		    " Dropping GTP packet%s.\n",
@@ -554,47 +842,8 @@ static void gtp_decode(const uint8_t *data, int data_len,
 		return;
 	}
 
-#if 1
-	/* TODO if (<loglevel is debug>)
-	   (waiting for a commit from jerlbeck) */
-	int i;
-
-	for (i = 0; i < 10; i++) {
-		const char *imsi;
-		if (get_ie_imsi_str(res->ie, i, &imsi) < 1)
-			break;
-		LOG(LOGL_DEBUG, "| IMSI %s\n", imsi);
-	}
-
-	for (i = 0; i < 10; i++) {
-		uint8_t nsapi;
-		if (!get_ie_nsapi(res->ie, i, &nsapi))
-			break;
-		LOG(LOGL_DEBUG, "| NSAPI %d\n", (int)nsapi);
-	}
-
-	for (i = 0; i < 2; i++) {
-		struct gsn_addr addr;
-		if (gsn_addr_get(&addr, res, i) == 0)
-			LOG(LOGL_DEBUG, "| addr %s\n", gsn_addr_to_str(&addr));
-	}
-
-	for (i = 0; i < 10; i++) {
-		uint32_t tei;
-		if (gtpie_gettv4(res->ie, GTPIE_TEI_DI, i, &tei) != 0)
-			break;
-		LOG(LOGL_DEBUG, "| TEI DI (USER) %" PRIu32 " 0x%08" PRIx32 "\n",
-		    tei, tei);
-	}
-
-	for (i = 0; i < 10; i++) {
-		uint32_t tei;
-		if (gtpie_gettv4(res->ie, GTPIE_TEI_C, i, &tei) != 0)
-			break;
-		LOG(LOGL_DEBUG, "| TEI (CTRL) %" PRIu32 " 0x%08" PRIx32 "\n",
-		    tei, tei);
-	}
-#endif
+	if (log_check_level(DGTPHUB, LOGL_DEBUG))
+		gtp_log_ies(res);
 }
 
 
@@ -623,8 +872,11 @@ void expiry_add(struct expiry *exq, struct expiring_item *item, time_t now)
 int expiry_tick(struct expiry *exq, time_t now)
 {
 	int expired = 0;
-	struct expiring_item *m, *n;
-	llist_for_each_entry_safe(m, n, &exq->items, entry) {
+	struct expiring_item *m;
+	/* Not llist_for_each_entry_safe(): a del_cb may delete other items
+	 * from the same queue, e.g. a GGSN lookup drops its parked requests. */
+	while (!llist_empty(&exq->items)) {
+		m = llist_first_entry(&exq->items, struct expiring_item, entry);
 		if (m->expiry <= now) {
 			expiring_item_del(m);
 			expired ++;
@@ -640,8 +892,9 @@ int expiry_tick(struct expiry *exq, time_t now)
 
 void expiry_clear(struct expiry *exq)
 {
-	struct expiring_item *m, *n;
-	llist_for_each_entry_safe(m, n, &exq->items, entry) {
+	struct expiring_item *m;
+	while (!llist_empty(&exq->items)) {
+		m = llist_first_entry(&exq->items, struct expiring_item, entry);
 		expiring_item_del(m);
 	}
 }
@@ -666,6 +919,108 @@ void expiring_item_del(struct expiring_item *item)
 }
 
 
+/* hash index */
+
+#define HASH_INDEX_MIN_BUCKETS 16
+
+struct llist_head hash_index_no_bucket = LLIST_HEAD_INIT(hash_index_no_bucket);
+
+uint32_t hash_u32(uint32_t val)
+{
+	/* MurmurHash3 finalizer: every input bit affects the low bits, which
+	 * are the ones used to pick a bucket. */
+	val ^= val >> 16;
+	val *= 0x85ebca6b;
+	val ^= val >> 13;
+	val *= 0xc2b2ae35;
+	val ^= val >> 16;
+	return val;
+}
+
+uint32_t hash_buf(uint32_t seed, const void *buf, size_t len)
+{
+	/* FNV-1a */
+	const uint8_t *pos = buf;
+	uint32_t h = seed ^ 2166136261u;
+	while (len--) {
+		h ^= *pos++;
+		h *= 16777619u;
+	}
+	return hash_u32(h);
+}
+
+void hash_index_init(struct hash_index *idx)
+{
+	ZERO_STRUCT(idx);
+}
+
+void hash_index_entry_init(struct hash_index_entry *e)
+{
+	ZERO_STRUCT(e);
+	INIT_LLIST_HEAD(&e->entry);
+}
+
+static void hash_index_resize(struct hash_index *idx, unsigned int n_buckets)
+{
+	struct llist_head *buckets;
+	unsigned int i;
+
+	buckets = talloc_array(osmo_gtphub_ctx, struct llist_head, n_buckets);
+	OSMO_ASSERT(buckets);
+	for (i = 0; i < n_buckets; i++)
+		INIT_LLIST_HEAD(&buckets[i]);
+
+	for (i = 0; i < idx->n_buckets; i++) {
+		struct hash_index_entry *e, *n;
+		llist_for_each_entry_safe(e, n, &idx->buckets[i], entry) {
+			llist_del(&e->entry);
+			llist_add_tail(&e->entry,
+				       &buckets[e->hash & (n_buckets - 1)]);
+		}
+	}
+
+	if (idx->buckets)
+		talloc_free(idx->buckets);
+	idx->buckets = buckets;
+	idx->n_buckets = n_buckets;
+}
+
+void hash_index_add(struct hash_index *idx, struct hash_index_entry *e,
+		    uint32_t hash)
+{
+	OSMO_ASSERT(!e->idx);
+
+	/* Keep an average of at most one entry per bucket. */
+	if (idx->count >= idx->n_buckets)
+		hash_index_resize(idx, idx->n_buckets ?
+				  2 * idx->n_buckets : HASH_INDEX_MIN_BUCKETS);
+
+	e->hash = hash;
+	e->idx = idx;
+	llist_add_tail(&e->entry, hash_index_bucket(idx, hash));
+	idx->count ++;
+}
+
+void hash_index_del(struct hash_index_entry *e)
+{
+	struct hash_index *idx = e->idx;
+	if (!idx)
+		return;
+
+	llist_del(&e->entry);
+	INIT_LLIST_HEAD(&e->entry);
+	e->idx = NULL;
+
+	OSMO_ASSERT(idx->count > 0);
+	idx->count --;
+	if (!idx->count) {
+		talloc_free(idx->buckets);
+		idx->buckets = NULL;
+		idx->n_buckets = 0;
+	}
+}
+
+
 /* nr_map, nr_pool */
 
 void nr_pool_init(struct nr_pool *pool, nr_t nr_min, nr_t nr_max)
@@ -694,6 +1049,8 @@ void nr_map_init(struct nr_map *map, struct nr_pool *pool,
 	map->pool = pool;
 	map->add_items_to_expiry = exq;
 	INIT_LLIST_HEAD(&map->mappings);
+	hash_index_init(&map->by_orig);
+	hash_index_init(&map->by_repl);
 }
 
 void nr_mapping_init(struct nr_mapping *m)
@@ -701,6 +1058,23 @@ void nr_mapping_init(struct nr_mapping *m)
 	ZERO_STRUCT(m);
 	INIT_LLIST_HEAD(&m->entry);
 	expiring_item_init(&m->expiry_entry);
+	hash_index_entry_init(&m->orig_hash);
+	hash_index_entry_init(&m->repl_hash);
+}
+
+static inline uint32_t nr_mapping_orig_hash(const void *origin, nr_t orig)
+{
+	uint64_t o = (uintptr_t)origin;
+	return hash_u32(orig ^ hash_u32((uint32_t)o ^ (uint32_t)(o >> 32)));
+}
+
+/* Remove mapping from its nr_map's list and indexes, not from the expiry. */
+static void nr_mapping_unlink(struct nr_mapping *mapping)
+{
+	llist_del(&mapping->entry);
+	INIT_LLIST_HEAD(&mapping->entry);
+	hash_index_del(&mapping->orig_hash);
+	hash_index_del(&mapping->repl_hash);
 }
 
 void nr_map_add(struct nr_map *map, struct nr_mapping *mapping, time_t now)
@@ -711,6 +1085,10 @@ void nr_map_add(struct nr_map *map, struct nr_mapping *mapping, time_t now)
 	/* Add to the tail to always yield a list sorted by expiry, in
 	 * ascending order. */
 	llist_add_tail(&mapping->entry, &map->mappings);
+	hash_index_add(&map->by_orig, &mapping->orig_hash,
+		       nr_mapping_orig_hash(mapping->origin, mapping->orig));
+	hash_index_add(&map->by_repl, &mapping->repl_hash,
+		       hash_u32(mapping->repl));
 	nr_map_refresh(map, mapping, now);
 }
 
@@ -741,7 +1119,8 @@ struct nr_mapping *nr_map_get(const struct nr_map *map,
 			      void *origin, nr_t nr_orig)
 {
 	struct nr_mapping *mapping;
-	llist_for_each_entry(mapping, &map->mappings, entry) {
+	uint32_t hash = nr_mapping_orig_hash(origin, nr_orig);
+	hash_index_for_each_possible(&map->by_orig, mapping, orig_hash, hash) {
 		if ((mapping->origin == origin)
 		    && (mapping->orig == nr_orig))
 			return mapping;
@@ -753,7 +1132,8 @@ struct nr_mapping *nr_map_get(const struct nr_map *map,
 struct nr_mapping *nr_map_get_inv(const struct nr_map *map, nr_t nr_repl)
 {
 	struct nr_mapping *mapping;
-	llist_for_each_entry(mapping, &map->mappings, entry) {
+	uint32_t hash = hash_u32(nr_repl);
+	hash_index_for_each_possible(&map->by_repl, mapping, repl_hash, hash) {
 		if (mapping->repl == nr_repl) {
 			return mapping;
 		}
@@ -765,8 +1145,7 @@ struct nr_mapping *nr_map_get_inv(const struct nr_map *map, nr_t nr_repl)
 void nr_mapping_del(struct nr_mapping *mapping)
 {
 	OSMO_ASSERT(mapping);
-	llist_del(&mapping->entry);
-	INIT_LLIST_HEAD(&mapping->entry);
+	nr_mapping_unlink(mapping);
 	expiring_item_del(&mapping->expiry_entry);
 }
 
@@ -800,6 +1179,7 @@ static void gtphub_peer_del(struct gtphub_peer *peer)
 {
 	OSMO_ASSERT(llist_empty(&peer->addresses));
 	nr_map_clear(&peer->seq_map);
+	llist_del(&peer->gc_entry);
 	llist_del(&peer->entry);
 	talloc_free(peer);
 }
@@ -807,6 +1187,7 @@ static void gtphub_peer_del(struct gtphub_peer *peer)
 static void gtphub_peer_addr_del(struct gtphub_peer_addr *pa)
 {
 	OSMO_ASSERT(llist_empty(&pa->ports));
+	hash_index_del(&pa->addr_hash);
 	llist_del(&pa->entry);
 	talloc_free(pa);
 }
@@ -814,6 +1195,8 @@ static void gtphub_peer_addr_del(struct gtphub_peer_addr *pa)
 static void gtphub_peer_port_del(struct gtphub_peer_port *pp)
 {
 	OSMO_ASSERT(pp->ref_count == 0);
+	hash_index_del(&pp->port_hash);
+	llist_del(&pp->gc_entry);
 	llist_del(&pp->entry);
 	rate_ctr_group_free(pp->counters_io);
 	talloc_free(pp);
@@ -823,26 +1206,54 @@ static void gtphub_peer_port_del(struct gtphub_peer_port *pp)
  * Return -1 on error. */
 static int gtphub_resolve_ggsn(struct gtphub *hub,
 			       struct gtp_packet_desc *p,
-			       struct gtphub_peer_port **pp);
+			       struct gtphub_peer_port **pp,
+			       struct llist_head **parked);
+static void gtphub_park(struct gtphub *hub, struct llist_head *parked,
+			struct gtp_packet_desc *p,
+			struct gtphub_peer_port *from_peer);
 
-/* See gtphub_ext.c (wrapped by unit test) */
+/* See gtphub_ares.c (wrapped by unit test). If the GGSN is not known yet and
+ * a DNS query is pending, return NULL and set *parked to a list to park the
+ * request in until the query concludes, see gtphub_parked_forward(). */
 struct gtphub_peer_port *gtphub_resolve_ggsn_addr(struct gtphub *hub,
 						  const char *imsi_str,
-						  const char *apn_ni_str);
+						  const char *apn_ni_str,
+						  struct llist_head **parked);
 int gtphub_ares_init(struct gtphub *hub);
 
+/* Return this worker's slice of the number range [0, range_len - 1], as used
+ * for mapped TEIs and sequence numbers. Numbers of worker w are those with
+ * nr / (range_len / workers) == w, which gtphub_steer_workers() relies on;
+ * the last worker also gets the remainder of the range. */
+static void gtphub_worker_slice(const struct gtphub *hub, uint64_t range_len,
+				uint32_t *nr_min, uint32_t *nr_max)
+{
+	unsigned int workers = hub->workers ? hub->workers : 1;
+	uint64_t slice = range_len / workers;
+
+	*nr_min = slice * hub->worker_id;
+	if (hub->worker_id == workers - 1)
+		*nr_max = range_len - 1;
+	else
+		*nr_max = slice * (hub->worker_id + 1) - 1;
+}
+
 static void gtphub_zero(struct gtphub *hub)
 {
 	ZERO_STRUCT(hub);
 	INIT_LLIST_HEAD(&hub->ggsn_lookups);
+	hash_index_init(&hub->ggsn_lookups_by_apn_oi);
 	INIT_LLIST_HEAD(&hub->resolved_ggsns);
+	hash_index_init(&hub->resolved_ggsns_by_apn_oi);
 }
 
+/* Bind a new socket to addr, or use the already bound socket fd if fd >= 0. */
 static int gtphub_sock_init(struct osmo_fd *ofd,
 			    const struct gtphub_cfg_addr *addr,
 			    osmo_fd_cb_t cb,
 			    void *data,
-			    int ofd_id)
+			    int ofd_id,
+			    int fd)
 {
 	if (!addr->addr_str) {
 		LOG(LOGL_FATAL, "Cannot bind: empty address.\n");
@@ -859,6 +1270,12 @@ static int gtphub_sock_init(struct osmo_fd *ofd,
 	ofd->priv_nr = ofd_id;
 
 	int rc;
+	if (fd >= 0) {
+		ofd->fd = fd;
+		rc = osmo_fd_register(ofd);
+		return rc ? -1 : 0;
+	}
+
 	rc = osmo_sock_init_ofd(ofd,
 				AF_UNSPEC, SOCK_DGRAM, IPPROTO_UDP,
 				addr->addr_str, addr->port,
@@ -884,16 +1301,24 @@ static void gtphub_bind_init(struct gtphub_bind *b, uint32_t idx)
 	ZERO_STRUCT(b);
 
 	INIT_LLIST_HEAD(&b->peers);
+	INIT_LLIST_HEAD(&b->gc_ports);
+	INIT_LLIST_HEAD(&b->gc_peers);
+	hash_index_init(&b->addrs_by_addr);
+	hash_index_init(&b->ports_by_addr);
 
 	b->counters_io = rate_ctr_group_alloc(osmo_gtphub_ctx,
 					      &gtphub_ctrg_io_desc, idx);
 	OSMO_ASSERT(b->counters_io);
+
+	b->counters_batch = rate_ctr_group_alloc(osmo_gtphub_ctx,
+						 &gtphub_ctrg_batch_desc, idx);
+	OSMO_ASSERT(b->counters_batch);
 }
 
 static int gtphub_bind_start(struct gtphub_bind *b,
 			     const struct gtphub_cfg_bind *cfg,
 			     osmo_fd_cb_t cb, void *cb_data,
-			     unsigned int ofd_id)
+			     unsigned int ofd_id, int fd)
 {
 	LOG(LOGL_DEBUG, "Starting bind %s\n", b->label);
 	if (gsn_addr_from_str(&b->local_addr, cfg->bind.addr_str) != 0) {
@@ -901,7 +1326,7 @@ static int gtphub_bind_start(struct gtphub_bind *b,
 		    b->label, cfg->bind.addr_str);
 		return -1;
 	}
-	if (gtphub_sock_init(&b->ofd, &cfg->bind, cb, cb_data, ofd_id) != 0) {
+	if (gtphub_sock_init(&b->ofd, &cfg->bind, cb, cb_data, ofd_id, fd) != 0) {
 		LOG(LOGL_FATAL, "Cannot bind for %s: %s\n",
 		    b->label, cfg->bind.addr_str);
 		return -1;
@@ -913,8 +1338,14 @@ static int gtphub_bind_start(struct gtphub_bind *b,
 static void gtphub_bind_free(struct gtphub_bind *b)
 {
 	OSMO_ASSERT(llist_empty(&b->peers));
+	OSMO_ASSERT(llist_empty(&b->gc_ports));
+	OSMO_ASSERT(llist_empty(&b->gc_peers));
+	OSMO_ASSERT(b->addrs_by_addr.count == 0);
+	OSMO_ASSERT(b->ports_by_addr.count == 0);
 	if (b->counters_io)
 		rate_ctr_group_free(b->counters_io);
+	if (b->counters_batch)
+		rate_ctr_group_free(b->counters_batch);
 }
 
 static void gtphub_bind_stop(struct gtphub_bind *b) {
@@ -922,37 +1353,193 @@ static void gtphub_bind_stop(struct gtphub_bind *b) {
 	gtphub_bind_free(b);
 }
 
-/* Recv datagram from from->fd, write sender's address to *from_addr.
- * Return the number of bytes read, zero on error. */
-static int gtphub_read(const struct osmo_fd *from,
-		       struct osmo_sockaddr *from_addr,
-		       uint8_t *buf, size_t buf_len)
+#define GTPH_BUF_LEN 4096
+
+/* Buffers to read a batch of datagrams with one recvmmsg() call and to collect
+ * the resulting outgoing datagrams for sendmmsg(), allocated once in
+ * gtphub_start(). */
+struct gtphub_batch {
+	unsigned int size;
+	struct mmsghdr *msgs;
+	struct iovec *iovs;
+	struct osmo_sockaddr *from_addrs;
+	uint8_t (*bufs)[GTPH_BUF_LEN];
+
+	/* Outgoing datagrams, in the order they were produced. */
+	unsigned int out_n;
+	struct gtphub_out *out;
+	struct osmo_fd **out_ofd;
+	/* Scratch space to group out[] by destination socket. */
+	struct gtphub_out *flush;
+};
+
+static struct gtphub_batch *gtphub_batch_alloc(unsigned int size)
+{
+	struct gtphub_batch *batch;
+	batch = talloc_zero(osmo_gtphub_ctx, struct gtphub_batch);
+	OSMO_ASSERT(batch);
+
+	batch->size = size;
+	batch->msgs = talloc_zero_array(batch, struct mmsghdr, size);
+	batch->iovs = talloc_zero_array(batch, struct iovec, size);
+	batch->from_addrs = talloc_zero_array(batch, struct osmo_sockaddr, size);
+	batch->bufs = talloc_size(batch, size * GTPH_BUF_LEN);
+	batch->out = talloc_zero_array(batch, struct gtphub_out, size);
+	batch->out_ofd = talloc_zero_array(batch, struct osmo_fd *, size);
+	batch->flush = talloc_zero_array(batch, struct gtphub_out, size);
+	OSMO_ASSERT(batch->msgs && batch->iovs && batch->from_addrs
+		    && batch->bufs && batch->out && batch->out_ofd
+		    && batch->flush);
+	return batch;
+}
+
+/* Recv up to batch->size datagrams from from->fd into batch->bufs, with the
+ * senders' addresses in batch->from_addrs. Return the number of datagrams
+ * read, zero on error. Truncated datagrams are returned with a zero msg_len
+ * and are to be skipped. */
+static int gtphub_read_batch(const struct osmo_fd *from,
+			     struct gtphub_batch *batch,
+			     struct gtphub_bind *from_bind)
 {
-	OSMO_ASSERT(from_addr);
+	unsigned int i;
+	int received;
+
+	for (i = 0; i < batch->size; i++) {
+		batch->iovs[i] = (struct iovec){
+			.iov_base = batch->bufs[i],
+			.iov_len = GTPH_BUF_LEN,
+		};
+		batch->msgs[i] = (struct mmsghdr){
+			.msg_hdr = {
+				.msg_name = &batch->from_addrs[i].a,
+				.msg_namelen = sizeof(batch->from_addrs[i].a),
+				.msg_iov = &batch->iovs[i],
+				.msg_iovlen = 1,
+			},
+		};
+	}
 
-	/* recvfrom requires the available length set in *from_addr_len. */
-	from_addr->l = sizeof(from_addr->a);
 	errno = 0;
-	ssize_t received = recvfrom(from->fd, buf, buf_len, 0,
-				    (struct sockaddr*)&from_addr->a,
-				    &from_addr->l);
-	/* TODO use recvmsg and get a MSG_TRUNC flag to make sure the message
-	 * is not truncated. Then maybe reduce buf's size. */
-
+	received = recvmmsg(from->fd, batch->msgs, batch->size, MSG_DONTWAIT,
+			    NULL);
 	if (received <= 0) {
 		LOG((errno == EAGAIN? LOGL_DEBUG : LOGL_ERROR),
 		    "error: %s\n", strerror(errno));
 		return 0;
 	}
 
-	LOG(LOGL_DEBUG, "Received %d bytes from %s: %s%s\n",
-	    (int)received, osmo_sockaddr_to_str(from_addr),
-	    osmo_hexdump(buf, received > 1000? 1000 : received),
-	    received > 1000 ? "..." : "");
+	rate_ctr_inc(&from_bind->counters_batch->ctr[GTPH_CTR_RX_BATCHES]);
+
+	for (i = 0; i < received; i++) {
+		struct mmsghdr *m = &batch->msgs[i];
+		struct osmo_sockaddr *from_addr = &batch->from_addrs[i];
+		from_addr->l = m->msg_hdr.msg_namelen;
+
+		if (m->msg_hdr.msg_flags & MSG_TRUNC) {
+			LOG(LOGL_ERROR, "Dropping truncated datagram from %s"
+			    " (more than %d bytes)\n",
+			    osmo_sockaddr_to_str(from_addr), GTPH_BUF_LEN);
+			rate_ctr_inc(&from_bind->counters_batch->ctr[GTPH_CTR_RX_TRUNCATED]);
+			m->msg_len = 0;
+			continue;
+		}
+
+		LOG(LOGL_DEBUG, "Received %d bytes from %s: %s%s\n",
+		    (int)m->msg_len, osmo_sockaddr_to_str(from_addr),
+		    osmo_hexdump(batch->bufs[i],
+				 m->msg_len > 1000? 1000 : m->msg_len),
+		    m->msg_len > 1000 ? "..." : "");
+	}
 
 	return received;
 }
 
+/* Send all datagrams collected in batch->out, with one sendmmsg() batch per
+ * destination socket. Datagrams to the same socket keep their order. */
+static void gtphub_flush_batch(struct gtphub_batch *batch)
+{
+	unsigned int i;
+	unsigned int j;
+
+	for (i = 0; i < batch->out_n; i++) {
+		struct osmo_fd *to_ofd = batch->out_ofd[i];
+		unsigned int n = 0;
+		int sent;
+
+		if (!to_ofd)
+			continue;
+
+		for (j = i; j < batch->out_n; j++) {
+			if (batch->out_ofd[j] != to_ofd)
+				continue;
+			batch->flush[n++] = batch->out[j];
+			batch->out_ofd[j] = NULL;
+		}
+
+		sent = gtphub_write_batch(to_ofd, batch->flush, n);
+
+		struct gtphub_bind *to_bind = container_of(to_ofd,
+							   struct gtphub_bind,
+							   ofd);
+		rate_ctr_inc(&to_bind->counters_batch->ctr[GTPH_CTR_TX_BATCHES]);
+		if (sent < n)
+			rate_ctr_add(&to_bind->counters_batch->ctr[GTPH_CTR_TX_ERRORS],
+				     n - sent);
+	}
+	batch->out_n = 0;
+}
+
+/* Drain up to one batch of datagrams from the given bind, handle each and send
+ * the results. */
+static int gtphub_read_and_handle(struct gtphub *hub,
+				  struct osmo_fd *from_ofd,
+				  unsigned int side_idx,
+				  unsigned int plane_idx)
+{
+	struct gtphub_batch *batch = hub->batch;
+	struct gtphub_bind *from_bind = &hub->to_gsns[side_idx][plane_idx];
+	time_t now = gtphub_now();
+	int received;
+	int i;
+
+	received = gtphub_read_batch(from_ofd, batch, from_bind);
+
+	for (i = 0; i < received; i++) {
+		struct osmo_sockaddr to_addr;
+		struct osmo_fd *to_ofd;
+		uint8_t *reply_buf;
+		int len;
+
+		if (!batch->msgs[i].msg_len)
+			continue;
+
+		len = gtphub_handle_buf(hub, side_idx, plane_idx,
+					&batch->from_addrs[i],
+					batch->bufs[i], batch->msgs[i].msg_len,
+					now, &reply_buf, &to_ofd, &to_addr);
+		if (len < 1)
+			continue;
+
+		/* Echo responses are composed in a static buffer, which the
+		 * next packet may overwrite. */
+		if (reply_buf != batch->bufs[i]) {
+			OSMO_ASSERT(len <= GTPH_BUF_LEN);
+			memcpy(batch->bufs[i], reply_buf, len);
+		}
+
+		batch->out[batch->out_n] = (struct gtphub_out){
+			.buf = batch->bufs[i],
+			.len = len,
+		};
+		osmo_sockaddr_copy(&batch->out[batch->out_n].to_addr, &to_addr);
+		batch->out_ofd[batch->out_n] = to_ofd;
+		batch->out_n ++;
+	}
+
+	gtphub_flush_batch(batch);
+	return 0;
+}
+
 static inline void gtphub_port_ref_count_inc(struct gtphub_peer_port *pp)
 {
 	OSMO_ASSERT(pp);
@@ -960,11 +1547,21 @@ static inline void gtphub_port_ref_count_inc(struct gtphub_peer_port *pp)
 	pp->ref_count++;
 }
 
+/* Have gtphub_gc() look at an unreferenced port. */
+static void gtphub_port_gc_candidate(struct gtphub_peer_port *pp)
+{
+	if (llist_empty(&pp->gc_entry))
+		llist_add_tail(&pp->gc_entry,
+			       &pp->peer_addr->peer->bind->gc_ports);
+}
+
 static inline void gtphub_port_ref_count_dec(struct gtphub_peer_port *pp)
 {
 	OSMO_ASSERT(pp);
 	OSMO_ASSERT(pp->ref_count > 0);
 	pp->ref_count--;
+	if (!pp->ref_count)
+		gtphub_port_gc_candidate(pp);
 }
 
 static inline void set_seq(struct gtp_packet_desc *p, uint16_t seq)
@@ -985,13 +1582,14 @@ static void gtphub_mapping_del_cb(struct expiring_item *expi);
 
 static struct nr_mapping *gtphub_mapping_new()
 {
-	struct nr_mapping *nrm;
-	nrm = talloc_zero(osmo_gtphub_ctx, struct nr_mapping);
-	OSMO_ASSERT(nrm);
-
-	nr_mapping_init(nrm);
-	nrm->expiry_entry.del_cb = gtphub_mapping_del_cb;
-	return nrm;
+	struct gtphub_seq_mapping *sm;
+	sm = talloc_zero(osmo_gtphub_ctx, struct gtphub_seq_mapping);
+	OSMO_ASSERT(sm);
+
+	nr_mapping_init(&sm->nrm);
+	sm->nrm.expiry_entry.del_cb = gtphub_mapping_del_cb;
+	hash_index_entry_init(&sm->req_hash);
+	return &sm->nrm;
 }
 
 
@@ -1081,6 +1679,9 @@ int gtphub_tunnel_complete(struct gtphub_tunnel *tun)
 	return 1;
 }
 
+static void gtphub_journal_tunnel(struct gtphub_tunnel *tun);
+static void gtphub_journal_tunnel_del(struct gtphub_tunnel *tun);
+
 static void gtphub_tunnel_del_cb(struct expiring_item *expi)
 {
 	struct gtphub_tunnel *tun = container_of(expi,
@@ -1088,8 +1689,11 @@ static void gtphub_tunnel_del_cb(struct expiring_item *expi)
 						 expiry_entry);
 	LOG(LOGL_DEBUG, "expired: %s\n", gtphub_tunnel_str(tun));
 
+	gtphub_journal_tunnel_del(tun);
+
 	llist_del(&tun->entry);
 	INIT_LLIST_HEAD(&tun->entry); /* mark unused */
+	hash_index_del(&tun->tei_repl_hash);
 
 	expi->del_cb = 0; /* avoid recursion loops */
 	expiring_item_del(&tun->expiry_entry); /* usually already done, but make sure. */
@@ -1099,10 +1703,10 @@ static void gtphub_tunnel_del_cb(struct expiring_item *expi)
 	for_each_side_and_plane(side_idx, plane_idx) {
 		struct gtphub_tunnel_endpoint *te = &tun->endpoint[side_idx][plane_idx];
 
+		hash_index_del(&te->tei_orig_hash);
+
 		/* clear ref count */
 		gtphub_tunnel_endpoint_set_peer(te, NULL);
-
-		rate_ctr_group_free(te->counters_io);
 	}
 
 	talloc_free(tun);
@@ -1110,29 +1714,25 @@ static void gtphub_tunnel_del_cb(struct expiring_item *expi)
 
 #define CTR_IDX(s, p, a, b) (a + s + (p + b) * 2)
 
-/* rate counter index for tunnels: [3; 6] */
-#define CTR_IDX_TUN(s, p) CTR_IDX(s, p, 1, 1)
-
-/* rate counter index for hubs: [7; 10] */
+/* rate counter index for hubs: [7; 10] (formerly after tunnels' [3; 6]) */
 #define CTR_IDX_HUB(s, p) CTR_IDX(s, p, 3, 2)
 
-static struct gtphub_tunnel *gtphub_tunnel_new()
+static struct gtphub_tunnel *gtphub_tunnel_new(struct gtphub *hub)
 {
 	struct gtphub_tunnel *tun;
 	tun = talloc_zero(osmo_gtphub_ctx, struct gtphub_tunnel);
 	OSMO_ASSERT(tun);
+	tun->hub = hub;
 
 	INIT_LLIST_HEAD(&tun->entry);
 	expiring_item_init(&tun->expiry_entry);
+	hash_index_entry_init(&tun->tei_repl_hash);
 
 	int side_idx, plane_idx;
 	for_each_side_and_plane(side_idx, plane_idx) {
 		struct gtphub_tunnel_endpoint *te = &tun->endpoint[side_idx][plane_idx];
-		te->counters_io = rate_ctr_group_alloc(osmo_gtphub_ctx,
-						       &gtphub_ctrg_io_desc,
-						       CTR_IDX_TUN(side_idx, plane_idx));
-		if (!te->counters_io)
-			return NULL;
+		te->tun = tun;
+		hash_index_entry_init(&te->tei_orig_hash);
 	}
 
 	tun->expiry_entry.del_cb = gtphub_tunnel_del_cb;
@@ -1189,8 +1789,9 @@ static void gtphub_mapping_del_cb(struct expiring_item *expi)
 	struct nr_mapping *nrm = container_of(expi,
 					      struct nr_mapping,
 					      expiry_entry);
-	llist_del(&nrm->entry);
-	INIT_LLIST_HEAD(&nrm->entry); /* mark unused */
+	nr_mapping_unlink(nrm); /* also marks unused */
+	hash_index_del(&container_of(nrm, struct gtphub_seq_mapping,
+				     nrm)->req_hash);
 
 	/* Just for log */
 	struct gtphub_peer_port *from = nrm->origin;
@@ -1231,9 +1832,9 @@ static struct nr_mapping *gtphub_mapping_have(struct nr_map *map,
 	return nrm;
 }
 
-static void gtphub_map_seq(struct gtp_packet_desc *p,
-			   struct gtphub_peer_port *from_port,
-			   struct gtphub_peer_port *to_port)
+static struct nr_mapping *gtphub_map_seq(struct gtp_packet_desc *p,
+					 struct gtphub_peer_port *from_port,
+					 struct gtphub_peer_port *to_port)
 {
 	/* Store a mapping in to_peer's map, so when we later receive a GTP
 	 * packet back from to_peer, the seq nr can be unmapped back to its
@@ -1244,6 +1845,7 @@ static void gtphub_map_seq(struct gtp_packet_desc *p,
 
 	/* Change the GTP packet to yield the new, mapped seq nr */
 	set_seq(p, nrm->repl);
+	return nrm;
 }
 
 static struct gtphub_peer_port *gtphub_unmap_seq(struct gtp_packet_desc *p,
@@ -1258,115 +1860,203 @@ static struct gtphub_peer_port *gtphub_unmap_seq(struct gtp_packet_desc *p,
 	LOG(LOGL_DEBUG, "peer %p: sequence unmap %d <-- %d\n",
 	    nrm->origin, (int)(nrm->orig), (int)(nrm->repl));
 	set_seq(p, nrm->orig);
+	p->seq_map = container_of(nrm, struct gtphub_seq_mapping, nrm);
 	return nrm->origin;
 }
 
-static int gtphub_check_mapped_tei(struct gtphub_tunnel *new_tun,
-				   struct gtphub_tunnel *iterated_tun,
-				   uint32_t *tei_min,
-				   uint32_t *tei_max)
+/* Keep a copy of the response p, as forwarded, to replay it when its request
+ * is retransmitted. */
+static void gtphub_seq_store_rsp(struct gtp_packet_desc *p)
 {
-	if (!new_tun->tei_repl || !iterated_tun->tei_repl)
-		return 1;
-
-	*tei_min = (*tei_min < iterated_tun->tei_repl)? *tei_min : iterated_tun->tei_repl;
-	*tei_max = (*tei_max > iterated_tun->tei_repl)? *tei_max : iterated_tun->tei_repl;
-
-	if (new_tun->tei_repl != iterated_tun->tei_repl)
-		return 1;
+	struct gtphub_seq_mapping *sm = p->seq_map;
 
-	/* new_tun->tei_repl is already taken. Try to find one out of the known
-	 * range. */
-	LOG(LOGL_DEBUG, "TEI replacement %d already taken.\n", new_tun->tei_repl);
+	talloc_free(sm->rsp);
+	sm->rsp = talloc_memdup(sm, p->data, p->data_len);
+	OSMO_ASSERT(sm->rsp);
+	sm->rsp_len = p->data_len;
+}
 
-	if ((*tei_max) < 0xffffffff) {
-		(*tei_max)++;
-		new_tun->tei_repl = *tei_max;
-		LOG(LOGL_DEBUG, "Using TEI %d instead.\n", new_tun->tei_repl);
-		return 1;
-	} else if ((*tei_min) > 1) {
-		(*tei_min)--;
-		new_tun->tei_repl = *tei_min;
-		LOG(LOGL_DEBUG, "Using TEI %d instead.\n", new_tun->tei_repl);
-		return 1;
+/* Remember the Ctrl request p, which was forwarded using the seq mapping nrm
+ * (p->seq still is the orig seq nr), to recognize its retransmissions. */
+static void gtphub_seq_track_req(struct gtphub *hub,
+				 struct gtp_packet_desc *p,
+				 struct nr_mapping *nrm,
+				 uint16_t orig_seq)
+{
+	struct gtphub_seq_mapping *sm;
+	sm = container_of(nrm, struct gtphub_seq_mapping, nrm);
+
+	/* A new request reusing the mapping must not get the response that
+	 * was cached for the previous one. */
+	if (sm->req_type != p->type || sm->req_digest != p->digest) {
+		talloc_free(sm->rsp);
+		sm->rsp = NULL;
+		sm->rsp_len = 0;
 	}
 
-	/* None seems to be available. */
-	return 0;
+	sm->req_type = p->type;
+	sm->req_digest = p->digest;
+	if (!sm->req_hash.idx)
+		hash_index_add(&hub->seq_reqs, &sm->req_hash,
+			       nr_mapping_orig_hash(nrm->origin, orig_seq));
 }
 
-static int gtphub_check_reused_teis(struct gtphub *hub,
-				    struct gtphub_tunnel *new_tun)
+/* Return the seq mapping if the Ctrl request p from from_peer was already
+ * forwarded, i.e. p is a retransmission, or NULL if p is new. */
+static struct gtphub_seq_mapping *gtphub_seq_find_req(struct gtphub *hub,
+						      const struct gtp_packet_desc *p,
+						      struct gtphub_peer_port *from_peer)
 {
-	uint32_t tei_min = 0xffffffff;
-	uint32_t tei_max = 0;
-	int side_idx;
+	struct gtphub_seq_mapping *sm;
+	hash_index_for_each_possible(&hub->seq_reqs, sm, req_hash,
+				     nr_mapping_orig_hash(from_peer, p->seq)) {
+		/* The digest also tells apart a new request that reuses the
+		 * seq nr, e.g. towards another GGSN. */
+		if (sm->nrm.origin == from_peer
+		    && sm->nrm.orig == p->seq
+		    && sm->req_type == p->type
+		    && sm->req_digest == p->digest)
+			return sm;
+	}
+	return NULL;
+}
+
+/* (Re-)index tun in hub->tunnels_by_tei, to be called whenever tun->tei_repl
+ * was set. */
+static void gtphub_tunnel_index_tei(struct gtphub *hub,
+				    struct gtphub_tunnel *tun)
+{
+	hash_index_del(&tun->tei_repl_hash);
+	hash_index_add(&hub->tunnels_by_tei, &tun->tei_repl_hash,
+		       hash_u32(tun->tei_repl));
+}
+
+static struct gtphub_tunnel *gtphub_tunnel_find_tei_repl(struct gtphub *hub,
+							 uint32_t tei_repl)
+{
+	struct gtphub_tunnel *tun;
+	hash_index_for_each_possible(&hub->tunnels_by_tei, tun, tei_repl_hash,
+				     hash_u32(tei_repl)) {
+		if (tun->tei_repl == tei_repl)
+			return tun;
+	}
+	return NULL;
+}
+
+static int gtphub_tei_repl_taken(struct gtphub *hub, uint32_t tei_repl)
+{
+	return gtphub_tunnel_find_tei_repl(hub, tei_repl) != NULL;
+}
+
+/* Return the next TEI from hub->tei_pool that no tunnel is using, or 0 if all
+ * TEIs are taken. */
+static uint32_t gtphub_tei_repl_alloc(struct gtphub *hub)
+{
+	struct nr_pool *pool = &hub->tei_pool;
+	uint64_t range = (uint64_t)pool->nr_max - pool->nr_min + 1;
+	uint64_t i;
+
+	if (hub->tunnels_by_tei.count >= range)
+		return 0;
+
+	/* Usually the first one is free. Only after the pool wrapped, skip
+	 * TEIs of tunnels that are still alive. */
+	for (i = 0; i < range; i++) {
+		uint32_t tei_repl = nr_pool_next(pool);
+		if (!gtphub_tei_repl_taken(hub, tei_repl))
+			return tei_repl;
+		LOG(LOGL_DEBUG, "TEI replacement %d already taken.\n", tei_repl);
+	}
+	return 0;
+}
+
+static uint32_t gtphub_tei_orig_hash(const struct gsn_addr *addr,
+				     uint32_t tei_orig)
+{
+	return hash_buf(hash_u32(tei_orig), addr->buf, addr->len);
+}
+
+/* (Re-)index tun->endpoint[side_idx][plane_idx] in hub->endpoints_by_tei_orig,
+ * to be called whenever its peer or tei_orig was set. */
+static void gtphub_tunnel_endpoint_index(struct gtphub *hub,
+					 struct gtphub_tunnel *tun,
+					 int side_idx, int plane_idx)
+{
+	struct gtphub_tunnel_endpoint *te = &tun->endpoint[side_idx][plane_idx];
+
+	hash_index_del(&te->tei_orig_hash);
+	if (!te->tei_orig || !te->peer)
+		return;
+	hash_index_add(&hub->endpoints_by_tei_orig[side_idx][plane_idx],
+		       &te->tei_orig_hash,
+		       gtphub_tei_orig_hash(&te->peer->peer_addr->addr,
+					    te->tei_orig));
+}
+
+/* Return a tunnel other than not_tun that has the same peer address and
+ * tei_orig on the given side and plane as te, or NULL if there is none. */
+static struct gtphub_tunnel *gtphub_tunnel_find_tei_orig(struct gtphub *hub,
+							 int side_idx,
+							 int plane_idx,
+							 struct gtphub_tunnel_endpoint *te,
+							 struct gtphub_tunnel *not_tun)
+{
+	const struct gsn_addr *addr = &te->peer->peer_addr->addr;
+	struct gtphub_tunnel_endpoint *te2;
+	hash_index_for_each_possible(&hub->endpoints_by_tei_orig[side_idx][plane_idx],
+				     te2, tei_orig_hash,
+				     gtphub_tei_orig_hash(addr, te->tei_orig)) {
+		if ((te2->tun == not_tun)
+		    || (te2->tei_orig != te->tei_orig)
+		    || (!te2->peer)
+		    || !gsn_addr_same(&te2->peer->peer_addr->addr, addr))
+			continue;
+		return te2->tun;
+	}
+	return NULL;
+}
+
+static void gtphub_check_reused_teis(struct gtphub *hub,
+				     struct gtphub_tunnel *new_tun)
+{
+	int side_idx;
 	int plane_idx;
 	struct gtphub_tunnel_endpoint *te;
 	struct gtphub_tunnel_endpoint *te2;
+	struct gtphub_tunnel *tun;
 
-	struct gtphub_tunnel *tun, *ntun;
-
-	llist_for_each_entry_safe(tun, ntun, &hub->tunnels, entry) {
-		if (tun == new_tun)
+	/* Check whether a GSN sent a TEI that it is reusing from a previous
+	 * tunnel. */
+	for_each_side_and_plane(side_idx, plane_idx) {
+		te2 = &new_tun->endpoint[side_idx][plane_idx];
+		if (!te2->tei_orig || !te2->peer)
 			continue;
 
-		/* Check whether the GSN sent a TEI that it is reusing from a
-		 * previous tunnel. */
-		int tun_continue = 0;
-		for_each_side(side_idx) {
-			for_each_plane(plane_idx) {
-				te = &tun->endpoint[side_idx][plane_idx];
-				te2 = &new_tun->endpoint[side_idx][plane_idx];
-				if ((te->tei_orig == 0)
-				    || (te->tei_orig != te2->tei_orig)
-				    || (!te->peer)
-				    || (!te2->peer)
-				    || !gsn_addr_same(&te->peer->peer_addr->addr,
-						      &te2->peer->peer_addr->addr))
-					continue;
-
-				/* The peer is reusing a TEI that I believe to
-				 * be part of another tunnel. The other tunnel
-				 * must be stale, then. */
-				LOG(LOGL_NOTICE,
-				    "Expiring tunnel due to reused TEI:"
-				    " %s peer %s sent %s TEI %x,"
-				    " previously used by tunnel %s...\n",
-				    gtphub_side_idx_names[side_idx],
-				    gtphub_port_str(te->peer),
-				    gtphub_plane_idx_names[plane_idx],
-				    te->tei_orig,
-				    gtphub_tunnel_str(tun));
-				LOG(LOGL_NOTICE, "...while establishing tunnel %s\n",
-				    gtphub_tunnel_str(new_tun));
-
-				expiring_item_del(&tun->expiry_entry);
-				/* continue to find more matches. There shouldn't be
-				 * any, but let's make sure. However, tun is deleted,
-				 * so we need to skip to the next tunnel. */
-				tun_continue = 1;
-				break;
-			}
-			if (tun_continue)
-				break;
-		}
-		if (tun_continue)
-			continue;
+		/* There shouldn't be more than one match, but let's make
+		 * sure. Expiring tun removes it from the index. */
+		while ((tun = gtphub_tunnel_find_tei_orig(hub, side_idx,
+							  plane_idx, te2,
+							  new_tun))) {
+			te = &tun->endpoint[side_idx][plane_idx];
 
-		/* Check whether the mapped TEI is already used by another
-		 * tunnel. */
-		if (!gtphub_check_mapped_tei(new_tun, tun, &tei_min, &tei_max)) {
-			LOG(LOGL_ERROR,
-			    "No mapped TEI is readily available."
-			    " Searching for holes between occupied"
-			    " TEIs not implemented.");
-			return 0;
-		}
+			/* The peer is reusing a TEI that I believe to be part
+			 * of another tunnel. The other tunnel must be stale,
+			 * then. */
+			LOG(LOGL_NOTICE,
+			    "Expiring tunnel due to reused TEI:"
+			    " %s peer %s sent %s TEI %x,"
+			    " previously used by tunnel %s...\n",
+			    gtphub_side_idx_names[side_idx],
+			    gtphub_port_str(te->peer),
+			    gtphub_plane_idx_names[plane_idx],
+			    te->tei_orig,
+			    gtphub_tunnel_str(tun));
+			LOG(LOGL_NOTICE, "...while establishing tunnel %s\n",
+			    gtphub_tunnel_str(new_tun));
 
+			expiring_item_del(&tun->expiry_entry);
+		}
 	}
-
-	return 1;
 }
 
 static void gtphub_tunnel_refresh(struct gtphub *hub,
@@ -1385,9 +2075,11 @@ static struct gtphub_tunnel_endpoint *gtphub_unmap_tei(struct gtphub *hub,
 {
 	OSMO_ASSERT(from);
 	int other_side = other_side_idx(p->side_idx);
+	uint32_t hash = hash_u32(p->header_tei_rx);
 
 	struct gtphub_tunnel *tun;
-	llist_for_each_entry(tun, &hub->tunnels, entry) {
+	hash_index_for_each_possible(&hub->tunnels_by_tei, tun, tei_repl_hash,
+				     hash) {
 		struct gtphub_tunnel_endpoint *te_from =
 			&tun->endpoint[p->side_idx][p->plane_idx];
 		struct gtphub_tunnel_endpoint *te_to =
@@ -1414,13 +2106,11 @@ static void gtphub_map_restart_counter(struct gtphub *hub,
 	if (p->rc != GTP_RC_PDU_C)
 		return;
 
-	int ie_idx;
-	ie_idx = gtpie_getie(p->ie, GTPIE_RECOVERY, 0);
-	if (ie_idx < 0)
+	if (!p->ie[GTP_IE_RECOVERY])
 		return;
 
 	/* Always send gtphub's own restart counter */
-	p->ie[ie_idx]->tv1.v = hton8(hub->restart_counter);
+	p->ie[GTP_IE_RECOVERY]->tv1.v = hton8(hub->restart_counter);
 }
 
 static int gtphub_unmap_header_tei(struct gtphub_peer_port **to_port_p,
@@ -1496,7 +2186,7 @@ static int gtphub_handle_create_pdp_ctx(struct gtphub *hub,
 		}
 
 		/* A new tunnel. */
-		tun = gtphub_tunnel_new();
+		tun = gtphub_tunnel_new(hub);
 		if (!tun) {
 			LOG(LOGL_ERROR, "Failed to allocate new tunnel %s <-> %s\n",
 			    gtphub_port_str(from_ctrl), gtphub_port_str(to_ctrl));
@@ -1505,9 +2195,18 @@ static int gtphub_handle_create_pdp_ctx(struct gtphub *hub,
 		p->tun = tun;
 
 		/* Create TEI mapping */
-		tun->tei_repl = nr_pool_next(&hub->tei_pool);
+		tun->tei_repl = gtphub_tei_repl_alloc(hub);
+		if (!tun->tei_repl) {
+			LOG(LOGL_ERROR, "TEI range exhausted, cannot create"
+			    " tunnel %s <-> %s\n",
+			    gtphub_port_str(from_ctrl), gtphub_port_str2(to_ctrl));
+			p->tun = NULL;
+			expiring_item_del(&tun->expiry_entry);
+			return -1;
+		}
 
 		llist_add(&tun->entry, &hub->tunnels);
+		gtphub_tunnel_index_tei(hub, tun);
 		gtphub_tunnel_refresh(hub, tun, p->timestamp);
 		/* The endpoint peers on this side (SGSN) will be set from IEs
 		 * below. Also set the GGSN Ctrl endpoint, for logging. */
@@ -1530,6 +2229,7 @@ static int gtphub_handle_create_pdp_ctx(struct gtphub *hub,
 	}
 
 	uint8_t ie_type[] = { GTPIE_TEI_C, GTPIE_TEI_DI };
+	enum gtp_ie_idx ie_idx[] = { GTP_IE_TEI_C, GTP_IE_TEI_DI };
 	int ie_mandatory = (p->type == GTP_CREATE_PDP_REQ);
 	unsigned int side_idx = p->side_idx;
 
@@ -1538,7 +2238,7 @@ static int gtphub_handle_create_pdp_ctx(struct gtphub *hub,
 		struct gsn_addr use_addr;
 		uint16_t use_port;
 		uint32_t tei_from_ie;
-		int ie_idx;
+		union gtpie_member *tei_ie;
 
 		/* Fetch GSN Address and TEI from IEs. As ensured by above
 		 * static asserts, plane_idx corresponds to the GSN Address IE
@@ -1554,8 +2254,8 @@ static int gtphub_handle_create_pdp_ctx(struct gtphub *hub,
 		    gsn_addr_to_str(&use_addr),
 		    use_addr.len);
 
-		ie_idx = gtpie_getie(p->ie, ie_type[plane_idx], 0);
-		if (ie_idx < 0) {
+		tei_ie = p->ie[ie_idx[plane_idx]];
+		if (!tei_ie) {
 			if (ie_mandatory) {
 				LOG(LOGL_ERROR,
 				    "Create PDP Context message invalid:"
@@ -1566,7 +2266,7 @@ static int gtphub_handle_create_pdp_ctx(struct gtphub *hub,
 			tei_from_ie = 0;
 		}
 		else
-			tei_from_ie = ntoh32(p->ie[ie_idx]->tv4.v);
+			tei_from_ie = ntoh32(tei_ie->tv4.v);
 
 		/* Make sure an entry for this peer address with default port
 		 * exists.
@@ -1612,20 +2312,14 @@ static int gtphub_handle_create_pdp_ctx(struct gtphub *hub,
 		if (tei_from_ie) {
 			/* Replace TEI in GTP packet IE */
 			tun->endpoint[side_idx][plane_idx].tei_orig = tei_from_ie;
-			p->ie[ie_idx]->tv4.v = hton32(tun->tei_repl);
-
-			if (!gtphub_check_reused_teis(hub, tun)) {
-				/* It's highly unlikely that all TEIs are
-				 * taken. But the code looking for an unused
-				 * TEI is, at the time of writing this comment,
-				 * not able to find gaps in the TEI space. To
-				 * explicitly alert the user of this problem,
-				 * rather abort than carry on. */
-				LOG(LOGL_FATAL, "TEI range exhausted. Cannot create TEI mapping, aborting.\n");
-				abort();
-			}
+			tei_ie->tv4.v = hton32(tun->tei_repl);
 		}
 
+		gtphub_tunnel_endpoint_index(hub, tun, side_idx, plane_idx);
+
+		if (tei_from_ie)
+			gtphub_check_reused_teis(hub, tun);
+
 		/* Replace the GSN address to reflect gtphub. */
 		rc = gsn_addr_put(&hub->to_gsns[other_side_idx(side_idx)][plane_idx].local_addr,
 				  p, plane_idx);
@@ -1687,12 +2381,12 @@ static int gtphub_handle_delete_pdp_ctx(struct gtphub *hub,
 		uint8_t teardown_ind;
 		uint8_t nsapi;
 
-		if (gtpie_gettv1(p->ie, GTPIE_TEARDOWN, 0, &teardown_ind) != 0) {
+		if (gtp_get_tv1(p, GTP_IE_TEARDOWN, &teardown_ind) != 0) {
 			LOG(LOGL_ERROR, "Missing Teardown Ind IE in Delete PDP Context Request.\n");
 			return -1;
 		}
 
-		if (gtpie_gettv1(p->ie, GTPIE_NSAPI, 0, &nsapi) != 0) {
+		if (gtp_get_tv1(p, GTP_IE_NSAPI, &nsapi) != 0) {
 			LOG(LOGL_ERROR, "Missing NSAPI IE in Delete PDP Context Request.\n");
 			return -1;
 		}
@@ -1753,7 +2447,7 @@ static int gtphub_handle_delete_pdp_ctx(struct gtphub *hub,
 		expiring_item_del(&pd->expiry_entry);
 
 		uint8_t cause;
-		if (gtpie_gettv1(p->ie, GTPIE_CAUSE, 0, &cause) != 0) {
+		if (gtp_get_tv1(p, GTP_IE_CAUSE, &cause) != 0) {
 			LOG(LOGL_ERROR, "Delete PDP Context Response:"
 			    " Missing Cause IE.");
 			/* If we delete the tunnel now, at least one of the
@@ -1798,11 +2492,17 @@ static int gtphub_handle_pdp_ctx(struct gtphub *hub,
 {
 	OSMO_ASSERT(p->plane_idx == GTPH_PLANE_CTRL);
 
+	int rc;
+
 	switch (p->type) {
 	case GTP_CREATE_PDP_REQ:
 	case GTP_CREATE_PDP_RSP:
-		return gtphub_handle_create_pdp_ctx(hub, p,
-						    from_ctrl, to_ctrl);
+		rc = gtphub_handle_create_pdp_ctx(hub, p,
+						  from_ctrl, to_ctrl);
+		/* Record the tunnel once the response completed it. */
+		if (rc == 0 && p->tun)
+			gtphub_journal_tunnel(p->tun);
+		return rc;
 
 	case GTP_DELETE_PDP_REQ:
 	case GTP_DELETE_PDP_RSP:
@@ -1901,6 +2601,7 @@ static void gtphub_restarted(struct gtphub *hub,
 							NULL);
 			gtphub_tunnel_endpoint_set_peer(&tun->endpoint[side_idx][GTPH_PLANE_USER],
 							NULL);
+			gtphub_journal_tunnel(tun);
 		}
 	}
 
@@ -1912,11 +2613,9 @@ static void gtphub_restarted(struct gtphub *hub,
 
 static int get_restart_count(struct gtp_packet_desc *p)
 {
-	int ie_idx;
-	ie_idx = gtpie_getie(p->ie, GTPIE_RECOVERY, 0);
-	if (ie_idx < 0)
+	if (!p->ie[GTP_IE_RECOVERY])
 		return -1;
-	return ntoh8(p->ie[ie_idx]->tv1.v);
+	return ntoh8(p->ie[GTP_IE_RECOVERY]->tv1.v);
 }
 
 static void gtphub_check_restart_counter(struct gtphub *hub,
@@ -1953,24 +2652,8 @@ static int from_sgsns_read_cb(struct osmo_fd *from_sgsns_ofd, unsigned int what)
 
 	struct gtphub *hub = from_sgsns_ofd->data;
 
-	static uint8_t buf[4096];
-	struct osmo_sockaddr from_addr;
-	struct osmo_sockaddr to_addr;
-	struct osmo_fd *to_ofd;
-	int len;
-	uint8_t *reply_buf;
-
-	len = gtphub_read(from_sgsns_ofd, &from_addr, buf, sizeof(buf));
-	if (len < 1)
-		return 0;
-
-	len = gtphub_handle_buf(hub, GTPH_SIDE_SGSN, plane_idx, &from_addr,
-				buf, len, gtphub_now(),
-				&reply_buf, &to_ofd, &to_addr);
-	if (len < 1)
-		return 0;
-
-	return gtphub_write(to_ofd, &to_addr, reply_buf, len);
+	return gtphub_read_and_handle(hub, from_sgsns_ofd, GTPH_SIDE_SGSN,
+				      plane_idx);
 }
 
 static int from_ggsns_read_cb(struct osmo_fd *from_ggsns_ofd, unsigned int what)
@@ -1984,24 +2667,8 @@ static int from_ggsns_read_cb(struct osmo_fd *from_ggsns_ofd, unsigned int what)
 
 	struct gtphub *hub = from_ggsns_ofd->data;
 
-	static uint8_t buf[4096];
-	struct osmo_sockaddr from_addr;
-	struct osmo_sockaddr to_addr;
-	struct osmo_fd *to_ofd;
-	int len;
-	uint8_t *reply_buf;
-
-	len = gtphub_read(from_ggsns_ofd, &from_addr, buf, sizeof(buf));
-	if (len < 1)
-		return 0;
-
-	len = gtphub_handle_buf(hub, GTPH_SIDE_GGSN, plane_idx, &from_addr,
-				buf, len, gtphub_now(),
-				&reply_buf, &to_ofd, &to_addr);
-	if (len < 1)
-		return 0;
-
-	return gtphub_write(to_ofd, &to_addr, reply_buf, len);
+	return gtphub_read_and_handle(hub, from_ggsns_ofd, GTPH_SIDE_GGSN,
+				      plane_idx);
 }
 
 static int gtphub_unmap(struct gtphub *hub,
@@ -2106,33 +2773,51 @@ static int gtphub_handle_echo_req(struct gtphub *hub, struct gtp_packet_desc *p,
 	return sizeof(echo_response_data);
 }
 
-struct gtphub_peer_port *gtphub_known_addr_have_port(const struct gtphub_bind *bind,
+struct gtphub_peer_port *gtphub_known_addr_have_port(struct gtphub_bind *bind,
 						     const struct osmo_sockaddr *addr);
 
-/* Parse buffer as GTP packet, replace elements in-place and return the ofd and
- * address to forward to. Return a pointer to the osmo_fd, but copy the
- * sockaddr to *to_addr. The reason for this is that the sockaddr may expire at
- * any moment, while the osmo_fd is guaranteed to persist. Return the number of
- * bytes to forward, 0 or less on failure. */
-int gtphub_handle_buf(struct gtphub *hub,
-		      unsigned int side_idx,
-		      unsigned int plane_idx,
-		      const struct osmo_sockaddr *from_addr,
-		      uint8_t *buf,
-		      size_t received,
-		      time_t now,
-		      uint8_t **reply_buf,
-		      struct osmo_fd **to_ofd,
-		      struct osmo_sockaddr *to_addr)
+/* Return 1 if buf looks like a GTPv1 G-PDU, i.e. is a candidate for
+ * gtphub_handle_gpdu(). */
+static inline int gtp_is_gpdu(const uint8_t *buf, size_t len)
+{
+	return (len >= GTP1_HEADER_SIZE_SHORT)
+		&& ((buf[0] >> 5) == 1)
+		&& (buf[1] == GTP_GPDU);
+}
+
+/* Fast path for G-PDUs received on the User plane: only validate the GTP
+ * header, find the tunnel from the header TEI via hub->tunnels_by_tei and
+ * rewrite the header in-place. Arguments and return value as for
+ * gtphub_handle_buf(). */
+static int gtphub_handle_gpdu(struct gtphub *hub,
+			      unsigned int side_idx,
+			      const struct osmo_sockaddr *from_addr,
+			      uint8_t *buf,
+			      size_t received,
+			      time_t now,
+			      uint8_t **reply_buf,
+			      struct osmo_fd **to_ofd,
+			      struct osmo_sockaddr *to_addr)
 {
+	const unsigned int plane_idx = GTPH_PLANE_USER;
 	struct gtphub_bind *from_bind = &hub->to_gsns[side_idx][plane_idx];
 	struct gtphub_bind *to_bind = &hub->to_gsns[other_side_idx(side_idx)][plane_idx];
+	struct gtphub_peer_port *from_peer;
+	struct gtphub_peer_port *to_peer;
+	struct gtphub_peer_port *to_peer_from_seq;
 
-	rate_ctr_add(&from_bind->counters_io->ctr[GTPH_CTR_BYTES_IN],
-		     received);
-
+	/* Unlike gtp_decode(), don't zero the entire packet desc: p.ie[] is
+	 * never used for User data. */
 	struct gtp_packet_desc p;
-	gtp_decode(buf, received, side_idx, plane_idx, &p, now);
+	p.data = (union gtp_packet*)buf;
+	p.data_len = received;
+	p.side_idx = side_idx;
+	p.plane_idx = plane_idx;
+	p.timestamp = now;
+	p.tun = NULL;
+	p.seq_map = NULL;
+
+	validate_gtp_header(&p);
 
 	LOG(LOGL_DEBUG, "%s rx %s from %s %s%s\n",
 	    (side_idx == GTPH_SIDE_GGSN)? "<-" : "->",
@@ -2149,34 +2834,13 @@ int gtphub_handle_buf(struct gtphub *hub,
 		    osmo_sockaddr_to_str(from_addr));
 		return -1;
 	}
+	p.rc = GTP_RC_PDU_U;
 
 	rate_ctr_inc(&from_bind->counters_io->ctr[GTPH_CTR_PKTS_IN]);
 
-	int reply_len;
-	reply_len = gtphub_handle_echo_req(hub, &p, reply_buf);
-	if (reply_len > 0) {
-		/* It was an echo. Nothing left to do. */
-		osmo_sockaddr_copy(to_addr, from_addr);
-		*to_ofd = &from_bind->ofd;
-
-		rate_ctr_inc(&from_bind->counters_io->ctr[GTPH_CTR_PKTS_OUT]);
-		rate_ctr_add(&from_bind->counters_io->ctr[GTPH_CTR_BYTES_OUT],
-			     reply_len);
-		LOG(LOGL_DEBUG, "%s Echo response to %s: %d bytes to %s\n",
-		    (side_idx == GTPH_SIDE_GGSN)? "-->" : "<--",
-		    gtphub_side_idx_names[side_idx],
-		    (int)reply_len, osmo_sockaddr_to_str(to_addr));
-		return reply_len;
-	}
-	if (reply_len < 0)
-		return -1;
-
 	*to_ofd = &to_bind->ofd;
 
-	/* If a proxy is configured, check that it's indeed that proxy talking
-	 * to us. A proxy is a forced 1:1 connection, e.g. to another gtphub,
-	 * so no-one else is allowed to talk to us from that side. */
-	struct gtphub_peer_port *from_peer = hub->proxy[side_idx][plane_idx];
+	from_peer = hub->proxy[side_idx][plane_idx];
 	if (from_peer) {
 		if (osmo_sockaddr_cmp(&from_peer->sa, from_addr) != 0) {
 			LOG(LOGL_ERROR,
@@ -2189,52 +2853,14 @@ int gtphub_handle_buf(struct gtphub *hub,
 			    osmo_sockaddr_to_str(from_addr));
 			return -1;
 		}
-	}
-
-	if (!from_peer) {
-		/* Find or create a peer with a matching address. The sender's
-		 * port may in fact differ. */
+	} else
 		from_peer = gtphub_known_addr_have_port(from_bind, from_addr);
-	}
-
-	/* If any PDP context has been created, we already have an entry for
-	 * this GSN. If we don't have an entry, a GGSN has nothing to tell us
-	 * about, while an SGSN may initiate a PDP context. */
-	if (!from_peer) {
-		if (side_idx == GTPH_SIDE_GGSN) {
-			LOG(LOGL_ERROR, "Dropping packet%s: unknown GGSN peer: %s\n",
-			    gtp_type_str(p.type),
-			    osmo_sockaddr_to_str(from_addr));
-			return -1;
-		} else {
-			/* SGSN */
-			/* A new peer. If this is on the Ctrl plane, an SGSN
-			 * may make first contact without being known yet, so
-			 * create the peer struct for the current sender. */
-			if (plane_idx != GTPH_PLANE_CTRL) {
-				LOG(LOGL_ERROR,
-				    "Dropping packet%s: User plane peer was not"
-				    "announced by PDP Context: %s\n",
-				    gtp_type_str(p.type),
-				    osmo_sockaddr_to_str(from_addr));
-				return -1;
-			}
-
-			struct gsn_addr from_gsna;
-			uint16_t from_port;
-			if (gsn_addr_from_sockaddr(&from_gsna, &from_port, from_addr) != 0)
-				return -1;
-
-			from_peer = gtphub_port_have(hub, from_bind, &from_gsna, from_port);
-		}
-	}
 
 	if (!from_peer) {
-		/* This could theoretically happen for invalid address data or
-		 * somesuch. */
-		LOG(LOGL_ERROR, "Dropping packet%s: invalid %s peer: %s\n",
+		LOG(LOGL_ERROR,
+		    "Dropping packet%s: User plane peer was not"
+		    " announced by PDP Context: %s\n",
 		    gtp_type_str(p.type),
-		    gtphub_side_idx_names[side_idx],
 		    osmo_sockaddr_to_str(from_addr));
 		return -1;
 	}
@@ -2243,14 +2869,6 @@ int gtphub_handle_buf(struct gtphub *hub,
 		     received);
 	rate_ctr_inc(&from_peer->counters_io->ctr[GTPH_CTR_PKTS_IN]);
 
-	LOG(LOGL_DEBUG, "from %s peer: %s\n", gtphub_side_idx_names[side_idx],
-	    gtphub_port_str(from_peer));
-
-	gtphub_check_restart_counter(hub, &p, from_peer);
-	gtphub_map_restart_counter(hub, &p);
-
-	struct gtphub_peer_port *to_peer_from_seq;
-	struct gtphub_peer_port *to_peer;
 	if (gtphub_unmap(hub, &p, from_peer,
 			 hub->proxy[other_side_idx(side_idx)][plane_idx],
 			 &to_peer, &to_peer_from_seq)
@@ -2258,42 +2876,85 @@ int gtphub_handle_buf(struct gtphub *hub,
 		return -1;
 	}
 
-	if (p.tun) {
-		struct gtphub_tunnel_endpoint *te = &p.tun->endpoint[p.side_idx][p.plane_idx];
-		rate_ctr_add(&te->counters_io->ctr[GTPH_CTR_BYTES_IN],
-			     received);
-		rate_ctr_inc(&te->counters_io->ctr[GTPH_CTR_PKTS_IN]);
+	if ((!to_peer) || (!p.tun)) {
+		LOG(LOGL_ERROR, "No %s to send to. Dropping packet%s"
+		    " (type=%" PRIu8 ", header-TEI=%" PRIx32 ", seq=%" PRIx16 ").\n",
+		    gtphub_side_idx_names[other_side_idx(side_idx)],
+		    gtp_type_str(p.type),
+		    p.type, p.header_tei_rx, p.seq
+		    );
+		return -1;
 	}
 
-	if ((!to_peer) && (side_idx == GTPH_SIDE_SGSN)) {
-		if (gtphub_resolve_ggsn(hub, &p, &to_peer) < 0)
-			return -1;
-	}
+	gtphub_tunnel_count_in(&p.tun->endpoint[side_idx][plane_idx], received);
+
+	if (!to_peer_from_seq)
+		gtphub_map_seq(&p, from_peer, to_peer);
 
-	if (!to_peer && p.tun && p.type == GTP_DELETE_PDP_RSP) {
+	osmo_sockaddr_copy(to_addr, &to_peer->sa);
+
+	*reply_buf = buf;
+
+	rate_ctr_inc(&to_bind->counters_io->ctr[GTPH_CTR_PKTS_OUT]);
+	rate_ctr_add(&to_bind->counters_io->ctr[GTPH_CTR_BYTES_OUT], received);
+
+	rate_ctr_inc(&to_peer->counters_io->ctr[GTPH_CTR_PKTS_OUT]);
+	rate_ctr_add(&to_peer->counters_io->ctr[GTPH_CTR_BYTES_OUT], received);
+
+	gtphub_tunnel_count_out(&p.tun->endpoint[other_side_idx(side_idx)][plane_idx],
+				received);
+
+	LOG(LOGL_DEBUG, "%s Forward to %s:"
+	    " header-TEI %" PRIx32", seq %" PRIx16", %d bytes to %s\n",
+	    (side_idx == GTPH_SIDE_SGSN)? "-->" : "<--",
+	    gtphub_side_idx_names[other_side_idx(side_idx)],
+	    p.header_tei, p.seq,
+	    (int)received, osmo_sockaddr_to_str(to_addr));
+	return received;
+}
+
+/* Second half of gtphub_handle_buf(), once the peer to forward to is known:
+ * set up tunnels from PDP Context messages, map the sequence nr and return the
+ * buffer to send in *reply_buf and its length, or 0 for nothing to send, or
+ * -1 on error. */
+static int gtphub_forward(struct gtphub *hub,
+			  struct gtp_packet_desc *p,
+			  struct gtphub_peer_port *from_peer,
+			  struct gtphub_peer_port *to_peer,
+			  struct gtphub_peer_port *to_peer_from_seq,
+			  uint8_t **reply_buf,
+			  struct osmo_fd **to_ofd,
+			  struct osmo_sockaddr *to_addr)
+{
+	struct gtphub_bind *to_bind =
+		&hub->to_gsns[other_side_idx(p->side_idx)][p->plane_idx];
+
+	*to_ofd = &to_bind->ofd;
+
+	if (!to_peer && p->tun && p->type == GTP_DELETE_PDP_RSP) {
 		/* It's a delete confirmation for a tunnel that is partly
 		 * invalid, probably marked unsuable due to a restarted peer.
 		 * Remove the tunnel and be happy without forwarding. */
-		expiring_item_del(&p.tun->expiry_entry);
-		p.tun = NULL;
+		expiring_item_del(&p->tun->expiry_entry);
+		p->tun = NULL;
 		return 0;
 	}
 
 	if (!to_peer) {
 		LOG(LOGL_ERROR, "No %s to send to. Dropping packet%s"
 		    " (type=%" PRIu8 ", header-TEI=%" PRIx32 ", seq=%" PRIx16 ").\n",
-		    gtphub_side_idx_names[other_side_idx(side_idx)],
-		    gtp_type_str(p.type),
-		    p.type, p.header_tei_rx, p.seq
+		    gtphub_side_idx_names[other_side_idx(p->side_idx)],
+		    gtp_type_str(p->type),
+		    p->type, p->header_tei_rx, p->seq
 		    );
 		return -1;
 	}
 
-	if (plane_idx == GTPH_PLANE_CTRL) {
+	if (p->plane_idx == GTPH_PLANE_CTRL) {
 		/* This may be a Create PDP Context response. If it is, there
 		 * are other addresses in the GTP message to set up apart from
 		 * the sender. */
-		if (gtphub_handle_pdp_ctx(hub, &p, from_peer, to_peer)
+		if (gtphub_handle_pdp_ctx(hub, p, from_peer, to_peer)
 		    != 0)
 			return -1;
 	}
@@ -2301,152 +2962,1161 @@ int gtphub_handle_buf(struct gtphub *hub,
 	/* Either to_peer was resolved from an existing tunnel,
 	 * or a PDP Ctx and thus a tunnel has just been created,
 	 * or the tunnel has been deleted due to this message. */
-	OSMO_ASSERT(p.tun || (p.type == GTP_DELETE_PDP_RSP));
+	OSMO_ASSERT(p->tun || (p->type == GTP_DELETE_PDP_RSP));
 
 	/* If the GGSN is replying to an SGSN request, the sequence nr has
 	 * already been unmapped above (to_peer_from_seq != NULL), and we need not
 	 * create a new mapping. */
-	if (!to_peer_from_seq)
-		gtphub_map_seq(&p, from_peer, to_peer);
+	if (!to_peer_from_seq) {
+		uint16_t orig_seq = p->seq;
+		struct nr_mapping *nrm = gtphub_map_seq(p, from_peer, to_peer);
+		if (p->plane_idx == GTPH_PLANE_CTRL)
+			gtphub_seq_track_req(hub, p, nrm, orig_seq);
+	} else if (p->seq_map && (p->plane_idx == GTPH_PLANE_CTRL))
+		gtphub_seq_store_rsp(p);
 
 	osmo_sockaddr_copy(to_addr, &to_peer->sa);
 
-	*reply_buf = (uint8_t*)p.data;
+	*reply_buf = (uint8_t*)p->data;
 
-	if (received) {
+	if (p->data_len) {
 		rate_ctr_inc(&to_bind->counters_io->ctr[GTPH_CTR_PKTS_OUT]);
 		rate_ctr_add(&to_bind->counters_io->ctr[GTPH_CTR_BYTES_OUT],
-			     received);
+			     p->data_len);
 
 		rate_ctr_inc(&to_peer->counters_io->ctr[GTPH_CTR_PKTS_OUT]);
 		rate_ctr_add(&to_peer->counters_io->ctr[GTPH_CTR_BYTES_OUT],
-			     received);
+			     p->data_len);
 	}
 
-	if (p.tun) {
-		struct gtphub_tunnel_endpoint *te = &p.tun->endpoint[other_side_idx(p.side_idx)][p.plane_idx];
-		rate_ctr_inc(&te->counters_io->ctr[GTPH_CTR_PKTS_OUT]);
-		rate_ctr_add(&te->counters_io->ctr[GTPH_CTR_BYTES_OUT],
-			     received);
-	}
+	if (p->tun)
+		gtphub_tunnel_count_out(&p->tun->endpoint[other_side_idx(p->side_idx)][p->plane_idx],
+					p->data_len);
 
 	LOG(LOGL_DEBUG, "%s Forward to %s:"
 	    " header-TEI %" PRIx32", seq %" PRIx16", %d bytes to %s\n",
-	    (side_idx == GTPH_SIDE_SGSN)? "-->" : "<--",
-	    gtphub_side_idx_names[other_side_idx(side_idx)],
-	    p.header_tei, p.seq,
-	    (int)received, osmo_sockaddr_to_str(to_addr));
-	return received;
+	    (p->side_idx == GTPH_SIDE_SGSN)? "-->" : "<--",
+	    gtphub_side_idx_names[other_side_idx(p->side_idx)],
+	    p->header_tei, p->seq,
+	    (int)p->data_len, osmo_sockaddr_to_str(to_addr));
+	return p->data_len;
 }
 
-static void resolved_gssn_del_cb(struct expiring_item *expi)
+static int64_t gtphub_now_ms(void)
 {
-	struct gtphub_resolved_ggsn *ggsn;
-	ggsn = container_of(expi, struct gtphub_resolved_ggsn, expiry_entry);
+	struct timespec now_tp;
+	OSMO_ASSERT(osmo_clock_gettime(CLOCK_MONOTONIC, &now_tp) >= 0);
+	return (int64_t)now_tp.tv_sec * 1000 + now_tp.tv_nsec / 1000000;
+}
 
-	gtphub_port_ref_count_dec(ggsn->peer);
-	llist_del(&ggsn->entry);
+/* Derive g->eff_weight from the configured weight and g's health. */
+static void gtphub_ggsn_pool_update(struct gtphub_pool_ggsn *g)
+{
+	uint64_t w;
 
-	ggsn->expiry_entry.del_cb = 0;
-	expiring_item_del(&ggsn->expiry_entry);
+	if (g->echo_missed >= GTPH_GGSN_ECHO_MISSED_MAX) {
+		g->eff_weight = 0;
+		return;
+	}
 
-	talloc_free(ggsn);
+	/* Scale up to keep precision for the reductions below. */
+	w = (uint64_t)g->weight * 1000;
+	if (g->rtt_ms > (int)GTPH_GGSN_RTT_SLOW_MS)
+		w = w * GTPH_GGSN_RTT_SLOW_MS / g->rtt_ms;
+	w = w * (1000 - g->reject_permille) / 1000;
+
+	/* Keep a trickle of new contexts, to notice when it recovers. */
+	g->eff_weight = w ? w : 1;
 }
 
-void gtphub_resolved_ggsn(struct gtphub *hub, const char *apn_oi_str,
-			  struct gsn_addr *resolved_addr,
-			  time_t now)
+struct gtphub_pool_ggsn *gtphub_ggsn_pool_add(struct gtphub *hub,
+					      const struct gsn_addr *addr,
+					      unsigned int weight)
 {
+	struct gtphub_pool_ggsn *g;
 	struct gtphub_peer_port *pp;
-	struct gtphub_resolved_ggsn *ggsn;
 
-	LOG(LOGL_DEBUG, "Resolved GGSN callback: %s %s\n",
-	    apn_oi_str, osmo_hexdump((unsigned char*)resolved_addr,
-				     sizeof(*resolved_addr)));
+	if (hub->ggsn_pool_len >= GTPH_GGSN_POOL_MAX)
+		return NULL;
 
 	pp = gtphub_port_have(hub, &hub->to_gsns[GTPH_SIDE_GGSN][GTPH_PLANE_CTRL],
-			      resolved_addr, 2123);
-	if (!pp) {
-		LOG(LOGL_ERROR, "Internal: Cannot create/find peer '%s'\n",
-		    gsn_addr_to_str(resolved_addr));
-		return;
-	}
+			      addr, gtphub_plane_idx_default_port[GTPH_PLANE_CTRL]);
+	if (!pp)
+		return NULL;
 
-	ggsn = talloc_zero(osmo_gtphub_ctx, struct gtphub_resolved_ggsn);
-	OSMO_ASSERT(ggsn);
-	INIT_LLIST_HEAD(&ggsn->entry);
-	expiring_item_init(&ggsn->expiry_entry);
+	g = &hub->ggsn_pool[hub->ggsn_pool_len ++];
+	memset(g, 0, sizeof(*g));
+	g->pp = pp;
+	g->weight = weight ? weight : 1;
+	g->rtt_ms = -1;
+	gtphub_ggsn_pool_update(g);
 
-	ggsn->peer = pp;
+	/* A pool member is never expired. */
 	gtphub_port_ref_count_inc(pp);
 
-	osmo_strlcpy(ggsn->apn_oi_str, apn_oi_str, sizeof(ggsn->apn_oi_str));
-
-	ggsn->expiry_entry.del_cb = resolved_gssn_del_cb;
-	expiry_add(&hub->expire_slowly, &ggsn->expiry_entry, now);
-
-	llist_add(&ggsn->entry, &hub->resolved_ggsns);
+	LOG(LOGL_NOTICE, "GGSN pool member %s, weight %u\n",
+	    gtphub_port_str(pp), g->weight);
+	return g;
 }
 
-static int gtphub_gc_peer_port(struct gtphub_peer_port *pp)
+static void gtphub_ggsn_pool_free(struct gtphub *hub)
 {
-	return pp->ref_count == 0;
+	unsigned int i;
+	for (i = 0; i < hub->ggsn_pool_len; i++)
+		gtphub_port_ref_count_dec(hub->ggsn_pool[i].pp);
+	hub->ggsn_pool_len = 0;
 }
 
-static int gtphub_gc_peer_addr(struct gtphub_peer_addr *pa)
+struct gtphub_pool_ggsn *gtphub_ggsn_pool_select(struct gtphub *hub)
 {
-	struct gtphub_peer_port *pp, *npp;
-	llist_for_each_entry_safe(pp, npp, &pa->ports, entry) {
-		if (gtphub_gc_peer_port(pp)) {
-			LOG(LOGL_DEBUG, "expired: peer %s\n",
-			    gtphub_port_str(pp));
-			gtphub_peer_port_del(pp);
-		}
+	struct gtphub_pool_ggsn *best = NULL;
+	int64_t total = 0;
+	unsigned int i;
+	int all_down = 1;
+
+	for (i = 0; i < hub->ggsn_pool_len; i++) {
+		if (hub->ggsn_pool[i].eff_weight)
+			all_down = 0;
 	}
-	return llist_empty(&pa->ports);
-}
 
-static int gtphub_gc_peer(struct gtphub_peer *p)
+	for (i = 0; i < hub->ggsn_pool_len; i++) {
+		struct gtphub_pool_ggsn *g = &hub->ggsn_pool[i];
+		/* If none answers, rather try all than none at all. */
+		int64_t w = all_down ? g->weight : g->eff_weight;
+		if (!w)
+			continue;
+		g->current += w;
+		total += w;
+		if (!best || (g->current > best->current))
+			best = g;
+	}
+
+	if (!best)
+		return NULL;
+
+	best->current -= total;
+	best->selected ++;
+	return best;
+}
+
+void gtphub_ggsn_pool_rtt(struct gtphub_pool_ggsn *g, unsigned int rtt_ms)
+{
+	if (g->rtt_ms < 0)
+		g->rtt_ms = rtt_ms;
+	else
+		g->rtt_ms = (g->rtt_ms * 3 + rtt_ms) / 4;
+	gtphub_ggsn_pool_update(g);
+}
+
+void gtphub_ggsn_pool_create_result(struct gtphub_pool_ggsn *g, int accepted)
+{
+	g->reject_permille = (g->reject_permille * 7
+			      + (accepted ? 0 : 1000)) / 8;
+	gtphub_ggsn_pool_update(g);
+}
+
+static struct gtphub_pool_ggsn *gtphub_ggsn_pool_find(struct gtphub *hub,
+						      struct gtphub_peer_port *pp)
+{
+	unsigned int i;
+	/* The GGSN may answer from another port than the default one. */
+	for (i = 0; i < hub->ggsn_pool_len; i++) {
+		struct gtphub_pool_ggsn *g = &hub->ggsn_pool[i];
+		if (g->pp->peer_addr->peer == pp->peer_addr->peer)
+			return g;
+	}
+	return NULL;
+}
+
+/* Take health input from a GTP-C message received from a GGSN. Return 1 if p
+ * is an answer to gtphub's own Echo Request, which is not to be forwarded. */
+static int gtphub_ggsn_pool_rx(struct gtphub *hub, struct gtp_packet_desc *p,
+			       struct gtphub_peer_port *from)
+{
+	struct gtphub_pool_ggsn *g;
+	uint8_t cause;
+
+	if (!hub->ggsn_pool_len)
+		return 0;
+
+	if ((p->side_idx != GTPH_SIDE_GGSN)
+	    || (p->plane_idx != GTPH_PLANE_CTRL))
+		return 0;
+
+	/* gtphub answers Echo Requests itself and never forwards them, so any
+	 * Echo Response is for gtphub. */
+	if (p->type == GTP_ECHO_RSP) {
+		g = gtphub_ggsn_pool_find(hub, from);
+		if (g && g->echo_pending && (p->seq == g->echo_seq)) {
+			g->echo_pending = 0;
+			g->echo_missed = 0;
+			gtphub_ggsn_pool_rtt(g, gtphub_now_ms() - g->echo_sent_ms);
+			LOG(LOGL_DEBUG, "GGSN pool: Echo from %s, rtt %d ms,"
+			    " weight %u\n", gtphub_port_str(from), g->rtt_ms,
+			    g->eff_weight);
+		}
+		return 1;
+	}
+
+	if (p->type != GTP_CREATE_PDP_RSP)
+		return 0;
+
+	g = gtphub_ggsn_pool_find(hub, from);
+	if (!g)
+		return 0;
+	if (gtp_get_tv1(p, GTP_IE_CAUSE, &cause) != 0)
+		return 0;
+
+	/* 7.7.1: 128..191 mean the request was accepted. */
+	gtphub_ggsn_pool_create_result(g, (cause >= 128) && (cause <= 191));
+	if (cause != GTPCAUSE_ACC_REQ)
+		LOG(LOGL_DEBUG, "GGSN pool: %s rejects PDP context (cause %u),"
+		    " weight %u\n", gtphub_port_str(from), cause,
+		    g->eff_weight);
+	return 0;
+}
+
+/* Send each pool member an Echo Request, and count the unanswered previous
+ * one as missed. */
+static void gtphub_ggsn_pool_echo_tick(struct gtphub *hub, time_t now)
+{
+	static uint8_t echo_req[12] = {
+		0x32,	/* GTP v1 flags */
+		GTP_ECHO_REQ,
+		0x00, 0x04, /* Length in network byte order */
+		0x00, 0x00, 0x00, 0x00,	/* Zero TEI */
+		0, 0,	/* Seq, to be replaced */
+		0, 0,	/* no extensions */
+	};
+	uint16_t *seq = (uint16_t*)&echo_req[8];
+	struct gtphub_bind *bind = &hub->to_gsns[GTPH_SIDE_GGSN][GTPH_PLANE_CTRL];
+	unsigned int i;
+
+	if (!hub->ggsn_pool_len
+	    || (now - hub->ggsn_pool_echo_last < GTPH_GGSN_ECHO_SECS))
+		return;
+	hub->ggsn_pool_echo_last = now;
+
+	for (i = 0; i < hub->ggsn_pool_len; i++) {
+		struct gtphub_pool_ggsn *g = &hub->ggsn_pool[i];
+
+		if (g->echo_pending) {
+			g->echo_missed ++;
+			gtphub_ggsn_pool_update(g);
+			if (g->echo_missed == GTPH_GGSN_ECHO_MISSED_MAX)
+				LOG(LOGL_NOTICE, "GGSN pool: %s does not answer"
+				    " Echo, no new PDP contexts for it\n",
+				    gtphub_port_str(g->pp));
+		}
+
+		g->echo_seq = nr_pool_next(&g->pp->peer_addr->peer->seq_pool);
+		*seq = hton16(g->echo_seq);
+		g->echo_sent_ms = gtphub_now_ms();
+		g->echo_pending = 1;
+		if (gtphub_write(&bind->ofd, &g->pp->sa, echo_req,
+				 sizeof(echo_req)) != 0)
+			LOG(LOGL_ERROR, "GGSN pool: failed to send Echo"
+			    " Request to %s\n", gtphub_port_str(g->pp));
+	}
+}
+
+/* Parse buffer as GTP packet, replace elements in-place and return the ofd and
+ * address to forward to. Return a pointer to the osmo_fd, but copy the
+ * sockaddr to *to_addr. The reason for this is that the sockaddr may expire at
+ * any moment, while the osmo_fd is guaranteed to persist. Return the number of
+ * bytes to forward, 0 or less on failure. */
+int gtphub_handle_buf(struct gtphub *hub,
+		      unsigned int side_idx,
+		      unsigned int plane_idx,
+		      const struct osmo_sockaddr *from_addr,
+		      uint8_t *buf,
+		      size_t received,
+		      time_t now,
+		      uint8_t **reply_buf,
+		      struct osmo_fd **to_ofd,
+		      struct osmo_sockaddr *to_addr)
+{
+	struct gtphub_bind *from_bind = &hub->to_gsns[side_idx][plane_idx];
+
+	rate_ctr_add(&from_bind->counters_io->ctr[GTPH_CTR_BYTES_IN],
+		     received);
+
+	if ((plane_idx == GTPH_PLANE_USER) && gtp_is_gpdu(buf, received))
+		return gtphub_handle_gpdu(hub, side_idx, from_addr,
+					  buf, received, now,
+					  reply_buf, to_ofd, to_addr);
+
+	struct gtp_packet_desc p;
+	gtp_decode(buf, received, side_idx, plane_idx, &p, now);
+	if (p.rc == GTP_RC_PDU_C)
+		p.digest = hash_buf(0, buf, received);
+
+	LOG(LOGL_DEBUG, "%s rx %s from %s %s%s\n",
+	    (side_idx == GTPH_SIDE_GGSN)? "<-" : "->",
+	    gtphub_plane_idx_names[plane_idx],
+	    gtphub_side_idx_names[side_idx],
+	    osmo_sockaddr_to_str(from_addr),
+	    gtp_type_str(p.type));
+
+	if (p.rc <= 0) {
+		LOG(LOGL_ERROR, "INVALID: dropping GTP packet%s from %s %s %s\n",
+		    gtp_type_str(p.type),
+		    gtphub_side_idx_names[side_idx],
+		    gtphub_plane_idx_names[plane_idx],
+		    osmo_sockaddr_to_str(from_addr));
+		return -1;
+	}
+
+	rate_ctr_inc(&from_bind->counters_io->ctr[GTPH_CTR_PKTS_IN]);
+
+	int reply_len;
+	reply_len = gtphub_handle_echo_req(hub, &p, reply_buf);
+	if (reply_len > 0) {
+		/* It was an echo. Nothing left to do. */
+		osmo_sockaddr_copy(to_addr, from_addr);
+		*to_ofd = &from_bind->ofd;
+
+		rate_ctr_inc(&from_bind->counters_io->ctr[GTPH_CTR_PKTS_OUT]);
+		rate_ctr_add(&from_bind->counters_io->ctr[GTPH_CTR_BYTES_OUT],
+			     reply_len);
+		LOG(LOGL_DEBUG, "%s Echo response to %s: %d bytes to %s\n",
+		    (side_idx == GTPH_SIDE_GGSN)? "-->" : "<--",
+		    gtphub_side_idx_names[side_idx],
+		    (int)reply_len, osmo_sockaddr_to_str(to_addr));
+		return reply_len;
+	}
+	if (reply_len < 0)
+		return -1;
+
+	/* If a proxy is configured, check that it's indeed that proxy talking
+	 * to us. A proxy is a forced 1:1 connection, e.g. to another gtphub,
+	 * so no-one else is allowed to talk to us from that side. */
+	struct gtphub_peer_port *from_peer = hub->proxy[side_idx][plane_idx];
+	if (from_peer) {
+		if (osmo_sockaddr_cmp(&from_peer->sa, from_addr) != 0) {
+			LOG(LOGL_ERROR,
+			    "Rejecting: %s proxy configured, but GTP packet"
+			    " received on %s bind is from another sender:"
+			    " proxy: %s  sender: %s\n",
+			    gtphub_side_idx_names[side_idx],
+			    gtphub_side_idx_names[side_idx],
+			    gtphub_port_str(from_peer),
+			    osmo_sockaddr_to_str(from_addr));
+			return -1;
+		}
+	}
+
+	if (!from_peer) {
+		/* Find or create a peer with a matching address. The sender's
+		 * port may in fact differ. */
+		from_peer = gtphub_known_addr_have_port(from_bind, from_addr);
+	}
+
+	/* If any PDP context has been created, we already have an entry for
+	 * this GSN. If we don't have an entry, a GGSN has nothing to tell us
+	 * about, while an SGSN may initiate a PDP context. */
+	if (!from_peer) {
+		if (side_idx == GTPH_SIDE_GGSN) {
+			LOG(LOGL_ERROR, "Dropping packet%s: unknown GGSN peer: %s\n",
+			    gtp_type_str(p.type),
+			    osmo_sockaddr_to_str(from_addr));
+			return -1;
+		} else {
+			/* SGSN */
+			/* A new peer. If this is on the Ctrl plane, an SGSN
+			 * may make first contact without being known yet, so
+			 * create the peer struct for the current sender. */
+			if (plane_idx != GTPH_PLANE_CTRL) {
+				LOG(LOGL_ERROR,
+				    "Dropping packet%s: User plane peer was not"
+				    "announced by PDP Context: %s\n",
+				    gtp_type_str(p.type),
+				    osmo_sockaddr_to_str(from_addr));
+				return -1;
+			}
+
+			struct gsn_addr from_gsna;
+			uint16_t from_port;
+			if (gsn_addr_from_sockaddr(&from_gsna, &from_port, from_addr) != 0)
+				return -1;
+
+			from_peer = gtphub_port_have(hub, from_bind, &from_gsna, from_port);
+		}
+	}
+
+	if (!from_peer) {
+		/* This could theoretically happen for invalid address data or
+		 * somesuch. */
+		LOG(LOGL_ERROR, "Dropping packet%s: invalid %s peer: %s\n",
+		    gtp_type_str(p.type),
+		    gtphub_side_idx_names[side_idx],
+		    osmo_sockaddr_to_str(from_addr));
+		return -1;
+	}
+
+	rate_ctr_add(&from_peer->counters_io->ctr[GTPH_CTR_BYTES_IN],
+		     received);
+	rate_ctr_inc(&from_peer->counters_io->ctr[GTPH_CTR_PKTS_IN]);
+
+	LOG(LOGL_DEBUG, "from %s peer: %s\n", gtphub_side_idx_names[side_idx],
+	    gtphub_port_str(from_peer));
+
+	gtphub_check_restart_counter(hub, &p, from_peer);
+	gtphub_map_restart_counter(hub, &p);
+
+	if (gtphub_ggsn_pool_rx(hub, &p, from_peer))
+		return 0;
+
+	if ((p.rc == GTP_RC_PDU_C) && (p.version == 1)) {
+		struct gtphub_seq_mapping *sm;
+		sm = gtphub_seq_find_req(hub, &p, from_peer);
+		if (sm && sm->rsp) {
+			rate_ctr_inc(&hub->counters->ctr[GTPH_CTR_RETRANS_REPLAYED]);
+			osmo_sockaddr_copy(to_addr, from_addr);
+			*to_ofd = &from_bind->ofd;
+			*reply_buf = sm->rsp;
+
+			rate_ctr_inc(&from_bind->counters_io->ctr[GTPH_CTR_PKTS_OUT]);
+			rate_ctr_add(&from_bind->counters_io->ctr[GTPH_CTR_BYTES_OUT],
+				     sm->rsp_len);
+			LOG(LOGL_DEBUG, "%s Retransmission, replaying cached"
+			    " response to %s: %d bytes to %s\n",
+			    (side_idx == GTPH_SIDE_GGSN)? "-->" : "<--",
+			    gtphub_side_idx_names[side_idx],
+			    (int)sm->rsp_len, osmo_sockaddr_to_str(to_addr));
+			return sm->rsp_len;
+		}
+		/* No response seen yet, forward it again. */
+		if (sm)
+			rate_ctr_inc(&hub->counters->ctr[GTPH_CTR_RETRANS_FORWARDED]);
+	}
+
+	struct gtphub_peer_port *to_peer_from_seq;
+	struct gtphub_peer_port *to_peer;
+	if (gtphub_unmap(hub, &p, from_peer,
+			 hub->proxy[other_side_idx(side_idx)][plane_idx],
+			 &to_peer, &to_peer_from_seq)
+	    != 0) {
+		return -1;
+	}
+
+	if (p.tun)
+		gtphub_tunnel_count_in(&p.tun->endpoint[p.side_idx][p.plane_idx],
+				       received);
+
+	if ((!to_peer) && (side_idx == GTPH_SIDE_SGSN)
+	    && (p.type == GTP_CREATE_PDP_REQ) && hub->ggsn_pool_len) {
+		struct gtphub_pool_ggsn *g = gtphub_ggsn_pool_select(hub);
+		to_peer = g->pp;
+		LOG(LOGL_DEBUG, "GGSN pool: picked %s (weight %u)\n",
+		    gtphub_port_str(to_peer), g->eff_weight);
+	}
+
+	if ((!to_peer) && (side_idx == GTPH_SIDE_SGSN)) {
+		struct llist_head *parked;
+		if (gtphub_resolve_ggsn(hub, &p, &to_peer, &parked) < 0) {
+			/* Forward as soon as the GGSN is resolved. */
+			if (parked)
+				gtphub_park(hub, parked, &p, from_peer);
+			return parked? 0 : -1;
+		}
+	}
+
+	return gtphub_forward(hub, &p, from_peer, to_peer, to_peer_from_seq,
+			      reply_buf, to_ofd, to_addr);
+}
+
+/* A Create PDP Context Request waiting for its GGSN to be resolved. */
+struct gtphub_parked {
+	struct llist_head entry;
+	struct expiring_item expiry_entry;
+
+	struct gtphub *hub;
+	struct gtphub_peer_port *from_peer;
+	uint16_t seq;
+	/* gtp_packet_desc.digest of the request as received */
+	uint32_t digest;
+	int forwarded;
+
+	size_t len;
+	uint8_t buf[0];
+};
+
+static void gtphub_parked_del_cb(struct expiring_item *expi)
+{
+	struct gtphub_parked *pk;
+	pk = container_of(expi, struct gtphub_parked, expiry_entry);
+
+	llist_del(&pk->entry);
+	gtphub_port_ref_count_dec(pk->from_peer);
+
+	if (!pk->forwarded) {
+		LOG(LOGL_DEBUG, "Dropping parked request from %s, seq %" PRIx16 "\n",
+		    gtphub_port_str(pk->from_peer), pk->seq);
+		rate_ctr_inc(&pk->hub->counters->ctr[GTPH_CTR_PARKED_DROPPED]);
+	}
+
+	pk->expiry_entry.del_cb = 0;
+	expiring_item_del(&pk->expiry_entry);
+
+	talloc_free(pk);
+}
+
+/* Keep a copy of the request in p until gtphub_parked_forward() or
+ * gtphub_parked_drop() is called on the list, or the expire_quickly timeout
+ * hits, whichever comes first. */
+static void gtphub_park(struct gtphub *hub, struct llist_head *parked,
+			struct gtp_packet_desc *p,
+			struct gtphub_peer_port *from_peer)
+{
+	struct gtphub_parked *pk;
+	unsigned int count = 0;
+
+	llist_for_each_entry(pk, parked, entry) {
+		if (pk->from_peer == from_peer && pk->seq == p->seq) {
+			/* A retransmission, the first copy will do. */
+			LOG(LOGL_DEBUG, "Already parked: request from %s,"
+			    " seq %" PRIx16 "\n",
+			    gtphub_port_str(from_peer), p->seq);
+			return;
+		}
+		count ++;
+	}
+
+	if (count >= GTPH_PARKED_MAX) {
+		LOG(LOGL_ERROR, "Too many requests waiting for GGSN resolution,"
+		    " dropping request from %s, seq %" PRIx16 "\n",
+		    gtphub_port_str(from_peer), p->seq);
+		rate_ctr_inc(&hub->counters->ctr[GTPH_CTR_PARKED_DROPPED]);
+		return;
+	}
+
+	pk = talloc_named_const(osmo_gtphub_ctx, sizeof(*pk) + p->data_len,
+				"struct gtphub_parked");
+	OSMO_ASSERT(pk);
+	memset(pk, 0, sizeof(*pk));
+	INIT_LLIST_HEAD(&pk->entry);
+	expiring_item_init(&pk->expiry_entry);
+
+	pk->hub = hub;
+	pk->from_peer = from_peer;
+	gtphub_port_ref_count_inc(from_peer);
+	pk->seq = p->seq;
+	pk->digest = p->digest;
+	pk->len = p->data_len;
+	memcpy(pk->buf, p->data, p->data_len);
+
+	pk->expiry_entry.del_cb = gtphub_parked_del_cb;
+	expiry_add(&hub->expire_quickly, &pk->expiry_entry, p->timestamp);
+
+	llist_add_tail(&pk->entry, parked);
+
+	LOG(LOGL_DEBUG, "Parked request from %s, seq %" PRIx16
+	    " until the GGSN is resolved\n",
+	    gtphub_port_str(from_peer), p->seq);
+	rate_ctr_inc(&hub->counters->ctr[GTPH_CTR_PARKED]);
+}
+
+void gtphub_parked_forward(struct gtphub *hub, struct llist_head *parked,
+			   struct gtphub_peer_port *ggsn, time_t now)
+{
+	struct gtphub_parked *pk;
+
+	while (!llist_empty(parked)) {
+		struct gtp_packet_desc p;
+		uint8_t *reply_buf;
+		struct osmo_fd *to_ofd;
+		struct osmo_sockaddr to_addr;
+		int len;
+
+		pk = llist_first_entry(parked, struct gtphub_parked, entry);
+
+		gtp_decode(pk->buf, pk->len, GTPH_SIDE_SGSN, GTPH_PLANE_CTRL,
+			   &p, now);
+		if (p.rc > 0) {
+			/* pk->buf may have been rewritten already, use the
+			 * digest of the request as received. */
+			p.digest = pk->digest;
+			len = gtphub_forward(hub, &p, pk->from_peer, ggsn, NULL,
+					     &reply_buf, &to_ofd, &to_addr);
+			if (len > 0
+			    && gtphub_write(to_ofd, &to_addr, reply_buf, len) == 0) {
+				pk->forwarded = 1;
+				rate_ctr_inc(&hub->counters->ctr[GTPH_CTR_PARKED_FORWARDED]);
+			}
+		}
+
+		/* Also unlinks pk from the parked list. */
+		expiring_item_del(&pk->expiry_entry);
+	}
+}
+
+void gtphub_parked_drop(struct llist_head *parked)
+{
+	struct gtphub_parked *pk;
+
+	while (!llist_empty(parked)) {
+		pk = llist_first_entry(parked, struct gtphub_parked, entry);
+		expiring_item_del(&pk->expiry_entry);
+	}
+}
+
+static void resolved_gssn_del_cb(struct expiring_item *expi)
+{
+	struct gtphub_resolved_ggsn *ggsn;
+	ggsn = container_of(expi, struct gtphub_resolved_ggsn, expiry_entry);
+
+	gtphub_port_ref_count_dec(ggsn->peer);
+	hash_index_del(&ggsn->apn_oi_hash);
+	llist_del(&ggsn->entry);
+
+	ggsn->expiry_entry.del_cb = 0;
+	expiring_item_del(&ggsn->expiry_entry);
+
+	talloc_free(ggsn);
+}
+
+uint32_t gtphub_apn_oi_hash(const char *apn_oi_str)
+{
+	return hash_buf(0, apn_oi_str, strlen(apn_oi_str));
+}
+
+static struct gtphub_resolved_ggsn *gtphub_resolved_ggsn_get(struct gtphub *hub,
+							     const char *apn_oi_str)
 {
-	struct gtphub_peer_addr *pa, *npa;
-	llist_for_each_entry_safe(pa, npa, &p->addresses, entry) {
-		if (gtphub_gc_peer_addr(pa)) {
-			gtphub_peer_addr_del(pa);
-		}
+	struct gtphub_resolved_ggsn *ggsn;
+	uint32_t hash = gtphub_apn_oi_hash(apn_oi_str);
+	hash_index_for_each_possible(&hub->resolved_ggsns_by_apn_oi, ggsn,
+				     apn_oi_hash, hash) {
+		if (strncmp(ggsn->apn_oi_str, apn_oi_str,
+			    sizeof(ggsn->apn_oi_str)) == 0)
+			return ggsn;
+	}
+	return NULL;
+}
+
+struct gtphub_peer_port *gtphub_resolved_ggsn_find(struct gtphub *hub,
+						   const char *apn_oi_str,
+						   time_t now,
+						   int *prefetch)
+{
+	struct gtphub_resolved_ggsn *ggsn;
+	int prefetch_secs;
+
+	*prefetch = 0;
+
+	ggsn = gtphub_resolved_ggsn_get(hub, apn_oi_str);
+	if (ggsn && (now >= ggsn->valid_until)) {
+		LOG(LOGL_DEBUG, "Resolved GGSN for %s: TTL ran out\n",
+		    apn_oi_str);
+		expiring_item_del(&ggsn->expiry_entry);
+		ggsn = NULL;
+	}
+
+	if (!ggsn) {
+		rate_ctr_inc(&hub->counters->ctr[GTPH_CTR_GGSN_CACHE_MISS]);
+		return NULL;
+	}
+
+	rate_ctr_inc(&hub->counters->ctr[GTPH_CTR_GGSN_CACHE_HIT]);
+	ggsn->hits ++;
+
+	prefetch_secs = ggsn->ttl / 10;
+	if (prefetch_secs < 1)
+		prefetch_secs = 1;
+	if (ggsn->hits >= GTPH_GGSN_PREFETCH_HITS
+	    && now >= ggsn->valid_until - prefetch_secs)
+		*prefetch = 1;
+
+	LOG(LOGL_DEBUG, "GGSN resolved from cache: %s -> %s%s\n",
+	    apn_oi_str, gtphub_port_str(ggsn->peer),
+	    *prefetch? " (refreshing)" : "");
+	return ggsn->peer;
+}
+
+struct gtphub_peer_port *gtphub_resolved_ggsn(struct gtphub *hub,
+					       const char *apn_oi_str,
+					       struct gsn_addr *resolved_addr,
+					       int ttl,
+					       time_t now)
+{
+	struct gtphub_peer_port *pp;
+	struct gtphub_resolved_ggsn *ggsn;
+
+	LOG(LOGL_DEBUG, "Resolved GGSN callback: %s %s TTL %d\n",
+	    apn_oi_str, osmo_hexdump((unsigned char*)resolved_addr,
+				     sizeof(*resolved_addr)),
+	    ttl);
+
+	pp = gtphub_port_have(hub, &hub->to_gsns[GTPH_SIDE_GGSN][GTPH_PLANE_CTRL],
+			      resolved_addr, 2123);
+	if (!pp) {
+		LOG(LOGL_ERROR, "Internal: Cannot create/find peer '%s'\n",
+		    gsn_addr_to_str(resolved_addr));
+		return NULL;
+	}
+
+	if (ttl < 0 || ttl > GTPH_EXPIRE_SLOWLY_MINUTES * 60)
+		ttl = GTPH_EXPIRE_SLOWLY_MINUTES * 60;
+	else if (ttl < GTPH_GGSN_TTL_MIN_SECS)
+		ttl = GTPH_GGSN_TTL_MIN_SECS;
+
+	/* A refresh replaces the previous result. */
+	ggsn = gtphub_resolved_ggsn_get(hub, apn_oi_str);
+	if (ggsn) {
+		gtphub_port_ref_count_dec(ggsn->peer);
+	} else {
+		ggsn = talloc_zero(osmo_gtphub_ctx, struct gtphub_resolved_ggsn);
+		OSMO_ASSERT(ggsn);
+		INIT_LLIST_HEAD(&ggsn->entry);
+		expiring_item_init(&ggsn->expiry_entry);
+		hash_index_entry_init(&ggsn->apn_oi_hash);
+
+		osmo_strlcpy(ggsn->apn_oi_str, apn_oi_str,
+			     sizeof(ggsn->apn_oi_str));
+
+		ggsn->expiry_entry.del_cb = resolved_gssn_del_cb;
+		llist_add(&ggsn->entry, &hub->resolved_ggsns);
+		hash_index_add(&hub->resolved_ggsns_by_apn_oi,
+			       &ggsn->apn_oi_hash,
+			       gtphub_apn_oi_hash(ggsn->apn_oi_str));
 	}
 
-	/* Note that there's a ref_count in each gtphub_peer_port instance
-	 * listed within p->addresses, referenced by TEI mappings from
-	 * hub->tei_map. As long as those don't expire, this peer will stay. */
+	ggsn->peer = pp;
+	gtphub_port_ref_count_inc(pp);
+
+	ggsn->ttl = ttl;
+	ggsn->valid_until = now + ttl;
+	ggsn->hits = 0;
+
+	/* expire_slowly is the upper bound, gtphub_gc() removes entries when
+	 * their TTL runs out. */
+	expiry_add(&hub->expire_slowly, &ggsn->expiry_entry, now);
+
+	return pp;
+}
 
-	return llist_empty(&p->addresses)
-		&& nr_map_empty(&p->seq_map);
+/* Remove resolved GGSNs whose DNS TTL has run out. */
+static void gtphub_gc_resolved_ggsns(struct gtphub *hub, time_t now)
+{
+	struct gtphub_resolved_ggsn *ggsn, *n;
+	llist_for_each_entry_safe(ggsn, n, &hub->resolved_ggsns, entry) {
+		if (now >= ggsn->valid_until)
+			expiring_item_del(&ggsn->expiry_entry);
+	}
 }
 
+/* Remove the candidates listed by gtphub_port_gc_candidate() that are still
+ * unreferenced, and peers left without any address once their seq_map is
+ * empty. Unlike walking all peers, this costs only as much as has changed. */
 static void gtphub_gc_bind(struct gtphub_bind *b)
 {
-	struct gtphub_peer *p, *n;
-	llist_for_each_entry_safe(p, n, &b->peers, entry) {
-		if (gtphub_gc_peer(p)) {
+	struct gtphub_peer_port *pp, *npp;
+	llist_for_each_entry_safe(pp, npp, &b->gc_ports, gc_entry) {
+		llist_del_init(&pp->gc_entry);
+		if (pp->ref_count)
+			continue; /* referenced again meanwhile */
+
+		struct gtphub_peer_addr *pa = pp->peer_addr;
+		struct gtphub_peer *peer = pa->peer;
+
+		LOG(LOGL_DEBUG, "expired: peer %s\n", gtphub_port_str(pp));
+		gtphub_peer_port_del(pp);
+
+		if (!llist_empty(&pa->ports))
+			continue;
+		gtphub_peer_addr_del(pa);
+
+		if (llist_empty(&peer->addresses)
+		    && llist_empty(&peer->gc_entry))
+			llist_add_tail(&peer->gc_entry, &b->gc_peers);
+	}
+
+	struct gtphub_peer *p, *np;
+	llist_for_each_entry_safe(p, np, &b->gc_peers, gc_entry) {
+		/* Note that the seq_map entries reference other peers' ports.
+		 * As long as those don't expire, this peer will stay. */
+		if (nr_map_empty(&p->seq_map))
 			gtphub_peer_del(p);
+	}
+}
+
+/* Tunnel journal: a header followed by fixed size records, each recording a
+ * tunnel as complete (PUT) or gone (DEL). The last record for a tei_repl wins.
+ * Records are in host byte order; the file is only meant to be read back by
+ * the same gtphub installation after a restart. */
+
+#define GTPH_JOURNAL_MAGIC "GTPHJ1\n"
+
+struct gtphub_journal_head {
+	char magic[8];
+	uint8_t restart_counter;
+	uint8_t spare[7];
+} __attribute__((packed));
+
+enum gtphub_journal_rec_type {
+	GTPH_JOURNAL_PUT = 1,
+	GTPH_JOURNAL_DEL = 2,
+};
+
+struct gtphub_journal_endpoint {
+	uint16_t addr_len;
+	uint8_t addr[16];
+	uint16_t port;
+	uint32_t tei_orig;
+} __attribute__((packed));
+
+struct gtphub_journal_rec {
+	uint32_t type; /* enum gtphub_journal_rec_type */
+	uint32_t tei_repl;
+	int64_t written; /* wall clock, seconds */
+	struct gtphub_journal_endpoint ep[GTPH_SIDE_N][GTPH_PLANE_N];
+} __attribute__((packed));
+
+static void gtphub_journal_rec_init(struct gtphub_journal_rec *rec,
+				    struct gtphub_tunnel *tun,
+				    enum gtphub_journal_rec_type type)
+{
+	memset(rec, 0, sizeof(*rec));
+	rec->type = type;
+	rec->tei_repl = tun->tei_repl;
+	rec->written = time(NULL);
+
+	if (type != GTPH_JOURNAL_PUT)
+		return;
+
+	int side_idx, plane_idx;
+	for_each_side_and_plane(side_idx, plane_idx) {
+		struct gtphub_tunnel_endpoint *te = &tun->endpoint[side_idx][plane_idx];
+		struct gtphub_journal_endpoint *ep = &rec->ep[side_idx][plane_idx];
+		struct gsn_addr *addr = &te->peer->peer_addr->addr;
+
+		ep->addr_len = addr->len;
+		memcpy(ep->addr, addr->buf, addr->len);
+		ep->port = te->peer->port;
+		ep->tei_orig = te->tei_orig;
+	}
+}
+
+/* Stop journaling after an error. Rather than leaving a journal behind that
+ * lacks the latest changes, remove it: on restart, peers will see a restart
+ * as if there had been no journal. */
+static void gtphub_journal_fail(struct gtphub *hub, const char *what)
+{
+	LOG(LOGL_ERROR, "Tunnel journal %s: %s failed: %s. Journal disabled.\n",
+	    hub->journal_path, what, strerror(errno));
+	unlink(hub->journal_path);
+	gtphub_journal_close(hub);
+}
+
+static void gtphub_journal_write(struct gtphub *hub,
+				 const struct gtphub_journal_rec *rec)
+{
+	if (write(hub->journal_fd, rec, sizeof(*rec)) != sizeof(*rec)) {
+		gtphub_journal_fail(hub, "write");
+		return;
+	}
+	hub->journal_records ++;
+}
+
+/* Record tun if it is complete, or its removal if it was recorded before but
+ * has become incomplete. */
+static void gtphub_journal_tunnel(struct gtphub_tunnel *tun)
+{
+	struct gtphub *hub = tun->hub;
+	struct gtphub_journal_rec rec;
+
+	if (!hub || (hub->journal_fd < 0))
+		return;
+
+	if (gtphub_tunnel_complete(tun)) {
+		gtphub_journal_rec_init(&rec, tun, GTPH_JOURNAL_PUT);
+		tun->journaled = 1;
+	} else if (tun->journaled) {
+		gtphub_journal_rec_init(&rec, tun, GTPH_JOURNAL_DEL);
+		tun->journaled = 0;
+	} else
+		return;
+
+	gtphub_journal_write(hub, &rec);
+}
+
+static void gtphub_journal_tunnel_del(struct gtphub_tunnel *tun)
+{
+	struct gtphub *hub = tun->hub;
+	struct gtphub_journal_rec rec;
+
+	if (!hub || (hub->journal_fd < 0) || !tun->journaled)
+		return;
+
+	gtphub_journal_rec_init(&rec, tun, GTPH_JOURNAL_DEL);
+	tun->journaled = 0;
+	gtphub_journal_write(hub, &rec);
+}
+
+/* Re-create a tunnel from a PUT record. Return 0 on success, -1 if the record
+ * doesn't describe a usable tunnel. */
+static int gtphub_journal_restore_tunnel(struct gtphub *hub,
+					 const struct gtphub_journal_rec *rec,
+					 time_t now)
+{
+	struct gtphub_tunnel *tun;
+	int side_idx, plane_idx;
+
+	if ((rec->tei_repl < hub->tei_pool.nr_min)
+	    || (rec->tei_repl > hub->tei_pool.nr_max))
+		return -1;
+
+	for_each_side_and_plane(side_idx, plane_idx) {
+		const struct gtphub_journal_endpoint *ep = &rec->ep[side_idx][plane_idx];
+		if (((ep->addr_len != 4) && (ep->addr_len != 16))
+		    || !ep->port || !ep->tei_orig)
+			return -1;
+	}
+
+	tun = gtphub_tunnel_new(hub);
+	if (!tun)
+		return -1;
+	tun->tei_repl = rec->tei_repl;
+
+	for_each_side_and_plane(side_idx, plane_idx) {
+		const struct gtphub_journal_endpoint *ep = &rec->ep[side_idx][plane_idx];
+		struct gtphub_tunnel_endpoint *te = &tun->endpoint[side_idx][plane_idx];
+		struct gsn_addr addr;
+
+		addr.len = ep->addr_len;
+		memcpy(addr.buf, ep->addr, ep->addr_len);
+		gtphub_tunnel_endpoint_set_peer(te,
+			gtphub_port_have(hub, &hub->to_gsns[side_idx][plane_idx],
+					 &addr, ep->port));
+		te->tei_orig = ep->tei_orig;
+	}
+
+	llist_add(&tun->entry, &hub->tunnels);
+	gtphub_tunnel_index_tei(hub, tun);
+	for_each_side_and_plane(side_idx, plane_idx)
+		gtphub_tunnel_endpoint_index(hub, tun, side_idx, plane_idx);
+	gtphub_tunnel_refresh(hub, tun, now);
+
+	LOG(LOGL_DEBUG, "restored: %s\n", gtphub_tunnel_str(tun));
+	return 0;
+}
+
+/* Replay the journal records in buf on hub. Return the number of tunnels. */
+static int gtphub_journal_restore(struct gtphub *hub, const uint8_t *buf,
+				  size_t len, time_t now)
+{
+	struct gtphub_journal_rec rec;
+	struct gtphub_tunnel *tun;
+	time_t wall = time(NULL);
+	uint32_t last_tei = 0;
+	size_t pos;
+
+	/* A truncated last record, from a crash while writing it, is
+	 * ignored. */
+	for (pos = sizeof(struct gtphub_journal_head);
+	     pos + sizeof(rec) <= len;
+	     pos += sizeof(rec)) {
+		memcpy(&rec, buf + pos, sizeof(rec));
+
+		tun = gtphub_tunnel_find_tei_repl(hub, rec.tei_repl);
+		if (tun)
+			expiring_item_del(&tun->expiry_entry);
+
+		if (rec.type != GTPH_JOURNAL_PUT)
+			continue;
+
+		/* Compaction rewrites all live tunnels regularly, so an older
+		 * record means the tunnel has expired meanwhile. */
+		if (wall - rec.written > GTPH_EXPIRE_SLOWLY_MINUTES * 60)
+			continue;
+
+		if (gtphub_journal_restore_tunnel(hub, &rec, now) != 0) {
+			LOG(LOGL_ERROR, "Tunnel journal %s: ignoring invalid"
+			    " record for TEI %u\n", hub->journal_path,
+			    rec.tei_repl);
+			continue;
 		}
+		last_tei = rec.tei_repl;
 	}
+
+	/* Continue TEI allocation after the restored ones. Which exact TEIs are
+	 * taken is checked when allocating. */
+	if (last_tei)
+		hub->tei_pool.last_nr = last_tei;
+
+	return hub->tunnels_by_tei.count;
 }
 
-void gtphub_gc(struct gtphub *hub, time_t now)
+int gtphub_journal_compact(struct gtphub *hub, time_t now)
 {
-	int expired;
-	expired = expiry_tick(&hub->expire_quickly, now);
-	expired += expiry_tick(&hub->expire_slowly, now);
+	struct gtphub_journal_head head;
+	struct gtphub_journal_rec rec;
+	struct gtphub_tunnel *tun;
+	unsigned int records = 0;
+	char *tmp_path;
+	FILE *f;
+	int fd;
+
+	OSMO_ASSERT(hub->journal_path);
+
+	/* Also on failure, to not retry on every gc tick. */
+	hub->journal_compacted = now;
+
+	tmp_path = talloc_asprintf(osmo_gtphub_ctx, "%s.tmp",
+				   hub->journal_path);
+	f = fopen(tmp_path, "w");
+	if (!f) {
+		LOG(LOGL_ERROR, "Tunnel journal: cannot write %s: %s\n",
+		    tmp_path, strerror(errno));
+		talloc_free(tmp_path);
+		return -1;
+	}
+
+	memset(&head, 0, sizeof(head));
+	memcpy(head.magic, GTPH_JOURNAL_MAGIC, sizeof(head.magic));
+	head.restart_counter = hub->restart_counter;
+	fwrite(&head, sizeof(head), 1, f);
+
+	llist_for_each_entry(tun, &hub->tunnels, entry) {
+		tun->journaled = gtphub_tunnel_complete(tun);
+		if (!tun->journaled)
+			continue;
+		gtphub_journal_rec_init(&rec, tun, GTPH_JOURNAL_PUT);
+		fwrite(&rec, sizeof(rec), 1, f);
+		records ++;
+	}
+
+	int err = ferror(f);
+	if (fclose(f) != 0)
+		err = 1;
+	if (err) {
+		LOG(LOGL_ERROR, "Tunnel journal: cannot write %s\n", tmp_path);
+		unlink(tmp_path);
+		talloc_free(tmp_path);
+		return -1;
+	}
+
+	if (rename(tmp_path, hub->journal_path) != 0) {
+		LOG(LOGL_ERROR, "Tunnel journal: cannot rename %s: %s\n",
+		    tmp_path, strerror(errno));
+		unlink(tmp_path);
+		talloc_free(tmp_path);
+		return -1;
+	}
+	talloc_free(tmp_path);
+
+	fd = open(hub->journal_path, O_WRONLY | O_APPEND | O_CLOEXEC);
+	if (fd < 0) {
+		gtphub_journal_fail(hub, "open");
+		return -1;
+	}
+	if (hub->journal_fd >= 0)
+		close(hub->journal_fd);
+	hub->journal_fd = fd;
+	hub->journal_records = records;
+
+	LOG(LOGL_DEBUG, "Tunnel journal %s compacted to %u tunnels\n",
+	    hub->journal_path, records);
+	return 0;
+}
+
+int gtphub_journal_open(struct gtphub *hub, const char *path, time_t now)
+{
+	struct gtphub_journal_head head;
+	struct stat st;
+	uint8_t *buf;
+	int restored = 0;
+	int fd;
+
+	gtphub_journal_close(hub);
+	hub->journal_path = talloc_strdup(osmo_gtphub_ctx, path);
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		if (errno != ENOENT) {
+			LOG(LOGL_ERROR, "Tunnel journal: cannot open %s: %s\n",
+			    path, strerror(errno));
+			goto fail;
+		}
+	} else {
+		if (fstat(fd, &st) != 0) {
+			LOG(LOGL_ERROR, "Tunnel journal: cannot stat %s: %s\n",
+			    path, strerror(errno));
+			close(fd);
+			goto fail;
+		}
 
-	/* ... */
+		if (st.st_size >= (off_t)sizeof(head)) {
+			buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+				   fd, 0);
+			if (buf == MAP_FAILED) {
+				LOG(LOGL_ERROR, "Tunnel journal: cannot map"
+				    " %s: %s\n", path, strerror(errno));
+				close(fd);
+				goto fail;
+			}
 
-	if (expired) {
-		int s, p;
-		for_each_side_and_plane(s, p) {
-			gtphub_gc_bind(&hub->to_gsns[s][p]);
+			memcpy(&head, buf, sizeof(head));
+			if (memcmp(head.magic, GTPH_JOURNAL_MAGIC,
+				   sizeof(head.magic)) == 0) {
+				restored = gtphub_journal_restore(hub, buf,
+								  st.st_size,
+								  now);
+				/* No tunnel state was lost, so peers need
+				 * not see a restart. This also keeps workers
+				 * without any tunnels in line with the
+				 * others. */
+				hub->restart_counter = head.restart_counter;
+				LOG(LOGL_NOTICE, "Restored %d tunnels from %s,"
+				    " keeping restart counter %u\n", restored,
+				    path, (unsigned int)hub->restart_counter);
+			} else
+				LOG(LOGL_ERROR, "Tunnel journal: %s is not a"
+				    " tunnel journal, ignoring it\n", path);
+			munmap(buf, st.st_size);
 		}
+		close(fd);
+	}
+
+	if (gtphub_journal_compact(hub, now) != 0)
+		goto fail;
+	return restored;
+
+fail:
+	gtphub_journal_close(hub);
+	return -1;
+}
+
+void gtphub_journal_close(struct gtphub *hub)
+{
+	if (hub->journal_fd >= 0)
+		close(hub->journal_fd);
+	hub->journal_fd = -1;
+	hub->journal_records = 0;
+	talloc_free(hub->journal_path);
+	hub->journal_path = NULL;
+}
+
+void gtphub_gc(struct gtphub *hub, time_t now)
+{
+	int s, p;
+
+	expiry_tick(&hub->expire_quickly, now);
+	expiry_tick(&hub->expire_slowly, now);
+	gtphub_gc_resolved_ggsns(hub, now);
+	gtphub_ggsn_pool_echo_tick(hub, now);
+
+	for_each_side_and_plane(s, p) {
+		gtphub_gc_bind(&hub->to_gsns[s][p]);
 	}
+
+	if ((hub->journal_fd >= 0)
+	    && ((now - hub->journal_compacted >= GTPH_JOURNAL_COMPACT_SECS)
+		|| ((now - hub->journal_compacted >= GTPH_JOURNAL_COMPACT_RETRY_SECS)
+		    && (hub->journal_records > GTPH_JOURNAL_COMPACT_MIN)
+		    && (hub->journal_records > 2 * hub->tunnels_by_tei.count))))
+		gtphub_journal_compact(hub, now);
 }
 
 static void gtphub_gc_cb(void *data)
@@ -2468,17 +4138,26 @@ void gtphub_init(struct gtphub *hub)
 	gtphub_zero(hub);
 
 	INIT_LLIST_HEAD(&hub->tunnels);
+	hash_index_init(&hub->tunnels_by_tei);
+	hash_index_init(&hub->seq_reqs);
 	INIT_LLIST_HEAD(&hub->pending_deletes);
 
 	expiry_init(&hub->expire_quickly, GTPH_EXPIRE_QUICKLY_SECS);
 	expiry_init(&hub->expire_slowly, GTPH_EXPIRE_SLOWLY_MINUTES * 60);
 
+	hub->workers = 1;
 	nr_pool_init(&hub->tei_pool, 1, 0xffffffff);
+	hub->journal_fd = -1;
+
+	hub->counters = rate_ctr_group_alloc(osmo_gtphub_ctx,
+					     &gtphub_ctrg_hub_desc, 0);
+	OSMO_ASSERT(hub->counters);
 
 	int side_idx;
 	int plane_idx;
 	for_each_side_and_plane(side_idx, plane_idx) {
 		gtphub_bind_init(&hub->to_gsns[side_idx][plane_idx], CTR_IDX_HUB(side_idx, plane_idx));
+		hash_index_init(&hub->endpoints_by_tei_orig[side_idx][plane_idx]);
 	}
 
 	hub->to_gsns[GTPH_SIDE_SGSN][GTPH_PLANE_CTRL].label = "SGSN Ctrl";
@@ -2492,6 +4171,11 @@ void gtphub_init(struct gtphub *hub)
  * segfaults when trying to close uninitialized ofds. */
 void gtphub_free(struct gtphub *hub)
 {
+	/* Close the journal first, so that expiring the tunnels below doesn't
+	 * remove them from it. */
+	gtphub_journal_close(hub);
+	gtphub_ggsn_pool_free(hub);
+
 	/* By expiring all mappings, a garbage collection should free
 	 * everything else. A gtphub_bind_free() will assert that everything is
 	 * indeed empty. */
@@ -2504,6 +4188,9 @@ void gtphub_free(struct gtphub *hub)
 		gtphub_gc_bind(&hub->to_gsns[side_idx][plane_idx]);
 		gtphub_bind_free(&hub->to_gsns[side_idx][plane_idx]);
 	}
+
+	rate_ctr_group_free(hub->counters);
+	hub->counters = NULL;
 }
 
 void gtphub_stop(struct gtphub *hub)
@@ -2513,6 +4200,8 @@ void gtphub_stop(struct gtphub *hub)
 	for_each_side_and_plane(side_idx, plane_idx) {
 		gtphub_bind_stop(&hub->to_gsns[side_idx][plane_idx]);
 	}
+	talloc_free(hub->batch);
+	hub->batch = NULL;
 	gtphub_free(hub);
 }
 
@@ -2535,14 +4224,42 @@ static int gtphub_make_proxy(struct gtphub *hub,
 	return 0;
 }
 
-int gtphub_start(struct gtphub *hub, struct gtphub_cfg *cfg,
-		 uint8_t restart_counter)
+/* Restrict hub to worker_id's slice of TEIs and of the sequence nrs of peers
+ * added from now on. Also called by unit tests. */
+void gtphub_init_worker(struct gtphub *hub, unsigned int workers,
+			unsigned int worker_id)
+{
+	uint32_t tei_min, tei_max;
+
+	hub->workers = workers;
+	hub->worker_id = worker_id;
+	if (workers <= 1)
+		return;
+
+	gtphub_worker_slice(hub, 0x100000000ULL, &tei_min, &tei_max);
+	nr_pool_init(&hub->tei_pool, tei_min ? tei_min : 1, tei_max);
+	LOG(LOGL_NOTICE, "Worker %u of %u: TEIs 0x%x..0x%x\n",
+	    worker_id, workers, hub->tei_pool.nr_min, hub->tei_pool.nr_max);
+}
+
+static int gtphub_start_worker(struct gtphub *hub, struct gtphub_cfg *cfg,
+			       uint8_t restart_counter,
+			       unsigned int workers, unsigned int worker_id,
+			       int fds[GTPH_SIDE_N][GTPH_PLANE_N])
 {
 	gtphub_init(hub);
+	gtphub_init_worker(hub, workers, worker_id);
 
 	hub->restart_counter = restart_counter;
 	hub->sgsn_use_sender = cfg->sgsn_use_sender? 1 : 0;
 
+	hub->batch_size = cfg->batch_size;
+	if (!hub->batch_size)
+		hub->batch_size = GTPH_BATCH_SIZE_DEFAULT;
+	if (hub->batch_size > GTPH_BATCH_SIZE_MAX)
+		hub->batch_size = GTPH_BATCH_SIZE_MAX;
+	hub->batch = gtphub_batch_alloc(hub->batch_size);
+
 	/* If a Ctrl plane proxy is configured, ares will never be used. */
 	if (!cfg->proxy[GTPH_SIDE_GGSN][GTPH_PLANE_CTRL].addr_str) {
 		if (gtphub_ares_init(hub) != 0) {
@@ -2560,7 +4277,8 @@ int gtphub_start(struct gtphub *hub, struct gtphub_cfg *cfg,
 				       (side_idx == GTPH_SIDE_SGSN)
 					       ? from_sgsns_read_cb
 					       : from_ggsns_read_cb,
-				       hub, plane_idx);
+				       hub, plane_idx,
+				       fds ? fds[side_idx][plane_idx] : -1);
 		if (rc) {
 			LOG(LOGL_FATAL, "Failed to bind for %ss (%s)\n",
 			    gtphub_side_idx_names[side_idx],
@@ -2595,40 +4313,191 @@ int gtphub_start(struct gtphub *hub, struct gtphub_cfg *cfg,
 	if (hub->sgsn_use_sender)
 		LOG(LOGL_NOTICE, "Using sender address and port for SGSN instead of GSN Addr IE and default ports.\n");
 
+	unsigned int i;
+	for (i = 0; i < cfg->ggsn_pool_len; i++) {
+		const struct gtphub_cfg_ggsn *c = &cfg->ggsn_pool[i];
+		struct gsn_addr gsna;
+		if ((gsn_addr_from_str(&gsna, c->addr_str) != 0)
+		    || !gtphub_ggsn_pool_add(hub, &gsna, c->weight)) {
+			LOG(LOGL_FATAL, "Cannot add GGSN pool member %s\n",
+			    c->addr_str);
+			return -1;
+		}
+	}
+
+	if (cfg->journal_path) {
+		/* Each worker owns a different slice of TEIs and keeps its own
+		 * journal. */
+		char *path = worker_id
+			? talloc_asprintf(osmo_gtphub_ctx, "%s.%u",
+					  cfg->journal_path, worker_id)
+			: talloc_strdup(osmo_gtphub_ctx, cfg->journal_path);
+		int rc = gtphub_journal_open(hub, path, gtphub_now());
+		talloc_free(path);
+		if (rc < 0) {
+			LOG(LOGL_FATAL, "Cannot use tunnel journal %s\n",
+			    cfg->journal_path);
+			return -1;
+		}
+	}
+
 	gtphub_gc_start(hub);
 	return 0;
 }
 
-static struct gtphub_peer_addr *gtphub_peer_find_addr(const struct gtphub_peer *peer,
-						      const struct gsn_addr *addr)
+/* Program for SO_ATTACH_REUSEPORT_CBPF, run on the UDP payload of each
+ * datagram to pick the worker's socket: by the header TEI, which gtphub mapped
+ * from the worker's slice of TEIs, or by the sequence nr for messages with a
+ * zero TEI (Create PDP Context Request, Echo). Any worker can handle those
+ * that do not map to a worker. */
+static int gtphub_steer_workers(int fd, unsigned int workers)
 {
-	struct gtphub_peer_addr *a;
-	llist_for_each_entry(a, &peer->addresses, entry) {
-		if (gsn_addr_same(&a->addr, addr))
-			return a;
+	struct sock_filter code[] = {
+		/* A = GTPv1 header TEI */
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 4),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 2, 0),
+		BPF_STMT(BPF_ALU | BPF_DIV | BPF_K, 0x100000000ULL / workers),
+		BPF_STMT(BPF_JMP | BPF_JA, 2),
+		/* TEI is zero: A = sequence nr */
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 8),
+		BPF_STMT(BPF_ALU | BPF_DIV | BPF_K, 0x10000 / workers),
+		/* The last worker's slice includes the remainder. */
+		BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, workers, 0, 1),
+		BPF_STMT(BPF_LD | BPF_IMM, workers - 1),
+		BPF_STMT(BPF_RET | BPF_A, 0),
+	};
+	struct sock_fprog prog = {
+		.len = ARRAY_SIZE(code),
+		.filter = code,
+	};
+
+	return setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+			  &prog, sizeof(prog));
+}
+
+/* Return a new UDP socket bound to addr with SO_REUSEPORT, or -1. */
+static int gtphub_reuseport_sock(const struct gtphub_cfg_addr *addr)
+{
+	struct osmo_sockaddr sa;
+	int on = 1;
+	int fd;
+
+	if (!addr->addr_str || !addr->port
+	    || osmo_sockaddr_init_udp(&sa, addr->addr_str, addr->port) != 0) {
+		LOG(LOGL_FATAL, "Invalid bind address %s port %d\n",
+		    addr->addr_str, (int)addr->port);
+		return -1;
 	}
-	return NULL;
+
+	fd = socket(sa.a.ss_family, SOCK_DGRAM, IPPROTO_UDP);
+	if (fd < 0)
+		return -1;
+
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on))
+	    || fcntl(fd, F_SETFL, O_NONBLOCK)
+	    || bind(fd, (struct sockaddr*)&sa.a, sa.l)) {
+		LOG(LOGL_FATAL, "Cannot bind to %s port %d: %s\n",
+		    addr->addr_str, (int)addr->port, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
 }
 
-static struct gtphub_peer_port *gtphub_addr_find_port(const struct gtphub_peer_addr *a,
-						      uint16_t port)
+int gtphub_start(struct gtphub *hub, struct gtphub_cfg *cfg,
+		 uint8_t restart_counter)
 {
-	OSMO_ASSERT(port);
-	struct gtphub_peer_port *pp;
-	llist_for_each_entry(pp, &a->ports, entry) {
-		if (pp->port == port)
-			return pp;
+	unsigned int workers = cfg->workers;
+	int fds[GTPH_WORKERS_MAX][GTPH_SIDE_N][GTPH_PLANE_N];
+	unsigned int worker_id;
+	unsigned int w;
+	int side_idx;
+	int plane_idx;
+
+	if (workers <= 1)
+		return gtphub_start_worker(hub, cfg, restart_counter, 1, 0,
+					   NULL);
+	if (workers > GTPH_WORKERS_MAX)
+		workers = GTPH_WORKERS_MAX;
+
+	for (w = 0; w < workers; w++) {
+		for_each_side_and_plane(side_idx, plane_idx)
+			fds[w][side_idx][plane_idx] = -1;
 	}
-	return NULL;
+
+	/* Bind all sockets in worker order before forking: the index of a
+	 * socket in its SO_REUSEPORT group, which the steering program
+	 * returns, is the order of binding. */
+	for (w = 0; w < workers; w++) {
+		for_each_side_and_plane(side_idx, plane_idx) {
+			fds[w][side_idx][plane_idx] =
+				gtphub_reuseport_sock(&cfg->to_gsns[side_idx][plane_idx].bind);
+			if (fds[w][side_idx][plane_idx] < 0)
+				goto close_fds;
+			if (w == 0
+			    && gtphub_steer_workers(fds[w][side_idx][plane_idx],
+						    workers)) {
+				LOG(LOGL_FATAL, "Cannot attach worker steering"
+				    " program: %s\n", strerror(errno));
+				goto close_fds;
+			}
+		}
+	}
+
+	worker_id = 0;
+	for (w = 1; w < workers; w++) {
+		pid_t pid = fork();
+		if (pid < 0) {
+			LOG(LOGL_FATAL, "Cannot fork worker %u: %s\n", w,
+			    strerror(errno));
+			goto close_fds;
+		}
+		if (pid == 0) {
+			/* Don't outlive the first worker. */
+			prctl(PR_SET_PDEATHSIG, SIGTERM);
+			worker_id = w;
+			break;
+		}
+	}
+
+	/* Each worker keeps only its own sockets. */
+	for (w = 0; w < workers; w++) {
+		if (w == worker_id)
+			continue;
+		for_each_side_and_plane(side_idx, plane_idx)
+			close(fds[w][side_idx][plane_idx]);
+	}
+
+	return gtphub_start_worker(hub, cfg, restart_counter, workers,
+				   worker_id, fds[worker_id]);
+
+close_fds:
+	for (w = 0; w < workers; w++) {
+		for_each_side_and_plane(side_idx, plane_idx) {
+			if (fds[w][side_idx][plane_idx] >= 0)
+				close(fds[w][side_idx][plane_idx]);
+		}
+	}
+	return -1;
+}
+
+static uint32_t gtphub_addr_hash(const struct gsn_addr *addr)
+{
+	return hash_buf(0, addr->buf, addr->len);
+}
+
+static uint32_t gtphub_port_hash(const struct gsn_addr *addr, uint16_t port)
+{
+	return hash_buf(gtphub_addr_hash(addr), &port, sizeof(port));
 }
 
 static struct gtphub_peer_addr *gtphub_addr_find(const struct gtphub_bind *bind,
 						 const struct gsn_addr *addr)
 {
-	struct gtphub_peer *peer;
-	llist_for_each_entry(peer, &bind->peers, entry) {
-		struct gtphub_peer_addr *a = gtphub_peer_find_addr(peer, addr);
-		if (a)
+	struct gtphub_peer_addr *a;
+	uint32_t hash = gtphub_addr_hash(addr);
+	hash_index_for_each_possible(&bind->addrs_by_addr, a, addr_hash, hash) {
+		if (gsn_addr_same(&a->addr, addr))
 			return a;
 	}
 	return NULL;
@@ -2638,10 +4507,14 @@ static struct gtphub_peer_port *gtphub_port_find(const struct gtphub_bind *bind,
 						 const struct gsn_addr *addr,
 						 uint16_t port)
 {
-	struct gtphub_peer_addr *a = gtphub_addr_find(bind, addr);
-	if (!a)
-		return NULL;
-	return gtphub_addr_find_port(a, port);
+	struct gtphub_peer_port *pp;
+	uint32_t hash = gtphub_port_hash(addr, port);
+	hash_index_for_each_possible(&bind->ports_by_addr, pp, port_hash, hash) {
+		if (pp->port == port
+		    && gsn_addr_same(&pp->peer_addr->addr, addr))
+			return pp;
+	}
+	return NULL;
 }
 
 struct gtphub_peer_port *gtphub_port_find_sa(const struct gtphub_bind *bind,
@@ -2663,20 +4536,26 @@ static struct gtphub_peer *gtphub_peer_new(struct gtphub *hub,
 	OSMO_ASSERT(peer);
 
 	INIT_LLIST_HEAD(&peer->addresses);
+	INIT_LLIST_HEAD(&peer->gc_entry);
+	peer->bind = bind;
 
-	nr_pool_init(&peer->seq_pool, 0, 0xffff);
+	uint32_t seq_min, seq_max;
+	gtphub_worker_slice(hub, 0x10000, &seq_min, &seq_max);
+	nr_pool_init(&peer->seq_pool, seq_min, seq_max);
 	nr_map_init(&peer->seq_map, &peer->seq_pool, &hub->expire_quickly);
 
 	/* TODO use something random to pick the initial sequence nr.
 	   0x6d31 produces the ASCII character sequence 'm1', currently used in
 	   gtphub_nc_test.sh. */
-	peer->seq_pool.last_nr = 0x6d31 - 1;
+	if (seq_min < 0x6d31 && 0x6d31 <= seq_max)
+		peer->seq_pool.last_nr = 0x6d31 - 1;
 
 	llist_add(&peer->entry, &bind->peers);
 	return peer;
 }
 
-static struct gtphub_peer_addr *gtphub_peer_add_addr(struct gtphub_peer *peer,
+static struct gtphub_peer_addr *gtphub_peer_add_addr(struct gtphub_bind *bind,
+						     struct gtphub_peer *peer,
 						     const struct gsn_addr *addr)
 {
 	struct gtphub_peer_addr *a;
@@ -2686,6 +4565,9 @@ static struct gtphub_peer_addr *gtphub_peer_add_addr(struct gtphub_peer *peer,
 	gsn_addr_copy(&a->addr, addr);
 	INIT_LLIST_HEAD(&a->ports);
 	llist_add(&a->entry, &peer->addresses);
+	hash_index_entry_init(&a->addr_hash);
+	hash_index_add(&bind->addrs_by_addr, &a->addr_hash,
+		       gtphub_addr_hash(&a->addr));
 
 	return a;
 }
@@ -2703,7 +4585,7 @@ static struct gtphub_peer_addr *gtphub_addr_have(struct gtphub *hub,
 	 * to this peer later, but not via this function. */
 	struct gtphub_peer *peer = gtphub_peer_new(hub, bind);
 
-	a = gtphub_peer_add_addr(peer, addr);
+	a = gtphub_peer_add_addr(bind, peer, addr);
 	
 	LOG(LOGL_DEBUG, "New peer address: %s %s\n",
 	    bind->label,
@@ -2712,9 +4594,11 @@ static struct gtphub_peer_addr *gtphub_addr_have(struct gtphub *hub,
 	return a;
 }
 
-static struct gtphub_peer_port *gtphub_addr_add_port(struct gtphub_peer_addr *a,
+static struct gtphub_peer_port *gtphub_addr_add_port(struct gtphub_bind *bind,
+						     struct gtphub_peer_addr *a,
 						     uint16_t port)
 {
+	OSMO_ASSERT(port);
 	struct gtphub_peer_port *pp;
 
 	pp = talloc_zero(osmo_gtphub_ctx, struct gtphub_peer_port);
@@ -2737,6 +4621,13 @@ static struct gtphub_peer_port *gtphub_addr_add_port(struct gtphub_peer_addr *a,
 	}
 
 	llist_add(&pp->entry, &a->ports);
+	hash_index_entry_init(&pp->port_hash);
+	hash_index_add(&bind->ports_by_addr, &pp->port_hash,
+		       gtphub_port_hash(&a->addr, port));
+
+	/* Unless referenced soon, e.g. by a tunnel, gc will remove it. */
+	INIT_LLIST_HEAD(&pp->gc_entry);
+	gtphub_port_gc_candidate(pp);
 
 	LOG(LOGL_DEBUG, "New peer port: %s port %d\n",
 	    gsn_addr_to_str(&a->addr),
@@ -2750,18 +4641,17 @@ struct gtphub_peer_port *gtphub_port_have(struct gtphub *hub,
 					  const struct gsn_addr *addr,
 					  uint16_t port)
 {
-	struct gtphub_peer_addr *a = gtphub_addr_have(hub, bind, addr);
-
-	struct gtphub_peer_port *pp = gtphub_addr_find_port(a, port);
+	struct gtphub_peer_port *pp = gtphub_port_find(bind, addr, port);
 	if (pp)
 		return pp;
 
-	return gtphub_addr_add_port(a, port);
+	struct gtphub_peer_addr *a = gtphub_addr_have(hub, bind, addr);
+	return gtphub_addr_add_port(bind, a, port);
 }
 
 /* Find a GGSN peer with a matching address. If the address is known but the
  * port not, create a new port for that peer address. */
-struct gtphub_peer_port *gtphub_known_addr_have_port(const struct gtphub_bind *bind,
+struct gtphub_peer_port *gtphub_known_addr_have_port(struct gtphub_bind *bind,
 						     const struct osmo_sockaddr *addr)
 {
 	struct gtphub_peer_addr *pa;
@@ -2773,44 +4663,46 @@ struct gtphub_peer_port *gtphub_known_addr_have_port(const struct gtphub_bind *b
 	if (rc < 0)
 		LOG(LOGL_ERROR, "%s(): failed to obtain GSN address\n", __func__);
 
+	pp = gtphub_port_find(bind, &gsna, port);
+	if (pp)
+		return pp;
+
 	pa = gtphub_addr_find(bind, &gsna);
 	if (!pa)
 		return NULL;
 
-	pp = gtphub_addr_find_port(pa, port);
-
-	if (!pp)
-		pp = gtphub_addr_add_port(pa, port);
-
-	return pp;
+	return gtphub_addr_add_port(bind, pa, port);
 }
 
 
 /* Return 0 if the message in p is not applicable for GGSN resolution, -1 if
  * resolution should be possible but failed, and 1 if resolution was
- * successful. *pp will be set to NULL if <1 is returned. */
+ * successful. *pp will be set to NULL if <1 is returned. If resolution is
+ * still pending, -1 is returned and *parked is set to where to park p. */
 static int gtphub_resolve_ggsn(struct gtphub *hub,
 			       struct gtp_packet_desc *p,
-			       struct gtphub_peer_port **pp)
+			       struct gtphub_peer_port **pp,
+			       struct llist_head **parked)
 {
 	*pp = NULL;
+	*parked = NULL;
 
 	/* TODO determine from message type whether IEs should be present? */
 
 	int rc;
 	const char *imsi_str;
-	rc = get_ie_imsi_str(p->ie, 0, &imsi_str);
+	rc = gtp_get_imsi_str(p, &imsi_str);
 	if (rc < 1)
 		return rc;
 	OSMO_ASSERT(imsi_str);
 
 	const char *apn_str;
-	rc = get_ie_apn_str(p->ie, &apn_str);
+	rc = gtp_get_apn_str(p, &apn_str);
 	if (rc < 1)
 		return rc;
 	OSMO_ASSERT(apn_str);
 
-	*pp = gtphub_resolve_ggsn_addr(hub, imsi_str, apn_str);
+	*pp = gtphub_resolve_ggsn_addr(hub, imsi_str, apn_str, parked);
 	return (*pp)? 1 : -1;
 }
 
@@ -52,6 +52,7 @@ int gtphub_ares_init(struct gtphub *hub)
 struct ggsn_lookup {
 	struct llist_head entry;
 	struct expiring_item expiry_entry;
+	struct hash_index_entry apn_oi_hash; /* in hub->ggsn_lookups_by_apn_oi */
 
 	struct gtphub *hub;
 
@@ -59,12 +60,15 @@ struct ggsn_lookup {
 	char apn_ni_str[GSM_APN_LENGTH];
 	char apn_oi_str[GSM_APN_LENGTH];
 	int have_3dig_mnc;
+
+	/* Requests waiting for this lookup, see gtphub_parked_forward(). */
+	struct llist_head parked;
 };
 
 static int start_ares_query(struct ggsn_lookup *lookup);
 
 static void ggsn_lookup_cb(void *arg, int status, int timeouts,
-			   struct hostent *hostent)
+			   struct hostent *hostent, int ttl)
 {
 	struct ggsn_lookup *lookup = arg;
 	LOGP(DGTPHUB, LOGL_NOTICE, "ggsn_lookup_cb(%p / %p)", lookup,
@@ -106,8 +110,12 @@ static void ggsn_lookup_cb(void *arg, int status, int timeouts,
 	     osmo_hexdump((unsigned char*)&resolved_addr,
 			  sizeof(resolved_addr)));
 
-	gtphub_resolved_ggsn(lookup->hub, lookup->apn_oi_str, &resolved_addr,
-			     gtphub_now());
+	struct gtphub_peer_port *pp;
+	pp = gtphub_resolved_ggsn(lookup->hub, lookup->apn_oi_str,
+				  &resolved_addr, ttl, gtphub_now());
+	if (pp)
+		gtphub_parked_forward(lookup->hub, &lookup->parked, pp,
+				      gtphub_now());
 
 remove_from_queue:
 	LOGP(DGTPHUB, LOGL_ERROR, "Removing GGSN lookup. (%p / %p)\n", lookup,
@@ -130,8 +138,8 @@ static int start_ares_query(struct ggsn_lookup *lookup)
 	LOGP(DGTPHUB, LOGL_DEBUG, "Going to query %s (%p / %p)\n",
 	     lookup->apn_oi_str, lookup, &lookup->expiry_entry);
 
-	int rc = sgsn_ares_query(sgsn, lookup->apn_oi_str, ggsn_lookup_cb,
-				 lookup);
+	int rc = sgsn_ares_query_ttl(sgsn, lookup->apn_oi_str, ggsn_lookup_cb,
+				     lookup);
 	if (rc != 0)
 		LOGP(DGTPHUB, LOGL_ERROR, "Failed to start ares query.\n");
 	return rc;
@@ -148,13 +156,31 @@ static void ggsn_lookup_del_cb(struct expiring_item *expi)
 	lookup->expiry_entry.del_cb = 0;
 	expiring_item_del(expi);
 
+	gtphub_parked_drop(&lookup->parked);
+
+	hash_index_del(&lookup->apn_oi_hash);
 	llist_del(&lookup->entry);
 	talloc_free(lookup);
 }
 
+static struct ggsn_lookup *ggsn_lookup_find(struct gtphub *hub,
+					    const char *apn_oi_str)
+{
+	struct ggsn_lookup *active;
+	uint32_t hash = gtphub_apn_oi_hash(apn_oi_str);
+	hash_index_for_each_possible(&hub->ggsn_lookups_by_apn_oi, active,
+				     apn_oi_hash, hash) {
+		if (strncmp(active->apn_oi_str, apn_oi_str,
+			    sizeof(active->apn_oi_str)) == 0)
+			return active;
+	}
+	return NULL;
+}
+
 struct gtphub_peer_port *gtphub_resolve_ggsn_addr(struct gtphub *hub,
 						  const char *imsi_str,
-						  const char *apn_ni_str)
+						  const char *apn_ni_str,
+						  struct llist_head **parked)
 {
 	OSMO_ASSERT(imsi_str);
 	OSMO_ASSERT(apn_ni_str);
@@ -168,6 +194,8 @@ struct gtphub_peer_port *gtphub_resolve_ggsn_addr(struct gtphub *hub,
 	     imsi_str, apn_ni_str, lookup, &lookup->expiry_entry);
 
 	expiring_item_init(&lookup->expiry_entry);
+	hash_index_entry_init(&lookup->apn_oi_hash);
+	INIT_LLIST_HEAD(&lookup->parked);
 	lookup->hub = hub;
 
 	osmo_strlcpy(lookup->imsi_str, imsi_str, sizeof(lookup->imsi_str));
@@ -176,45 +204,59 @@ struct gtphub_peer_port *gtphub_resolve_ggsn_addr(struct gtphub *hub,
 
 	make_addr_str(lookup);
 
-	struct ggsn_lookup *active;
-	llist_for_each_entry(active, &hub->ggsn_lookups, entry) {
-		if (strncmp(active->apn_oi_str, lookup->apn_oi_str,
-			    sizeof(lookup->apn_oi_str)) == 0) {
-			LOGP(DGTPHUB, LOGL_DEBUG,
-			     "Query already pending for %s\n",
-			     lookup->apn_oi_str);
-			/* A query already pending. Just tip our hat. */
-			return NULL;
-		}
+	char apn_oi_str[GSM_APN_LENGTH];
+	osmo_strlcpy(apn_oi_str, lookup->apn_oi_str, sizeof(apn_oi_str));
+
+	struct gtphub_peer_port *pp;
+	int prefetch;
+	pp = gtphub_resolved_ggsn_find(hub, apn_oi_str, gtphub_now(),
+				       &prefetch);
+
+	struct ggsn_lookup *active = ggsn_lookup_find(hub, apn_oi_str);
+	if (active || (pp && !prefetch)) {
+		talloc_free(lookup);
+		if (pp)
+			return pp;
+		LOGP(DGTPHUB, LOGL_DEBUG, "Query already pending for %s\n",
+		     apn_oi_str);
+		/* A query already pending. Wait along with it. */
+		*parked = &active->parked;
+		return NULL;
 	}
 
-	struct gtphub_resolved_ggsn *resolved;
-	llist_for_each_entry(resolved, &hub->resolved_ggsns, entry) {
-		if (strncmp(resolved->apn_oi_str, lookup->apn_oi_str,
-			    sizeof(lookup->apn_oi_str)) == 0) {
-			LOGP(DGTPHUB, LOGL_DEBUG,
-			     "GGSN resolved from cache: %s -> %s\n",
-			     lookup->apn_oi_str,
-			     gtphub_port_str(resolved->peer));
-			return resolved->peer;
-		}
+	if (pp) {
+		/* Still valid, but refresh it before it runs out. */
+		LOGP(DGTPHUB, LOGL_DEBUG, "Refreshing GGSN for %s\n",
+		     apn_oi_str);
+		rate_ctr_inc(&hub->counters->ctr[GTPH_CTR_GGSN_PREFETCH]);
+	} else {
+		/* Kick off a resolution, but so far return nothing. The
+		 * caller parks the request in lookup->parked, to be forwarded
+		 * once the GGSN is resolved. */
+		LOGP(DGTPHUB, LOGL_DEBUG,
+		     "Sending out DNS query for %s..."
+		     " (Parking the request until resolution has concluded)\n",
+		     apn_oi_str);
 	}
 
-	/* Kick off a resolution, but so far return nothing. The hope is that
-	 * the peer will resend the request (a couple of times), and by then
-	 * the GGSN will be resolved. */
-	LOGP(DGTPHUB, LOGL_DEBUG,
-	     "Sending out DNS query for %s..."
-	     " (Returning failure, hoping for a retry once resolution"
-	     " has concluded)\n",
-	     lookup->apn_oi_str);
-
 	llist_add(&lookup->entry, &hub->ggsn_lookups);
+	hash_index_add(&hub->ggsn_lookups_by_apn_oi, &lookup->apn_oi_hash,
+		       gtphub_apn_oi_hash(apn_oi_str));
 
 	lookup->expiry_entry.del_cb = ggsn_lookup_del_cb;
 	expiry_add(&hub->expire_quickly, &lookup->expiry_entry, gtphub_now());
 
 	start_ares_query(lookup);
 
-	return NULL;
+	if (pp)
+		return pp;
+
+	/* c-ares may answer right away, e.g. from /etc/hosts, in which case
+	 * ggsn_lookup_cb() has already removed the lookup. */
+	if (ggsn_lookup_find(hub, apn_oi_str) == lookup) {
+		*parked = &lookup->parked;
+		return NULL;
+	}
+	return gtphub_resolved_ggsn_find(hub, apn_oi_str, gtphub_now(),
+					 &prefetch);
 }
@@ -329,6 +329,21 @@ static void handle_options(struct cmdline_cfg *ccfg, int argc, char **argv)
 	}
 }
 
+static void start_telnet(void)
+{
+	if (telnet_init_dynif(osmo_gtphub_ctx, 0, vty_get_bind_addr(),
+			      OSMO_VTY_PORT_GTPHUB) < 0)
+		exit(1);
+}
+
+static void start_daemon(void)
+{
+	if (osmo_daemonize() < 0) {
+		LOGP(DGTPHUB, LOGL_FATAL, "Error during daemonize");
+		exit(1);
+	}
+}
+
 int main(int argc, char **argv)
 {
 	int rc;
@@ -376,26 +391,29 @@ int main(int argc, char **argv)
 		exit(2);
 	}
 
+	/* With several workers, daemonize before gtphub_start() forks them, so
+	 * that they are forked from the daemon process. */
+	if (ccfg->daemonize && cfg->workers > 1)
+		start_daemon();
+
 	/* start telnet after reading config for vty_get_bind_addr() */
-	rc = telnet_init_dynif(osmo_gtphub_ctx, 0, vty_get_bind_addr(),
-			       OSMO_VTY_PORT_GTPHUB);
-	if (rc < 0)
-		exit(1);
+	if (cfg->workers <= 1)
+		start_telnet();
 
 	if (gtphub_start(hub, cfg,
 			 next_restart_count(ccfg->restart_counter_file))
 	    != 0)
 		return -1;
 
-	log_cfg(cfg);
+	/* Only the first worker serves the VTY. */
+	if (cfg->workers > 1 && hub->worker_id == 0)
+		start_telnet();
 
-	if (ccfg->daemonize) {
-		rc = osmo_daemonize();
-		if (rc < 0) {
-			LOGP(DGTPHUB, LOGL_FATAL, "Error during daemonize");
-			exit(1);
-		}
-	}
+	if (hub->worker_id == 0)
+		log_cfg(cfg);
+
+	if (ccfg->daemonize && cfg->workers <= 1)
+		start_daemon();
 
 	while (1) {
 		rc = osmo_select_main(0);
@@ -25,6 +25,11 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+
 #include <osmocom/sgsn/gtphub.h>
 #include <osmocom/sgsn/debug.h>
 
@@ -58,3 +63,59 @@ int gtphub_write(const struct osmo_fd *to,
 	return 0;
 }
 
+
+/* Number of datagrams passed to one sendmmsg() call. */
+#define GTPH_WRITE_CHUNK 64
+
+int gtphub_write_batch(const struct osmo_fd *to,
+		       const struct gtphub_out *out, unsigned int n)
+{
+	struct mmsghdr msgs[GTPH_WRITE_CHUNK];
+	struct iovec iovs[GTPH_WRITE_CHUNK];
+	unsigned int done = 0;
+	unsigned int sent_total = 0;
+
+	while (done < n) {
+		unsigned int chunk = n - done;
+		unsigned int i;
+		int sent;
+
+		if (chunk > GTPH_WRITE_CHUNK)
+			chunk = GTPH_WRITE_CHUNK;
+
+		memset(msgs, 0, chunk * sizeof(msgs[0]));
+		for (i = 0; i < chunk; i++) {
+			const struct gtphub_out *o = &out[done + i];
+			iovs[i].iov_base = (void*)o->buf;
+			iovs[i].iov_len = o->len;
+			msgs[i].msg_hdr.msg_name = (void*)&o->to_addr.a;
+			msgs[i].msg_hdr.msg_namelen = o->to_addr.l;
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		errno = 0;
+		sent = sendmmsg(to->fd, msgs, chunk, 0);
+		if (sent < 1) {
+			/* The first datagram failed. Drop it, as gtphub_write()
+			 * would, and carry on with the rest. */
+			LOG(LOGL_ERROR, "error sending to %s: %s\n",
+			    osmo_sockaddr_to_str(&out[done].to_addr),
+			    strerror(errno));
+			done ++;
+			continue;
+		}
+
+		for (i = 0; i < sent; i++) {
+			if (msgs[i].msg_len != iovs[i].iov_len)
+				LOG(LOGL_ERROR, "sent(%u) != data_len(%d)\n",
+				    msgs[i].msg_len, (int)iovs[i].iov_len);
+		}
+
+		done += sent;
+		sent_total += sent;
+	}
+
+	LOG(LOGL_DEBUG, "Sent %u of %u datagrams\n", sent_total, n);
+	return sent_total;
+}
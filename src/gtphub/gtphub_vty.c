@@ -93,6 +93,24 @@ static int config_write_gtphub(struct vty *vty)
 		vty_out(vty, "sgsn-use-sender%s", VTY_NEWLINE);
 	}
 
+	if (g_cfg->batch_size
+	    && g_cfg->batch_size != GTPH_BATCH_SIZE_DEFAULT)
+		vty_out(vty, " batch-size %u%s", g_cfg->batch_size,
+			VTY_NEWLINE);
+
+	if (g_cfg->workers > 1)
+		vty_out(vty, " workers %u%s", g_cfg->workers, VTY_NEWLINE);
+
+	if (g_cfg->journal_path)
+		vty_out(vty, " journal %s%s", g_cfg->journal_path,
+			VTY_NEWLINE);
+
+	unsigned int i;
+	for (i = 0; i < g_cfg->ggsn_pool_len; i++)
+		vty_out(vty, " ggsn-pool-member %s weight %u%s",
+			g_cfg->ggsn_pool[i].addr_str,
+			g_cfg->ggsn_pool[i].weight, VTY_NEWLINE);
+
 	if (g_cfg->proxy[GTPH_SIDE_SGSN][GTPH_PLANE_CTRL].addr_str) {
 		write_addrs(vty, "sgsn-proxy",
 			    &g_cfg->proxy[GTPH_SIDE_SGSN][GTPH_PLANE_CTRL],
@@ -264,6 +282,109 @@ DEFUN(cfg_gtphub_no_sgsn_use_sender,
 	return CMD_SUCCESS;
 }
 
+DEFUN(cfg_gtphub_batch_size, cfg_gtphub_batch_size_cmd,
+      "batch-size <1-1024>",
+      "Datagrams to read and send per system call on each bind\n"
+      "Number of datagrams (1 reads and sends one at a time)\n")
+{
+	g_cfg->batch_size = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_gtphub_workers, cfg_gtphub_workers_cmd,
+      "workers <1-16>",
+      "Number of worker processes sharing the binds via SO_REUSEPORT"
+      " (takes effect on restart; the VTY only shows the first worker)\n"
+      "Number of workers\n")
+{
+	g_cfg->workers = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_gtphub_journal, cfg_gtphub_journal_cmd,
+      "journal PATH",
+      "Record tunnels in a file, to resume them after a restart"
+      " (takes effect on restart; workers append .<worker nr>)\n"
+      "Path of the journal file\n")
+{
+	talloc_free((char *)g_cfg->journal_path);
+	g_cfg->journal_path = talloc_strdup(tall_vty_ctx, argv[0]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_gtphub_no_journal, cfg_gtphub_no_journal_cmd,
+      "no journal",
+      NO_STR "Don't record tunnels; tunnels are lost on restart\n")
+{
+	talloc_free((char *)g_cfg->journal_path);
+	g_cfg->journal_path = NULL;
+	return CMD_SUCCESS;
+}
+
+static struct gtphub_cfg_ggsn *cfg_ggsn_pool_find(const char *addr_str)
+{
+	unsigned int i;
+	for (i = 0; i < g_cfg->ggsn_pool_len; i++) {
+		if (strcmp(g_cfg->ggsn_pool[i].addr_str, addr_str) == 0)
+			return &g_cfg->ggsn_pool[i];
+	}
+	return NULL;
+}
+
+static int cfg_ggsn_pool_set(struct vty *vty, const char *addr_str,
+			     unsigned int weight)
+{
+	struct gtphub_cfg_ggsn *c = cfg_ggsn_pool_find(addr_str);
+	if (!c) {
+		if (g_cfg->ggsn_pool_len >= GTPH_GGSN_POOL_MAX) {
+			vty_out(vty, "%% At most %d GGSN pool members%s",
+				GTPH_GGSN_POOL_MAX, VTY_NEWLINE);
+			return CMD_WARNING;
+		}
+		c = &g_cfg->ggsn_pool[g_cfg->ggsn_pool_len ++];
+		c->addr_str = talloc_strdup(tall_vty_ctx, addr_str);
+	}
+	c->weight = weight;
+	return CMD_SUCCESS;
+}
+
+#define GGSN_POOL_MEMBER_STR \
+	"Spread new PDP contexts across a pool of GGSNs instead of resolving" \
+	" the GGSN via DNS (takes effect on restart)\n" \
+	"GGSN GTP-C IP address (v4 or v6)\n"
+
+DEFUN(cfg_gtphub_ggsn_pool_member_short, cfg_gtphub_ggsn_pool_member_short_cmd,
+      "ggsn-pool-member ADDR",
+      GGSN_POOL_MEMBER_STR)
+{
+	return cfg_ggsn_pool_set(vty, argv[0], 1);
+}
+
+DEFUN(cfg_gtphub_ggsn_pool_member, cfg_gtphub_ggsn_pool_member_cmd,
+      "ggsn-pool-member ADDR weight <1-1000>",
+      GGSN_POOL_MEMBER_STR
+      "Share of new PDP contexts relative to the other members\n"
+      "Weight\n")
+{
+	return cfg_ggsn_pool_set(vty, argv[0], atoi(argv[1]));
+}
+
+DEFUN(cfg_gtphub_no_ggsn_pool_member, cfg_gtphub_no_ggsn_pool_member_cmd,
+      "no ggsn-pool-member ADDR",
+      NO_STR "Remove a GGSN from the pool\n"
+      "GGSN GTP-C IP address (v4 or v6)\n")
+{
+	struct gtphub_cfg_ggsn *c = cfg_ggsn_pool_find(argv[0]);
+	if (!c) {
+		vty_out(vty, "%% No such GGSN pool member: %s%s", argv[0],
+			VTY_NEWLINE);
+		return CMD_WARNING;
+	}
+	g_cfg->ggsn_pool_len --;
+	memmove(c, c + 1, (&g_cfg->ggsn_pool[g_cfg->ggsn_pool_len] - c)
+		* sizeof(*c));
+	return CMD_SUCCESS;
+}
 
 /* Copied from sgsn_vty.h */
 DEFUN(cfg_grx_ggsn, cfg_grx_ggsn_cmd,
@@ -295,11 +416,75 @@ static void show_bind_stats_all(struct vty *vty)
 				gsn_addr_to_str(&b->local_addr), (int)b->local_port,
 				VTY_NEWLINE);
 			vty_out_rate_ctr_group(vty, "    ", b->counters_io);
+			vty_out_rate_ctr_group(vty, "    ", b->counters_batch);
 		}
 	}
 }
 
-static void show_tunnel_stats(struct vty *vty, struct gtphub_tunnel *tun)
+static void show_hub_ctrs(struct vty *vty, const char *title,
+			  int first, int last)
+{
+	const struct rate_ctr_group_desc *desc = g_hub->counters->desc;
+	int i;
+
+	vty_out(vty, "- %s:%s", title, VTY_NEWLINE);
+	for (i = first; i <= last; i++)
+		vty_out(vty, "    %s: %" PRIu64 "%s",
+			desc->ctr_desc[i].description,
+			g_hub->counters->ctr[i].current, VTY_NEWLINE);
+}
+
+static void show_hub_stats(struct vty *vty)
+{
+	show_hub_ctrs(vty, "Parked requests",
+		      GTPH_CTR_PARKED, GTPH_CTR_PARKED_DROPPED);
+	show_hub_ctrs(vty, "GGSN resolution",
+		      GTPH_CTR_GGSN_CACHE_HIT, GTPH_CTR_GGSN_PREFETCH);
+	show_hub_ctrs(vty, "Retransmissions",
+		      GTPH_CTR_RETRANS_REPLAYED, GTPH_CTR_RETRANS_FORWARDED);
+}
+
+static void show_ggsn_pool(struct vty *vty)
+{
+	unsigned int i;
+
+	if (!g_hub->ggsn_pool_len)
+		return;
+
+	vty_out(vty, "- GGSN pool:%s", VTY_NEWLINE);
+	for (i = 0; i < g_hub->ggsn_pool_len; i++) {
+		struct gtphub_pool_ggsn *g = &g_hub->ggsn_pool[i];
+		vty_out(vty, "  - %s: weight %u (effective %u.%03u),"
+			" %lu PDP contexts%s",
+			gtphub_port_str(g->pp), g->weight,
+			g->eff_weight / 1000, g->eff_weight % 1000,
+			g->selected, VTY_NEWLINE);
+		if (g->rtt_ms >= 0)
+			vty_out(vty, "    echo rtt %d ms", g->rtt_ms);
+		else
+			vty_out(vty, "    echo rtt unknown");
+		vty_out(vty, ", %u missed, %u.%u%% rejects%s",
+			g->echo_missed,
+			g->reject_permille / 10, g->reject_permille % 10,
+			VTY_NEWLINE);
+	}
+}
+
+static void show_tunnel_counters(struct vty *vty, const char *prefix,
+				 const struct gtphub_tunnel_counters *c)
+{
+	vty_out(vty, "%sPackets ( In): %" PRIu64 "%s", prefix, c->pkts_in,
+		VTY_NEWLINE);
+	vty_out(vty, "%sPackets (Out): %" PRIu64 "%s", prefix, c->pkts_out,
+		VTY_NEWLINE);
+	vty_out(vty, "%sBytes   ( In): %" PRIu64 "%s", prefix, c->bytes_in,
+		VTY_NEWLINE);
+	vty_out(vty, "%sBytes   (Out): %" PRIu64 "%s", prefix, c->bytes_out,
+		VTY_NEWLINE);
+}
+
+static void show_tunnel_stats(struct vty *vty,
+			      struct gtphub_tunnel_counters c[GTPH_SIDE_N][GTPH_PLANE_N])
 {
 	int plane_idx;
 	for_each_plane(plane_idx) {
@@ -308,11 +493,10 @@ static void show_tunnel_stats(struct vty *vty, struct gtphub_tunnel *tun)
 
 		int side_idx;
 		for_each_side(side_idx) {
-			struct gtphub_tunnel_endpoint *te = &tun->endpoint[side_idx][plane_idx];
 			vty_out(vty, "  - to/from %s:%s",
 				gtphub_side_idx_names[side_idx],
 				VTY_NEWLINE);
-			vty_out_rate_ctr_group(vty, "    ", te->counters_io);
+			show_tunnel_counters(vty, "    ", &c[side_idx][plane_idx]);
 		}
 	}
 }
@@ -495,7 +679,13 @@ static void show_tunnels_all(struct vty *vty, int with_io_stats)
 
 	unsigned int count = 0;
 	unsigned int incomplete = 0;
+	struct gtphub_tunnel_counters c[GTPH_SIDE_N][GTPH_PLANE_N];
+	struct gtphub_tunnel_counters sum[GTPH_SIDE_N][GTPH_PLANE_N];
 	struct gtphub_tunnel *tun;
+	int side_idx, plane_idx;
+
+	memset(sum, 0, sizeof(sum));
+
 	llist_for_each_entry(tun, &g_hub->tunnels, entry) {
 		vty_out(vty,
 			"%s (expiry in %dm)%s",
@@ -505,11 +695,26 @@ static void show_tunnels_all(struct vty *vty, int with_io_stats)
 		count ++;
 		if (!gtphub_tunnel_complete(tun))
 			incomplete ++;
-		if (with_io_stats)
-			show_tunnel_stats(vty, tun);
+		if (!with_io_stats)
+			continue;
+
+		for_each_side_and_plane(side_idx, plane_idx) {
+			struct gtphub_tunnel_counters *t =
+				&tun->endpoint[side_idx][plane_idx].counters;
+			struct gtphub_tunnel_counters *s =
+				&sum[side_idx][plane_idx];
+			c[side_idx][plane_idx] = *t;
+			s->pkts_in += t->pkts_in;
+			s->pkts_out += t->pkts_out;
+			s->bytes_in += t->bytes_in;
+			s->bytes_out += t->bytes_out;
+		}
+		show_tunnel_stats(vty, c);
 	}
 	vty_out(vty, "Total: %u tunnels (of which %u incomplete)%s",
 		count, incomplete, VTY_NEWLINE);
+	if (with_io_stats)
+		show_tunnel_stats(vty, sum);
 }
 
 #define SHOW_GTPHUB_STRS   SHOW_STR "Show info on running GTP hub\n"
@@ -558,10 +763,19 @@ DEFUN(show_gtphub_tunnels_stats, show_gtphub_tunnels_stats_cmd, "show gtphub tun
 	return CMD_SUCCESS;
 }
 
+DEFUN(show_gtphub_ggsn_pool, show_gtphub_ggsn_pool_cmd, "show gtphub ggsn-pool",
+      SHOW_GTPHUB_STRS "GGSN pool members and their health\n")
+{
+	show_ggsn_pool(vty);
+	return CMD_SUCCESS;
+}
+
 DEFUN(show_gtphub, show_gtphub_cmd, "show gtphub all",
       SHOW_GTPHUB_STRS "Summarize everything about the GTP hub\n")
 {
 	show_bind_stats_all(vty);
+	show_hub_stats(vty);
+	show_ggsn_pool(vty);
 	show_peers_summary(vty);
 	show_tunnels_summary(vty);
 	return CMD_SUCCESS;
@@ -580,6 +794,7 @@ int gtphub_vty_init(struct gtphub *global_hub, struct gtphub_cfg *global_cfg)
 	install_element_ve(&show_gtphub_tunnels_summary_cmd);
 	install_element_ve(&show_gtphub_tunnels_list_cmd);
 	install_element_ve(&show_gtphub_tunnels_stats_cmd);
+	install_element_ve(&show_gtphub_ggsn_pool_cmd);
 
 	install_element(CONFIG_NODE, &cfg_gtphub_cmd);
 	install_node(&gtphub_node, config_write_gtphub);
@@ -594,6 +809,13 @@ int gtphub_vty_init(struct gtphub *global_hub, struct gtphub_cfg *global_cfg)
 	install_element(GTPHUB_NODE, &cfg_gtphub_sgsn_proxy_cmd);
 	install_element(GTPHUB_NODE, &cfg_gtphub_sgsn_use_sender_cmd);
 	install_element(GTPHUB_NODE, &cfg_gtphub_no_sgsn_use_sender_cmd);
+	install_element(GTPHUB_NODE, &cfg_gtphub_batch_size_cmd);
+	install_element(GTPHUB_NODE, &cfg_gtphub_workers_cmd);
+	install_element(GTPHUB_NODE, &cfg_gtphub_journal_cmd);
+	install_element(GTPHUB_NODE, &cfg_gtphub_no_journal_cmd);
+	install_element(GTPHUB_NODE, &cfg_gtphub_ggsn_pool_member_short_cmd);
+	install_element(GTPHUB_NODE, &cfg_gtphub_ggsn_pool_member_cmd);
+	install_element(GTPHUB_NODE, &cfg_gtphub_no_ggsn_pool_member_cmd);
 	install_element(GTPHUB_NODE, &cfg_grx_ggsn_cmd);
 
 	return 0;
@@ -14,6 +14,7 @@
 #include <getopt.h>
 #include <dlfcn.h>
 #include <time.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 
@@ -2467,6 +2468,8 @@ static void test_gbproxy_ptmsi_patching()
 	dump_peers(stdout, 0, 0, &gbcfg);
 
 	old_ctr = peer->ctrg->ctr[GBPROX_PEER_CTR_PTMSI_PATCHED_SGSN].current;
+	OSMO_ASSERT(peer->area != NULL);
+	OSMO_ASSERT(peer->area->ctrg->ctr[GBPROX_AREA_CTR_PAGING_PS].current == 0);
 
 	send_bssgp_paging(nsi, &sgsn_peer, imsi, sizeof(imsi), &rai_bss, sgsn_ptmsi3);
 
@@ -2474,6 +2477,8 @@ static void test_gbproxy_ptmsi_patching()
 
 	OSMO_ASSERT(old_ctr + 1 ==
 		    peer->ctrg->ctr[GBPROX_PEER_CTR_PTMSI_PATCHED_SGSN].current);
+	OSMO_ASSERT(peer->area->ctrg->ctr[GBPROX_AREA_CTR_PAGING_PS].current == 1);
+	OSMO_ASSERT(peer->area->ctrg->ctr[GBPROX_AREA_CTR_PAGING_BVC].current == 1);
 
 	/* Bad case: Invalid BVCI */
 	send_bssgp_llc_discarded(nsi, &bss_peer[0], 0xeee1,
@@ -3529,6 +3534,248 @@ static void test_gbproxy_secondary_sgsn()
 	cleanup_test();
 }
 
+static void test_gbproxy_sgsn_pool(void)
+{
+	struct gbproxy_config cfg = {0};
+	struct gbproxy_peer *peer;
+	struct gbproxy_sgsn *sgsn1, *sgsn2, *sgsn3;
+	struct gbproxy_link_info *link_info;
+	struct gbproxy_link_info *first_info = NULL;
+	struct gprs_gb_parse_context parse_ctx = {0};
+	uint8_t tlli_enc[4] = {0};
+	const uint32_t tllis[] = {
+		0xc0200123, 0x80400abc, 0xc0f00123, 0x78200123,
+	};
+	const char *err_msg = NULL;
+	uint32_t nsei, bss_ptmsi;
+	uint16_t nri;
+	int i;
+
+	printf("=== %s ===\n", __func__);
+
+	gbproxy_init_config(&cfg);
+	cfg.nsip_sgsn_nsei = 0x0100;
+	cfg.nri_bitlen = 4;
+
+	sgsn1 = gbproxy_sgsn_alloc(&cfg, 0x0100);
+	OSMO_ASSERT(gbproxy_sgsn_add_nri(sgsn1, 1) == 0);
+	sgsn2 = gbproxy_sgsn_alloc(&cfg, 0x0200);
+	sgsn2->weight = 2;
+	OSMO_ASSERT(gbproxy_sgsn_add_nri(sgsn2, 2) == 0);
+	OSMO_ASSERT(gbproxy_sgsn_add_nri(sgsn2, 3) == 0);
+	OSMO_ASSERT(gbproxy_sgsn_add_nri(sgsn2, 3) == 0);
+	OSMO_ASSERT(sgsn2->num_nri == 2);
+	sgsn3 = gbproxy_sgsn_alloc(&cfg, 0x0300);
+	sgsn3->weight = 0;
+	OSMO_ASSERT(gbproxy_sgsn_add_nri(sgsn3, 4) == 0);
+
+	OSMO_ASSERT(gbproxy_sgsn_by_nsei(&cfg, 0x0200) == sgsn2);
+	OSMO_ASSERT(gbproxy_sgsn_by_nsei(&cfg, 0x0400) == NULL);
+	OSMO_ASSERT(gbproxy_sgsn_by_nri(&cfg, 3) == sgsn2);
+	OSMO_ASSERT(gbproxy_sgsn_by_nri(&cfg, 5) == NULL);
+
+	peer = gbproxy_peer_alloc(&cfg, 20);
+	parse_ctx.tlli_enc = tlli_enc;
+
+	printf("- NRI of the TLLI\n");
+	for (i = 0; i < ARRAY_SIZE(tllis); i++) {
+		if (gbproxy_tlli_nri(&cfg, tllis[i], &nri))
+			printf("  TLLI %08x: NRI %u\n", tllis[i], nri);
+		else
+			printf("  TLLI %08x: no NRI\n", tllis[i]);
+	}
+
+	printf("- Route without link by NRI\n");
+	for (i = 0; i < ARRAY_SIZE(tllis); i++) {
+		parse_ctx.tlli = tllis[i];
+		nsei = gbproxy_select_sgsn(&cfg, NULL, &parse_ctx);
+		printf("  TLLI %08x: SGSN NSEI 0x%04x\n", tllis[i], nsei);
+	}
+
+	printf("- Distribute new links by weight\n");
+	for (i = 0; i < 6; i++) {
+		link_info = gbproxy_link_info_alloc(peer);
+		gbproxy_attach_link_info(peer, 0, link_info);
+		link_info->tlli.current = 0x78000000 + i;
+		if (!first_info)
+			first_info = link_info;
+
+		parse_ctx.tlli = link_info->tlli.current;
+		nsei = gbproxy_select_sgsn(&cfg, link_info, &parse_ctx);
+		link_info->sgsn_nsei = nsei;
+		OSMO_ASSERT(link_info->sgsn_pinned);
+		printf("  TLLI %08x: SGSN NSEI 0x%04x\n",
+		       link_info->tlli.current, nsei);
+	}
+
+	printf("- Keep the SGSN of a pinned link\n");
+	link_info = first_info;
+	parse_ctx.tlli = link_info->tlli.current;
+	nsei = gbproxy_select_sgsn(&cfg, link_info, &parse_ctx);
+	OSMO_ASSERT(nsei == link_info->sgsn_nsei);
+	printf("  TLLI %08x: SGSN NSEI 0x%04x\n", parse_ctx.tlli, nsei);
+
+	printf("- Follow the NRI of a new P-TMSI\n");
+	parse_ctx.tlli = 0xc0400001;
+	link_info->sgsn_nsei = gbproxy_select_sgsn(&cfg, link_info, &parse_ctx);
+	OSMO_ASSERT(link_info->sgsn_nsei == 0x0300);
+	printf("  TLLI %08x: SGSN NSEI 0x%04x\n", parse_ctx.tlli,
+	       link_info->sgsn_nsei);
+
+	printf("- Reselect after the SGSN has left the pool\n");
+	gbproxy_sgsn_free(sgsn3);
+	parse_ctx.tlli = 0xc0400001;
+	link_info->sgsn_nsei = gbproxy_select_sgsn(&cfg, link_info, &parse_ctx);
+	OSMO_ASSERT(link_info->sgsn_nsei != 0x0300);
+	printf("  TLLI %08x: SGSN NSEI 0x%04x\n", parse_ctx.tlli,
+	       link_info->sgsn_nsei);
+
+	printf("- Route by IMSI to the secondary SGSN\n");
+	cfg.route_to_sgsn2 = true;
+	cfg.nsip_sgsn2_nsei = 0x0102;
+	cfg.acquire_imsi = true;
+	OSMO_ASSERT(gbproxy_set_patch_filter(&cfg.matches[GBPROX_MATCH_ROUTING],
+					     "^1234", &err_msg) == 0);
+
+	link_info = gbproxy_link_info_alloc(peer);
+	gbproxy_attach_link_info(peer, 0, link_info);
+	link_info->tlli.current = 0x78000010;
+	parse_ctx.tlli = link_info->tlli.current;
+	nsei = gbproxy_select_sgsn(&cfg, link_info, &parse_ctx);
+	OSMO_ASSERT(!link_info->sgsn_pinned);
+	printf("  TLLI %08x, no IMSI: SGSN NSEI 0x%04x\n", parse_ctx.tlli, nsei);
+
+	link_info->imsi_len = 4;
+	link_info->is_matching[GBPROX_MATCH_ROUTING] = true;
+	nsei = gbproxy_select_sgsn(&cfg, link_info, &parse_ctx);
+	OSMO_ASSERT(!link_info->sgsn_pinned);
+	printf("  TLLI %08x, matching IMSI: SGSN NSEI 0x%04x\n",
+	       parse_ctx.tlli, nsei);
+
+	link_info->is_matching[GBPROX_MATCH_ROUTING] = false;
+	nsei = gbproxy_select_sgsn(&cfg, link_info, &parse_ctx);
+	OSMO_ASSERT(link_info->sgsn_pinned);
+	printf("  TLLI %08x, other IMSI: SGSN NSEI 0x%04x\n",
+	       parse_ctx.tlli, nsei);
+	link_info->imsi_len = 0;
+
+	printf("- Keep the NRI in patched P-TMSIs\n");
+	cfg.patch_ptmsi = true;
+	bss_ptmsi = gbproxy_make_bss_ptmsi(peer, 0xc0200123);
+	OSMO_ASSERT(gbproxy_tlli_nri(&cfg, bss_ptmsi, &nri) && nri == 2);
+	printf("  SGSN P-TMSI c0200123: BSS P-TMSI %08x\n", bss_ptmsi);
+
+	gbproxy_peer_free(peer);
+	gbproxy_clear_patch_filter(&cfg.matches[GBPROX_MATCH_ROUTING]);
+	gbprox_reset(&cfg);
+	/* gbprox_reset() frees the rate_ctr, but re-allocates it again. */
+	rate_ctr_group_free(cfg.ctrg);
+
+	cleanup_test();
+}
+
+static void test_gbproxy_sgsn_pool_routing(void)
+{
+	struct gprs_ns_inst *nsi = gprs_ns_instantiate(gprs_ns_callback, tall_sgsn_ctx);
+	struct sockaddr_in bss_peer[1] = {{0},};
+	struct sockaddr_in sgsn_peer[2] = {{0},};
+	struct  gprs_ra_id rai_bss =
+		{.mcc = 112, .mnc = 332, .lac = 16464, .rac = 96};
+	uint16_t cell_id = 0x1234;
+	struct gbproxy_sgsn *sgsn;
+	unsigned bss_nu = 0;
+
+	/* NRI 2 belongs to SGSN 2, NRI 1 to SGSN 1 */
+	const uint32_t local_bss_tlli_nri2 = 0xc0200123;
+	const uint32_t foreign_bss_tlli_nri1 = 0x80100abc;
+	const uint32_t random_bss_tlli1 = 0x78000001;
+	const uint32_t random_bss_tlli2 = 0x78000002;
+
+	bssgp_nsi = nsi;
+	gbcfg.nsi = bssgp_nsi;
+	gbcfg.nsip_sgsn_nsei = SGSN_NSEI;
+	gbcfg.patch_ptmsi = 0;
+	gbcfg.acquire_imsi = 0;
+	gbcfg.core_plmn = (struct osmo_plmn_id){};
+	gbcfg.core_apn = NULL;
+	gbcfg.core_apn_size = 0;
+	gbcfg.route_to_sgsn2 = 0;
+	gbcfg.nsip_sgsn2_nsei = 0xffff;
+
+	gbcfg.nri_bitlen = 4;
+	sgsn = gbproxy_sgsn_alloc(&gbcfg, SGSN_NSEI);
+	OSMO_ASSERT(gbproxy_sgsn_add_nri(sgsn, 1) == 0);
+	sgsn = gbproxy_sgsn_alloc(&gbcfg, SGSN2_NSEI);
+	OSMO_ASSERT(gbproxy_sgsn_add_nri(sgsn, 2) == 0);
+
+	configure_sgsn_peer(&sgsn_peer[0]);
+	configure_sgsn2_peer(&sgsn_peer[1]);
+	configure_bss_peers(bss_peer, ARRAY_SIZE(bss_peer));
+
+	printf("=== %s ===\n", __func__);
+	printf("--- Initialise SGSN 1 ---\n\n");
+
+	connect_sgsn(nsi, &sgsn_peer[0], SGSN_NSEI);
+
+	printf("--- Initialise SGSN 2 ---\n\n");
+
+	connect_sgsn(nsi, &sgsn_peer[1], SGSN2_NSEI);
+
+	printf("--- Initialise BSS 1 ---\n\n");
+
+	/* Every pool member gets the BVC-RESET, only the primary SGSN's ACK
+	 * is relayed to the BSS */
+	setup_ns(nsi, &bss_peer[0], 0x1001, 0x1000);
+	setup_bssgp(nsi, &bss_peer[0], 0x1002);
+	send_bssgp_reset_ack(nsi, &sgsn_peer[0], 0x1002);
+	send_bssgp_reset_ack(nsi, &sgsn_peer[1], 0x1002);
+
+	printf("--- Flow control ---\n\n");
+
+	send_bssgp_flow_control_bvc(nsi, &bss_peer[0], 0x1002, 1);
+	send_bssgp_flow_control_bvc_ack(nsi, &sgsn_peer[0], 0x1002, 1);
+	send_bssgp_flow_control_bvc_ack(nsi, &sgsn_peer[1], 0x1002, 1);
+
+	printf("--- Route by the NRI of the TLLI ---\n\n");
+
+	send_llc_ul_ui(nsi, "ATTACH COMPLETE (local TLLI, NRI 2)",
+		       &bss_peer[0], 0x1002, local_bss_tlli_nri2,
+		       &rai_bss, cell_id, GPRS_SAPI_GMM, bss_nu++,
+		       dtap_attach_complete, sizeof(dtap_attach_complete));
+
+	send_llc_ul_ui(nsi, "ATTACH COMPLETE (foreign TLLI, NRI 1)",
+		       &bss_peer[0], 0x1002, foreign_bss_tlli_nri1,
+		       &rai_bss, cell_id, GPRS_SAPI_GMM, bss_nu++,
+		       dtap_attach_complete, sizeof(dtap_attach_complete));
+
+	printf("--- Distribute new TLLIs by weight ---\n\n");
+
+	send_llc_ul_ui(nsi, "ATTACH COMPLETE (random TLLI 1)",
+		       &bss_peer[0], 0x1002, random_bss_tlli1,
+		       &rai_bss, cell_id, GPRS_SAPI_GMM, bss_nu++,
+		       dtap_attach_complete, sizeof(dtap_attach_complete));
+
+	send_llc_ul_ui(nsi, "ATTACH COMPLETE (random TLLI 2)",
+		       &bss_peer[0], 0x1002, random_bss_tlli2,
+		       &rai_bss, cell_id, GPRS_SAPI_GMM, bss_nu++,
+		       dtap_attach_complete, sizeof(dtap_attach_complete));
+
+	printf("--- Keep the SGSN of a pinned TLLI ---\n\n");
+
+	/* The next new TLLI would go to SGSN 1 */
+	send_llc_ul_ui(nsi, "ATTACH COMPLETE (random TLLI 2)",
+		       &bss_peer[0], 0x1002, random_bss_tlli2,
+		       &rai_bss, cell_id, GPRS_SAPI_GMM, bss_nu++,
+		       dtap_attach_complete, sizeof(dtap_attach_complete));
+
+	gbcfg.nri_bitlen = 0;
+	gbprox_reset(&gbcfg);
+	gprs_ns_destroy(nsi);
+	nsi = NULL;
+
+	cleanup_test();
+}
+
 static void test_gbproxy_keep_info()
 {
 	struct gprs_ns_inst *nsi = gprs_ns_instantiate(gprs_ns_callback, tall_sgsn_ctx);
@@ -4519,7 +4766,7 @@ struct gbproxy_link_info *register_tlli(
 		LOGP(DGPRS, LOGL_INFO, "Adding TLLI %08x to list\n", tlli);
 
 	gbproxy_attach_link_info(peer, now, link_info);
-	gbproxy_update_link_info(link_info, imsi, imsi_len);
+	gbproxy_update_link_info(peer, link_info, imsi, imsi_len);
 
 	if (imsi_matches >= 0)
 		link_info->is_matching[GBPROX_MATCH_PATCHING] = imsi_matches;
@@ -4753,6 +5000,51 @@ static void test_gbproxy_tlli_expire(void)
 
 		gbproxy_peer_free(peer);
 	}
+
+	{
+		struct gbproxy_peer *peer2;
+		int num_removed;
+
+		printf("Test TLLI expiry of all peers, max_total_len == 2, max_age == 1:\n");
+
+		cfg.tlli_max_len = 0;
+		cfg.tlli_max_total_len = 2;
+		cfg.tlli_max_age = 1;
+		peer = gbproxy_peer_alloc(&cfg, 20);
+		peer2 = gbproxy_peer_alloc(&cfg, 21);
+		OSMO_ASSERT(cfg.link_count == 0);
+
+		printf("  Add TLLI 1, IMSI 1 to peer 1 (should be removed)\n");
+		register_tlli(peer, tlli1, imsi1, ARRAY_SIZE(imsi1), now);
+		printf("  Add TLLI 2, IMSI 2 to peer 2 (should expire after timeout)\n");
+		register_tlli(peer2, tlli2, imsi2, ARRAY_SIZE(imsi2), now + 1);
+		printf("  Add TLLI 3, IMSI 3 to peer 1\n");
+		register_tlli(peer, tlli3, imsi3, ARRAY_SIZE(imsi3), now + 2);
+		OSMO_ASSERT(cfg.link_count == 3);
+
+		printf("  Remove the least recently used TLLI\n");
+		num_removed = gbproxy_remove_stale_links(&cfg, now + 2);
+		OSMO_ASSERT(num_removed == 1);
+		OSMO_ASSERT(cfg.link_count == 2);
+		OSMO_ASSERT(peer->patch_state.logical_link_count == 1);
+		OSMO_ASSERT(peer2->patch_state.logical_link_count == 1);
+		OSMO_ASSERT(!gbproxy_link_info_by_tlli(peer, tlli1));
+
+		printf("  Remove stale TLLIs\n");
+		num_removed = gbproxy_remove_stale_links(&cfg, now + 3);
+		OSMO_ASSERT(num_removed == 1);
+		OSMO_ASSERT(cfg.link_count == 1);
+		OSMO_ASSERT(peer2->patch_state.logical_link_count == 0);
+		OSMO_ASSERT(gbproxy_link_info_by_tlli(peer, tlli3));
+
+		printf("\n");
+
+		gbproxy_peer_free(peer2);
+		gbproxy_peer_free(peer);
+		OSMO_ASSERT(cfg.link_count == 0);
+		OSMO_ASSERT(llist_empty(&cfg.link_lru));
+		cfg.tlli_max_total_len = 0;
+	}
 	gbproxy_clear_patch_filter(&cfg.matches[GBPROX_MATCH_PATCHING]);
 	gbprox_reset(&cfg);
 	/* gbprox_reset() frees the rate_ctr, but re-allocates it again. */
@@ -4761,6 +5053,283 @@ static void test_gbproxy_tlli_expire(void)
 	cleanup_test();
 }
 
+static unsigned count_area_peers(struct gbproxy_area *area)
+{
+	struct gbproxy_peer *peer;
+	unsigned count = 0;
+
+	llist_for_each_entry(peer, &area->peers, area_list)
+		count += 1;
+
+	return count;
+}
+
+static void test_gbproxy_paging_areas(void)
+{
+	struct gbproxy_config cfg = {0};
+	struct gbproxy_peer *peer1, *peer2, *peer3, *peer4;
+	struct gbproxy_area *area;
+	struct gprs_ra_id raid1 = {.mcc = 112, .mnc = 332, .lac = 16464, .rac = 96};
+	struct gprs_ra_id raid2 = {.mcc = 112, .mnc = 332, .lac = 16464, .rac = 97};
+	struct gprs_ra_id raid3 = {.mcc = 112, .mnc = 332, .lac = 16465, .rac = 96};
+	uint8_t ra1[6], ra2[6], ra3[6];
+	struct tlv_parsed tp;
+	struct msgb *msg;
+	unsigned count;
+
+	printf("Test paging areas\n\n");
+
+	gbproxy_init_config(&cfg);
+
+	gsm48_encode_ra((struct gsm48_ra_id *)ra1, &raid1);
+	gsm48_encode_ra((struct gsm48_ra_id *)ra2, &raid2);
+	gsm48_encode_ra((struct gsm48_ra_id *)ra3, &raid3);
+
+	peer1 = gbproxy_peer_alloc(&cfg, 20);
+	peer2 = gbproxy_peer_alloc(&cfg, 21);
+	peer3 = gbproxy_peer_alloc(&cfg, 22);
+	peer4 = gbproxy_peer_alloc(&cfg, 23);
+
+	OSMO_ASSERT(gbproxy_peer_by_rai(&cfg, ra1) == NULL);
+	OSMO_ASSERT(gbproxy_peer_by_lai(&cfg, ra1) == NULL);
+
+	gbproxy_peer_set_ra(peer1, ra1);
+	gbproxy_peer_set_ra(peer2, ra1);
+	gbproxy_peer_set_ra(peer3, ra2);
+	gbproxy_peer_set_ra(peer4, ra3);
+
+	/* two BVCs in the first RA, the latest one is found first */
+	area = gbproxy_area_by_rai(&cfg, ra1);
+	OSMO_ASSERT(area != NULL);
+	OSMO_ASSERT(area == peer1->area && area == peer2->area);
+	OSMO_ASSERT(count_area_peers(area) == 2);
+	OSMO_ASSERT(gbproxy_peer_by_rai(&cfg, ra1) == peer2);
+	OSMO_ASSERT(gbproxy_peer_by_rai(&cfg, ra3) == peer4);
+
+	/* both RAs of the location area are found by the LAI */
+	count = 0;
+	area = NULL;
+	while ((area = gbproxy_area_by_lai(&cfg, ra1, area))) {
+		OSMO_ASSERT(area == peer1->area || area == peer3->area);
+		count += 1;
+	}
+	OSMO_ASSERT(count == 2);
+	OSMO_ASSERT(gbproxy_peer_by_lai(&cfg, ra3) == peer4);
+
+	/* moving a peer keeps the index consistent */
+	gbproxy_peer_set_ra(peer2, ra2);
+	OSMO_ASSERT(count_area_peers(peer1->area) == 1);
+	OSMO_ASSERT(count_area_peers(peer3->area) == 2);
+	OSMO_ASSERT(peer2->area == peer3->area);
+
+	/* a PAGING fails if every BVC of the area is blocked */
+	msg = msgb_alloc(64, "paging_areas");
+	msgb_bssgph(msg) = msgb_put(msg, 3 + sizeof(ra1));
+	msgb_bssgph(msg)[0] = BSSGP_PDUT_PAGING_PS;
+	msgb_bssgph(msg)[1] = BSSGP_IE_ROUTEING_AREA;
+	msgb_bssgph(msg)[2] = 0x80 | sizeof(ra1);
+	memcpy(msgb_bssgph(msg) + 3, ra1, sizeof(ra1));
+	bssgp_tlv_parse(&tp, msgb_bssgph(msg) + 1, msgb_bssgp_len(msg) - 1);
+
+	peer1->blocked = true;
+	OSMO_ASSERT(gbprox_rx_paging(&cfg, msg, &tp, 0x100, 0) == -EINVAL);
+	OSMO_ASSERT(cfg.ctrg->ctr[GBPROX_GLOB_CTR_INV_RAI].current == 1);
+	OSMO_ASSERT(peer1->area->ctrg->
+		    ctr[GBPROX_AREA_CTR_PAGING_BLOCKED].current == 1);
+	OSMO_ASSERT(peer1->area->ctrg->
+		    ctr[GBPROX_AREA_CTR_PAGING_BVC].current == 0);
+	peer1->blocked = false;
+
+	/* the same by LAI, the location area of ra3 has a single BVC */
+	msgb_bssgph(msg)[1] = BSSGP_IE_LOCATION_AREA;
+	msgb_bssgph(msg)[2] = 0x80 | (sizeof(ra3) - 1);
+	memcpy(msgb_bssgph(msg) + 3, ra3, sizeof(ra3) - 1);
+	msgb_trim(msg, 3 + sizeof(ra3) - 1);
+	bssgp_tlv_parse(&tp, msgb_bssgph(msg) + 1, msgb_bssgp_len(msg) - 1);
+
+	peer4->blocked = true;
+	OSMO_ASSERT(gbprox_rx_paging(&cfg, msg, &tp, 0x100, 0) == -EINVAL);
+	OSMO_ASSERT(cfg.ctrg->ctr[GBPROX_GLOB_CTR_INV_LAI].current == 1);
+	OSMO_ASSERT(peer4->area->ctrg->
+		    ctr[GBPROX_AREA_CTR_PAGING_BLOCKED].current == 1);
+	msgb_free(msg);
+
+	/* the area is released with its last peer */
+	gbproxy_peer_free(peer4);
+	OSMO_ASSERT(gbproxy_area_by_rai(&cfg, ra3) == NULL);
+	OSMO_ASSERT(gbproxy_peer_by_lai(&cfg, ra3) == NULL);
+
+	/* the BVCI and NSEI lookups follow the peers as well */
+	gbproxy_peer_set_nsei(peer1, 0x1000);
+	gbproxy_peer_set_nsei(peer2, 0x1000);
+	gbproxy_peer_set_nsei(peer3, 0x2000);
+	OSMO_ASSERT(gbproxy_peer_by_bvci(&cfg, 21) == peer2);
+	OSMO_ASSERT(gbproxy_peer_by_bvci(&cfg, 23) == NULL);
+	OSMO_ASSERT(gbproxy_peer_by_nsei(&cfg, 0x2000) == peer3);
+	OSMO_ASSERT(gbproxy_peer_by_nsei(&cfg, 0) == NULL);
+	OSMO_ASSERT(gbproxy_cleanup_peers(&cfg, 0x1000, 0) == 2);
+	OSMO_ASSERT(gbproxy_peer_by_nsei(&cfg, 0x1000) == NULL);
+	OSMO_ASSERT(gbproxy_peer_by_bvci(&cfg, 20) == NULL);
+
+	gbprox_reset(&cfg);
+	/* gbprox_reset() frees the rate_ctr, but re-allocates it again. */
+	rate_ctr_group_free(cfg.ctrg);
+
+	cleanup_test();
+}
+
+static void test_gbproxy_stored_msgs_budget(void)
+{
+	struct gbproxy_config cfg = {0};
+	struct gbproxy_peer *peer;
+	struct gbproxy_link_info *link_info1, *link_info2;
+	struct gprs_gb_parse_context parse_ctx = {0};
+	struct msgb *msg, *stored_msg;
+	const uint8_t pdu[] = {
+		BSSGP_PDUT_UL_UNITDATA, 0xc0, 0x00, 0x00, 0x01,
+		0x00, 0x00, 0x00, 0x04, 0x08, 0x88, 0x11, 0x22,
+	};
+	size_t one_msg;
+	time_t now = 1407479214;
+
+	printf("Test stored message budget\n\n");
+
+	gbproxy_init_config(&cfg);
+
+	peer = gbproxy_peer_alloc(&cfg, 20);
+	link_info1 = gbproxy_link_info_alloc(peer);
+	gbproxy_attach_link_info(peer, now, link_info1);
+	link_info2 = gbproxy_link_info_alloc(peer);
+	gbproxy_attach_link_info(peer, now, link_info2);
+
+	msg = msgb_alloc_headroom(1024, 128, "stored_msgs_budget");
+	msgb_bssgph(msg) = msgb_put(msg, sizeof(pdu));
+	memcpy(msgb_bssgph(msg), pdu, sizeof(pdu));
+	msgb_nsei(msg) = 0x1000;
+	msgb_bvci(msg) = 20;
+	parse_ctx.tlli_enc = msgb_bssgph(msg) + 1;
+	parse_ctx.tlli = 0xc0000001;
+	parse_ctx.llc_msg_name = "TEST";
+
+	/* no limit by default */
+	OSMO_ASSERT(gbproxy_link_info_store_msg(peer, link_info1, msg, &parse_ctx) == 0);
+	one_msg = cfg.stored_msgs_bytes;
+	OSMO_ASSERT(one_msg >= sizeof(pdu));
+	OSMO_ASSERT(peer->stored_msgs_bytes == one_msg);
+	OSMO_ASSERT(gbproxy_link_info_store_msg(peer, link_info2, msg, &parse_ctx) == 0);
+	OSMO_ASSERT(gbproxy_link_info_store_msg(peer, link_info1, msg, &parse_ctx) == 0);
+	OSMO_ASSERT(cfg.stored_msgs_bytes == 3 * one_msg);
+
+	/* the oldest message of all links is dropped first */
+	cfg.stored_msgs_max_bytes = 3 * one_msg;
+	OSMO_ASSERT(gbproxy_link_info_store_msg(peer, link_info2, msg, &parse_ctx) == 0);
+	OSMO_ASSERT(link_info1->stored_msgs_len == 1);
+	OSMO_ASSERT(link_info2->stored_msgs_len == 2);
+	OSMO_ASSERT(cfg.stored_msgs_bytes == 3 * one_msg);
+	OSMO_ASSERT(peer->stored_msgs_bytes == 3 * one_msg);
+	OSMO_ASSERT(cfg.ctrg->ctr[GBPROX_GLOB_CTR_STORED_MSGS_DROPPED].current == 1);
+
+	/* the parse context refers to the restored message */
+	memset(&parse_ctx, 0, sizeof(parse_ctx));
+	stored_msg = gbproxy_link_info_dequeue_msg(link_info1, &parse_ctx);
+	OSMO_ASSERT(stored_msg != NULL);
+	OSMO_ASSERT(msgb_bssgp_len(stored_msg) == sizeof(pdu));
+	OSMO_ASSERT(!memcmp(msgb_bssgph(stored_msg), pdu, sizeof(pdu)));
+	OSMO_ASSERT(msgb_nsei(stored_msg) == 0x1000);
+	OSMO_ASSERT(msgb_bvci(stored_msg) == 20);
+	OSMO_ASSERT(parse_ctx.tlli_enc == msgb_bssgph(stored_msg) + 1);
+	OSMO_ASSERT(parse_ctx.tlli == 0xc0000001);
+	OSMO_ASSERT(parse_ctx.llc == NULL);
+	OSMO_ASSERT(parse_ctx.peer_nsei == 0x1000);
+	msgb_free(stored_msg);
+	OSMO_ASSERT(gbproxy_link_info_dequeue_msg(link_info1, &parse_ctx) == NULL);
+	OSMO_ASSERT(link_info1->stored_msgs_len == 0);
+	OSMO_ASSERT(cfg.stored_msgs_bytes == 2 * one_msg);
+
+	/* a message that can never fit is rejected without dropping others */
+	cfg.stored_msgs_max_bytes = one_msg - 1;
+	OSMO_ASSERT(gbproxy_link_info_store_msg(peer, link_info1, msg, &parse_ctx) == -EMSGSIZE);
+	OSMO_ASSERT(link_info1->stored_msgs_len == 0);
+	OSMO_ASSERT(link_info2->stored_msgs_len == 2);
+	OSMO_ASSERT(cfg.ctrg->ctr[GBPROX_GLOB_CTR_STORED_MSGS_DROPPED].current == 1);
+
+	/* dropping a message tells where it came from */
+	OSMO_ASSERT(gbproxy_link_info_drop_msg(link_info2) == 0x1000);
+	OSMO_ASSERT(link_info2->stored_msgs_len == 1);
+	OSMO_ASSERT(cfg.stored_msgs_bytes == one_msg);
+	OSMO_ASSERT(gbproxy_link_info_drop_msg(link_info1) == -1);
+
+	/* deleting the links releases their messages */
+	gbproxy_peer_free(peer);
+	OSMO_ASSERT(cfg.stored_msgs_bytes == 0);
+	OSMO_ASSERT(llist_empty(&cfg.stored_msgs));
+
+	msgb_free(msg);
+	gbprox_reset(&cfg);
+	/* gbprox_reset() frees the rate_ctr, but re-allocates it again. */
+	rate_ctr_group_free(cfg.ctrg);
+
+	cleanup_test();
+}
+
+static void test_gbproxy_llc_fcs_apn_patching(void)
+{
+	struct gbproxy_config cfg = {0};
+	struct gbproxy_peer *peer;
+	struct gprs_gb_parse_context parse_ctx = {0};
+	struct msgb *msg;
+	uint8_t *llc;
+	size_t llc_len = 3 + sizeof(dtap_act_pdp_ctx_req) + 3;
+	unsigned fcs;
+	int len_change = 0;
+
+	printf("Test LLC FCS after APN patching\n\n");
+
+	gbproxy_init_config(&cfg);
+	/* Same length as the APN 'ab' of dtap_act_pdp_ctx_req */
+	cfg.core_apn = talloc_zero_size(tall_sgsn_ctx, 100);
+	cfg.core_apn_size = gprs_str_to_apn(cfg.core_apn, 100, "xy");
+
+	peer = gbproxy_peer_alloc(&cfg, 20);
+
+	msg = msgb_alloc_headroom(1024, 128, "llc_fcs_apn_patching");
+	llc = msgb_put(msg, llc_len);
+	llc[0] = GPRS_SAPI_GMM;
+	llc[1] = 0xc0;
+	llc[2] = (3 << 2) | 1;
+	memcpy(llc + 3, dtap_act_pdp_ctx_req, sizeof(dtap_act_pdp_ctx_req));
+	fcs = gprs_llc_fcs(llc, llc_len - 3);
+	llc[llc_len - 3] = fcs & 0xff;
+	llc[llc_len - 2] = (fcs >> 8) & 0xff;
+	llc[llc_len - 1] = (fcs >> 16) & 0xff;
+
+	OSMO_ASSERT(gprs_gb_parse_llc(llc, llc_len, &parse_ctx));
+	OSMO_ASSERT(parse_ctx.apn_ie != NULL);
+	OSMO_ASSERT(parse_ctx.apn_ie_len == cfg.core_apn_size + 2);
+
+	OSMO_ASSERT(gbproxy_patch_llc(msg, llc, llc_len, peer, NULL,
+				      &len_change, &parse_ctx) == 1);
+	OSMO_ASSERT(len_change == 0);
+	OSMO_ASSERT(peer->ctrg->ctr[GBPROX_PEER_CTR_APN_PATCHED].current == 1);
+	OSMO_ASSERT(!memcmp(parse_ctx.apn_ie + 2, cfg.core_apn,
+			    cfg.core_apn_size));
+
+	/* The FCS covers the new APN */
+	fcs = gprs_llc_fcs(llc, llc_len - 3);
+	OSMO_ASSERT(llc[llc_len - 3] == (fcs & 0xff));
+	OSMO_ASSERT(llc[llc_len - 2] == ((fcs >> 8) & 0xff));
+	OSMO_ASSERT(llc[llc_len - 1] == ((fcs >> 16) & 0xff));
+
+	msgb_free(msg);
+	talloc_free(cfg.core_apn);
+	cfg.core_apn = NULL;
+	gbprox_reset(&cfg);
+	/* gbprox_reset() frees the rate_ctr, but re-allocates it again. */
+	rate_ctr_group_free(cfg.ctrg);
+
+	cleanup_test();
+}
+
 static void test_gbproxy_imsi_matching(void)
 {
 	const char *err_msg = NULL;
@@ -4831,8 +5400,38 @@ static void test_gbproxy_imsi_matching(void)
 
 	/* TODO: Check correct length but wrong type with is_mi_tmsi */
 
+	/* Prefix patterns are matched by the trie, others by regexec() */
+	OSMO_ASSERT(gbproxy_set_patch_filter(&match, filter_re2, &err_msg) == 0);
+	OSMO_ASSERT(match.prefix_trie != NULL);
+
+	OSMO_ASSERT(gbproxy_set_patch_filter(&match, "^(4321|12345)", &err_msg) == 0);
+	OSMO_ASSERT(match.prefix_trie != NULL);
+	OSMO_ASSERT(gbproxy_check_imsi(&match, imsi1, ARRAY_SIZE(imsi1)) == 1);
+	OSMO_ASSERT(gbproxy_check_imsi(&match, imsi2, ARRAY_SIZE(imsi2)) == 1);
+	OSMO_ASSERT(gbproxy_check_imsi(&match, imsi3_bad, ARRAY_SIZE(imsi3_bad)) == 0);
+	OSMO_ASSERT(gbproxy_check_imsi(&match, tmsi1, ARRAY_SIZE(tmsi1)) == -1);
+
+	OSMO_ASSERT(gbproxy_set_patch_filter(&match, "^(4321|1234567).*", &err_msg) == 0);
+	OSMO_ASSERT(match.prefix_trie != NULL);
+	OSMO_ASSERT(gbproxy_check_imsi(&match, imsi1, ARRAY_SIZE(imsi1)) == 0);
+	OSMO_ASSERT(gbproxy_check_imsi(&match, imsi2, ARRAY_SIZE(imsi2)) == 1);
+
+	OSMO_ASSERT(gbproxy_set_patch_filter(&match, filter_re1, &err_msg) == 0);
+	OSMO_ASSERT(match.prefix_trie != NULL);
+	OSMO_ASSERT(gbproxy_check_imsi(&match, imsi3_bad, ARRAY_SIZE(imsi3_bad)) == 1);
+	OSMO_ASSERT(gbproxy_check_imsi(&match, imei1, ARRAY_SIZE(imei1)) == -1);
+
+	OSMO_ASSERT(gbproxy_set_patch_filter(&match, "^1234$", &err_msg) == 0);
+	OSMO_ASSERT(match.prefix_trie == NULL);
+	OSMO_ASSERT(gbproxy_check_imsi(&match, imsi1, ARRAY_SIZE(imsi1)) == 0);
+
+	OSMO_ASSERT(gbproxy_set_patch_filter(&match, "3456", &err_msg) == 0);
+	OSMO_ASSERT(match.prefix_trie == NULL);
+	OSMO_ASSERT(gbproxy_check_imsi(&match, imsi1, ARRAY_SIZE(imsi1)) == 1);
+
 	gbproxy_clear_patch_filter(&match);
 	OSMO_ASSERT(match.enable == 0);
+	OSMO_ASSERT(match.prefix_trie == NULL);
 
 	cleanup_test();
 }
@@ -5065,8 +5664,13 @@ int main(int argc, char **argv)
 	test_gbproxy_ptmsi_patching_bad_cases();
 	test_gbproxy_imsi_acquisition();
 	test_gbproxy_secondary_sgsn();
+	test_gbproxy_sgsn_pool();
+	test_gbproxy_sgsn_pool_routing();
 	test_gbproxy_keep_info();
 	test_gbproxy_tlli_expire();
+	test_gbproxy_paging_areas();
+	test_gbproxy_stored_msgs_budget();
+	test_gbproxy_llc_fcs_apn_patching();
 	test_gbproxy_stored_messages();
 	test_gbproxy_parse_bssgp_unitdata();
 	gbprox_reset(&gbcfg);
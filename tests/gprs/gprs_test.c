@@ -1,9 +1,11 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <inttypes.h>
 
 #include <osmocom/sgsn/gprs_llc.h>
 #include <osmocom/sgsn/gprs_utils.h>
+#include <osmocom/sgsn/crc24.h>
 
 #include <osmocom/sgsn/debug.h>
 
@@ -115,6 +117,42 @@ static void test_gprs_timer_enc_dec(void)
 	}
 }
 
+static void test_crc24_update(void)
+{
+	uint8_t frame[1600];
+	uint8_t old_data[8];
+	unsigned int len, off, n, i;
+	uint32_t fcs, fcs_upd;
+
+	printf("Test CRC-24 incremental update\n");
+
+	for (i = 0; i < sizeof(frame); i++)
+		frame[i] = (uint8_t)(i * 131 + 7);
+
+	for (len = 1; len <= sizeof(frame); len += 37) {
+		for (n = 1; n <= 6 && n <= len; n++) {
+			for (off = 0; off + n <= len; off += 1 + len / 5) {
+				fcs = crc24_calc(INIT_CRC24, frame, len);
+
+				memcpy(old_data, frame + off, n);
+				for (i = 0; i < n; i++)
+					frame[off + i] ^= (uint8_t)(0x5a + off + i);
+
+				fcs_upd = crc24_update(fcs, old_data, frame + off, n,
+						       len - off - n);
+				OSMO_ASSERT(fcs_upd ==
+					    crc24_calc(INIT_CRC24, frame, len));
+
+				/* A change back must restore the original CRC */
+				fcs_upd = crc24_update(fcs_upd, frame + off, old_data,
+						       n, len - off - n);
+				OSMO_ASSERT(fcs_upd == fcs);
+				memcpy(frame + off, old_data, n);
+			}
+		}
+	}
+}
+
 const struct log_info_cat default_categories[] = {
 	[DGPRS] = {
 		.name = "DGPRS",
@@ -135,6 +173,7 @@ int main(int argc, char **argv)
 
 	test_8_4_2();
 	test_gprs_timer_enc_dec();
+	test_crc24_update();
 
 	printf("Done.\n");
 	return EXIT_SUCCESS;
@@ -0,0 +1,558 @@
+/* Benchmark parts of the GTP hub */
+
+/* (C) 2015 by sysmocom s.f.m.c. GmbH
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Not part of the testsuite: timing results depend on the machine. Run
+ * manually, e.g. to compare lookup cost before and after a change:
+ *
+ *   ./gtphub_bench [max_mappings [max_tunnels]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+
+#include <gtp.h>
+#include <gtpie.h>
+
+#include <osmocom/core/utils.h>
+#include <osmocom/core/application.h>
+
+#include <osmocom/sgsn/debug.h>
+
+#include <osmocom/sgsn/gtphub.h>
+
+void *osmo_gtphub_ctx;
+void gtphub_init(struct gtphub *hub);
+void gtphub_free(struct gtphub *hub);
+
+/* bench_pdp() sets the GGSN that the next Create PDP Context Request
+ * resolves to. */
+static struct gsn_addr *bench_resolve_to;
+
+struct gtphub_peer_port *__wrap_gtphub_resolve_ggsn_addr(struct gtphub *hub,
+							 const char *imsi_str,
+							 const char *apn_ni_str,
+							 struct llist_head **parked)
+{
+	*parked = NULL;
+	if (!bench_resolve_to)
+		return NULL;
+	return gtphub_port_have(hub,
+				&hub->to_gsns[GTPH_SIDE_GGSN][GTPH_PLANE_CTRL],
+				bench_resolve_to, 2123);
+}
+
+/* gtphub.o references these, but none of the benchmarks reach them. */
+int __wrap_gtphub_ares_init(struct gtphub *hub)
+{
+	return 0;
+}
+
+int __wrap_gtphub_write(const struct osmo_fd *to,
+			const struct osmo_sockaddr *to_addr,
+			const uint8_t *buf, size_t buf_len)
+{
+	return 0;
+}
+
+int __wrap_gtphub_write_batch(const struct osmo_fd *to,
+			      const struct gtphub_out *out, unsigned int n)
+{
+	return n;
+}
+
+static double now_s(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#define BENCH_ORIGINS 16
+
+/* Add n mappings across BENCH_ORIGINS origins, then look each one up by
+ * origin+orig and by repl, and print the time per operation. */
+static void bench_nr_map(int n)
+{
+	struct nr_pool pool;
+	struct nr_map map;
+	struct nr_mapping *mappings;
+	char origins[BENCH_ORIGINS];
+	double t0, t_add, t_get, t_get_inv, t_del;
+	int i;
+
+	mappings = talloc_array(osmo_gtphub_ctx, struct nr_mapping, n);
+	OSMO_ASSERT(mappings);
+
+	nr_pool_init(&pool, 1, UINT_MAX);
+	nr_map_init(&map, &pool, NULL);
+
+	t0 = now_s();
+	for (i = 0; i < n; i++) {
+		struct nr_mapping *m = &mappings[i];
+		nr_mapping_init(m);
+		m->origin = &origins[i % BENCH_ORIGINS];
+		m->orig = i / BENCH_ORIGINS;
+		nr_map_add(&map, m, 0);
+	}
+	t_add = now_s() - t0;
+
+	t0 = now_s();
+	for (i = 0; i < n; i++) {
+		struct nr_mapping *m = nr_map_get(&map,
+						  &origins[i % BENCH_ORIGINS],
+						  i / BENCH_ORIGINS);
+		OSMO_ASSERT(m == &mappings[i]);
+	}
+	t_get = now_s() - t0;
+
+	t0 = now_s();
+	for (i = 0; i < n; i++)
+		OSMO_ASSERT(nr_map_get_inv(&map, mappings[i].repl)
+			    == &mappings[i]);
+	t_get_inv = now_s() - t0;
+
+	t0 = now_s();
+	nr_map_clear(&map);
+	t_del = now_s() - t0;
+	OSMO_ASSERT(nr_map_empty(&map));
+
+	printf("nr_map %8d mappings: add %6.1f ns, get %6.1f ns,"
+	       " get_inv %6.1f ns, del %6.1f ns\n",
+	       n,
+	       t_add * 1e9 / n,
+	       t_get * 1e9 / n,
+	       t_get_inv * 1e9 / n,
+	       t_del * 1e9 / n);
+
+	talloc_free(mappings);
+}
+
+/* Add n peers to a bind, then identify each as a sender by its address, as
+ * done for every received packet, and print the time per lookup. */
+static void bench_port_find(int n)
+{
+	struct gtphub hub;
+	struct gtphub_bind *bind;
+	struct gtphub_peer_port **ports;
+	double t0, t_add, t_find;
+	int i;
+
+	ports = talloc_array(osmo_gtphub_ctx, struct gtphub_peer_port *, n);
+	OSMO_ASSERT(ports);
+
+	gtphub_init(&hub);
+	bind = &hub.to_gsns[GTPH_SIDE_SGSN][GTPH_PLANE_CTRL];
+
+	t0 = now_s();
+	for (i = 0; i < n; i++) {
+		struct gsn_addr addr;
+		addr.len = 4;
+		addr.buf[0] = 10;
+		addr.buf[1] = i >> 16;
+		addr.buf[2] = i >> 8;
+		addr.buf[3] = i;
+		ports[i] = gtphub_port_have(&hub, bind, &addr, 2123);
+		OSMO_ASSERT(ports[i]);
+	}
+	t_add = now_s() - t0;
+
+	t0 = now_s();
+	for (i = 0; i < n; i++)
+		OSMO_ASSERT(gtphub_port_find_sa(bind, &ports[i]->sa)
+			    == ports[i]);
+	t_find = now_s() - t0;
+
+	printf("peers  %8d ports:    add %6.1f ns, find %6.1f ns\n",
+	       n,
+	       t_add * 1e9 / n,
+	       t_find * 1e9 / n);
+
+	gtphub_free(&hub);
+	talloc_free(ports);
+}
+
+#define BENCH_SGSNS 64
+#define BENCH_GGSNS 32
+#define BENCH_GPDU_ROUNDS 4
+
+struct bench_gsn {
+	struct gsn_addr addr;
+	struct osmo_sockaddr sa[GTPH_PLANE_N];
+	uint16_t seq;
+};
+
+struct bench_tunnel {
+	uint32_t tei_repl;
+	uint16_t seq_to_ggsn;
+};
+
+static uint8_t bench_buf[1024];
+
+static void bench_gsn_init(struct bench_gsn *gsn, const char *fmt, int i)
+{
+	char str[32];
+	snprintf(str, sizeof(str), fmt, i >> 8, i & 0xff);
+	OSMO_ASSERT(gsn_addr_from_str(&gsn->addr, str) == 0);
+	OSMO_ASSERT(osmo_sockaddr_init_udp(&gsn->sa[GTPH_PLANE_CTRL], str, 2123)
+		    == 0);
+	OSMO_ASSERT(osmo_sockaddr_init_udp(&gsn->sa[GTPH_PLANE_USER], str, 2152)
+		    == 0);
+	gsn->seq = 0;
+}
+
+static uint8_t *put_u16(uint8_t *pos, uint16_t val)
+{
+	*pos++ = val >> 8;
+	*pos++ = val;
+	return pos;
+}
+
+static uint8_t *put_u32(uint8_t *pos, uint32_t val)
+{
+	pos = put_u16(pos, val >> 16);
+	return put_u16(pos, val);
+}
+
+static uint16_t get_u16(const uint8_t *pos)
+{
+	return (pos[0] << 8) | pos[1];
+}
+
+static uint32_t get_u32(const uint8_t *pos)
+{
+	return ((uint32_t)get_u16(pos) << 16) | get_u16(pos + 2);
+}
+
+/* Write a GTPv1 header with sequence nr to bench_buf, return the position of
+ * the first IE. */
+static uint8_t *gtp_hdr(uint8_t type, uint32_t tei, uint16_t seq)
+{
+	uint8_t *pos = bench_buf;
+	*pos++ = 0x32;
+	*pos++ = type;
+	pos = put_u16(pos, 0);
+	pos = put_u32(pos, tei);
+	pos = put_u16(pos, seq);
+	*pos++ = 0;
+	*pos++ = 0;
+	return pos;
+}
+
+/* Fill in the length in bench_buf's GTP header, return the message size. */
+static size_t gtp_end(uint8_t *end)
+{
+	size_t len = end - bench_buf;
+	put_u16(bench_buf + 2, len - 8);
+	return len;
+}
+
+/* Put an IMSI IE whose last seven digits are nr. */
+static uint8_t *put_imsi(uint8_t *pos, uint32_t nr)
+{
+	int i;
+	*pos++ = GTPIE_IMSI;
+	pos = put_u32(pos, 0x42000121);
+	for (i = 0; i < 4; i++) {
+		uint8_t lo = nr % 10;
+		uint8_t hi = (i == 3)? 0xf : (nr / 10) % 10;
+		*pos++ = (hi << 4) | lo;
+		nr /= 100;
+	}
+	return pos;
+}
+
+static uint8_t *put_gsn_addrs(uint8_t *pos, const struct gsn_addr *addr)
+{
+	int i;
+	for (i = 0; i < 2; i++) {
+		*pos++ = GTPIE_GSN_ADDR;
+		pos = put_u16(pos, addr->len);
+		memcpy(pos, addr->buf, addr->len);
+		pos += addr->len;
+	}
+	return pos;
+}
+
+/* Create PDP Context Request: the TEI Control IE value is at offset 31. */
+static size_t msg_create_req(uint16_t seq, uint32_t imsi, uint32_t tei,
+			     const struct gsn_addr *sgsn)
+{
+	static const uint8_t apn[] = { 8, 'i', 'n', 't', 'e', 'r', 'n', 'e', 't' };
+	uint8_t *pos = gtp_hdr(GTP_CREATE_PDP_REQ, 0, seq);
+	*pos++ = GTPIE_RECOVERY;
+	*pos++ = 1;
+	pos = put_imsi(pos, imsi);
+	*pos++ = GTPIE_SELECTION_MODE;
+	*pos++ = 1;
+	*pos++ = GTPIE_TEI_DI;
+	pos = put_u32(pos, tei);
+	*pos++ = GTPIE_TEI_C;
+	pos = put_u32(pos, tei);
+	*pos++ = GTPIE_NSAPI;
+	*pos++ = 5;
+	*pos++ = GTPIE_APN;
+	pos = put_u16(pos, sizeof(apn));
+	memcpy(pos, apn, sizeof(apn));
+	pos += sizeof(apn);
+	return gtp_end(put_gsn_addrs(pos, sgsn));
+}
+
+static size_t msg_create_rsp(uint32_t tei_h, uint16_t seq, uint32_t tei,
+			     const struct gsn_addr *ggsn)
+{
+	uint8_t *pos = gtp_hdr(GTP_CREATE_PDP_RSP, tei_h, seq);
+	*pos++ = GTPIE_CAUSE;
+	*pos++ = 0x80;
+	*pos++ = GTPIE_RECOVERY;
+	*pos++ = 1;
+	*pos++ = GTPIE_TEI_DI;
+	pos = put_u32(pos, tei);
+	*pos++ = GTPIE_TEI_C;
+	pos = put_u32(pos, tei);
+	return gtp_end(put_gsn_addrs(pos, ggsn));
+}
+
+/* Update and Delete PDP Context Request. */
+static size_t msg_pdp_req(uint8_t type, uint32_t tei_h, uint16_t seq)
+{
+	uint8_t *pos = gtp_hdr(type, tei_h, seq);
+	if (type == GTP_DELETE_PDP_REQ) {
+		*pos++ = GTPIE_TEARDOWN;
+		*pos++ = 0xff;
+	}
+	*pos++ = GTPIE_NSAPI;
+	*pos++ = 5;
+	return gtp_end(pos);
+}
+
+/* Update and Delete PDP Context Response. */
+static size_t msg_pdp_rsp(uint8_t type, uint32_t tei_h, uint16_t seq)
+{
+	uint8_t *pos = gtp_hdr(type, tei_h, seq);
+	*pos++ = GTPIE_CAUSE;
+	*pos++ = 0x80;
+	return gtp_end(pos);
+}
+
+/* G-PDU without sequence nr, carrying a 64 octet payload. */
+static size_t msg_gpdu(uint32_t tei_h)
+{
+	uint8_t *pos = bench_buf;
+	*pos++ = 0x30;
+	*pos++ = GTP_GPDU;
+	pos = put_u16(pos, 64);
+	pos = put_u32(pos, tei_h);
+	memset(pos, 0x2a, 64);
+	return 8 + 64;
+}
+
+/* Pass bench_buf through gtphub, return the forwarded packet. */
+static uint8_t *bench_rx(struct gtphub *hub, unsigned int side_idx,
+			 unsigned int plane_idx,
+			 const struct osmo_sockaddr *from, size_t len,
+			 time_t now)
+{
+	uint8_t *out = NULL;
+	struct osmo_fd *to_ofd;
+	struct osmo_sockaddr to_addr;
+	OSMO_ASSERT(gtphub_handle_buf(hub, side_idx, plane_idx, from,
+				      bench_buf, len, now,
+				      &out, &to_ofd, &to_addr) > 0);
+	return out;
+}
+
+static void bench_pdp_report(const char *what, int n_tunnels, int n_pkts,
+			     double t)
+{
+	printf("pdp    %8d tunnels:  %-8s %9.0f pkt/s, %6.1f ns/pkt\n",
+	       n_tunnels, what, n_pkts / t, t * 1e9 / n_pkts);
+}
+
+/* Establish n tunnels between BENCH_SGSNS SGSNs and BENCH_GGSNS GGSNs, run
+ * G-PDUs through them in both directions, update and delete them, all via
+ * gtphub_handle_buf() without sockets. Print the packet rate per phase and
+ * the memory each tunnel occupies. The time includes composing each packet,
+ * since gtphub rewrites it in place. */
+static void bench_pdp(int n)
+{
+	struct gtphub hub;
+	struct bench_gsn sgsns[BENCH_SGSNS];
+	struct bench_gsn ggsns[BENCH_GGSNS];
+	struct bench_tunnel *tuns;
+	time_t now = 1;
+	size_t mem0, mem;
+	double t0;
+	int i, r;
+
+	tuns = talloc_array(NULL, struct bench_tunnel, n);
+	OSMO_ASSERT(tuns);
+
+	gtphub_init(&hub);
+	OSMO_ASSERT(gsn_addr_from_str(&hub.to_gsns[GTPH_SIDE_SGSN][GTPH_PLANE_CTRL].local_addr,
+				      "127.0.1.1") == 0);
+	OSMO_ASSERT(gsn_addr_from_str(&hub.to_gsns[GTPH_SIDE_SGSN][GTPH_PLANE_USER].local_addr,
+				      "127.0.1.2") == 0);
+	OSMO_ASSERT(gsn_addr_from_str(&hub.to_gsns[GTPH_SIDE_GGSN][GTPH_PLANE_CTRL].local_addr,
+				      "127.0.2.1") == 0);
+	OSMO_ASSERT(gsn_addr_from_str(&hub.to_gsns[GTPH_SIDE_GGSN][GTPH_PLANE_USER].local_addr,
+				      "127.0.2.2") == 0);
+
+	for (i = 0; i < BENCH_SGSNS; i++)
+		bench_gsn_init(&sgsns[i], "10.1.%d.%d", i + 1);
+	for (i = 0; i < BENCH_GGSNS; i++)
+		bench_gsn_init(&ggsns[i], "10.2.%d.%d", i + 1);
+
+	mem0 = talloc_total_size(osmo_gtphub_ctx);
+
+	t0 = now_s();
+	for (i = 0; i < n; i++) {
+		struct bench_gsn *sgsn = &sgsns[i % BENCH_SGSNS];
+		struct bench_gsn *ggsn = &ggsns[i % BENCH_GGSNS];
+		uint8_t *out;
+		size_t len;
+
+		bench_resolve_to = &ggsn->addr;
+		len = msg_create_req(++sgsn->seq, i, i + 1, &sgsn->addr);
+		out = bench_rx(&hub, GTPH_SIDE_SGSN, GTPH_PLANE_CTRL,
+			       &sgsn->sa[GTPH_PLANE_CTRL], len, now);
+		tuns[i].seq_to_ggsn = get_u16(out + 8);
+		tuns[i].tei_repl = get_u32(out + 31);
+
+		len = msg_create_rsp(tuns[i].tei_repl, tuns[i].seq_to_ggsn,
+				     i + 1, &ggsn->addr);
+		bench_rx(&hub, GTPH_SIDE_GGSN, GTPH_PLANE_CTRL,
+			 &ggsn->sa[GTPH_PLANE_CTRL], len, now);
+	}
+	bench_pdp_report("create", n, 2 * n, now_s() - t0);
+	bench_resolve_to = NULL;
+
+	/* Let the sequence nr mappings expire, the tunnels stay. */
+	now += GTPH_EXPIRE_QUICKLY_SECS + 1;
+	gtphub_gc(&hub, now);
+	mem = talloc_total_size(osmo_gtphub_ctx);
+
+	t0 = now_s();
+	for (r = 0; r < BENCH_GPDU_ROUNDS; r++) {
+		for (i = 0; i < n; i++) {
+			struct bench_gsn *sgsn = &sgsns[i % BENCH_SGSNS];
+			struct bench_gsn *ggsn = &ggsns[i % BENCH_GGSNS];
+			bench_rx(&hub, GTPH_SIDE_SGSN, GTPH_PLANE_USER,
+				 &sgsn->sa[GTPH_PLANE_USER],
+				 msg_gpdu(tuns[i].tei_repl), now);
+			bench_rx(&hub, GTPH_SIDE_GGSN, GTPH_PLANE_USER,
+				 &ggsn->sa[GTPH_PLANE_USER],
+				 msg_gpdu(tuns[i].tei_repl), now);
+		}
+	}
+	bench_pdp_report("g-pdu", n, 2 * BENCH_GPDU_ROUNDS * n, now_s() - t0);
+
+	t0 = now_s();
+	for (i = 0; i < n; i++) {
+		struct bench_gsn *sgsn = &sgsns[i % BENCH_SGSNS];
+		struct bench_gsn *ggsn = &ggsns[i % BENCH_GGSNS];
+		uint8_t *out;
+
+		out = bench_rx(&hub, GTPH_SIDE_SGSN, GTPH_PLANE_CTRL,
+			       &sgsn->sa[GTPH_PLANE_CTRL],
+			       msg_pdp_req(GTP_UPDATE_PDP_REQ,
+					   tuns[i].tei_repl, ++sgsn->seq),
+			       now);
+		bench_rx(&hub, GTPH_SIDE_GGSN, GTPH_PLANE_CTRL,
+			 &ggsn->sa[GTPH_PLANE_CTRL],
+			 msg_pdp_rsp(GTP_UPDATE_PDP_RSP, tuns[i].tei_repl,
+				     get_u16(out + 8)),
+			 now);
+	}
+	bench_pdp_report("update", n, 2 * n, now_s() - t0);
+
+	now += GTPH_EXPIRE_QUICKLY_SECS + 1;
+	gtphub_gc(&hub, now);
+
+	t0 = now_s();
+	for (i = 0; i < n; i++) {
+		struct bench_gsn *sgsn = &sgsns[i % BENCH_SGSNS];
+		struct bench_gsn *ggsn = &ggsns[i % BENCH_GGSNS];
+		uint8_t *out;
+
+		out = bench_rx(&hub, GTPH_SIDE_SGSN, GTPH_PLANE_CTRL,
+			       &sgsn->sa[GTPH_PLANE_CTRL],
+			       msg_pdp_req(GTP_DELETE_PDP_REQ,
+					   tuns[i].tei_repl, ++sgsn->seq),
+			       now);
+		bench_rx(&hub, GTPH_SIDE_GGSN, GTPH_PLANE_CTRL,
+			 &ggsn->sa[GTPH_PLANE_CTRL],
+			 msg_pdp_rsp(GTP_DELETE_PDP_RSP, tuns[i].tei_repl,
+				     get_u16(out + 8)),
+			 now);
+	}
+	bench_pdp_report("delete", n, 2 * n, now_s() - t0);
+	OSMO_ASSERT(llist_empty(&hub.tunnels));
+
+	printf("pdp    %8d tunnels:  %6.0f bytes per tunnel\n",
+	       n, (double)(mem - mem0) / n);
+
+	gtphub_free(&hub);
+	talloc_free(tuns);
+}
+
+static struct log_info_cat gtphub_categories[] = {
+	[DGTPHUB] = {
+		.name = "DGTPHUB",
+		.description = "GTP Hub",
+		.color = "\033[1;33m",
+		.enabled = 1, .loglevel = LOGL_ERROR,
+	},
+};
+
+static struct log_info info = {
+	.cat = gtphub_categories,
+	.num_cat = ARRAY_SIZE(gtphub_categories),
+};
+
+int main(int argc, char **argv)
+{
+	int max_n = 1000000;
+	int max_tunnels = 100000;
+	int n;
+
+	if (argc > 1)
+		max_n = atoi(argv[1]);
+	if (argc > 2)
+		max_tunnels = atoi(argv[2]);
+
+	osmo_gtphub_ctx = talloc_named_const(NULL, 0, "osmo_gtphub");
+	void *log_ctx = talloc_named_const(osmo_gtphub_ctx, 0, "log");
+	osmo_init_logging2(log_ctx, &info);
+
+	for (n = 1000; n <= max_n; n *= 10)
+		bench_nr_map(n);
+	for (n = 10; n <= max_n && n <= 100000; n *= 10)
+		bench_port_find(n);
+	for (n = 1000; n <= max_tunnels; n *= 10)
+		bench_pdp(n);
+
+	talloc_free(log_ctx);
+	OSMO_ASSERT(talloc_total_blocks(osmo_gtphub_ctx) == 1);
+	talloc_free(osmo_gtphub_ctx);
+	return 0;
+}
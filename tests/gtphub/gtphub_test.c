@@ -24,6 +24,7 @@
 #include <string.h>
 #include <limits.h>
 #include <unistd.h>
+#include <fcntl.h>
 
 #include <osmocom/core/utils.h>
 #include <osmocom/core/application.h>
@@ -52,6 +53,8 @@
 	  printf(label "\n"); }
 
 void gtphub_init(struct gtphub *hub);
+void gtphub_init_worker(struct gtphub *hub, unsigned int workers,
+			unsigned int worker_id);
 void gtphub_free(struct gtphub *hub);
 
 void *osmo_gtphub_ctx;
@@ -283,6 +286,85 @@ static void test_nr_map_wrap(void)
 		));
 }
 
+/* Reference lookups by plain list traversal, as nr_map_get() and
+ * nr_map_get_inv() used to do before the mappings were hashed. */
+static struct nr_mapping *nr_map_get_linear(struct nr_map *map, void *origin,
+					    nr_t orig)
+{
+	struct nr_mapping *m;
+	llist_for_each_entry(m, &map->mappings, entry) {
+		if (m->origin == origin && m->orig == orig)
+			return m;
+	}
+	return NULL;
+}
+
+static struct nr_mapping *nr_map_get_inv_linear(struct nr_map *map, nr_t repl)
+{
+	struct nr_mapping *m;
+	llist_for_each_entry(m, &map->mappings, entry) {
+		if (m->repl == repl)
+			return m;
+	}
+	return NULL;
+}
+
+static int nr_map_matches_linear(struct nr_map *map, void **origins,
+				 int origins_n, nr_t orig_max, nr_t repl_max)
+{
+	int o;
+	nr_t nr;
+	for (o = 0; o < origins_n; o++) {
+		for (nr = 0; nr <= orig_max; nr++)
+			LVL2_ASSERT(nr_map_get(map, origins[o], nr)
+				    == nr_map_get_linear(map, origins[o], nr));
+	}
+	for (nr = 0; nr <= repl_max; nr++)
+		LVL2_ASSERT(nr_map_get_inv(map, nr)
+			    == nr_map_get_inv_linear(map, nr));
+	return 1;
+}
+
+static void test_nr_map_index(void)
+{
+	/* Use a small pool so that replacement numbers get reused, and enough
+	 * mappings to make the hash indexes grow a few times. The hashed
+	 * lookups must return exactly what a list traversal returns, also
+	 * with duplicate repl values. */
+#define TEST_POOL_MAX 50
+#define TEST_ORIG_MAX 200
+	struct nr_pool pool;
+	struct nr_map map;
+	void *origins[] = { (void*)0x1234, (void*)0x5678, (void*)0x9abc };
+	int origins_n = ARRAY_SIZE(origins);
+	int o;
+	nr_t nr;
+
+	nr_pool_init(&pool, 1, TEST_POOL_MAX);
+	nr_map_init(&map, &pool, NULL);
+
+	for (nr = 0; nr < TEST_ORIG_MAX; nr += 3)
+		for (o = 0; o < origins_n; o++)
+			OSMO_ASSERT(nr_map_have(&map, origins[o], nr, 0));
+	OSMO_ASSERT(nr_map_matches_linear(&map, origins, origins_n,
+					  TEST_ORIG_MAX, TEST_POOL_MAX));
+
+	/* Remove every other mapping, so that the first match for a repl
+	 * value moves to a later entry. */
+	for (nr = 0; nr < TEST_ORIG_MAX; nr += 6)
+		nr_mapping_del(nr_map_get(&map, origins[(nr / 6) % origins_n],
+					  nr));
+	OSMO_ASSERT(nr_map_matches_linear(&map, origins, origins_n,
+					  TEST_ORIG_MAX, TEST_POOL_MAX));
+
+	nr_map_clear(&map);
+	OSMO_ASSERT(nr_map_empty(&map));
+	OSMO_ASSERT(!nr_map_get(&map, origins[0], 3));
+	OSMO_ASSERT(!nr_map_get_inv(&map, 1));
+#undef TEST_POOL_MAX
+#undef TEST_ORIG_MAX
+}
+
 static void test_expiry(void)
 {
 	struct expiry expiry;
@@ -418,15 +500,30 @@ static int send_from_ggsn(const char *addr, uint16_t port)
 /* override, requires '-Wl,--wrap=gtphub_resolve_ggsn_addr' */
 struct gtphub_peer_port *__real_gtphub_resolve_ggsn_addr(struct gtphub *hub,
 							 const char *imsi_str,
-							 const char *apn_ni_str);
+							 const char *apn_ni_str,
+							 struct llist_head **parked);
+
+/* If set, __wrap_gtphub_resolve_ggsn_addr() pretends that a DNS query is still
+ * pending and asks to park the request in this list. */
+struct llist_head *resolve_ggsn_park_in = NULL;
 
 struct gtphub_peer_port *__wrap_gtphub_resolve_ggsn_addr(struct gtphub *hub,
 							 const char *imsi_str,
-							 const char *apn_ni_str)
+							 const char *apn_ni_str,
+							 struct llist_head **parked)
 {
 	struct gsn_addr resolved_gsna;
 	uint16_t resolved_port;
 
+	if (resolve_ggsn_park_in) {
+		printf("- __wrap_gtphub_resolve_ggsn_addr():\n"
+		       "  resolution pending for imsi %s ni %s\n",
+		       imsi_str, apn_ni_str);
+		*parked = resolve_ggsn_park_in;
+		return NULL;
+	}
+	*parked = NULL;
+
 	OSMO_ASSERT(gsn_addr_from_sockaddr(&resolved_gsna, &resolved_port,
 					   &resolved_ggsn_addr) == 0);
 
@@ -507,6 +604,16 @@ int __wrap_gtphub_write(const struct osmo_fd *to,
 	return 0;
 }
 
+int __wrap_gtphub_write_batch(const struct osmo_fd *to,
+			      const struct gtphub_out *out, unsigned int n)
+{
+	unsigned int i;
+	for (i = 0; i < n; i++)
+		__wrap_gtphub_write(to, &out[i].to_addr, out[i].buf,
+				    out[i].len);
+	return n;
+}
+
 #define buf_len 1024
 static uint8_t buf[buf_len];
 static uint8_t *reply_buf;
@@ -1179,6 +1286,18 @@ static void test_user_data(void)
 		" <-> 192.168.43.34 (TEI C=765 U=567)"
 		" @22545\n"));
 
+	/* Counted on the tunnel's User plane endpoints. */
+	struct gtphub_tunnel *tun = llist_first_entry(&hub->tunnels,
+						      struct gtphub_tunnel,
+						      entry);
+	struct gtphub_tunnel_counters *c;
+	c = &tun->endpoint[GTPH_SIDE_GGSN][GTPH_PLANE_USER].counters;
+	OSMO_ASSERT(c->pkts_in == 1 && c->bytes_in == 96);
+	OSMO_ASSERT(c->pkts_out == 0);
+	c = &tun->endpoint[GTPH_SIDE_SGSN][GTPH_PLANE_USER].counters;
+	OSMO_ASSERT(c->pkts_out == 1 && c->bytes_out == 96);
+	OSMO_ASSERT(c->pkts_in == 0);
+
 	const char *u_from_sgsn =
 		"32" 	/* 0b001'1 0010: version 1, protocol GTP, with seq nr */
 		"ff"	/* type 255: G-PDU */
@@ -1746,6 +1865,624 @@ void test_parallel_context_creation(void)
 }
 
 
+static void test_tei_wrap(void)
+{
+	LOG("test_tei_wrap");
+
+	OSMO_ASSERT(setup_test_hub());
+
+	OSMO_ASSERT(create_pdp_ctx());
+
+	/* Let the TEI pool wrap, so that the next TEI would be 1 again, which
+	 * is still in use. */
+	hub->tei_pool.last_nr = hub->tei_pool.nr_max;
+
+	const char *gtp_req_from_sgsn =
+		MSG_PDP_CTX_REQ("0068",
+				"abce",
+				"60",
+				"42000121436588f9",
+				"00000124",
+				"00000322",
+				"0009""08696e7465726e6574", /* "(8)internet" */
+				"0004""c0a82a17", /* same as default sgsn_sender */
+				"0004""c0a82a17"
+			       );
+	const char *gtp_req_to_ggsn =
+		MSG_PDP_CTX_REQ("0068",
+				"6d32",	/* mapped seq ("abce") */
+				"23",
+				"42000121436588f9",
+				"00000002", /* TEI 1 is taken, skipped to 2 */
+				"00000002",
+				"0009""08696e7465726e6574",
+				"0004""7f000201", /* replaced with gtphub's ggsn ctrl */
+				"0004""7f000202" /* replaced with gtphub's ggsn user */
+			       );
+
+	OSMO_ASSERT(msg_from_sgsn_c(&sgsn_sender,
+				    &resolved_ggsn_addr,
+				    gtp_req_from_sgsn,
+				    gtp_req_to_ggsn));
+
+	OSMO_ASSERT(tunnels_are(
+		"TEI=2:"
+		" 192.168.42.23 (TEI C=322 U=124)"
+		" <-> 192.168.43.34/(uninitialized) (TEI C=0 U=0)"
+		" @21945\n"
+		"TEI=1:"
+		" 192.168.42.23 (TEI C=321 U=123)"
+		" <-> 192.168.43.34 (TEI C=765 U=567)"
+		" @21945\n"
+		));
+
+	OSMO_ASSERT(clear_test_hub());
+}
+
+static void test_worker_slices(void)
+{
+	LOG("test_worker_slices");
+
+	const unsigned int workers = 3;
+	const uint32_t tei_slice = 0x100000000ULL / workers;
+	const uint32_t seq_slice = 0x10000 / workers;
+	uint32_t tei_next_min = 1;
+	uint32_t seq_next_min = 0;
+	unsigned int w;
+
+	for (w = 0; w < workers; w++) {
+		struct gsn_addr peer_addr;
+		struct gtphub_peer_port *pp;
+		struct nr_pool *seq_pool;
+
+		OSMO_ASSERT(setup_test_hub());
+		gtphub_init_worker(hub, workers, w);
+
+		/* The slices are adjacent, the last one takes the remainder.
+		 * Each nr of a slice steers to its worker, see
+		 * gtphub_steer_workers(). */
+		OSMO_ASSERT(hub->tei_pool.nr_min == tei_next_min);
+		OSMO_ASSERT(hub->tei_pool.nr_min / tei_slice == w);
+		if (w < workers - 1)
+			OSMO_ASSERT(hub->tei_pool.nr_max / tei_slice == w);
+		else
+			OSMO_ASSERT(hub->tei_pool.nr_max == 0xffffffff);
+		tei_next_min = hub->tei_pool.nr_max + 1;
+
+		OSMO_ASSERT(nr_pool_next(&hub->tei_pool) / tei_slice == w);
+
+		/* Peers added from now on map sequence nrs from their own
+		 * slice. */
+		OSMO_ASSERT(gsn_addr_from_str(&peer_addr, "192.168.42.99")
+			    == 0);
+		pp = gtphub_port_have(hub,
+				      &hub->to_gsns[GTPH_SIDE_SGSN][GTPH_PLANE_CTRL],
+				      &peer_addr, 2123);
+		OSMO_ASSERT(pp);
+		seq_pool = &pp->peer_addr->peer->seq_pool;
+		OSMO_ASSERT(seq_pool->nr_min == seq_next_min);
+		OSMO_ASSERT(seq_pool->nr_min / seq_slice == w);
+		if (w < workers - 1)
+			OSMO_ASSERT(seq_pool->nr_max / seq_slice == w);
+		else
+			OSMO_ASSERT(seq_pool->nr_max == 0xffff);
+		seq_next_min = seq_pool->nr_max + 1;
+
+		OSMO_ASSERT(nr_pool_next(seq_pool) / seq_slice == w);
+
+		OSMO_ASSERT(clear_test_hub());
+	}
+}
+
+static void test_parked_pdp_ctx(void)
+{
+	LOG("test_parked_pdp_ctx");
+
+	OSMO_ASSERT(setup_test_hub());
+
+	struct llist_head pending;
+	INIT_LLIST_HEAD(&pending);
+	resolve_ggsn_park_in = &pending;
+
+	const char *gtp_req_from_sgsn =
+		MSG_PDP_CTX_REQ("0068",
+				"abcd",
+				"60",
+				"42000121436587f9",
+				"00000123",
+				"00000321",
+				"0009""08696e7465726e6574", /* "(8)internet" */
+				"0004""c0a82a17", /* same as default sgsn_sender */
+				"0004""c0a82a17"
+			       );
+	struct osmo_fd *ggsn_ofd;
+	struct osmo_sockaddr ggsn_addr;
+	int i;
+
+	/* The GGSN is not resolved yet: nothing is sent, and not even a
+	 * retransmission adds another parked request. */
+	for (i = 0; i < 2; i++) {
+		OSMO_ASSERT(gtphub_handle_buf(hub, GTPH_SIDE_SGSN,
+					      GTPH_PLANE_CTRL, &sgsn_sender,
+					      buf, msg(gtp_req_from_sgsn), now,
+					      &reply_buf, &ggsn_ofd, &ggsn_addr)
+			    == 0);
+		OSMO_ASSERT(llist_count(&pending) == 1);
+	}
+	OSMO_ASSERT(tunnels_are(""));
+
+	resolve_ggsn_park_in = NULL;
+
+	/* Once resolved, the request goes out as if it had just come in. */
+	struct gsn_addr resolved_gsna;
+	uint16_t resolved_port;
+	OSMO_ASSERT(gsn_addr_from_sockaddr(&resolved_gsna, &resolved_port,
+					   &resolved_ggsn_addr) == 0);
+	struct gtphub_peer_port *ggsn_port;
+	ggsn_port = gtphub_port_have(hub, &hub->to_gsns[GTPH_SIDE_GGSN][GTPH_PLANE_CTRL],
+				     &resolved_gsna, resolved_port);
+	OSMO_ASSERT(ggsn_port);
+
+	gtphub_parked_forward(hub, &pending, ggsn_port, now);
+	OSMO_ASSERT(llist_empty(&pending));
+
+	OSMO_ASSERT(tunnels_are(
+		"TEI=1:"
+		" 192.168.42.23 (TEI C=321 U=123)"
+		" <-> 192.168.43.34/(uninitialized) (TEI C=0 U=0)"
+		" @21945\n"));
+
+	/* A request parked for a lookup that fails is dropped. */
+	resolve_ggsn_park_in = &pending;
+	OSMO_ASSERT(gtphub_handle_buf(hub, GTPH_SIDE_SGSN,
+				      GTPH_PLANE_CTRL, &sgsn_sender,
+				      buf, msg(gtp_req_from_sgsn), now,
+				      &reply_buf, &ggsn_ofd, &ggsn_addr)
+		    == 0);
+	resolve_ggsn_park_in = NULL;
+	OSMO_ASSERT(llist_count(&pending) == 1);
+	gtphub_parked_drop(&pending);
+	OSMO_ASSERT(llist_empty(&pending));
+
+	/* The forwarded request is known as such: once the GGSN has answered,
+	 * a retransmission gets the cached response. */
+	const char *gtp_resp_from_ggsn =
+		MSG_PDP_CTX_RSP("004e",
+				"00000001", /* destination TEI (sent in req above) */
+				"6d31", /* mapped seq */
+				"01", /* restart */
+				"00000567", /* TEI U */
+				"00000765", /* TEI C */
+				"0004""c0a82b22", /* GSN addresses */
+				"0004""c0a82b22"  /* (== resolved_ggsn_addr) */
+			       );
+	const char *gtp_resp_to_sgsn =
+		MSG_PDP_CTX_RSP("004e",
+				"00000321", /* unmapped TEI ("001") */
+				"abcd", /* unmapped seq ("6d31") */
+				"23",
+				"00000001", /* mapped TEI from GGSN ("567") */
+				"00000001", /* mapped TEI from GGSN ("765") */
+				"0004""7f000101", /* gtphub's address towards SGSNs (Ctrl) */
+				"0004""7f000102" /* gtphub's address towards SGSNs (User) */
+			       );
+	OSMO_ASSERT(msg_from_ggsn_c(&resolved_ggsn_addr,
+				    &sgsn_sender,
+				    gtp_resp_from_ggsn,
+				    gtp_resp_to_sgsn));
+
+	struct osmo_fd *sgsn_ofd;
+	struct osmo_sockaddr sgsn_addr;
+	OSMO_ASSERT(gtphub_handle_buf(hub, GTPH_SIDE_SGSN, GTPH_PLANE_CTRL,
+				      &sgsn_sender, buf, msg(gtp_req_from_sgsn),
+				      now, &reply_buf, &sgsn_ofd, &sgsn_addr)
+		    > 0);
+	OSMO_ASSERT(sgsn_ofd->priv_nr == SGSNS_CTRL_FD);
+	OSMO_ASSERT(reply_is(gtp_resp_to_sgsn));
+	OSMO_ASSERT(hub->counters->ctr[GTPH_CTR_RETRANS_REPLAYED].current == 1);
+
+	OSMO_ASSERT(clear_test_hub());
+}
+
+static void test_resolved_ggsn_cache(void)
+{
+	LOG("test_resolved_ggsn_cache");
+
+	OSMO_ASSERT(setup_test_hub());
+
+	const char *apn_oi = "internet.mnc001.mcc240.gprs";
+	struct gsn_addr ggsn_addr;
+	struct gtphub_peer_port *pp;
+	int prefetch;
+	OSMO_ASSERT(gsn_addr_from_str(&ggsn_addr, "192.168.43.34") == 0);
+
+#define HITS hub->counters->ctr[GTPH_CTR_GGSN_CACHE_HIT].current
+#define MISSES hub->counters->ctr[GTPH_CTR_GGSN_CACHE_MISS].current
+
+	OSMO_ASSERT(!gtphub_resolved_ggsn_find(hub, apn_oi, now, &prefetch));
+	OSMO_ASSERT(MISSES == 1);
+
+	/* TTL of 60 seconds. */
+	pp = gtphub_resolved_ggsn(hub, apn_oi, &ggsn_addr, 60, now);
+	OSMO_ASSERT(pp);
+	OSMO_ASSERT(gtphub_resolved_ggsn_find(hub, apn_oi, now, &prefetch) == pp);
+	OSMO_ASSERT(!prefetch);
+	OSMO_ASSERT(!gtphub_resolved_ggsn_find(hub, "other.gprs", now, &prefetch));
+
+	/* A popular entry is refreshed in the last tenth of its TTL. */
+	OSMO_ASSERT(gtphub_resolved_ggsn_find(hub, apn_oi, now + 53, &prefetch) == pp);
+	OSMO_ASSERT(!prefetch);
+	OSMO_ASSERT(gtphub_resolved_ggsn_find(hub, apn_oi, now + 54, &prefetch) == pp);
+	OSMO_ASSERT(prefetch);
+	OSMO_ASSERT(HITS == 3);
+
+	/* A refresh replaces the entry and restarts the TTL. */
+	OSMO_ASSERT(gtphub_resolved_ggsn(hub, apn_oi, &ggsn_addr, 60, now + 55) == pp);
+	OSMO_ASSERT(llist_count(&hub->resolved_ggsns) == 1);
+	OSMO_ASSERT(gtphub_resolved_ggsn_find(hub, apn_oi, now + 114, &prefetch) == pp);
+	OSMO_ASSERT(!prefetch);
+
+	/* Once the TTL ran out, it's a miss. */
+	OSMO_ASSERT(!gtphub_resolved_ggsn_find(hub, apn_oi, now + 115, &prefetch));
+	OSMO_ASSERT(llist_empty(&hub->resolved_ggsns));
+	OSMO_ASSERT(MISSES == 3);
+
+	/* A zero TTL is raised to GTPH_GGSN_TTL_MIN_SECS, and gc removes the
+	 * entry when it runs out. */
+	now += 200;
+	OSMO_ASSERT(gtphub_resolved_ggsn(hub, apn_oi, &ggsn_addr, 0, now) == pp);
+	gtphub_gc(hub, now + GTPH_GGSN_TTL_MIN_SECS - 1);
+	OSMO_ASSERT(llist_count(&hub->resolved_ggsns) == 1);
+	gtphub_gc(hub, now + GTPH_GGSN_TTL_MIN_SECS);
+	OSMO_ASSERT(llist_empty(&hub->resolved_ggsns));
+
+	/* Without a TTL, an entry lasts as long as expire_slowly. (gc has
+	 * removed the unused GGSN peer meanwhile.) */
+	pp = gtphub_resolved_ggsn(hub, apn_oi, &ggsn_addr, -1, now);
+	OSMO_ASSERT(pp);
+	gtphub_gc(hub, now + GTPH_EXPIRE_SLOWLY_MINUTES * 60 - 1);
+	OSMO_ASSERT(gtphub_resolved_ggsn_find(hub, apn_oi,
+					      now + GTPH_EXPIRE_SLOWLY_MINUTES * 60 - 1,
+					      &prefetch) == pp);
+
+#undef HITS
+#undef MISSES
+
+	OSMO_ASSERT(clear_test_hub());
+}
+
+static void test_gc_candidates(void)
+{
+	LOG("test_gc_candidates");
+
+	OSMO_ASSERT(setup_test_hub());
+
+	struct gtphub_bind *bind = &hub->to_gsns[GTPH_SIDE_GGSN][GTPH_PLANE_CTRL];
+	struct gsn_addr ggsn_addr;
+	struct gtphub_peer_port *pp;
+	OSMO_ASSERT(gsn_addr_from_str(&ggsn_addr, "192.168.43.34") == 0);
+
+	/* A new, unreferenced port is a gc candidate right away, and is
+	 * collected even though nothing expired. */
+	pp = gtphub_port_have(hub, bind, &ggsn_addr, 2123);
+	OSMO_ASSERT(pp);
+	OSMO_ASSERT(llist_count(&bind->gc_ports) == 1);
+	gtphub_gc(hub, now);
+	OSMO_ASSERT(llist_empty(&bind->gc_ports));
+	OSMO_ASSERT(llist_empty(&bind->peers));
+
+	/* A port referenced before the gc tick stays, and is no longer a
+	 * candidate. */
+	pp = gtphub_resolved_ggsn(hub, "internet.mnc001.mcc240.gprs",
+				  &ggsn_addr, 60, now);
+	OSMO_ASSERT(pp);
+	gtphub_gc(hub, now);
+	OSMO_ASSERT(llist_empty(&bind->gc_ports));
+	OSMO_ASSERT(gtphub_port_find_sa(bind, &pp->sa) == pp);
+
+	/* Dropping the last reference makes it a candidate again. */
+	gtphub_gc(hub, now + 60);
+	OSMO_ASSERT(llist_empty(&bind->gc_ports));
+	OSMO_ASSERT(llist_empty(&bind->peers));
+
+	OSMO_ASSERT(clear_test_hub());
+}
+
+static void test_tunnel_journal(void)
+{
+	LOG("test_tunnel_journal");
+
+	char path[] = "/tmp/gtphub_test_journal.XXXXXX";
+	int fd = mkstemp(path);
+	OSMO_ASSERT(fd >= 0);
+	close(fd);
+
+	/* An empty file is a fresh journal. */
+	OSMO_ASSERT(setup_test_hub());
+	OSMO_ASSERT(gtphub_journal_open(hub, path, now) == 0);
+	OSMO_ASSERT(hub->restart_counter == 0x23);
+
+	/* Only the complete tunnel is recorded, once. */
+	OSMO_ASSERT(create_pdp_ctx());
+	OSMO_ASSERT(hub->journal_records == 1);
+
+	/* Freeing the hub leaves the journal in place. */
+	gtphub_free(hub);
+
+	/* A restarted gtphub resumes the tunnel with its own TEI and keeps
+	 * the restart counter, so the peers don't notice. */
+	OSMO_ASSERT(setup_test_hub());
+	hub->restart_counter = 0x24;
+	OSMO_ASSERT(gtphub_journal_open(hub, path, now) == 1);
+	OSMO_ASSERT(hub->restart_counter == 0x23);
+	OSMO_ASSERT(hub->journal_records == 1);
+	OSMO_ASSERT(tunnels_are(
+		"TEI=1:"
+		" 192.168.42.23 (TEI C=321 U=123)"
+		" <-> 192.168.43.34 (TEI C=765 U=567)"
+		" @21945\n"));
+
+	/* Messages for the restored tunnel are forwarded, and its deletion is
+	 * recorded. Sequence nrs are not journaled and start afresh. */
+	OSMO_ASSERT(msg_from_sgsn_c(&sgsn_sender,
+				    &resolved_ggsn_addr,
+				    MSG_DEL_PDP_CTX_REQ("00000001", "abce"),
+				    MSG_DEL_PDP_CTX_REQ("00000765", "6d31")));
+	OSMO_ASSERT(msg_from_ggsn_c(&resolved_ggsn_addr,
+				    &sgsn_sender,
+				    MSG_DEL_PDP_CTX_RSP("00000001", "6d31"),
+				    MSG_DEL_PDP_CTX_RSP("00000321", "abce")));
+	OSMO_ASSERT(tunnels_are(""));
+	OSMO_ASSERT(hub->journal_records == 2);
+	gtphub_free(hub);
+
+	OSMO_ASSERT(setup_test_hub());
+	OSMO_ASSERT(gtphub_journal_open(hub, path, now) == 0);
+	OSMO_ASSERT(tunnels_are(""));
+	OSMO_ASSERT(hub->journal_records == 0);
+
+	/* A truncated record is ignored. */
+	gtphub_journal_close(hub);
+	fd = open(path, O_WRONLY | O_APPEND);
+	OSMO_ASSERT(fd >= 0);
+	OSMO_ASSERT(write(fd, "\x01\x00", 2) == 2);
+	close(fd);
+	OSMO_ASSERT(gtphub_journal_open(hub, path, now) == 0);
+	OSMO_ASSERT(tunnels_are(""));
+
+	OSMO_ASSERT(clear_test_hub());
+	unlink(path);
+}
+
+static void test_ggsn_pool(void)
+{
+	LOG("test_ggsn_pool");
+
+	OSMO_ASSERT(setup_test_hub());
+
+	struct gsn_addr addr;
+	struct gtphub_pool_ggsn *a, *b;
+	OSMO_ASSERT(gsn_addr_from_str(&addr, "192.168.43.34") == 0);
+	a = gtphub_ggsn_pool_add(hub, &addr, 3);
+	OSMO_ASSERT(gsn_addr_from_str(&addr, "192.168.43.35") == 0);
+	b = gtphub_ggsn_pool_add(hub, &addr, 1);
+	OSMO_ASSERT(a && b);
+	OSMO_ASSERT(a->eff_weight == 3000);
+	OSMO_ASSERT(b->eff_weight == 1000);
+
+	/* A new PDP context goes to the pool instead of a DNS resolved GGSN.
+	 * The first pick is the heaviest member, at resolved_ggsn_addr. */
+	OSMO_ASSERT(msg_from_sgsn_c(&sgsn_sender,
+				    &resolved_ggsn_addr,
+				    MSG_PDP_CTX_REQ("0068",
+						    "abcd",
+						    "60",
+						    "42000121436587f9",
+						    "00000123",
+						    "00000321",
+						    "0009""08696e7465726e6574",
+						    "0004""c0a82a17",
+						    "0004""c0a82a17"),
+				    MSG_PDP_CTX_REQ("0068",
+						    "6d31",
+						    "23",
+						    "42000121436587f9",
+						    "00000001",
+						    "00000001",
+						    "0009""08696e7465726e6574",
+						    "0004""7f000201",
+						    "0004""7f000202")));
+	OSMO_ASSERT(a->selected == 1);
+
+	/* The GGSN accepts, which counts as healthy. */
+	OSMO_ASSERT(msg_from_ggsn_c(&resolved_ggsn_addr,
+				    &sgsn_sender,
+				    MSG_PDP_CTX_RSP("004e",
+						    "00000001",
+						    "6d31",
+						    "01",
+						    "00000567",
+						    "00000765",
+						    "0004""c0a82b22",
+						    "0004""c0a82b22"),
+				    MSG_PDP_CTX_RSP("004e",
+						    "00000321",
+						    "abcd",
+						    "23",
+						    "00000001",
+						    "00000001",
+						    "0004""7f000101",
+						    "0004""7f000102")));
+	OSMO_ASSERT(a->reject_permille == 0);
+	OSMO_ASSERT(a->eff_weight == 3000);
+
+	/* Smooth weighted round robin: 3 to 1, interleaved. */
+	int i;
+	for (i = 0; i < 8; i++)
+		OSMO_ASSERT(gtphub_ggsn_pool_select(hub));
+	OSMO_ASSERT(a->selected == 7);
+	OSMO_ASSERT(b->selected == 2);
+
+	/* Slow echos and rejects reduce a member's share. */
+	gtphub_ggsn_pool_rtt(a, 800);
+	OSMO_ASSERT(a->rtt_ms == 800);
+	OSMO_ASSERT(a->eff_weight == 750);
+	gtphub_ggsn_pool_create_result(b, 0);
+	OSMO_ASSERT(b->reject_permille == 125);
+	OSMO_ASSERT(b->eff_weight == 875);
+
+	/* Echo Requests go out to all members. An Echo Response is consumed
+	 * by gtphub and updates the round trip time. */
+	gtphub_gc(hub, now);
+	OSMO_ASSERT(a->echo_pending && b->echo_pending);
+	OSMO_ASSERT(msg_from_ggsn_c(&resolved_ggsn_addr, NULL,
+				    "32" "02" "0006" "00000000"
+				    "6d32" /* next seq of the first GGSN */
+				    "0000" "0e01",
+				    ""));
+	OSMO_ASSERT(!a->echo_pending);
+	OSMO_ASSERT(a->echo_missed == 0);
+	OSMO_ASSERT(a->rtt_ms < 800);
+
+	/* A member that stops answering gets no new PDP contexts. */
+	for (i = 1; i <= GTPH_GGSN_ECHO_MISSED_MAX; i++)
+		gtphub_gc(hub, now + i * GTPH_GGSN_ECHO_SECS);
+	OSMO_ASSERT(b->echo_missed == GTPH_GGSN_ECHO_MISSED_MAX);
+	OSMO_ASSERT(b->eff_weight == 0);
+	OSMO_ASSERT(a->echo_missed == GTPH_GGSN_ECHO_MISSED_MAX - 1);
+	OSMO_ASSERT(a->eff_weight > 0);
+	for (i = 0; i < 4; i++)
+		OSMO_ASSERT(gtphub_ggsn_pool_select(hub) == a);
+	OSMO_ASSERT(b->selected == 2);
+
+	gtphub_free(hub);
+}
+
+static void test_retransmission(void)
+{
+	LOG("test_retransmission");
+
+#define REPLAYED hub->counters->ctr[GTPH_CTR_RETRANS_REPLAYED].current
+#define FORWARDED hub->counters->ctr[GTPH_CTR_RETRANS_FORWARDED].current
+
+	OSMO_ASSERT(setup_test_hub());
+	OSMO_ASSERT(create_pdp_ctx());
+
+	/* The SGSN missed the Create PDP Context Response and retransmits its
+	 * request: answer from the cache, without asking the GGSN again. */
+	const char *gtp_req_from_sgsn =
+		MSG_PDP_CTX_REQ("0068",
+				"abcd",
+				"60",
+				"42000121436587f9",
+				"00000123",
+				"00000321",
+				"0009""08696e7465726e6574", /* "(8)internet" */
+				"0004""c0a82a17", /* same as default sgsn_sender */
+				"0004""c0a82a17"
+			       );
+	const char *gtp_resp_to_sgsn =
+		MSG_PDP_CTX_RSP("004e",
+				"00000321", /* unmapped TEI ("001") */
+				"abcd", /* unmapped seq ("6d31") */
+				"23",
+				"00000001", /* mapped TEI from GGSN ("567") */
+				"00000001", /* mapped TEI from GGSN ("765") */
+				"0004""7f000101", /* gtphub's address towards SGSNs (Ctrl) */
+				"0004""7f000102" /* gtphub's address towards SGSNs (User) */
+			       );
+
+	struct osmo_fd *to_ofd = NULL;
+	struct osmo_sockaddr to_addr;
+	int send;
+	send = gtphub_handle_buf(hub, GTPH_SIDE_SGSN, GTPH_PLANE_CTRL,
+				 &sgsn_sender, buf, msg(gtp_req_from_sgsn), now,
+				 &reply_buf, &to_ofd, &to_addr);
+	OSMO_ASSERT(send > 0);
+	OSMO_ASSERT(to_ofd && to_ofd->priv_nr == SGSNS_CTRL_FD);
+	OSMO_ASSERT(same_addr(&to_addr, &sgsn_sender));
+	OSMO_ASSERT(reply_is(gtp_resp_to_sgsn));
+	OSMO_ASSERT(REPLAYED == 1);
+	OSMO_ASSERT(FORWARDED == 0);
+
+	now += GTPH_EXPIRE_QUICKLY_SECS + 1;
+	gtphub_gc(hub, now);
+
+	/* A retransmission before any response is forwarded again, with the
+	 * same mapped seq. */
+	const char *del_req_from_sgsn = MSG_DEL_PDP_CTX_REQ("00000001", "abce");
+	const char *del_req_to_ggsn = MSG_DEL_PDP_CTX_REQ("00000765", "6d32");
+	OSMO_ASSERT(msg_from_sgsn_c(&sgsn_sender,
+				    &resolved_ggsn_addr,
+				    del_req_from_sgsn,
+				    del_req_to_ggsn));
+	OSMO_ASSERT(msg_from_sgsn_c(&sgsn_sender,
+				    &resolved_ggsn_addr,
+				    del_req_from_sgsn,
+				    del_req_to_ggsn));
+	OSMO_ASSERT(REPLAYED == 1);
+	OSMO_ASSERT(FORWARDED == 1);
+
+	const char *del_resp_to_sgsn = MSG_DEL_PDP_CTX_RSP("00000321", "abce");
+	OSMO_ASSERT(msg_from_ggsn_c(&resolved_ggsn_addr,
+				    &sgsn_sender,
+				    MSG_DEL_PDP_CTX_RSP("00000001", "6d32"),
+				    del_resp_to_sgsn));
+	OSMO_ASSERT(tunnels_are(""));
+
+	/* The tunnel is gone, yet a retransmitted Delete PDP Context Request
+	 * still gets its response. */
+	send = gtphub_handle_buf(hub, GTPH_SIDE_SGSN, GTPH_PLANE_CTRL,
+				 &sgsn_sender, buf, msg(del_req_from_sgsn), now,
+				 &reply_buf, &to_ofd, &to_addr);
+	OSMO_ASSERT(send > 0);
+	OSMO_ASSERT(to_ofd->priv_nr == SGSNS_CTRL_FD);
+	OSMO_ASSERT(same_addr(&to_addr, &sgsn_sender));
+	OSMO_ASSERT(reply_is(del_resp_to_sgsn));
+	OSMO_ASSERT(REPLAYED == 2);
+
+	/* A new request reusing the seq nr is not mistaken for a
+	 * retransmission. */
+	send = gtphub_handle_buf(hub, GTPH_SIDE_SGSN, GTPH_PLANE_CTRL,
+				 &sgsn_sender, buf,
+				 msg(MSG_DEL_PDP_CTX_REQ("00000002", "abce")),
+				 now, &reply_buf, &to_ofd, &to_addr);
+	OSMO_ASSERT(send < 0);
+	OSMO_ASSERT(REPLAYED == 2);
+
+	/* A new request that does get forwarded on the reused seq nr drops
+	 * the response cached for the earlier one: its retransmission is
+	 * forwarded again instead of being answered with that response. */
+	const char *new_req_from_sgsn =
+		MSG_PDP_CTX_REQ("0068",
+				"abce",
+				"60",
+				"42000121436587f9",
+				"00000124",
+				"00000322",
+				"0009""08696e7465726e6574", /* "(8)internet" */
+				"0004""c0a82a17", /* same as default sgsn_sender */
+				"0004""c0a82a17"
+			       );
+	int i;
+	for (i = 0; i < 2; i++) {
+		send = gtphub_handle_buf(hub, GTPH_SIDE_SGSN, GTPH_PLANE_CTRL,
+					 &sgsn_sender, buf,
+					 msg(new_req_from_sgsn), now,
+					 &reply_buf, &to_ofd, &to_addr);
+		OSMO_ASSERT(send > 0);
+		OSMO_ASSERT(to_ofd->priv_nr == GGSNS_CTRL_FD);
+		OSMO_ASSERT(same_addr(&to_addr, &resolved_ggsn_addr));
+		OSMO_ASSERT(REPLAYED == 2);
+		OSMO_ASSERT(FORWARDED == 1 + i);
+	}
+
+#undef REPLAYED
+#undef FORWARDED
+
+	OSMO_ASSERT(clear_test_hub());
+}
+
 static struct log_info_cat gtphub_categories[] = {
 	[DGTPHUB] = {
 		.name = "DGTPHUB",
@@ -1768,6 +2505,7 @@ int main(int argc, char **argv)
 
 	test_nr_map_basic();
 	test_nr_map_wrap();
+	test_nr_map_index();
 	test_expiry();
 	test_echo();
 	test_one_pdp_ctx(GTPH_SIDE_SGSN);
@@ -1778,6 +2516,14 @@ int main(int argc, char **argv)
 	test_peer_restarted_reusing_tei();
 	test_sgsn_behind_nat();
 	test_parallel_context_creation();
+	test_tei_wrap();
+	test_worker_slices();
+	test_parked_pdp_ctx();
+	test_resolved_ggsn_cache();
+	test_gc_candidates();
+	test_tunnel_journal();
+	test_ggsn_pool();
+	test_retransmission();
 	printf("Done\n");
 
 	talloc_report_full(osmo_gtphub_ctx, stderr);